@@ -107,6 +107,92 @@ static int64_t factory_timeout = 0;
 
 struct batch_queue *queue = 0;
 
+/*
+Predictive mode. Rather than submitting workers for the tasks counted at
+each cycle, the factory keeps moving averages of the rates at which tasks
+arrive to and complete at the masters, and of the time a worker takes to
+connect after it is submitted. It then submits the workers needed for the
+tasks expected by the time those workers would connect, and lowers its
+target gradually, so that a burst does not leave workers queued in the
+batch system when they are no longer needed.
+*/
+
+static int predictive = 0;
+
+/* weight of the newest observation in the moving averages of the model. */
+#define MODEL_ALPHA 0.3
+
+struct factory_model {
+	time_t  last_time;
+	int64_t last_submitted;    // tasks submitted to the masters at last_time.
+	int64_t last_done;         // tasks done by the masters at last_time.
+	int     last_connected;
+	double  arrival_rate;      // tasks per second.
+	double  arrival_last[2];   // tasks per second, in each of the last two cycles.
+	double  completion_rate;   // tasks per second.
+	double  submit_latency;    // seconds from the submission of a worker to its connection.
+	struct list *pending;      // submission times of the workers not connected yet, oldest first.
+	int     target;            // workers planned in the last cycle.
+};
+
+static struct factory_model model;
+
+/*
+Simulation. With --simulate=<trace>, the factory does not contact any
+master, and submits workers to the dryrun batch system, which only logs
+them. A simulated master runs the tasks of the trace, which has lines
+"<time> <count> <seconds>": at time seconds from the start, count tasks
+that run for the given seconds arrive. Simulated workers connect
+--simulate-latency seconds after their submission, run tasks-per-worker
+tasks at once, and exit after being idle for the worker timeout. The clock
+advances factory_period seconds per cycle without sleeping, and once the
+trace is done the factory reports how well it used the workers.
+*/
+
+static const char *simulate_trace = 0;
+static int simulate_latency = 60;
+
+struct sim_burst {
+	time_t time;
+	int count;
+	int duration;
+};
+
+struct sim_task {
+	time_t arrival;
+	time_t end;
+	int duration;
+	struct sim_worker *worker;
+};
+
+struct sim_worker {
+	batch_job_id_t jobid;
+	time_t connect_time;
+	time_t idle_since;
+	int connected;
+	int busy;
+};
+
+static struct {
+	time_t start;
+	time_t now;
+	struct list *bursts;       // struct sim_burst, in time order.
+	struct list *waiting;      // struct sim_task
+	struct list *running;      // struct sim_task
+	struct list *workers;      // struct sim_worker
+	int64_t tasks_submitted;
+	int64_t tasks_done;
+	int workers_submitted;
+	double slot_seconds;       // seconds of task slots of connected workers.
+	double busy_seconds;       // seconds of those slots running tasks.
+	double wait_seconds;       // seconds tasks waited for a slot.
+} sim;
+
+static time_t factory_time()
+{
+	return simulate_trace ? sim.now : time(0);
+}
+
 
 static void handle_abort( int sig )
 {
@@ -294,6 +380,331 @@ static int count_workers_connected( struct list *masters_list )
 }
 
 
+/*
+Count the tasks of a given list of masters, and add up how many they have
+been given and how many they have done.
+*/
+
+static int count_tasks( struct list *masters_list, int only_waiting, int64_t *submitted, int64_t *done )
+{
+	int tasks=0;
+	struct jx *j;
+
+	if(!masters_list) {
+		return tasks;
+	}
+
+	list_first_item(masters_list);
+	while((j=list_next_item(masters_list))) {
+		const int tr = jx_lookup_integer(j,"tasks_on_workers");
+		const int tw = jx_lookup_integer(j,"tasks_waiting");
+		const int tl = jx_lookup_integer(j,"tasks_left");
+
+		tasks += only_waiting ? tw : tr+tw+tl;
+
+		*submitted += jx_lookup_integer(j,"tasks_submitted");
+		*done      += jx_lookup_integer(j,"tasks_done");
+	}
+
+	return tasks;
+}
+
+static double model_average( double average, double sample )
+{
+	return MODEL_ALPHA*sample + (1-MODEL_ALPHA)*average;
+}
+
+static void model_init( struct factory_model *m )
+{
+	memset(m, 0, sizeof(*m));
+	m->pending = list_create();
+
+	/* until a worker connects, assume it takes a cycle. */
+	m->submit_latency = factory_period;
+}
+
+/* Remember when count workers were submitted. */
+static void model_workers_submitted( struct factory_model *m, int count )
+{
+	int i;
+	for(i = 0; i < count; i++) {
+		time_t *t = xxmalloc(sizeof(*t));
+		*t = factory_time();
+		list_push_tail(m->pending, t);
+	}
+}
+
+/* Update the rates with the totals of the masters and the workers connected. */
+static void model_observe( struct factory_model *m, int64_t submitted, int64_t done, int connected, int workers_submitted )
+{
+	time_t now = factory_time();
+
+	if(m->last_time > 0 && now > m->last_time) {
+		double elapsed = now - m->last_time;
+
+		/* masters that come and go may make the totals go back. */
+		double arrivals    = MAX(0, submitted - m->last_submitted);
+		double completions = MAX(0, done - m->last_done);
+
+		m->arrival_last[1] = m->arrival_last[0];
+		m->arrival_last[0] = arrivals/elapsed;
+		m->arrival_rate    = model_average(m->arrival_rate, m->arrival_last[0]);
+		m->completion_rate = model_average(m->completion_rate, completions/elapsed);
+	}
+
+	/* workers connect roughly in the order they were submitted. */
+	int joined = connected - m->last_connected;
+	while(joined > 0 && list_size(m->pending) > 0) {
+		time_t *t = list_pop_head(m->pending);
+		m->submit_latency = model_average(m->submit_latency, now - *t);
+		free(t);
+		joined--;
+	}
+
+	/* forget the workers that exited before connecting. */
+	while(list_size(m->pending) > MAX(0, workers_submitted - connected)) {
+		free(list_pop_head(m->pending));
+	}
+
+	m->last_time      = now;
+	m->last_submitted = submitted;
+	m->last_done      = done;
+	m->last_connected = connected;
+}
+
+/*
+Workers to have submitted, given the workers needed and the tasks the
+masters have now. The tasks expected by the time a new worker would connect
+are those of now, plus those arriving, minus those completing until then,
+and the workers needed grow or shrink with them.
+*/
+
+static int model_plan( struct factory_model *m, int needed, int tasks )
+{
+	double horizon  = m->submit_latency + factory_period;
+
+	/* tasks are expected to keep arriving only after two cycles of arrivals, so that a burst is not taken for a trend. */
+	double arrivals = MIN(m->arrival_rate, MIN(m->arrival_last[0], m->arrival_last[1]));
+	double expected = MAX(0, tasks + (arrivals - m->completion_rate)*horizon);
+
+	int planned;
+	if(tasks > 0) {
+		planned = ceil(needed * expected / tasks);
+	} else {
+		planned = ceil(expected / MAX(tasks_per_worker, 1));
+	}
+
+	/* go down half way each cycle, so that a lull between bursts does not empty the pool. */
+	if(planned < m->target) {
+		planned = m->target - (m->target - planned + 1)/2;
+	}
+
+	debug(D_WQ,"model: %.2f tasks/s arriving, %.2f tasks/s completing, workers connect in %.0f s, %.0f tasks expected in %.0f s: %d workers",
+			arrivals, m->completion_rate, m->submit_latency, expected, horizon, planned);
+
+	m->target = planned;
+
+	return planned;
+}
+
+static int sim_slots()
+{
+	return MAX(tasks_per_worker, 1);
+}
+
+static int sim_load_trace( const char *filename )
+{
+	FILE *file = fopen(filename, "r");
+	if(!file) {
+		fprintf(stderr, "work_queue_factory: couldn't open %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+
+	memset(&sim, 0, sizeof(sim));
+	sim.bursts  = list_create();
+	sim.waiting = list_create();
+	sim.running = list_create();
+	sim.workers = list_create();
+
+	/* an arbitrary start, so that times are never 0. */
+	sim.start = sim.now = 1000000;
+
+	char line[1024];
+	int lineno = 0;
+	while(fgets(line, sizeof(line), file)) {
+		lineno++;
+
+		long when;
+		int count, duration;
+		char *c = line + strspn(line, " \t");
+		if(*c == '#' || *c == '\n' || !*c) {
+			continue;
+		}
+
+		if(sscanf(c, "%ld %d %d", &when, &count, &duration) != 3 || when < 0 || count < 0 || duration < 0) {
+			fprintf(stderr, "work_queue_factory: %s:%d: expected <time> <count> <seconds>\n", filename, lineno);
+			fclose(file);
+			return 0;
+		}
+
+		struct sim_burst *b = xxmalloc(sizeof(*b));
+		b->time     = sim.start + when;
+		b->count    = count;
+		b->duration = duration;
+		list_push_priority(sim.bursts, b, -b->time);
+	}
+
+	fclose(file);
+
+	return 1;
+}
+
+static void sim_worker_submitted( batch_job_id_t jobid )
+{
+	struct sim_worker *w = xxcalloc(1, sizeof(*w));
+	w->jobid = jobid;
+	w->connect_time = sim.now + simulate_latency;
+	list_push_tail(sim.workers, w);
+
+	sim.workers_submitted++;
+}
+
+static int sim_workers_connected()
+{
+	int connected = 0;
+	struct sim_worker *w;
+
+	list_first_item(sim.workers);
+	while((w = list_next_item(sim.workers))) {
+		connected += w->connected;
+	}
+
+	return connected;
+}
+
+/* The simulated master, as a master would report itself to the factory. */
+static struct list *sim_query()
+{
+	struct jx *j = jx_object(0);
+
+	jx_insert_string(j, "project", "simulation");
+	jx_insert_string(j, "name", master_host);
+	jx_insert_integer(j, "port", master_port);
+	jx_insert_integer(j, "tasks_waiting", list_size(sim.waiting));
+	jx_insert_integer(j, "tasks_on_workers", list_size(sim.running));
+	jx_insert_integer(j, "tasks_running", list_size(sim.running));
+	jx_insert_integer(j, "tasks_left", 0);
+	jx_insert_integer(j, "tasks_submitted", sim.tasks_submitted);
+	jx_insert_integer(j, "tasks_done", sim.tasks_done);
+	jx_insert_integer(j, "tasks_complete", sim.tasks_done);
+	jx_insert_integer(j, "workers", sim_workers_connected());
+
+	struct list *masters_list = list_create();
+	list_push_head(masters_list, j);
+
+	return masters_list;
+}
+
+static int sim_finished()
+{
+	return list_size(sim.bursts) == 0 && list_size(sim.waiting) == 0 && list_size(sim.running) == 0;
+}
+
+/* Run the simulation for the given seconds. Returns the number of workers that exited. */
+static int sim_advance( struct itable *job_table, int seconds )
+{
+	int exited = 0;
+	time_t stop = sim.now + seconds;
+
+	for(; sim.now < stop && !sim_finished(); sim.now++) {
+		struct sim_burst *b;
+		struct sim_task *t;
+		struct sim_worker *w;
+
+		while((b = list_peek_head(sim.bursts)) && b->time <= sim.now) {
+			list_pop_head(sim.bursts);
+
+			int i;
+			for(i = 0; i < b->count; i++) {
+				t = xxcalloc(1, sizeof(*t));
+				t->arrival  = sim.now;
+				t->duration = b->duration;
+				list_push_tail(sim.waiting, t);
+			}
+
+			sim.tasks_submitted += b->count;
+			free(b);
+		}
+
+		int n = list_size(sim.running);
+		while(n-- > 0) {
+			t = list_pop_head(sim.running);
+			if(t->end > sim.now) {
+				list_push_tail(sim.running, t);
+				continue;
+			}
+
+			t->worker->busy--;
+			if(t->worker->busy == 0) {
+				t->worker->idle_since = sim.now;
+			}
+
+			sim.tasks_done++;
+			free(t);
+		}
+
+		n = list_size(sim.workers);
+		while(n-- > 0) {
+			w = list_pop_head(sim.workers);
+
+			if(!w->connected && w->connect_time <= sim.now) {
+				w->connected  = 1;
+				w->idle_since = sim.now;
+			}
+
+			if(w->connected && w->busy == 0 && sim.now - w->idle_since >= worker_timeout) {
+				itable_remove(job_table, w->jobid);
+				exited++;
+				free(w);
+				continue;
+			}
+
+			while(w->connected && w->busy < sim_slots() && (t = list_pop_head(sim.waiting))) {
+				t->end    = sim.now + t->duration;
+				t->worker = w;
+				w->busy++;
+				sim.wait_seconds += sim.now - t->arrival;
+				list_push_tail(sim.running, t);
+			}
+
+			if(w->connected) {
+				sim.slot_seconds += sim_slots();
+				sim.busy_seconds += w->busy;
+			}
+
+			list_push_tail(sim.workers, w);
+		}
+	}
+
+	/* the dryrun batch system says jobs finished as soon as they are submitted. */
+	struct batch_job_info info;
+	while(batch_job_wait_timeout(queue, &info, time(0)) > 0) { }
+
+	return exited;
+}
+
+static void sim_report()
+{
+	fprintf(stdout, "simulated %ld s: %" PRId64 " of %" PRId64 " tasks done, %d workers submitted, %.1f%% of worker slots busy, tasks waited %.1f s on average\n",
+			(long) (sim.now - sim.start),
+			sim.tasks_done,
+			sim.tasks_submitted,
+			sim.workers_submitted,
+			sim.slot_seconds > 0 ? 100*sim.busy_seconds/sim.slot_seconds : 0,
+			sim.tasks_done > 0 ? sim.wait_seconds/sim.tasks_done : 0);
+	fflush(stdout);
+}
+
 static void set_worker_resources_options( struct batch_queue *queue )
 {
 	buffer_t b;
@@ -431,6 +842,9 @@ static int submit_workers( struct batch_queue *queue, struct itable *job_table,
 		if(jobid>0) {
 			debug(D_WQ,"worker job %d submitted",jobid);
 			itable_insert(job_table,jobid,(void*)1);
+			if(simulate_trace) {
+				sim_worker_submitted(jobid);
+			}
 		} else {
 			break;
 		}
@@ -712,6 +1126,10 @@ static void mainloop( struct batch_queue *queue )
 
 	int64_t factory_timeout_start = time(0);
 
+	if(predictive) {
+		model_init(&model);
+	}
+
 	while(!abort_flag) {
 
 		if(config_file && !read_config_file(config_file)) {
@@ -723,7 +1141,10 @@ static void mainloop( struct batch_queue *queue )
 
 		submission_regex = foremen_regex ? foremen_regex : project_regex;
 
-		if(using_catalog) {
+		if(simulate_trace) {
+			masters_list = sim_query();
+		}
+		else if(using_catalog) {
 			masters_list = work_queue_catalog_query(catalog_host,catalog_port,project_regex);
 		}
 		else {
@@ -769,6 +1190,19 @@ static void mainloop( struct batch_queue *queue )
 
 		debug(D_WQ,"raw workers needed: %d", workers_needed);
 
+		if(predictive) {
+			int64_t tasks_submitted = 0;
+			int64_t tasks_done      = 0;
+
+			int tasks = count_tasks(masters_list, 0, &tasks_submitted, &tasks_done);
+			if(foremen_regex) {
+				tasks += count_tasks(foremen_list, 1, &tasks_submitted, &tasks_done);
+			}
+
+			model_observe(&model, tasks_submitted, tasks_done, workers_connected, workers_submitted);
+			workers_needed = model_plan(&model, workers_needed, tasks);
+		}
+
 		if(workers_needed > workers_max) {
 			debug(D_WQ,"applying maximum of %d workers",workers_max);
 			workers_needed = workers_max;
@@ -786,7 +1220,8 @@ static void mainloop( struct batch_queue *queue )
 			new_workers_needed = workers_per_cycle;
 		}
 
-		if(workers_per_cycle > 0 && workers_submitted > new_workers_needed + workers_connected) {
+		/* the model already expects submitted workers to take a while to connect. */
+		if(!predictive && workers_per_cycle > 0 && workers_submitted > new_workers_needed + workers_connected) {
 			debug(D_WQ,"waiting for %d previously submitted workers to connect", workers_submitted - workers_connected);
 			new_workers_needed = 0;
 		}
@@ -801,13 +1236,31 @@ static void mainloop( struct batch_queue *queue )
 
 		if(new_workers_needed>0) {
 			debug(D_WQ,"submitting %d new workers to reach target",new_workers_needed);
-			workers_submitted += submit_workers(queue,job_table,new_workers_needed);
+			int submitted = submit_workers(queue,job_table,new_workers_needed);
+			workers_submitted += submitted;
+			if(predictive) {
+				model_workers_submitted(&model, submitted);
+			}
 		} else if(new_workers_needed<0) {
 			debug(D_WQ,"too many workers, will wait for some to exit");
 		} else {
 			debug(D_WQ,"target number of workers is reached.");
 		}
 
+		if(simulate_trace) {
+			workers_submitted -= sim_advance(job_table, factory_period);
+
+			delete_projects_list(masters_list);
+			delete_projects_list(foremen_list);
+
+			if(sim_finished()) {
+				sim_report();
+				break;
+			}
+
+			continue;
+		}
+
 		debug(D_WQ,"checking for exited workers...");
 		time_t stoptime = time(0)+5;
 
@@ -863,6 +1316,9 @@ static void show_help(const char *cmd)
 	printf(" %-30s Exit after no master has been seen in <n> seconds.\n", "--factory-timeout");
 	printf(" %-30s Use this scratch dir for temporary files. (default is /tmp/wq-pool-$uid)\n","-S,--scratch-dir");
 	printf(" %-30s Use worker capacity reported by masters.\n","-c,--capacity");
+	printf(" %-30s Plan workers ahead from the rates tasks arrive and complete, and how long workers take to connect.\n","--predictive");
+	printf(" %-30s Simulate the tasks in <trace> (lines of <time> <count> <seconds>) with the dryrun batch system.\n","--simulate=<trace>");
+	printf(" %-30s Seconds simulated workers take to connect. (default=%d)\n","--simulate-latency=<s>", simulate_latency);
 	printf(" %-30s Enable debugging for this subsystem.\n", "-d,--debug=<subsystem>");
 	printf(" %-30s Specify path to Amazon credentials (for use with -T amazon)\n", "--amazon-credentials");
 	printf(" %-30s Specify amazon machine image (AMI). (for use with -T amazon)\n", "--amazon-ami");
@@ -893,7 +1349,10 @@ enum{   LONG_OPT_CORES = 255,
 		LONG_OPT_WORKER_BINARY,
 		LONG_OPT_MESOS_MASTER, 
 		LONG_OPT_MESOS_PATH,
-		LONG_OPT_MESOS_PRELOAD
+		LONG_OPT_MESOS_PRELOAD,
+		LONG_OPT_PREDICTIVE,
+		LONG_OPT_SIMULATE,
+		LONG_OPT_SIMULATE_LATENCY
 	};
 
 static const struct option long_options[] = {
@@ -930,6 +1389,9 @@ static const struct option long_options[] = {
 	{"mesos-master", required_argument, 0, LONG_OPT_MESOS_MASTER},
 	{"mesos-path", required_argument, 0, LONG_OPT_MESOS_PATH},
 	{"mesos-preload", required_argument, 0, LONG_OPT_MESOS_PRELOAD},
+	{"predictive", no_argument, 0, LONG_OPT_PREDICTIVE},
+	{"simulate", required_argument, 0, LONG_OPT_SIMULATE},
+	{"simulate-latency", required_argument, 0, LONG_OPT_SIMULATE_LATENCY},
 	{0,0,0,0}
 };
 
@@ -1072,6 +1534,15 @@ int main(int argc, char *argv[])
 			case LONG_OPT_MESOS_PRELOAD:
 				mesos_preload = xxstrdup(optarg);
 				break;
+			case LONG_OPT_PREDICTIVE:
+				predictive = 1;
+				break;
+			case LONG_OPT_SIMULATE:
+				simulate_trace = xxstrdup(optarg);
+				break;
+			case LONG_OPT_SIMULATE_LATENCY:
+				simulate_latency = MAX(0, atoi(optarg));
+				break;
 			default:
 				show_help(argv[0]);
 				return EXIT_FAILURE;
@@ -1092,7 +1563,15 @@ int main(int argc, char *argv[])
 		config_file = xxstrdup(abs_path_name);
 	}
 
-	if(project_regex) {
+	if(simulate_trace) {
+		using_catalog = 0;
+		master_host = "simulation";
+		master_port = 0;
+		batch_queue_type = BATCH_QUEUE_TYPE_DRYRUN;
+		if(!sim_load_trace(simulate_trace)) {
+			return 1;
+		}
+	} else if(project_regex) {
 		using_catalog = 1;
 	} else if(config_file) {
 		using_catalog = 1;
@@ -1147,7 +1626,9 @@ int main(int argc, char *argv[])
 	}
 
 	char cmd[1024];
-	if(worker_command != NULL){
+	if(simulate_trace) {
+		/* the dryrun batch system does not run the worker. */
+	}else if(worker_command != NULL){
 		sprintf(cmd,"cp '%s' '%s'",worker_command,scratch_dir);
 		if(system(cmd)){
 			fprintf(stderr, "work_queue_factory: Could not Access specified worker_queue_worker binary.\n");
@@ -1199,6 +1680,10 @@ int main(int argc, char *argv[])
 		batch_queue_set_option(queue, "condor-requirements", condor_requirements);
 	}
 
+	if(batch_queue_type == BATCH_QUEUE_TYPE_DRYRUN) {
+		batch_queue_set_logfile(queue, "work_queue_factory.dryrun");
+	}
+
 	if(batch_queue_type == BATCH_QUEUE_TYPE_MESOS) {
 		batch_queue_set_option(queue, "mesos-path", mesos_path);
 		batch_queue_set_option(queue, "mesos-master", mesos_master);
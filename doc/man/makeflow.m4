@@ -55,15 +55,18 @@ OPTION_TRIPLET(-L, batch-log, logfile)Use this file for the batch system log. (d
 OPTION_ITEM(`-R, --retry')Automatically retry failed batch jobs up to 100 times.
 OPTION_TRIPLET(-r, retry-count, n)Automatically retry failed batch jobs up to n times.
 OPTION_PAIR(--wait-for-files-upto, #)Wait for output files to be created upto this many seconds (e.g., to deal with NFS semantics).
+OPTION_PAIR(--schedule, mode)Order of submission of ready rules: fifo, or critical-path for the rules that lead the longest chains first, with the length of the chain as their Work Queue priority. (default is fifo)
 OPTION_TRIPLET(-S, submission-timeout, timeout)Time to retry failed batch job submission. (default is 3600s)
 OPTION_TRIPLET(-T, batch-type, type)Batch system type: local, dryrun, condor, sge, pbs, torque, blue_waters, slurm, moab, cluster, wq, amazon, mesos. (default is local)
 OPTIONS_END
 
 SUBSECTION(JSON/JX Options)
 OPTIONS_BEGIN
+OPTION_PAIR(--dag-cache, file)Load the parsed PARAM(dagfile) from PARAM(file) (default is PARAM(dagfile).dagcache), which is written again whenever PARAM(dagfile) or the environment variables it uses change.
 OPTION_ITEM(--json)Interpret PARAM(dagfile) as a JSON format Makeflow.
 OPTION_ITEM(--jx)Evaluate JX expressions in PARAM(dagfile). Implies --json.
 OPTION_PAIR(--jx-context, ctx)Use PARAM(ctx) as the context for evaluating JX.
+OPTION_PAIR(--jx-threads, n)Evaluate the JX rules with PARAM(n) threads. (default is the number of cores)
 OPTIONS_END
 
 SUBSECTION(Debugging Options)
@@ -174,6 +177,15 @@ specified by BOLD(-L) PARAM(logfile). This script will run the commands in
 serial that Makeflow would have run. This shell script format may be useful
 for archival purposes, since it does not depend on Makeflow.
 
+SECTION(RECOVERY)
+
+Makeflow records the progress of a workflow in its log, and plays the log back
+to continue where it stopped when run again. As the workflow runs, and when it
+stops, Makeflow also writes a checkpoint of its progress to PARAM(logfile).checkpoint,
+so that a restart only plays back the part of the log written after it. The
+checkpoint is ignored if it does not match the log. The log of a long running
+workflow may be shortened with BOLD(makeflow_compact_log).
+
 SECTION(ENVIRONMENT VARIABLES)
 
 The following environment variables will affect the execution of your
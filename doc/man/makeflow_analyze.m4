@@ -15,6 +15,7 @@ SECTION(OPTIONS)
 SUBSECTION(Commands)
 OPTIONS_BEGIN
 OPTION_TRIPLET(-b, bundle-dir, directory)Create portable bundle of workflow.
+OPTION_PAIR(--dag-cache, file)Load the parsed PARAM(dagfile) from PARAM(file) (default is PARAM(dagfile).dagcache), which is written again whenever PARAM(dagfile) or the environment variables it uses change.
 OPTION_ITEM(`-h, --help')Show this help screen.
 OPTION_ITEM(`-I, --show-input')Show input files.
 OPTION_ITEM(`-k, --syntax-check')Syntax check.
@@ -0,0 +1,50 @@
+include(manual.h)dnl
+HEADER(makeflow_compact_log)
+
+SECTION(NAME)
+BOLD(makeflow_compact_log) - remove old events from a makeflow log
+
+SECTION(SYNOPSIS)
+CODE(BOLD(makeflow_compact_log [options] PARAM(logfile)))
+
+SECTION(DESCRIPTION)
+
+BOLD(makeflow_compact_log) rewrites a makeflow log with only the events
+needed to recover the workflow: the last state of each rule and of each
+file, and the time each file was created. Garbage collection events are
+dropped, and all other events are kept in order. A workflow recovered from
+the compacted log runs the same rules as it would have from the full log,
+but its log no longer shows the history of earlier runs.
+
+PARA
+
+By default the log is replaced, and its checkpoint is removed. The log must
+not be compacted while BOLD(makeflow) is running the workflow.
+
+SECTION(OPTIONS)
+OPTIONS_BEGIN
+OPTION_TRIPLET(-o, output, file)Write the compacted log to this file. (default is to replace PARAM(logfile))
+OPTION_TRIPLET(-d, debug, subsystem)Enable debugging for this subsystem.
+OPTION_ITEM(`-h, --help')Show help text.
+OPTION_ITEM(`-v, --version')Show version string.
+OPTIONS_END
+
+SECTION(EXIT STATUS)
+On success, returns 0 and prints the number of lines before and after compacting.
+
+SECTION(EXAMPLES)
+
+LONGCODE_BEGIN
+makeflow_compact_log Makeflow.makeflowlog
+makeflow_compact_log -o small.makeflowlog Makeflow.makeflowlog
+LONGCODE_END
+
+SECTION(COPYRIGHT)
+
+COPYRIGHT_BOILERPLATE
+
+SECTION(SEE ALSO)
+
+SEE_ALSO_MAKEFLOW
+
+FOOTER
@@ -14,6 +14,7 @@ BOLD(makeflow_viz) is a collection of tools to graphically display workflows. Th
 SECTION(OPTIONS)
 SUBSECTION(Commands)
 OPTIONS_BEGIN
+OPTION_PAIR(--dag-cache, file)Load the parsed PARAM(dagfile) from PARAM(file) (default is PARAM(dagfile).dagcache), which is written again whenever PARAM(dagfile) or the environment variables it uses change.
 OPTION_TRIPLET(-D, display, opt) Translate the makeflow to the desired visualization format:
     dot      DOT file format for precise graph drawing.
     ppm      PPM file format for rapid iconic display
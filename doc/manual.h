@@ -6,7 +6,7 @@ define(SEE_ALSO_MAKEFLOW,
 `LIST_BEGIN
 LIST_ITEM(MANUAL(Cooperative Computing Tools Documentation,"../index.html"))
 LIST_ITEM(MANUAL(Makeflow User Manual,"../makeflow.html"))
-LIST_ITEM(MANPAGE(makeflow,1), MANPAGE(makeflow_monitor,1), MANPAGE(makeflow_analyze,1), MANPAGE(makeflow_viz,1), MANPAGE(makeflow_graph_log,1), MANPAGE(starch,1))
+LIST_ITEM(MANPAGE(makeflow,1), MANPAGE(makeflow_monitor,1), MANPAGE(makeflow_analyze,1), MANPAGE(makeflow_viz,1), MANPAGE(makeflow_graph_log,1), MANPAGE(makeflow_compact_log,1), MANPAGE(starch,1))
 LIST_END')dnl
 dnl
 define(SEE_ALSO_WORK_QUEUE,
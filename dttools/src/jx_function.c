@@ -139,6 +139,8 @@ struct jx *jx_function_foreach( struct jx_function *f, struct jx *context ) {
 	}
 
 	result = jx_array(NULL);
+	// append at the tail, rather than walking the whole array for each item
+	struct jx_item **tail = &result->u.items;
 	void *i = NULL;
 	struct jx *item;
 	while ((item = jx_iterate_array(array, &i))) {
@@ -146,7 +148,8 @@ struct jx *jx_function_foreach( struct jx_function *f, struct jx *context ) {
 		if (!local_context) local_context = jx_object(NULL);
 		jx_insert(local_context, jx_string(symbol), jx_copy(item));
 		struct jx *local_result = jx_eval(body, local_context);
-		jx_array_append(result, local_result);
+		*tail = jx_item(local_result, NULL);
+		tail = &(*tail)->next;
 		jx_delete(local_context);
 	}
 
@@ -207,8 +210,10 @@ struct jx *jx_function_range( struct jx_function *f, struct jx *context ) {
 		return result;
 	}
 
+	struct jx_item **tail = &result->u.items;
 	for (jx_int_t i = start; stop >= start ? i < stop : i > stop; i += step) {
-		jx_array_append(result, jx_integer(i));
+		*tail = jx_item(jx_integer(i), NULL);
+		tail = &(*tail)->next;
 	}
 
 	return result;
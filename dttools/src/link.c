@@ -9,11 +9,19 @@ See the file COPYING for details.
 #include "debug.h"
 #include "domain_name.h"
 #include "full_io.h"
+#include "itable.h"
 #include "link.h"
+#include "list.h"
 #include "macros.h"
+#include "set.h"
 #include "stringtools.h"
 #include "address.h"
 
+#ifdef CCTOOLS_OPSYS_LINUX
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -60,6 +68,16 @@ struct link {
 	char buffer[1<<16];
 	char raddr[LINK_ADDRESS_MAX];
 	int rport;
+	struct link_poller *poller;
+	int poller_events;
+};
+
+struct link_poller {
+	int fd;                      /* epoll descriptor, or -1 to fall back to poll. */
+	struct itable *links;        /* fd -> link, for all the registered links. */
+	struct set *pending;         /* registered links that may have data in their buffers. */
+	void *events;                /* scratch array of epoll_event or pollfd. */
+	int events_size;
 };
 
 static int link_send_window = 65536;
@@ -283,6 +301,8 @@ static struct link *link_create()
 	link->raddr[0] = 0;
 	link->rport = 0;
 	link->type = LINK_TYPE_STANDARD;
+	link->poller = 0;
+	link->poller_events = 0;
 
 	return link;
 }
@@ -562,6 +582,8 @@ static ssize_t fill_buffer(struct link *link, time_t stoptime)
 			link->read += chunk;
 			link->buffer_start = link->buffer;
 			link->buffer_length = chunk;
+			if(link->poller)
+				set_insert(link->poller->pending, link);
 			return chunk;
 		} else if(chunk == 0) {
 			link->buffer_start = link->buffer;
@@ -581,6 +603,23 @@ static ssize_t fill_buffer(struct link *link, time_t stoptime)
 	}
 }
 
+ssize_t link_buffer_fill(struct link *link)
+{
+	if(link->buffer_length > 0)
+		return link->buffer_length;
+
+	ssize_t chunk = read(link->fd, link->buffer, sizeof(link->buffer));
+	if(chunk > 0) {
+		link->read += chunk;
+		link->buffer_start = link->buffer;
+		link->buffer_length = chunk;
+		if(link->poller)
+			set_insert(link->poller->pending, link);
+	}
+
+	return chunk;
+}
+
 /* link_read blocks until all the requested data is available */
 
 ssize_t link_read(struct link *link, char *data, size_t count, time_t stoptime)
@@ -767,6 +806,33 @@ ssize_t link_write(struct link *link, const char *data, size_t count, time_t sto
 	}
 }
 
+/* link_write_avail writes whatever the link accepts, without blocking */
+
+ssize_t link_write_avail(struct link *link, const char *data, size_t count)
+{
+	ssize_t total = 0;
+
+	while(count > 0) {
+		ssize_t chunk = write(link->fd, data, count);
+		if(chunk < 0) {
+			if(errno_is_temporary(errno)) {
+				break;
+			} else {
+				return -1;
+			}
+		} else if(chunk == 0) {
+			break;
+		} else {
+			link->written += chunk;
+			total += chunk;
+			count -= chunk;
+			data += chunk;
+		}
+	}
+
+	return total;
+}
+
 ssize_t link_putlstring(struct link *link, const char *data, size_t count, time_t stoptime)
 {
 	ssize_t total = 0;
@@ -819,6 +885,8 @@ ssize_t link_putfstring(struct link *link, const char *fmt, time_t stoptime, ...
 void link_close(struct link *link)
 {
 	if(link) {
+		if(link->poller)
+			link_poller_remove(link->poller, link);
 		if(link->fd >= 0)
 			close(link->fd);
 		if(link->rport)
@@ -830,6 +898,8 @@ void link_close(struct link *link)
 void link_detach(struct link *link)
 {
 	if(link) {
+		if(link->poller)
+			link_poller_remove(link->poller, link);
 		free(link);
 	}
 }
@@ -970,10 +1040,57 @@ int64_t link_stream_to_file(struct link * link, FILE * file, int64_t length, tim
 	return total;
 }
 
+/*
+Send from fd straight to the socket with sendfile, without copying the data
+through user space. Returns zero if sendfile cannot be used for fd, before
+anything has been sent, so that the caller falls back to read and write.
+Otherwise, returns one with total set as link_stream_from_fd would.
+*/
+
+static int link_sendfile(struct link *link, int fd, int64_t length, time_t stoptime, int64_t *total)
+{
+#ifdef CCTOOLS_OPSYS_LINUX
+	*total = 0;
+
+	while(length > 0) {
+		size_t chunk = MIN(1<<30, length);
+
+		ssize_t actual = sendfile(link->fd, fd, NULL, chunk);
+		if(actual > 0) {
+			link->written += actual;
+			*total += actual;
+			length -= actual;
+		} else if(actual == 0) {
+			/* end of file */
+			break;
+		} else if(errno_is_temporary(errno)) {
+			if(!link_sleep(link, stoptime, 0, 1)) {
+				*total = -1;
+				break;
+			}
+		} else if(*total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+			return 0;
+		} else {
+			*total = -1;
+			break;
+		}
+	}
+
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 int64_t link_stream_from_fd(struct link * link, int fd, int64_t length, time_t stoptime)
 {
 	int64_t total = 0;
 
+	/* Only plain sockets take the zero-copy path. */
+	if(link->type == LINK_TYPE_STANDARD && link_sendfile(link, fd, length, stoptime, &total)) {
+		return total;
+	}
+
 	while(length > 0) {
 		char buffer[1<<16];
 		size_t chunk = MIN(sizeof(buffer), (size_t)length);
@@ -995,6 +1112,67 @@ int64_t link_stream_from_fd(struct link * link, int fd, int64_t length, time_t s
 	return total;
 }
 
+int64_t link_stream_from_fd_avail(struct link *link, int fd, off_t *offset, int64_t length)
+{
+	int64_t total = 0;
+
+#ifdef CCTOOLS_OPSYS_LINUX
+	if(link->type == LINK_TYPE_STANDARD) {
+		while(length > 0) {
+			ssize_t actual = sendfile(link->fd, fd, offset, MIN(1<<30, length));
+			if(actual > 0) {
+				link->written += actual;
+				total += actual;
+				length -= actual;
+			} else if(actual == 0) {
+				/* fd ended before length bytes. */
+				errno = EPIPE;
+				return -1;
+			} else if(errno_is_temporary(errno)) {
+				return total;
+			} else if(total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+				break;
+			} else {
+				return -1;
+			}
+		}
+
+		if(length == 0)
+			return total;
+	}
+#endif
+
+	while(length > 0) {
+		char buffer[1<<16];
+		size_t chunk = MIN(sizeof(buffer), (size_t)length);
+
+		ssize_t ractual = offset ? full_pread(fd, buffer, chunk, *offset) : full_read(fd, buffer, chunk);
+		if(ractual <= 0) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		ssize_t wactual = link_write_avail(link, buffer, ractual);
+		if(wactual < 0)
+			return -1;
+
+		total += wactual;
+		length -= wactual;
+
+		if(offset) {
+			*offset += wactual;
+		} else if(wactual < ractual) {
+			/* give back what the link did not take. */
+			lseek(fd, wactual - ractual, SEEK_CUR);
+		}
+
+		if(wactual < ractual)
+			break;
+	}
+
+	return total;
+}
+
 int64_t link_stream_from_file(struct link * link, FILE * file, int64_t length, time_t stoptime)
 {
 	int64_t total = 0;
@@ -1121,4 +1299,256 @@ int link_poll(struct link_info *links, int nlinks, int msec)
 	return result;
 }
 
+#ifdef CCTOOLS_OPSYS_LINUX
+static int link_to_epoll(int events)
+{
+	int r = 0;
+	if(events & LINK_READ)
+		r |= EPOLLIN | EPOLLHUP;
+	if(events & LINK_WRITE)
+		r |= EPOLLOUT;
+	return r;
+}
+
+static int epoll_to_link(int events)
+{
+	int r = 0;
+	if(events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		r |= LINK_READ;
+	if(events & EPOLLOUT)
+		r |= LINK_WRITE;
+	return r;
+}
+#endif
+
+struct link_poller *link_poller_create()
+{
+	struct link_poller *p = malloc(sizeof(*p));
+	if(!p)
+		return 0;
+
+	p->fd = -1;
+#ifdef CCTOOLS_OPSYS_LINUX
+	p->fd = epoll_create(1);
+	if(p->fd < 0) {
+		debug(D_TCP, "epoll_create failed, falling back to poll: %s", strerror(errno));
+	} else {
+		fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+
+	p->links = itable_create(0);
+	p->pending = set_create(0);
+	p->events = 0;
+	p->events_size = 0;
+
+	return p;
+}
+
+void link_poller_delete(struct link_poller *p)
+{
+	uint64_t fd;
+	struct link *link;
+
+	if(!p)
+		return;
+
+	itable_firstkey(p->links);
+	while(itable_nextkey(p->links, &fd, (void **) &link)) {
+		link->poller = 0;
+		link->poller_events = 0;
+	}
+
+	if(p->fd >= 0)
+		close(p->fd);
+
+	itable_delete(p->links);
+	set_delete(p->pending);
+	free(p->events);
+	free(p);
+}
+
+int link_poller_add(struct link_poller *p, struct link *link, int events)
+{
+	if(link->poller && link->poller != p)
+		link_poller_remove(link->poller, link);
+
+#ifdef CCTOOLS_OPSYS_LINUX
+	if(p->fd >= 0) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = link_to_epoll(events);
+		ev.data.ptr = link;
+
+		int op = link->poller ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		if(epoll_ctl(p->fd, op, link->fd, &ev) < 0)
+			return 0;
+	}
+#endif
+
+	link->poller = p;
+	link->poller_events = events;
+	itable_insert(p->links, link->fd, link);
+
+	if(link->buffer_length)
+		set_insert(p->pending, link);
+
+	return 1;
+}
+
+int link_poller_remove(struct link_poller *p, struct link *link)
+{
+	if(link->poller != p)
+		return 0;
+
+#ifdef CCTOOLS_OPSYS_LINUX
+	if(p->fd >= 0) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		epoll_ctl(p->fd, EPOLL_CTL_DEL, link->fd, &ev);
+	}
+#endif
+
+	itable_remove(p->links, link->fd);
+	set_remove(p->pending, link);
+	link->poller = 0;
+	link->poller_events = 0;
+
+	return 1;
+}
+
+int link_poller_size(struct link_poller *p)
+{
+	return itable_size(p->links);
+}
+
+int link_poller_fd(struct link_poller *p)
+{
+	return p->fd;
+}
+
+/* Links with data already in their buffers are ready, but the kernel does not
+know about them. Put them first in the array, and forget the ones that have
+been drained since. */
+static int link_poller_pending(struct link_poller *p, struct link_info *links, int nlinks)
+{
+	int n = 0;
+	struct link *link;
+	struct list *drained = list_create();
+
+	set_first_element(p->pending);
+	while((link = set_next_element(p->pending))) {
+		if(!link->buffer_length) {
+			list_push_tail(drained, link);
+		} else if(n < nlinks && (link->poller_events & LINK_READ)) {
+			links[n].link = link;
+			links[n].events = link->poller_events;
+			links[n].revents = LINK_READ;
+			n++;
+		}
+	}
+
+	while((link = list_pop_head(drained))) {
+		set_remove(p->pending, link);
+	}
+
+	list_delete(drained);
+
+	return n;
+}
+
+static void link_poller_merge(struct link_info *links, int npending, int *n, struct link *link, int revents)
+{
+	int i;
+
+	if(!revents)
+		return;
+
+	for(i = 0; i < npending; i++) {
+		if(links[i].link == link) {
+			links[i].revents |= revents;
+			return;
+		}
+	}
+
+	links[*n].link = link;
+	links[*n].events = link->poller_events;
+	links[*n].revents = revents;
+	(*n)++;
+}
+
+int link_poller_wait(struct link_poller *p, struct link_info *links, int nlinks, int msec)
+{
+	int i, result;
+
+	int npending = link_poller_pending(p, links, nlinks);
+	int n = npending;
+
+	if(npending > 0)
+		msec = 0;
+
+	if(n >= nlinks)
+		return n;
+
+#ifdef CCTOOLS_OPSYS_LINUX
+	if(p->fd >= 0) {
+		if(p->events_size < nlinks) {
+			free(p->events);
+			p->events = malloc(sizeof(struct epoll_event) * nlinks);
+			p->events_size = nlinks;
+		}
+
+		struct epoll_event *events = p->events;
+
+		result = epoll_wait(p->fd, events, nlinks - n, msec);
+		if(result < 0)
+			return npending ? npending : (errno == EINTR ? 0 : -1);
+
+		for(i = 0; i < result; i++) {
+			link_poller_merge(links, npending, &n, events[i].data.ptr, epoll_to_link(events[i].events));
+		}
+
+		return n;
+	}
+#endif
+
+	/* Without epoll, poll all the registered links. */
+	int nfds = itable_size(p->links);
+	if(p->events_size < nfds) {
+		free(p->events);
+		p->events = malloc(sizeof(struct pollfd) * nfds);
+		p->events_size = nfds;
+	}
+
+	struct pollfd *fds = p->events;
+	struct link **fd_links = malloc(sizeof(*fd_links) * (nfds + 1));
+
+	uint64_t fd;
+	struct link *link;
+
+	i = 0;
+	itable_firstkey(p->links);
+	while(itable_nextkey(p->links, &fd, (void **) &link)) {
+		fds[i].fd = link->fd;
+		fds[i].events = link_to_poll(link->poller_events);
+		fds[i].revents = 0;
+		fd_links[i] = link;
+		i++;
+	}
+
+	result = poll(fds, nfds, msec);
+	if(result < 0) {
+		free(fd_links);
+		return npending ? npending : (errno == EINTR ? 0 : -1);
+	}
+
+	for(i = 0; i < nfds && n < nlinks; i++) {
+		link_poller_merge(links, npending, &n, fd_links[i], poll_to_link(fds[i].revents));
+	}
+
+	free(fd_links);
+
+	return n;
+}
+
 /* vim: set noexpandtab tabstop=4: */
@@ -151,6 +151,16 @@ ssize_t link_read_avail(struct link *link, char *data, size_t length, time_t sto
 */
 ssize_t link_write(struct link *link, const char *data, size_t length, time_t stoptime);
 
+/** Write data to a connection without blocking.
+This call will write whatever the connection accepts immediately, and then
+return without blocking.
+@param link The link to write.
+@param data A pointer to the data.
+@param length The number of bytes to write.
+@return The number of bytes actually written, possibly zero, or less than zero on error.
+*/
+ssize_t link_write_avail(struct link *link, const char *data, size_t length);
+
 /* Write a string of length len to a connection. All data is written until
  * finished or an error is encountered.
 @param link The link to write.
@@ -283,6 +293,13 @@ int link_nonblocking(struct link *link, int onoff);
 */
 int link_buffer_empty(struct link *link);
 
+/** Read the data available on a link into its buffer, without blocking.
+Does nothing if the buffer is not empty.
+@param link The link to read from.
+@return The number of bytes in the buffer, zero at end of file, or -1 on error. If no data was available, returns -1 with errno set to EAGAIN or EWOULDBLOCK.
+*/
+ssize_t link_buffer_fill(struct link *link);
+
 /** Return the local address of the link in text format.
 @param link The link to examine.
 @param addr Pointer to a string of at least @ref LINK_ADDRESS_MAX bytes, which will be filled with a text representation of the local IP address.
@@ -305,6 +322,20 @@ int64_t link_stream_to_fd(struct link *link, int fd, int64_t length, time_t stop
 int64_t link_stream_to_file(struct link *link, FILE * file, int64_t length, time_t stoptime);
 
 int64_t link_stream_from_fd(struct link *link, int fd, int64_t length, time_t stoptime);
+
+/** Send data from a file descriptor to a connection without blocking.
+This call will send from fd whatever the connection accepts immediately,
+up to length bytes, and then return without blocking.
+If offset is null, the data is read from the current offset of fd, which is
+left after the data sent. Otherwise, it is read from *offset, which is moved
+after the data sent, and the offset of fd does not change, as with sendfile.
+@param link The link to write.
+@param fd The file descriptor to read from.
+@param offset Where to read fd from, or null for its current offset.
+@param length The maximum number of bytes to send.
+@return The number of bytes actually sent, possibly zero, or less than zero on error, or if fd ends before length bytes.
+*/
+int64_t link_stream_from_fd_avail(struct link *link, int fd, off_t *offset, int64_t length);
 int64_t link_stream_from_file(struct link *link, FILE * file, int64_t length, time_t stoptime);
 
 int64_t link_soak(struct link *link, int64_t length, time_t stoptime);
@@ -346,4 +377,60 @@ Wait for a activity on a an array of links.
 
 int link_poll(struct link_info *array, int nlinks, int msec);
 
+/** A persistent set of links to wait on.
+Unlike @ref link_poll, links are registered once with @ref link_poller_add,
+and waiting costs time proportional to the number of ready links, rather
+than to the number of registered links. On Linux it is backed by epoll. */
+struct link_poller;
+
+/** Create a new poller.
+@return A pointer to a new poller, or null on failure.
+*/
+struct link_poller *link_poller_create();
+
+/** Delete a poller. The links registered are not closed.
+@param p The poller to delete.
+*/
+void link_poller_delete(struct link_poller *p);
+
+/** Register a link with a poller, or change the events of interest of a registered link.
+A link can only be registered with one poller at a time, and it is removed from it by @ref link_close.
+@param p The poller.
+@param link The link to register.
+@param events The events to wait for (@ref LINK_READ or @ref LINK_WRITE).
+@return One on success, zero on failure, with errno set. The failure is not logged, so that any thread may call it.
+*/
+int link_poller_add(struct link_poller *p, struct link *link, int events);
+
+/** Remove a link from a poller.
+@param p The poller.
+@param link The link to remove.
+@return One if the link was removed, zero if it was not registered with p.
+*/
+int link_poller_remove(struct link_poller *p, struct link *link);
+
+/** Return the number of links registered with a poller.
+@param p The poller.
+@return The number of links registered.
+*/
+int link_poller_size(struct link_poller *p);
+
+/** Return a descriptor that becomes readable when links registered with a poller may be ready.
+It can be waited on along with other descriptors, before calling @ref link_poller_wait without waiting.
+Links with data already buffered are not signaled by it.
+@param p The poller.
+@return The descriptor, or -1 if the poller does not have one.
+*/
+int link_poller_fd(struct link_poller *p);
+
+/** Wait for activity on the links registered with a poller.
+Links with data already buffered are reported ready without waiting.
+@param p The poller.
+@param array Pointer to an array of @ref link_info structures, which is filled with the links ready, and their revents fields with the events that occurred.
+@param nlinks The length of the array. Links ready that do not fit are reported on the next call.
+@param msec The number of milliseconds to wait for activity.  Zero indicates do not wait at all, while -1 indicates wait forever.
+@return The number of entries filled in the array, or -1 on error.
+*/
+int link_poller_wait(struct link_poller *p, struct link_info *array, int nlinks, int msec);
+
 #endif
@@ -0,0 +1,142 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+/*
+Compares the throughput of sending a file over a local TCP link with
+link_stream_from_fd, which uses sendfile when possible, and with
+link_stream_from_file, which copies the data through a user space buffer.
+*/
+
+#include "link.h"
+#include "timestamp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static void show_help(const char *cmd)
+{
+	printf("Use: %s <path> <runs>\n", cmd);
+}
+
+/* accept one connection, and read all of it. */
+static pid_t start_reader(struct link *server, int64_t length, int runs)
+{
+	pid_t pid = fork();
+	if(pid != 0)
+		return pid;
+
+	int i;
+	for(i = 0; i < runs; i++) {
+		struct link *l = link_accept(server, time(0) + 60);
+		if(!l)
+			_exit(EXIT_FAILURE);
+
+		if(link_soak(l, length, time(0) + 600) != length)
+			_exit(EXIT_FAILURE);
+
+		link_close(l);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+static double send_once(const char *path, int port, int64_t length, int use_fd)
+{
+	struct link *l = link_connect("127.0.0.1", port, time(0) + 60);
+	if(!l) {
+		printf("could not connect to port %d: %s\n", port, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t actual;
+	timestamp_t start = timestamp_get();
+
+	if(use_fd) {
+		int fd = open(path, O_RDONLY);
+		actual = link_stream_from_fd(l, fd, length, time(0) + 600);
+		close(fd);
+	} else {
+		FILE *file = fopen(path, "r");
+		actual = link_stream_from_file(l, file, length, time(0) + 600);
+		fclose(file);
+	}
+
+	link_close(l);
+
+	timestamp_t elapsed = timestamp_get() - start;
+
+	if(actual != length) {
+		printf("sent %lld of %lld bytes\n", (long long) actual, (long long) length);
+		exit(EXIT_FAILURE);
+	}
+
+	return elapsed / 1000000.0;
+}
+
+static void run(const char *name, const char *path, int64_t length, int runs, int use_fd)
+{
+	char addr[LINK_ADDRESS_MAX];
+	int port;
+
+	struct link *server = link_serve_address("127.0.0.1", 0);
+	if(!server) {
+		printf("could not listen: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	link_address_local(server, addr, &port);
+
+	pid_t pid = start_reader(server, length, runs);
+
+	double seconds = 0;
+	int i;
+	for(i = 0; i < runs; i++) {
+		seconds += send_once(path, port, length, use_fd);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	link_close(server);
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		printf("reader failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-24s %8.3f s %10.1f MB/s\n", name, seconds / runs, (length * runs) / seconds / (1024 * 1024));
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat info;
+
+	if(argc < 3) {
+		show_help(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char *path = argv[1];
+	int runs = atoi(argv[2]);
+
+	if(stat(path, &info) < 0) {
+		printf("could not stat %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	run("link_stream_from_file", path, info.st_size, runs, 0);
+	run("link_stream_from_fd", path, info.st_size, runs, 1);
+
+	return EXIT_SUCCESS;
+}
+
+/* vim: set noexpandtab tabstop=4: */
@@ -0,0 +1,242 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "priority_queue.h"
+#include "itable.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* with one in four nodes promoted at each level, 16 levels keep searches
+logarithmic well past a billion items. */
+#define MAX_LEVEL 16
+
+/*
+Nodes are ordered first by band, so that items pushed to the head come before
+any other, then by decreasing priority, and then by increasing sequence
+number, which keeps the push order among equal priorities.
+*/
+
+struct priority_node {
+	void *item;
+	int band;
+	double priority;
+	int64_t sequence;
+	int levels;
+	struct priority_node *next[1];
+};
+
+struct priority_queue {
+	struct priority_node *head;
+	struct priority_node *iter;
+	struct itable *index;
+	int levels;
+	int64_t tail_sequence;
+	int64_t head_sequence;
+	uint64_t random_state;
+};
+
+static struct priority_node *node_create(void *item, int band, double priority, int64_t sequence, int levels)
+{
+	struct priority_node *n = calloc(1, sizeof(*n) + (levels - 1) * sizeof(n->next[0]));
+	if(!n)
+		return 0;
+
+	n->item = item;
+	n->band = band;
+	n->priority = priority;
+	n->sequence = sequence;
+	n->levels = levels;
+
+	return n;
+}
+
+/* true if node a should come before node b. */
+static int node_before(const struct priority_node *a, const struct priority_node *b)
+{
+	if(a->band != b->band)
+		return a->band > b->band;
+
+	if(a->priority != b->priority)
+		return a->priority > b->priority;
+
+	return a->sequence < b->sequence;
+}
+
+static int random_levels(struct priority_queue *q)
+{
+	int levels = 1;
+
+	/* xorshift, so that queues do not disturb the sequence of random(). */
+	uint64_t x = q->random_state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	q->random_state = x;
+
+	while(levels < MAX_LEVEL && (x & 3) == 0) {
+		levels++;
+		x >>= 2;
+	}
+
+	return levels;
+}
+
+/* fill prev with the last node before n at each level. */
+static void find_previous(struct priority_queue *q, const struct priority_node *n, struct priority_node **prev)
+{
+	struct priority_node *p = q->head;
+	int i;
+
+	for(i = q->levels - 1; i >= 0; i--) {
+		while(p->next[i] && node_before(p->next[i], n))
+			p = p->next[i];
+		prev[i] = p;
+	}
+}
+
+struct priority_queue *priority_queue_create()
+{
+	struct priority_queue *q = calloc(1, sizeof(*q));
+	if(!q)
+		return 0;
+
+	q->head = node_create(0, 0, 0, 0, MAX_LEVEL);
+	q->index = itable_create(0);
+
+	if(!q->head || !q->index) {
+		priority_queue_delete(q);
+		return 0;
+	}
+
+	q->levels = 1;
+	q->random_state = 0x9e3779b97f4a7c15ULL;
+
+	return q;
+}
+
+void priority_queue_delete(struct priority_queue *q)
+{
+	if(!q)
+		return;
+
+	struct priority_node *n = q->head;
+	while(n) {
+		struct priority_node *next = n->next[0];
+		free(n);
+		n = next;
+	}
+
+	if(q->index)
+		itable_delete(q->index);
+
+	free(q);
+}
+
+int priority_queue_size(struct priority_queue *q)
+{
+	return itable_size(q->index);
+}
+
+static int insert(struct priority_queue *q, void *item, int band, double priority, int64_t sequence)
+{
+	struct priority_node *prev[MAX_LEVEL];
+	int i;
+
+	if(itable_lookup(q->index, (uintptr_t) item))
+		return 0;
+
+	struct priority_node *n = node_create(item, band, priority, sequence, random_levels(q));
+	if(!n)
+		return 0;
+
+	if(n->levels > q->levels)
+		q->levels = n->levels;
+
+	find_previous(q, n, prev);
+
+	for(i = 0; i < n->levels; i++) {
+		n->next[i] = prev[i]->next[i];
+		prev[i]->next[i] = n;
+	}
+
+	itable_insert(q->index, (uintptr_t) item, n);
+
+	return 1;
+}
+
+int priority_queue_push(struct priority_queue *q, void *item, double priority)
+{
+	return insert(q, item, 0, priority, q->tail_sequence++);
+}
+
+int priority_queue_push_head(struct priority_queue *q, void *item)
+{
+	return insert(q, item, 1, 0, --q->head_sequence);
+}
+
+void *priority_queue_peek_head(struct priority_queue *q)
+{
+	struct priority_node *n = q->head->next[0];
+	return n ? n->item : 0;
+}
+
+void *priority_queue_pop_head(struct priority_queue *q)
+{
+	void *item = priority_queue_peek_head(q);
+	if(item)
+		priority_queue_remove(q, item);
+
+	return item;
+}
+
+int priority_queue_remove(struct priority_queue *q, void *item)
+{
+	struct priority_node *prev[MAX_LEVEL];
+	int i;
+
+	struct priority_node *n = itable_remove(q->index, (uintptr_t) item);
+	if(!n)
+		return 0;
+
+	find_previous(q, n, prev);
+
+	for(i = 0; i < n->levels; i++)
+		prev[i]->next[i] = n->next[i];
+
+	while(q->levels > 1 && !q->head->next[q->levels - 1])
+		q->levels--;
+
+	if(q->iter == n)
+		q->iter = n->next[0];
+
+	free(n);
+
+	return 1;
+}
+
+int priority_queue_contains(struct priority_queue *q, void *item)
+{
+	return itable_lookup(q->index, (uintptr_t) item) != 0;
+}
+
+void priority_queue_first_item(struct priority_queue *q)
+{
+	q->iter = q->head->next[0];
+}
+
+void *priority_queue_next_item(struct priority_queue *q)
+{
+	struct priority_node *n = q->iter;
+	if(!n)
+		return 0;
+
+	q->iter = n->next[0];
+
+	return n->item;
+}
+
+/* vim: set noexpandtab tabstop=4: */
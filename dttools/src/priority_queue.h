@@ -0,0 +1,112 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef PRIORITY_QUEUE_H
+#define PRIORITY_QUEUE_H
+
+/** @file priority_queue.h An ordered queue of items with priorities.
+
+A priority queue keeps items sorted from the highest to the lowest priority.
+Items of equal priority keep the order in which they were pushed. Unlike
+@ref list_push_priority, which walks the list on every insertion, pushing,
+popping, and removing any item take O(log n) expected time, as the queue is
+kept in a skip list and indexed by item.
+
+An item may be in a queue at most once. To visit the items in order, use
+@ref priority_queue_first_item and @ref priority_queue_next_item like this:
+
+<pre>
+struct priority_queue *q = priority_queue_create();
+
+priority_queue_push(q, item, 10);
+priority_queue_push_head(q, urgent);
+
+priority_queue_first_item(q);
+while((item = priority_queue_next_item(q))) {
+	if(...)
+		priority_queue_remove(q, item);
+}
+</pre>
+
+The item returned last by @ref priority_queue_next_item may be removed while
+iterating, as in the example above.
+*/
+
+/** Create an empty priority queue.
+@return A pointer to a new priority queue.
+*/
+struct priority_queue *priority_queue_create();
+
+/** Delete a priority queue.
+The items in the queue are not deleted.
+@param q The queue to delete.
+*/
+void priority_queue_delete(struct priority_queue *q);
+
+/** Count the items in a priority queue.
+@param q A priority queue.
+@return The number of items in the queue.
+*/
+int priority_queue_size(struct priority_queue *q);
+
+/** Push an item by priority.
+The item is placed after all the items of higher or equal priority.
+@param q A priority queue.
+@param item The item to push.
+@param priority The priority of the item. Larger values come first.
+@return True on success, false if the item is already in the queue.
+*/
+int priority_queue_push(struct priority_queue *q, void *item, double priority);
+
+/** Push an item ahead of all others, regardless of their priority.
+The item is placed before all the items currently in the queue, including
+those previously pushed with this function.
+@param q A priority queue.
+@param item The item to push.
+@return True on success, false if the item is already in the queue.
+*/
+int priority_queue_push_head(struct priority_queue *q, void *item);
+
+/** Look at the first item of a priority queue.
+@param q A priority queue.
+@return The first item, or null if the queue is empty.
+*/
+void *priority_queue_peek_head(struct priority_queue *q);
+
+/** Remove the first item of a priority queue.
+@param q A priority queue.
+@return The first item, or null if the queue is empty.
+*/
+void *priority_queue_pop_head(struct priority_queue *q);
+
+/** Remove an item from a priority queue.
+@param q A priority queue.
+@param item The item to remove.
+@return True if the item was in the queue, false otherwise.
+*/
+int priority_queue_remove(struct priority_queue *q, void *item);
+
+/** Test whether an item is in a priority queue.
+@param q A priority queue.
+@param item The item to look for.
+@return True if the item is in the queue, false otherwise.
+*/
+int priority_queue_contains(struct priority_queue *q, void *item);
+
+/** Begin iterating over a priority queue, from the highest priority.
+@param q A priority queue.
+*/
+void priority_queue_first_item(struct priority_queue *q);
+
+/** Continue iterating over a priority queue.
+@param q A priority queue.
+@return The next item, or null at the end of the queue.
+*/
+void *priority_queue_next_item(struct priority_queue *q);
+
+#endif
+
+/* vim: set noexpandtab tabstop=4: */
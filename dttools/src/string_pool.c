@@ -0,0 +1,196 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "string_pool.h"
+#include "hash_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_SIZE 128
+
+/* strings are packed into blocks of this size, and longer ones than a quarter
+of a block are given a block of their own. */
+#define BLOCK_SIZE 65536
+
+struct string_block {
+	struct string_block *next;
+	size_t used;
+	size_t size;
+	char data[1];
+};
+
+/*
+The index is an open addressed table of power of two size, probed linearly.
+Each slot keeps the hash of its string, so that most probes and all resizes
+do not touch the strings themselves.
+*/
+
+struct string_slot {
+	unsigned hash;
+	const char *str;
+};
+
+struct string_pool {
+	struct string_slot *slots;
+	int bucket_count;
+	int size;
+	struct string_block *blocks;
+	size_t memory;
+};
+
+struct string_pool *string_pool_create(int bucket_count)
+{
+	struct string_pool *p = calloc(1, sizeof(*p));
+	if(!p)
+		return 0;
+
+	int count = DEFAULT_SIZE;
+	while(count < bucket_count)
+		count *= 2;
+
+	p->slots = calloc(count, sizeof(*p->slots));
+	if(!p->slots) {
+		free(p);
+		return 0;
+	}
+
+	p->bucket_count = count;
+	p->memory = count * sizeof(*p->slots);
+
+	return p;
+}
+
+void string_pool_delete(struct string_pool *p)
+{
+	if(!p)
+		return;
+
+	while(p->blocks) {
+		struct string_block *b = p->blocks;
+		p->blocks = b->next;
+		free(b);
+	}
+
+	free(p->slots);
+	free(p);
+}
+
+static struct string_slot *string_pool_find(struct string_pool *p, const char *str, unsigned hash)
+{
+	unsigned mask = p->bucket_count - 1;
+	unsigned i;
+
+	for(i = hash & mask; p->slots[i].str; i = (i + 1) & mask) {
+		if(p->slots[i].hash == hash && !strcmp(p->slots[i].str, str))
+			break;
+	}
+
+	return &p->slots[i];
+}
+
+static int string_pool_double_buckets(struct string_pool *p)
+{
+	int count = 2 * p->bucket_count;
+	struct string_slot *slots = calloc(count, sizeof(*slots));
+	if(!slots)
+		return 0;
+
+	unsigned mask = count - 1;
+	int i;
+	for(i = 0; i < p->bucket_count; i++) {
+		if(!p->slots[i].str)
+			continue;
+
+		unsigned j;
+		for(j = p->slots[i].hash & mask; slots[j].str; j = (j + 1) & mask) { }
+		slots[j] = p->slots[i];
+	}
+
+	free(p->slots);
+	p->slots = slots;
+	p->memory += (count - p->bucket_count) * sizeof(*slots);
+	p->bucket_count = count;
+
+	return 1;
+}
+
+static char *string_pool_copy(struct string_pool *p, const char *str)
+{
+	size_t length = strlen(str) + 1;
+	struct string_block *b = p->blocks;
+
+	if(!b || b->size - b->used < length) {
+		size_t size = length > BLOCK_SIZE / 4 ? length : BLOCK_SIZE;
+
+		struct string_block *n = malloc(sizeof(*n) + size);
+		if(!n)
+			return 0;
+
+		n->used = 0;
+		n->size = size;
+		p->memory += sizeof(*n) + size;
+
+		/* a string with a block of its own goes behind the current block,
+		which is still the one to fill. */
+		if(b && size != BLOCK_SIZE) {
+			n->next = b->next;
+			b->next = n;
+		} else {
+			n->next = b;
+			p->blocks = n;
+		}
+		b = n;
+	}
+
+	char *copy = b->data + b->used;
+	memcpy(copy, str, length);
+	b->used += length;
+
+	return copy;
+}
+
+const char *string_pool_insert(struct string_pool *p, const char *str)
+{
+	unsigned hash = hash_string(str);
+	struct string_slot *s = string_pool_find(p, str, hash);
+
+	if(s->str)
+		return s->str;
+
+	if(4 * (p->size + 1) > 3 * p->bucket_count) {
+		if(!string_pool_double_buckets(p))
+			return 0;
+		s = string_pool_find(p, str, hash);
+	}
+
+	const char *copy = string_pool_copy(p, str);
+	if(!copy)
+		return 0;
+
+	s->hash = hash;
+	s->str = copy;
+	p->size++;
+
+	return copy;
+}
+
+const char *string_pool_lookup(struct string_pool *p, const char *str)
+{
+	return string_pool_find(p, str, hash_string(str))->str;
+}
+
+int string_pool_size(struct string_pool *p)
+{
+	return p->size;
+}
+
+size_t string_pool_memory(struct string_pool *p)
+{
+	return p->memory;
+}
+
+/* vim: set noexpandtab tabstop=4: */
@@ -0,0 +1,72 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include <stddef.h>
+
+/** @file string_pool.h A pool of interned strings.
+
+A string pool keeps a single copy of each distinct string inserted into it.
+Inserting a string returns the copy kept by the pool, so that equal strings
+inserted anywhere share the same memory, and may be compared by pointer.
+The copies are packed into large blocks, rather than allocated one by one,
+and live until the pool is deleted:
+
+<pre>
+struct string_pool *p = string_pool_create(0);
+
+const char *a = string_pool_insert(p, "input.dat");
+const char *b = string_pool_insert(p, "input.dat");
+
+assert(a == b);
+
+string_pool_delete(p);
+</pre>
+
+Strings returned by the pool must not be modified or freed.
+*/
+
+/** Create an empty string pool.
+@param bucket_count The initial number of buckets in the index, or zero for a default value.
+@return A pointer to a new string pool.
+*/
+struct string_pool *string_pool_create(int bucket_count);
+
+/** Delete a string pool.
+All the strings returned by the pool are freed.
+@param p The pool to delete.
+*/
+void string_pool_delete(struct string_pool *p);
+
+/** Insert a string into a pool.
+@param p A string pool.
+@param str The string to insert.
+@return The copy of str kept by the pool, which is the same for every equal string, or null if out of memory.
+*/
+const char *string_pool_insert(struct string_pool *p, const char *str);
+
+/** Look up a string in a pool.
+@param p A string pool.
+@param str The string to look for.
+@return The copy of str kept by the pool, or null if str was never inserted.
+*/
+const char *string_pool_lookup(struct string_pool *p, const char *str);
+
+/** Count the distinct strings in a pool.
+@param p A string pool.
+@return The number of distinct strings inserted into the pool.
+*/
+int string_pool_size(struct string_pool *p);
+
+/** Measure the memory kept by a pool.
+@param p A string pool.
+@return The number of bytes allocated for the strings and the index of the pool.
+*/
+size_t string_pool_memory(struct string_pool *p);
+
+#endif
@@ -0,0 +1,89 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+exe="link_poller.test"
+
+prepare()
+{
+	gcc -g $CCTOOLS_TEST_CCFLAGS -o "$exe" -I ../src/ -x c - -x none ../src/libdttools.a -lm <<EOF
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link.h"
+
+int main(int argc, char **argv)
+{
+  int a[2], b[2];
+  char line[1024];
+  struct link_info ready[4];
+
+  assert( pipe(a) == 0 );
+  assert( pipe(b) == 0 );
+
+  struct link *la = link_attach_to_fd(a[0]);
+  struct link *lb = link_attach_to_fd(b[0]);
+
+  struct link_poller *p = link_poller_create();
+  assert( link_poller_add(p, la, LINK_READ) );
+  assert( link_poller_add(p, lb, LINK_READ) );
+  assert( link_poller_size(p) == 2 );
+
+  /* nothing to read yet. */
+  assert( link_poller_wait(p, ready, 4, 0) == 0 );
+
+  /* only the link written to is ready. */
+  assert( write(b[1], "one\ntwo\n", 8) == 8 );
+  assert( link_poller_wait(p, ready, 4, 1000) == 1 );
+  assert( ready[0].link == lb );
+  assert( ready[0].revents & LINK_READ );
+
+  /* after reading one line, the second one is left in the link buffer,
+     and the link is still ready, even if the pipe is empty. */
+  assert( link_readline(lb, line, sizeof(line), time(0) + 5) );
+  assert( !strcmp(line, "one") );
+  assert( link_poller_wait(p, ready, 4, 1000) == 1 );
+  assert( ready[0].link == lb );
+
+  assert( link_readline(lb, line, sizeof(line), time(0) + 5) );
+  assert( !strcmp(line, "two") );
+  assert( link_poller_wait(p, ready, 4, 0) == 0 );
+
+  /* removed links are not reported. */
+  assert( write(a[1], "three\n", 6) == 6 );
+  assert( link_poller_remove(p, la) );
+  assert( link_poller_size(p) == 1 );
+  assert( link_poller_wait(p, ready, 4, 0) == 0 );
+
+  /* closing a link removes it from its poller. */
+  link_close(lb);
+  assert( link_poller_size(p) == 0 );
+
+  link_poller_delete(p);
+  link_close(la);
+
+  return 0;
+}
+EOF
+	return $?
+}
+
+run()
+{
+	./"$exe"
+	return $?
+}
+
+clean()
+{
+	rm -f "$exe"
+	return 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,101 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+exe="priority_queue.test"
+
+prepare()
+{
+	gcc -g $CCTOOLS_TEST_CCFLAGS -o "$exe" -I ../src/ -x c - -x none ../src/libdttools.a -lm <<EOF
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "priority_queue.h"
+
+#define N 5000
+
+int main(int argc, char **argv)
+{
+  struct priority_queue *q = priority_queue_create();
+  double priorities[N + 1];
+  int i;
+
+  srand(7);
+  for(i = 1; i <= N; i++) {
+    priorities[i] = rand() % 10;
+    assert( priority_queue_push(q, (void *) (uintptr_t) i, priorities[i]) );
+  }
+
+  assert( priority_queue_size(q) == N );
+  assert( !priority_queue_push(q, (void *) (uintptr_t) 1, 3) );
+
+  /* highest priority first, and equal priorities in push order. */
+  void *a;
+  uintptr_t last = 0;
+  int count = 0;
+  priority_queue_first_item(q);
+  while((a = priority_queue_next_item(q))) {
+    uintptr_t j = (uintptr_t) a;
+    if(last)
+      assert( priorities[last] > priorities[j] || (priorities[last] == priorities[j] && last < j) );
+    last = j;
+    count++;
+  }
+  assert( count == N );
+
+  /* remove the odd items while iterating. */
+  priority_queue_first_item(q);
+  while((a = priority_queue_next_item(q))) {
+    if((uintptr_t) a % 2)
+      assert( priority_queue_remove(q, a) );
+  }
+  assert( priority_queue_size(q) == N / 2 );
+  assert( !priority_queue_contains(q, (void *) (uintptr_t) 1) );
+  assert( priority_queue_contains(q, (void *) (uintptr_t) 2) );
+  assert( !priority_queue_remove(q, (void *) (uintptr_t) 1) );
+
+  /* items pushed to the head come first, the last one pushed first. */
+  assert( priority_queue_push_head(q, (void *) (uintptr_t) 1) );
+  assert( priority_queue_push_head(q, (void *) (uintptr_t) 3) );
+  assert( priority_queue_push(q, (void *) (uintptr_t) 5, 1000) );
+  assert( priority_queue_pop_head(q) == (void *) (uintptr_t) 3 );
+  assert( priority_queue_pop_head(q) == (void *) (uintptr_t) 1 );
+  assert( priority_queue_pop_head(q) == (void *) (uintptr_t) 5 );
+
+  /* the rest are still in order. */
+  last = 0;
+  while((a = priority_queue_pop_head(q))) {
+    uintptr_t j = (uintptr_t) a;
+    assert( j % 2 == 0 );
+    if(last)
+      assert( priorities[last] > priorities[j] || (priorities[last] == priorities[j] && last < j) );
+    last = j;
+  }
+  assert( priority_queue_size(q) == 0 );
+  assert( !priority_queue_pop_head(q) );
+
+  priority_queue_delete(q);
+
+  return 0;
+}
+EOF
+	return $?
+}
+
+run()
+{
+	./"$exe"
+	return $?
+}
+
+clean()
+{
+	rm -f "$exe"
+	return 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
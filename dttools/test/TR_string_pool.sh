@@ -0,0 +1,86 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+exe="string_pool.test"
+
+prepare()
+{
+	gcc -g $CCTOOLS_TEST_CCFLAGS -o "$exe" -I ../src/ -x c - -x none ../src/libdttools.a -lm <<EOF
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_pool.h"
+
+#define N 50000
+
+int main(int argc, char **argv)
+{
+  struct string_pool *p = string_pool_create(0);
+  const char *first[N];
+  char name[64];
+  int i;
+
+  /* enough strings to grow the index and fill several blocks. */
+  for(i = 0; i < N; i++) {
+    sprintf(name, "file.%d", i);
+    first[i] = string_pool_insert(p, name);
+    assert( first[i] && first[i] != name );
+    assert( !strcmp(first[i], name) );
+  }
+  assert( string_pool_size(p) == N );
+
+  /* equal strings give back the same copy. */
+  for(i = 0; i < N; i++) {
+    sprintf(name, "file.%d", i);
+    assert( string_pool_insert(p, name) == first[i] );
+    assert( string_pool_lookup(p, name) == first[i] );
+  }
+  assert( string_pool_size(p) == N );
+  assert( !string_pool_lookup(p, "file.-1") );
+
+  /* the empty string, and strings longer than a block. */
+  const char *empty = string_pool_insert(p, "");
+  assert( empty && !*empty );
+  assert( string_pool_insert(p, "") == empty );
+
+  char *big = malloc(100000);
+  memset(big, 'x', 99999);
+  big[99999] = 0;
+  const char *b = string_pool_insert(p, big);
+  assert( b && !strcmp(b, big) );
+  assert( string_pool_insert(p, big) == b );
+  free(big);
+
+  /* the block being filled is still in use after the long string. */
+  const char *last = string_pool_insert(p, "last");
+  assert( !strcmp(last, "last") );
+  assert( !strcmp(first[N-1], "file.49999") );
+  assert( string_pool_size(p) == N + 3 );
+  assert( string_pool_memory(p) > 100000 );
+
+  string_pool_delete(p);
+
+  return 0;
+}
+EOF
+	return $?
+}
+
+run()
+{
+	./"$exe"
+	return $?
+}
+
+clean()
+{
+	rm -f "$exe"
+	return 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
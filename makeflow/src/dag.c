@@ -16,7 +16,9 @@ See the file COPYING for details.
 #include "itable.h"
 #include "hash_table.h"
 #include "list.h"
+#include "priority_queue.h"
 #include "set.h"
+#include "string_pool.h"
 #include "stringtools.h"
 #include "rmsummary.h"
 
@@ -36,6 +38,7 @@ struct dag *dag_create()
 	d->local_job_table = itable_create(0);
 	d->remote_job_table = itable_create(0);
 	d->files = hash_table_create(0, 0);
+	d->strings = string_pool_create(0);
 	d->inputs = set_create(0);
 	d->outputs = set_create(0);
 	d->nodeid_counter = 0;
@@ -43,6 +46,8 @@ struct dag *dag_create()
 	d->special_vars = set_create(0);
 	d->completed_files = 0;
 	d->deleted_files = 0;
+	d->ready_local = priority_queue_create();
+	d->ready_remote = priority_queue_create();
 
 	d->categories   = hash_table_create(0, 0);
 	d->default_category = makeflow_category_lookup_or_create(d, "default");
@@ -148,7 +153,7 @@ struct dag_file *dag_file_lookup_or_create(struct dag *d, const char *filename)
 	f = hash_table_lookup(d->files, filename);
 	if(f) return f;
 
-	f = dag_file_create(filename);
+	f = dag_file_create(string_pool_insert(d->strings, filename));
 
 	hash_table_insert(d->files, f->filename, (void *) f);
 
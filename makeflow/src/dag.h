@@ -25,6 +25,7 @@ struct dag {
 	struct dag_node *nodes;            /* Linked list of all production rules, without ordering. */
 	struct itable *node_table;         /* Mapping from unique integers dag_node->nodeid to nodes. */
 	struct hash_table *files;          /* Maps every filename to a struct dag_file. */
+	struct string_pool *strings;       /* Single copies of file names and remote names, shared by files and nodes. */
 	struct set *inputs;                /* Set of every struct dag_file specified as input. */
 	struct set *outputs;               /* Set of every struct dag_file specified as output. */
 	struct hash_table *categories;     /* Mapping from labels to category structures. */
@@ -43,6 +44,8 @@ struct dag {
 	struct itable *remote_job_table;    /* Mapping from unique integers dag_node->jobid to nodes. */
 	int completed_files;                /* Keeps a count of the rules in state recieved or beyond. */
 	int deleted_files;                  /* Keeps a count of the files delete in GC. */
+	struct priority_queue *ready_local; /* Waiting nodes with all of their source files that run in the local queue, by priority then in the order they became ready. */
+	struct priority_queue *ready_remote;/* As ready_local, for the nodes that run in the remote queue. */
 
 	char *cache_dir;                    /* The dirname of the cache storing all the deps specified in the mountfile */
 
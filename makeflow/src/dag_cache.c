@@ -0,0 +1,585 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "dag_cache.h"
+#include "dag.h"
+#include "dag_resources.h"
+#include "dag_variable.h"
+#include "parser.h"
+
+#include "category.h"
+#include "debug.h"
+#include "hash_table.h"
+#include "itable.h"
+#include "jx.h"
+#include "list.h"
+#include "set.h"
+#include "sha1.h"
+#include "string_pool.h"
+#include "stringtools.h"
+#include "xxmalloc.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+The cache is a header followed by the environment variables read while
+parsing, the files, the categories with their variables, the exported
+variable names, and the nodes in the order of their ids. Numbers are written
+in the byte order of the host, which the header records, and strings as their
+length followed by their bytes, with a length of DAG_CACHE_NULL for a null
+string. Nodes refer to files and categories by their position in the cache.
+*/
+
+#define DAG_CACHE_MAGIC "MFDAGC\n"
+#define DAG_CACHE_VERSION 1
+#define DAG_CACHE_BYTE_ORDER 0x01020304
+#define DAG_CACHE_NULL UINT32_MAX
+
+#define DAG_CACHE_LOCAL_JOB  1
+#define DAG_CACHE_NESTED_JOB 2
+
+struct dag_cache_reader {
+	const char *data;
+	size_t size;
+	size_t pos;
+	int error;
+};
+
+char *dag_cache_default_name(const char *filename)
+{
+	return string_format("%s.dagcache", filename);
+}
+
+static void write_u32(FILE *stream, uint32_t value)
+{
+	fwrite(&value, sizeof(value), 1, stream);
+}
+
+static void write_u64(FILE *stream, uint64_t value)
+{
+	fwrite(&value, sizeof(value), 1, stream);
+}
+
+static void write_string(FILE *stream, const char *s)
+{
+	if(!s) {
+		write_u32(stream, DAG_CACHE_NULL);
+		return;
+	}
+
+	uint32_t length = strlen(s);
+	write_u32(stream, length);
+	fwrite(s, 1, length, stream);
+}
+
+static void write_variables(FILE *stream, struct hash_table *variables)
+{
+	char *name;
+	struct dag_variable *var;
+	int i;
+
+	if(!variables) {
+		write_u32(stream, 0);
+		return;
+	}
+
+	write_u32(stream, hash_table_size(variables));
+
+	hash_table_firstkey(variables);
+	while(hash_table_nextkey(variables, &name, (void **) &var)) {
+		write_string(stream, name);
+		write_u32(stream, var->count);
+		for(i = 0; i < var->count; i++) {
+			write_u32(stream, var->values[i]->nodeid);
+			write_string(stream, var->values[i]->value);
+		}
+	}
+}
+
+static void write_node_files(FILE *stream, struct dag_node *n, struct list *files, struct itable *file_index)
+{
+	struct dag_file *f;
+
+	write_u32(stream, list_size(files));
+
+	list_first_item(files);
+	while((f = list_next_item(files))) {
+		write_u32(stream, (uintptr_t) itable_lookup(file_index, (uintptr_t) f) - 1);
+		write_string(stream, itable_lookup(n->remote_names, (uintptr_t) f));
+	}
+}
+
+static void write_dag(FILE *stream, struct dag *d, struct jx *environment, const unsigned char digest[SHA1_DIGEST_LENGTH])
+{
+	struct jx_pair *p;
+	struct dag_file *f;
+	struct dag_node *n;
+	struct category *c;
+	char *name;
+	uintptr_t index;
+	int i;
+
+	fwrite(DAG_CACHE_MAGIC, 1, sizeof(DAG_CACHE_MAGIC), stream);
+	write_u32(stream, DAG_CACHE_VERSION);
+	write_u32(stream, DAG_CACHE_BYTE_ORDER);
+	fwrite(digest, 1, SHA1_DIGEST_LENGTH, stream);
+
+	index = 0;
+	for(p = environment->u.pairs; p; p = p->next)
+		index++;
+	write_u32(stream, index);
+	for(p = environment->u.pairs; p; p = p->next) {
+		write_string(stream, p->key->u.string_value);
+		write_string(stream, p->value->type == JX_STRING ? p->value->u.string_value : NULL);
+	}
+
+	/* Positions are kept one-based, as a null lookup means not found. */
+	struct itable *file_index = itable_create(0);
+	write_u32(stream, hash_table_size(d->files));
+	index = 0;
+	hash_table_firstkey(d->files);
+	while(hash_table_nextkey(d->files, &name, (void **) &f)) {
+		itable_insert(file_index, (uintptr_t) f, (void *) ++index);
+		write_string(stream, f->filename);
+		write_u64(stream, f->estimated_size);
+	}
+
+	struct itable *category_index = itable_create(0);
+	write_u32(stream, hash_table_size(d->categories));
+	index = 0;
+	hash_table_firstkey(d->categories);
+	while(hash_table_nextkey(d->categories, &name, (void **) &c)) {
+		itable_insert(category_index, (uintptr_t) c, (void *) ++index);
+		write_string(stream, c->name);
+		write_u32(stream, c->allocation_mode);
+		write_variables(stream, c->mf_variables);
+	}
+
+	write_u32(stream, set_size(d->export_vars));
+	set_first_element(d->export_vars);
+	while((name = set_next_element(d->export_vars)))
+		write_string(stream, name);
+
+	write_u32(stream, d->nodeid_counter);
+	for(i = 0; i < d->nodeid_counter; i++) {
+		n = itable_lookup(d->node_table, i);
+
+		write_u32(stream, n->linenum);
+		write_u32(stream, (n->local_job ? DAG_CACHE_LOCAL_JOB : 0) | (n->nested_job ? DAG_CACHE_NESTED_JOB : 0));
+		write_string(stream, n->command);
+		write_string(stream, n->makeflow_dag);
+		write_string(stream, n->makeflow_cwd);
+		write_u32(stream, (uintptr_t) itable_lookup(category_index, (uintptr_t) n->category) - 1);
+		write_variables(stream, n->variables);
+		write_node_files(stream, n, n->target_files, file_index);
+		write_node_files(stream, n, n->source_files, file_index);
+	}
+
+	itable_delete(file_index);
+	itable_delete(category_index);
+}
+
+/* Write the cache to a temporary file first, so that a cache is never seen half written. */
+static int dag_cache_write(struct dag *d, struct jx *environment, const unsigned char digest[SHA1_DIGEST_LENGTH], const char *cachename)
+{
+	int i;
+
+	for(i = 0; i < d->nodeid_counter; i++) {
+		if(!itable_lookup(d->node_table, i))
+			return 0;
+	}
+
+	char *tmpname = string_format("%s.XXXXXX", cachename);
+	int fd = mkstemp(tmpname);
+	if(fd < 0) {
+		debug(D_MAKEFLOW_PARSER, "could not create %s: %s", tmpname, strerror(errno));
+		free(tmpname);
+		return 0;
+	}
+
+	FILE *stream = fdopen(fd, "w");
+	if(!stream) {
+		close(fd);
+		unlink(tmpname);
+		free(tmpname);
+		return 0;
+	}
+
+	write_dag(stream, d, environment, digest);
+
+	int ok = !ferror(stream);
+	if(fclose(stream) != 0)
+		ok = 0;
+
+	if(ok && rename(tmpname, cachename) < 0) {
+		debug(D_MAKEFLOW_PARSER, "could not rename %s to %s: %s", tmpname, cachename, strerror(errno));
+		ok = 0;
+	}
+
+	if(!ok)
+		unlink(tmpname);
+
+	free(tmpname);
+
+	return ok;
+}
+
+static const void *read_bytes(struct dag_cache_reader *r, size_t length)
+{
+	if(r->error || length > r->size - r->pos) {
+		r->error = 1;
+		return NULL;
+	}
+
+	const void *p = r->data + r->pos;
+	r->pos += length;
+
+	return p;
+}
+
+static uint32_t read_u32(struct dag_cache_reader *r)
+{
+	uint32_t value = 0;
+	const void *p = read_bytes(r, sizeof(value));
+	if(p)
+		memcpy(&value, p, sizeof(value));
+
+	return value;
+}
+
+static uint64_t read_u64(struct dag_cache_reader *r)
+{
+	uint64_t value = 0;
+	const void *p = read_bytes(r, sizeof(value));
+	if(p)
+		memcpy(&value, p, sizeof(value));
+
+	return value;
+}
+
+/* Returns a copy of the next string, or NULL for a null string or on error. */
+static char *read_string(struct dag_cache_reader *r)
+{
+	uint32_t length = read_u32(r);
+	if(length == DAG_CACHE_NULL)
+		return NULL;
+
+	const char *p = read_bytes(r, length);
+	if(!p)
+		return NULL;
+
+	char *s = xxmalloc(length + 1);
+	memcpy(s, p, length);
+	s[length] = '\0';
+
+	return s;
+}
+
+/* Read a count of items of at least size bytes each, which the rest of the cache must be able to hold. */
+static uint32_t read_count(struct dag_cache_reader *r, size_t size)
+{
+	uint32_t count = read_u32(r);
+
+	if(!r->error && count > (r->size - r->pos) / size)
+		r->error = 1;
+
+	return r->error ? 0 : count;
+}
+
+static void read_variables(struct dag_cache_reader *r, struct hash_table *variables)
+{
+	uint32_t count = read_count(r, 2 * sizeof(uint32_t));
+	uint32_t i, j;
+
+	for(i = 0; i < count && !r->error; i++) {
+		char *name = read_string(r);
+		uint32_t values = read_count(r, 2 * sizeof(uint32_t));
+
+		if(!name) {
+			r->error = 1;
+			break;
+		}
+
+		struct dag_variable *var = xxmalloc(sizeof(*var));
+		var->count = 0;
+		var->values = values > 0 ? xxmalloc(values * sizeof(struct dag_variable_value *)) : NULL;
+
+		for(j = 0; j < values && !r->error; j++) {
+			int nodeid = (int) read_u32(r);
+			char *value = read_string(r);
+			if(!value) {
+				r->error = 1;
+				break;
+			}
+
+			struct dag_variable_value *v = dag_variable_value_create(value);
+			v->nodeid = nodeid;
+			var->values[var->count++] = v;
+			free(value);
+		}
+
+		hash_table_insert(variables, name, var);
+		free(name);
+	}
+}
+
+static void read_node_files(struct dag_cache_reader *r, struct dag_node *n, struct dag_file **files, uint32_t nfiles, int targets)
+{
+	uint32_t count = read_count(r, 2 * sizeof(uint32_t));
+	uint32_t i;
+
+	for(i = 0; i < count && !r->error; i++) {
+		uint32_t index = read_u32(r);
+		char *remotename = read_string(r);
+
+		if(index >= nfiles) {
+			r->error = 1;
+			free(remotename);
+			break;
+		}
+
+		struct dag_file *f = files[index];
+
+		if(remotename) {
+			const char *name = string_pool_insert(n->d->strings, remotename);
+			itable_insert(n->remote_names, (uintptr_t) f, (void *) name);
+			hash_table_insert(n->remote_names_inv, name, (void *) f);
+			free(remotename);
+		}
+
+		if(targets) {
+			list_push_tail(n->target_files, f);
+			f->created_by = n;
+		} else {
+			list_push_tail(n->source_files, f);
+			list_push_head(f->needed_by, n);
+			f->reference_count++;
+		}
+	}
+}
+
+static int environment_changed(struct dag_cache_reader *r)
+{
+	uint32_t count = read_count(r, 2 * sizeof(uint32_t));
+	uint32_t i;
+
+	for(i = 0; i < count && !r->error; i++) {
+		char *name = read_string(r);
+		char *value = read_string(r);
+		const char *current = name ? getenv(name) : NULL;
+
+		int changed = (!value != !current) || (value && strcmp(value, current));
+		if(changed)
+			debug(D_MAKEFLOW_PARSER, "environment variable %s changed since the dag was cached", name);
+
+		free(name);
+		free(value);
+
+		if(changed)
+			return 1;
+	}
+
+	return r->error;
+}
+
+static int set_contains_string(struct set *s, const char *name)
+{
+	char *element;
+
+	set_first_element(s);
+	while((element = set_next_element(s))) {
+		if(!strcmp(element, name))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+A dag read from a damaged cache is abandoned as is, as there is no way to
+delete a dag, and the makeflow file is parsed instead.
+*/
+
+static struct dag *read_dag(struct dag_cache_reader *r, const char *filename, const unsigned char digest[SHA1_DIGEST_LENGTH])
+{
+	uint32_t i, count;
+
+	const char *magic = read_bytes(r, sizeof(DAG_CACHE_MAGIC));
+	if(!magic || memcmp(magic, DAG_CACHE_MAGIC, sizeof(DAG_CACHE_MAGIC)))
+		return NULL;
+
+	if(read_u32(r) != DAG_CACHE_VERSION || read_u32(r) != DAG_CACHE_BYTE_ORDER)
+		return NULL;
+
+	const unsigned char *cached_digest = read_bytes(r, SHA1_DIGEST_LENGTH);
+	if(!cached_digest || memcmp(cached_digest, digest, SHA1_DIGEST_LENGTH)) {
+		debug(D_MAKEFLOW_PARSER, "%s changed since the dag was cached", filename);
+		return NULL;
+	}
+
+	if(environment_changed(r))
+		return NULL;
+
+	struct dag *d = dag_create();
+	d->filename = xxstrdup(filename);
+
+	uint32_t nfiles = read_count(r, sizeof(uint32_t) + sizeof(uint64_t));
+	struct dag_file **files = xxmalloc((nfiles + 1) * sizeof(*files));
+	for(i = 0; i < nfiles && !r->error; i++) {
+		char *name = read_string(r);
+		uint64_t estimated_size = read_u64(r);
+		if(!name) {
+			r->error = 1;
+			break;
+		}
+
+		files[i] = dag_file_lookup_or_create(d, name);
+		files[i]->estimated_size = estimated_size;
+		free(name);
+	}
+
+	uint32_t ncategories = read_count(r, 3 * sizeof(uint32_t));
+	struct category **categories = xxmalloc((ncategories + 1) * sizeof(*categories));
+	for(i = 0; i < ncategories && !r->error; i++) {
+		char *name = read_string(r);
+		uint32_t mode = read_u32(r);
+		if(!name) {
+			r->error = 1;
+			break;
+		}
+
+		categories[i] = makeflow_category_lookup_or_create(d, name);
+		category_specify_allocation_mode(categories[i], mode);
+		read_variables(r, categories[i]->mf_variables);
+		free(name);
+	}
+
+	count = read_count(r, sizeof(uint32_t));
+	for(i = 0; i < count && !r->error; i++) {
+		char *name = read_string(r);
+		if(!name) {
+			r->error = 1;
+			break;
+		}
+
+		if(set_contains_string(d->export_vars, name)) {
+			free(name);
+		} else {
+			set_insert(d->export_vars, name);
+		}
+	}
+
+	count = read_count(r, 8 * sizeof(uint32_t));
+	for(i = 0; i < count && !r->error; i++) {
+		struct dag_node *n = dag_node_create(d, read_u32(r));
+		uint32_t flags = read_u32(r);
+
+		n->local_job  = (flags & DAG_CACHE_LOCAL_JOB)  ? 1 : 0;
+		n->nested_job = (flags & DAG_CACHE_NESTED_JOB) ? 1 : 0;
+		n->command      = read_string(r);
+		n->makeflow_dag = read_string(r);
+		n->makeflow_cwd = read_string(r);
+
+		uint32_t category = read_u32(r);
+		if(category >= ncategories) {
+			r->error = 1;
+			break;
+		}
+		n->category = categories[category];
+
+		read_variables(r, n->variables);
+		read_node_files(r, n, files, nfiles, 1);
+		read_node_files(r, n, files, nfiles, 0);
+
+		n->next = d->nodes;
+		d->nodes = n;
+		itable_insert(d->node_table, n->nodeid, n);
+	}
+
+	free(files);
+	free(categories);
+
+	if(r->error || r->pos != r->size) {
+		debug(D_MAKEFLOW_PARSER, "the dag cache for %s is damaged", filename);
+		return NULL;
+	}
+
+	dag_close_over_environment(d);
+	dag_close_over_categories(d);
+	dag_compile_ancestors(d);
+
+	return d;
+}
+
+static struct dag *dag_cache_read(const char *filename, const char *cachename, const unsigned char digest[SHA1_DIGEST_LENGTH])
+{
+	struct stat info;
+
+	int fd = open(cachename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &info) < 0 || info.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(data == MAP_FAILED)
+		return NULL;
+
+	struct dag_cache_reader r = { data, info.st_size, 0, 0 };
+	struct dag *d = read_dag(&r, filename, digest);
+
+	munmap(data, info.st_size);
+
+	return d;
+}
+
+struct dag *dag_from_file_cached(const char *filename, const char *cachename)
+{
+	unsigned char digest[SHA1_DIGEST_LENGTH];
+
+	if(!sha1_file(filename, digest))
+		return dag_from_file(filename);
+
+	struct dag *d = dag_cache_read(filename, cachename, digest);
+	if(d) {
+		debug(D_MAKEFLOW_PARSER, "loaded %s from the dag cache %s", filename, cachename);
+		return d;
+	}
+
+	struct jx *environment = jx_object(NULL);
+
+	dag_variable_record_environment(environment);
+	d = dag_from_file(filename);
+	dag_variable_record_environment(NULL);
+
+	if(d) {
+		if(dag_cache_write(d, environment, digest, cachename)) {
+			debug(D_MAKEFLOW_PARSER, "wrote the dag cache %s for %s", cachename, filename);
+		} else {
+			debug(D_MAKEFLOW_PARSER, "could not write the dag cache %s for %s", cachename, filename);
+		}
+	}
+
+	jx_delete(environment);
+
+	return d;
+}
+
+/* vim: set noexpandtab tabstop=4: */
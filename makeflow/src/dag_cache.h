@@ -0,0 +1,25 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef DAG_CACHE_H
+#define DAG_CACHE_H
+
+#include "dag.h"
+
+/* A dag cache keeps a makeflow file as parsed, so that large files are not
+ * lexed again on every start. The cache is keyed by the checksum of the
+ * makeflow file and by the environment variables read while parsing it, and
+ * is written again whenever either changes. */
+
+/* The cache used for filename when none is given: filename.dagcache */
+char *dag_cache_default_name(const char *filename);
+
+/* Returns the dag described by filename, as dag_from_file, loading it from
+ * cachename when the cache is up to date, or else parsing filename and
+ * writing the cache. Returns NULL on failure. */
+struct dag *dag_from_file_cached(const char *filename, const char *cachename);
+
+#endif
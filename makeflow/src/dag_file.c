@@ -16,7 +16,7 @@ See the file COPYING for details.
 struct dag_file * dag_file_create( const char *filename )
 {
 	struct dag_file *f = malloc(sizeof(*f));
-	f->filename = xxstrdup(filename);
+	f->filename = filename;
 	f->needed_by = list_create();
 	f->created_by = 0;
 	f->actual_size = 0;
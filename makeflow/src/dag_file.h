@@ -61,7 +61,8 @@ struct dag_file {
 };
 
 /** Create dag file struct.
-@param filename A const pointer to the unique filename.
+@param filename A const pointer to the unique filename. It is kept, not
+copied, as the names interned in the string pool of the dag are.
 @return dag_file struct.
 */
 struct dag_file *dag_file_create( const char *filename );
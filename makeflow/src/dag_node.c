@@ -13,12 +13,18 @@ See the file COPYING for details.
 #include "stringtools.h"
 #include "xxmalloc.h"
 #include "jx.h"
+#include "string_pool.h"
 
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+/* Most rules have a handful of variables, files, and neighbours, while the
+ * default size of a table is over a thousand bytes, which for large
+ * workflows is most of the memory of the dag. The tables grow as needed. */
+#define DAG_NODE_TABLE_SIZE 7
+
 struct dag_node *dag_node_create(struct dag *d, int linenum)
 {
 	struct dag_node *n;
@@ -29,16 +35,16 @@ struct dag_node *dag_node_create(struct dag *d, int linenum)
 	n->linenum = linenum;
 	n->state = DAG_NODE_STATE_WAITING;
 	n->nodeid = d->nodeid_counter++;
-	n->variables = hash_table_create(0, 0);
+	n->variables = hash_table_create(DAG_NODE_TABLE_SIZE, 0);
 
 	n->source_files = list_create();
 	n->target_files = list_create();
 
-	n->remote_names = itable_create(0);
-	n->remote_names_inv = hash_table_create(0, 0);
+	n->remote_names = itable_create(DAG_NODE_TABLE_SIZE);
+	n->remote_names_inv = hash_table_create(DAG_NODE_TABLE_SIZE, 0);
 
-	n->descendants = set_create(0);
-	n->ancestors = set_create(0);
+	n->descendants = set_create(DAG_NODE_TABLE_SIZE);
+	n->ancestors = set_create(DAG_NODE_TABLE_SIZE);
 
 	n->ancestor_depth = -1;
 
@@ -189,17 +195,20 @@ static const char *dag_node_add_remote_name(struct dag_node *n, const char *file
 	if(!f)
 		fatal("trying to add remote name %s to unknown file %s.\n", remotename, filename);
 
-	if(!remotename)
-		remotename = dag_node_translate_filename(n, filename);
-	else
-		remotename = xxstrdup(remotename);
+	if(!remotename) {
+		char *newname = dag_node_translate_filename(n, filename);
+		remotename = string_pool_insert(n->d->strings, newname);
+		free(newname);
+	} else {
+		remotename = string_pool_insert(n->d->strings, remotename);
+	}
 
 	oldname = hash_table_lookup(n->remote_names_inv, remotename);
 
 	if(oldname && strcmp(oldname, filename) == 0)
 		debug(D_MAKEFLOW_RUN, "Remote name %s for %s already in use for %s\n", remotename, filename, oldname);
 
-	itable_insert(n->remote_names, (uintptr_t) f, remotename);
+	itable_insert(n->remote_names, (uintptr_t) f, (void *) remotename);
 	hash_table_insert(n->remote_names_inv, remotename, (void *) f);
 
 	return remotename;
@@ -73,6 +73,8 @@ struct dag_node {
 	batch_job_id_t jobid;               /* The id this node get, either from the local or remote batch system. */
 	dag_node_state_t state;             /* Enum: DAG_NODE_STATE_{WAITING,RUNNING,...} */
 	int failure_count;                  /* How many times has this rule failed? (see -R and -r) */
+	int source_files_missing;           /* Source files not yet expected to exist, see makeflow_ready_init. */
+	double critical_path;               /* Estimated seconds from the start of this node to the end of the workflow. */
 	time_t previous_completion;
 
 	const char *umbrella_spec;          /* the umbrella spec file for executing this job */
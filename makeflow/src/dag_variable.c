@@ -8,6 +8,8 @@ See the file COPYING for details.
 #include "dag_variable.h"
 #include "dag_resources.h"
 #include "hash_table.h"
+#include "jx.h"
+#include "string_pool.h"
 #include "xxmalloc.h"
 #include "debug.h"
 
@@ -16,24 +18,51 @@ See the file COPYING for details.
 #include <unistd.h>
 #include <stdlib.h>
 
+/* When set, the environment variables read while parsing, see dag_cache.c. */
+static struct jx *environment_record = NULL;
+
+void dag_variable_record_environment(struct jx *record)
+{
+	environment_record = record;
+}
+
+char *dag_variable_getenv(const char *name)
+{
+	char *value = getenv(name);
+
+	if(environment_record && !jx_lookup(environment_record, name))
+		jx_insert(environment_record, jx_string(name), value ? jx_string(value) : jx_null());
+
+	return value;
+}
+
+/* Values repeat across rules (categories, resources, and the same inputs),
+ * so a value is kept in this pool until it is appended to, when it gets a
+ * copy of its own. Values in the pool have a size of zero. */
+static struct string_pool *value_pool = NULL;
+
 struct dag_variable_value *dag_variable_value_create(const char *value)
 {
 	struct dag_variable_value *v = malloc(sizeof(struct dag_variable_value));
 
+	if(!value_pool)
+		value_pool = string_pool_create(0);
+
 	v->nodeid = 0;
 	v->len    = strlen(value);
-	v->size   = v->len + 1;
+	v->size   = 0;
 
-	v->value = malloc(v->size * sizeof(char));
-
-	strcpy(v->value, value);
+	v->value = (char *) string_pool_insert(value_pool, value);
+	if(!v->value)
+		fatal("Could not allocate memory for makeflow variable value: %s\n", value);
 
 	return v;
 }
 
 void dag_variable_value_free(struct dag_variable_value *v)
 {
-	free(v->value);
+	if(v->size > 0)
+		free(v->value);
 	free(v);
 }
 
@@ -50,10 +79,14 @@ struct dag_variable_value *dag_variable_value_append_or_create(struct dag_variab
 		//make size for string to be appended, plus some more, so we do not
 		//need to reallocate for a while.
 		int nsize = req > 2*(v->size) ? 2*req : 2*(v->size);
-		char *new_val = realloc(v->value, nsize*sizeof(char));
+		char *new_val = realloc(v->size > 0 ? v->value : NULL, nsize*sizeof(char));
 		if(!new_val)
 			fatal("Could not allocate memory for makeflow variable value: %s\n", value);
 
+		//values in the pool are copied before they are appended to.
+		if(v->size == 0)
+			memcpy(new_val, v->value, v->len + 1);
+
 		v->size  = nsize;
 		v->value = new_val;
 	}
@@ -74,7 +107,7 @@ struct dag_variable *dag_variable_create(const char *name, const char *initial_v
 
 	if(!initial_value && name)
 	{
-		initial_value = getenv(name);
+		initial_value = dag_variable_getenv(name);
 	}
 
 	if(initial_value)
@@ -97,7 +130,7 @@ void dag_variable_add_value(const char *name, struct hash_table *current_table,
 	struct dag_variable *var = hash_table_lookup(current_table, name);
 	if(!var)
 	{
-		char *value_env = getenv(name);
+		char *value_env = dag_variable_getenv(name);
 		var = dag_variable_create(name, value_env);
 		hash_table_insert(current_table, name, var);
 	}
@@ -203,7 +236,7 @@ struct dag_variable_value *dag_variable_lookup(const char *name, struct dag_vari
 	}
 
 	/* Try the environment last. */
-	char *value = getenv(name);
+	char *value = dag_variable_getenv(name);
 	if(value) {
 		return dag_variable_value_create(value);
 	}
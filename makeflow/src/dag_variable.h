@@ -13,7 +13,7 @@ See the file COPYING for details.
 
 struct dag_variable_value {
 	int   nodeid;  /* The nodeid of the rule to which this value binding takes effect. */
-	int   size;    /* memory size allocated for value */
+	int   size;    /* memory size allocated for value, or zero if value is shared */
 	int   len;     /* records strlen(value) */
 	char *value;   /* The value of the variable. */
 };
@@ -32,6 +32,15 @@ struct dag_variable {
 };
 
 struct dag_variable *dag_variable_create(const char *name, const char *initial_value);
+
+/*
+ * dag_variable_getenv reads an environment variable, and while a record is
+ * set with dag_variable_record_environment, adds its name and value (null if
+ * unset) to the record the first time it is read.
+ */
+struct jx;
+char *dag_variable_getenv(const char *name);
+void dag_variable_record_environment(struct jx *record);
 void dag_variable_add_value(const char *name, struct hash_table *current_table, int nodeid, const char *value);
 struct dag_variable_value *dag_variable_get_value(const char *name, struct hash_table *t, int node_id);
 
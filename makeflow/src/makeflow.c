@@ -20,6 +20,7 @@ See the file COPYING for details.
 #include "load_average.h"
 #include "macros.h"
 #include "path.h"
+#include "priority_queue.h"
 #include "random.h"
 #include "rmonitor.h"
 #include "stringtools.h"
@@ -34,6 +35,7 @@ See the file COPYING for details.
 #include "sha1.h"
 
 #include "dag.h"
+#include "dag_cache.h"
 #include "dag_visitors.h"
 #include "parser.h"
 #include "parser_jx.h"
@@ -119,6 +121,9 @@ static struct batch_queue *remote_queue = 0;
 static int local_jobs_max = 1;
 static int remote_jobs_max = MAX_REMOTE_JOBS_DEFAULT;
 
+/* Submit the ready rules with the longest critical path first, see makeflow_critical_path_update. */
+static int makeflow_critical_path_flag = 0;
+
 static char *project = NULL;
 static int port = 0;
 static int output_len_check = 0;
@@ -235,6 +240,7 @@ static void makeflow_abort_all(struct dag *d)
 }
 
 static void makeflow_node_force_rerun(struct itable *rerun_table, struct dag *d, struct dag_node *n);
+static void makeflow_node_release_descendants(struct dag *d, struct dag_node *n);
 
 /*
 Decide whether to rerun a node based on batch and file system status. The silent
@@ -573,6 +579,12 @@ static void makeflow_node_submit(struct dag *d, struct dag_node *n)
 
 	batch_queue_set_int_option(queue, "task-id", n->nodeid);
 
+	if(makeflow_critical_path_flag) {
+		char *priority = string_format("%.3f", n->critical_path);
+		batch_queue_set_option(queue, "task-priority", priority);
+		free(priority);
+	}
+
 	/* Generate the environment vars specific to this node. */
 	struct jx *envlist = dag_node_env_create(d,n);
 
@@ -591,6 +603,7 @@ static void makeflow_node_submit(struct dag *d, struct dag_node *n)
 			makeflow_log_file_state_change(d, f, DAG_FILE_STATE_EXISTS);
 		}
 		makeflow_log_state_change(d, n, DAG_NODE_STATE_COMPLETE);
+		makeflow_node_release_descendants(d, n);
 		did_find_archived_job = 1;
 	} else {
 		/* Now submit the actual job, retrying failures as needed. */
@@ -624,50 +637,288 @@ static void makeflow_node_submit(struct dag *d, struct dag_node *n)
 	jx_delete(envlist);
 }
 
-static int makeflow_node_ready(struct dag *d, struct dag_node *n)
+/*
+Ready set. Rather than looking at every node and every source file on each
+pass of makeflow_run, each node counts its source files that are not yet
+expected to exist, and the waiting nodes without any are kept in
+d->ready_local or d->ready_remote, by the queue they run in. When a node
+completes, the nodes that need its target files are updated, so that the
+cost of dispatching is in proportion to the nodes that become ready.
+*/
+
+static int makeflow_node_count_missing_sources(struct dag_node *n)
 {
 	struct dag_file *f;
+	int missing = 0;
 
-	if(n->state != DAG_NODE_STATE_WAITING)
-		return 0;
+	list_first_item(n->source_files);
+	while((f = list_next_item(n->source_files))) {
+		if(!dag_file_should_exist(f))
+			missing++;
+	}
 
-	if(n->local_job && local_queue) {
-		if(dag_local_jobs_running(d) >= local_jobs_max)
-			return 0;
-	} else {
-		if(dag_remote_jobs_running(d) >= remote_jobs_max)
-			return 0;
+	return missing;
+}
+
+static struct priority_queue *makeflow_node_ready_queue(struct dag *d, struct dag_node *n)
+{
+	return (n->local_job && local_queue) ? d->ready_local : d->ready_remote;
+}
+
+static void makeflow_node_push_ready(struct dag *d, struct dag_node *n)
+{
+	priority_queue_push(makeflow_node_ready_queue(d, n), n, makeflow_critical_path_flag ? n->critical_path : 0);
+}
+
+static void makeflow_ready_init(struct dag *d)
+{
+	struct dag_node *n;
+
+	priority_queue_delete(d->ready_local);
+	priority_queue_delete(d->ready_remote);
+	d->ready_local = priority_queue_create();
+	d->ready_remote = priority_queue_create();
+
+	for(n = d->nodes; n; n = n->next) {
+		n->source_files_missing = makeflow_node_count_missing_sources(n);
+		if(n->state == DAG_NODE_STATE_WAITING && n->source_files_missing == 0)
+			makeflow_node_push_ready(d, n);
 	}
+}
 
-	list_first_item(n->source_files);
-	while((f = list_next_item(n->source_files))) {
-		if(dag_file_should_exist(f)) {
+/*
+The target files of n now exist, so the nodes that need them are one file
+closer to being ready.
+*/
+
+static void makeflow_node_release_descendants(struct dag *d, struct dag_node *n)
+{
+	struct dag_file *f;
+	struct dag_node *m;
+
+	list_first_item(n->target_files);
+	while((f = list_next_item(n->target_files))) {
+		if(!dag_file_should_exist(f))
 			continue;
-		} else {
-			return 0;
+
+		list_first_item(f->needed_by);
+		while((m = list_next_item(f->needed_by))) {
+			m->source_files_missing--;
+			if(m->source_files_missing == 0 && m->state == DAG_NODE_STATE_WAITING)
+				makeflow_node_push_ready(d, m);
 		}
 	}
+}
+
+/*
+Critical path. With --schedule=critical-path, the ready set is ordered, and
+the jobs are given a priority, by the estimated time from the start of each
+node to the end of the workflow through its longest chain of descendants, so
+that the nodes that gate long chains are not left behind many short ones.
+The time of a node is the mean of the times measured for its category, or
+for all nodes when none of its category has completed yet, or one second
+before any completes, and no less than a millisecond, so that a longer chain
+of nodes too quick to measure still comes first. The paths are computed again
+each time the number of measured nodes doubles, so that the total cost stays
+linear in the size of the workflow.
+*/
+
+#define MAKEFLOW_RUNTIME_MIN 0.001
+
+struct makeflow_runtime {
+	double total;
+	int count;
+};
+
+static struct hash_table *makeflow_runtimes = 0;
+static struct makeflow_runtime makeflow_runtime_all = {0, 0};
+static int makeflow_runtime_next_update = 1;
+
+/* All nodes, each after all of the nodes that need its target files. */
+static struct dag_node **makeflow_critical_path_order = 0;
+static int makeflow_critical_path_count = 0;
+
+static double makeflow_node_estimated_time(struct dag_node *n)
+{
+	struct makeflow_runtime *r = NULL;
+
+	if(n->category)
+		r = hash_table_lookup(makeflow_runtimes, n->category->name);
+
+	if(r && r->count > 0)
+		return MAX(r->total / r->count, MAKEFLOW_RUNTIME_MIN);
+
+	if(makeflow_runtime_all.count > 0)
+		return MAX(makeflow_runtime_all.total / makeflow_runtime_all.count, MAKEFLOW_RUNTIME_MIN);
 
 	return 1;
 }
 
 /*
-Find all jobs ready to be run, then submit them.
+Order the nodes from the end of the workflow backwards, without recursion,
+as deep workflows would exhaust the stack. A node is placed once all of the
+nodes that need its target files are.
 */
 
-static void makeflow_dispatch_ready_jobs(struct dag *d)
+static void makeflow_critical_path_order_init(struct dag *d)
 {
 	struct dag_node *n;
+	struct dag_file *f;
+	int head = 0;
+
+	int *needed = xxcalloc(d->nodeid_counter, sizeof(int));
+	makeflow_critical_path_order = xxcalloc(d->nodeid_counter, sizeof(struct dag_node *));
+	makeflow_critical_path_count = 0;
 
 	for(n = d->nodes; n; n = n->next) {
-		if(dag_remote_jobs_running(d) >= remote_jobs_max && dag_local_jobs_running(d) >= local_jobs_max) {
-			break;
+		list_first_item(n->source_files);
+		while((f = list_next_item(n->source_files))) {
+			if(f->created_by)
+				needed[f->created_by->nodeid]++;
+		}
+	}
+
+	for(n = d->nodes; n; n = n->next) {
+		if(needed[n->nodeid] == 0)
+			makeflow_critical_path_order[makeflow_critical_path_count++] = n;
+	}
+
+	while(head < makeflow_critical_path_count) {
+		n = makeflow_critical_path_order[head++];
+		list_first_item(n->source_files);
+		while((f = list_next_item(n->source_files))) {
+			if(f->created_by && --needed[f->created_by->nodeid] == 0)
+				makeflow_critical_path_order[makeflow_critical_path_count++] = f->created_by;
 		}
+	}
 
-		if(makeflow_node_ready(d, n)) {
-			makeflow_node_submit(d, n);
+	free(needed);
+}
+
+static void makeflow_critical_path_update(struct dag *d)
+{
+	struct dag_node *n;
+	struct dag_file *f;
+	int i;
+
+	double *longest = xxcalloc(d->nodeid_counter, sizeof(double));
+
+	for(i = 0; i < makeflow_critical_path_count; i++) {
+		n = makeflow_critical_path_order[i];
+		n->critical_path = makeflow_node_estimated_time(n) + longest[n->nodeid];
+
+		list_first_item(n->source_files);
+		while((f = list_next_item(n->source_files))) {
+			if(f->created_by)
+				longest[f->created_by->nodeid] = MAX(longest[f->created_by->nodeid], n->critical_path);
 		}
 	}
+
+	free(longest);
+
+	/* Place the ready nodes again by their new paths. */
+	struct list *ready = list_create();
+	while((n = priority_queue_pop_head(d->ready_local)))
+		list_push_tail(ready, n);
+	while((n = priority_queue_pop_head(d->ready_remote)))
+		list_push_tail(ready, n);
+	while((n = list_pop_head(ready)))
+		makeflow_node_push_ready(d, n);
+	list_delete(ready);
+
+	debug(D_MAKEFLOW_RUN, "critical paths updated from %d measured rules", makeflow_runtime_all.count);
+}
+
+static void makeflow_critical_path_init(struct dag *d)
+{
+	if(!makeflow_critical_path_flag)
+		return;
+
+	makeflow_runtimes = hash_table_create(0, 0);
+	makeflow_critical_path_order_init(d);
+
+	if(makeflow_critical_path_count < d->nodeid_counter)
+		debug(D_MAKEFLOW_RUN, "%d rules are in a cycle and have no critical path", d->nodeid_counter - makeflow_critical_path_count);
+
+	makeflow_critical_path_update(d);
+}
+
+/*
+Measure the time n took to run, from its resource summary if it was
+monitored, or else from the batch system.
+*/
+
+static void makeflow_critical_path_measure(struct dag *d, struct dag_node *n, struct batch_job_info *info)
+{
+	double elapsed;
+
+	if(!makeflow_critical_path_flag)
+		return;
+
+	if(n->resources_measured && n->resources_measured->wall_time > 0) {
+		elapsed = n->resources_measured->wall_time / 1000000.0;
+	} else {
+		elapsed = MAX(info->finished - info->started, 0);
+	}
+
+	const char *name = n->category ? n->category->name : "default";
+	struct makeflow_runtime *r = hash_table_lookup(makeflow_runtimes, name);
+	if(!r) {
+		r = xxcalloc(1, sizeof(*r));
+		hash_table_insert(makeflow_runtimes, name, r);
+	}
+
+	r->total += elapsed;
+	r->count++;
+	makeflow_runtime_all.total += elapsed;
+	makeflow_runtime_all.count++;
+
+	if(makeflow_runtime_all.count >= makeflow_runtime_next_update) {
+		makeflow_runtime_next_update *= 2;
+		makeflow_critical_path_update(d);
+	}
+}
+
+/*
+Move to submit the nodes at the head of ready, while running is under max.
+The nodes left keep their place, and are not looked at.
+*/
+
+static void makeflow_dispatch_ready_queue(struct priority_queue *ready, int running, int max, struct list *submit)
+{
+	struct dag_node *n;
+
+	while(running < max && (n = priority_queue_pop_head(ready))) {
+		if(n->state != DAG_NODE_STATE_WAITING)
+			continue;
+
+		/* A file needed was removed since the node was counted, so it waits for it again. */
+		n->source_files_missing = makeflow_node_count_missing_sources(n);
+		if(n->source_files_missing > 0)
+			continue;
+
+		list_push_tail(submit, n);
+		running++;
+	}
+}
+
+/*
+Submit the jobs of the ready sets that fit in the local and remote limits.
+*/
+
+static void makeflow_dispatch_ready_jobs(struct dag *d)
+{
+	struct dag_node *n;
+	struct list *submit = list_create();
+
+	makeflow_dispatch_ready_queue(d->ready_local, dag_local_jobs_running(d), local_jobs_max, submit);
+	makeflow_dispatch_ready_queue(d->ready_remote, dag_remote_jobs_running(d), remote_jobs_max, submit);
+
+	/* Submitting may make other nodes ready, so it is not done while iterating. */
+	while((n = list_pop_head(submit)))
+		makeflow_node_submit(d, n);
+
+	list_delete(submit);
 }
 
 /*
@@ -869,8 +1120,14 @@ static void makeflow_node_complete(struct dag *d, struct dag_node *n, struct bat
 		}
 
 		makeflow_log_state_change(d, n, DAG_NODE_STATE_COMPLETE);
+		makeflow_critical_path_measure(d, n, info);
+		makeflow_node_release_descendants(d, n);
 	}
 	list_delete(outputs);
+
+	/* A job to retry is ready again, as its sources were there when it ran. */
+	if(n->state == DAG_NODE_STATE_WAITING)
+		makeflow_node_push_ready(d, n);
 }
 
 /*
@@ -992,6 +1249,9 @@ static void makeflow_run( struct dag *d )
             makeflow_catalog_summary(d, project, batch_queue_type, start);
         }
 
+	makeflow_critical_path_init(d);
+	makeflow_ready_init(d);
+
 	while(!makeflow_abort_flag) {
 		did_find_archived_job = 0;
 		makeflow_dispatch_ready_jobs(d);
@@ -1142,6 +1402,7 @@ static void show_help_run(const char *cmd)
 	printf(" %-30s Automatically retry failed batch jobs up to %d times.\n", "-R,--retry", makeflow_retry_max);
 	printf(" %-30s Automatically retry failed batch jobs up to n times.\n", "-r,--retry-count=<n>");
 	printf(" %-30s Wait for output files to be created upto n seconds (e.g., to deal with NFS semantics).\n", "   --wait-for-files-upto=<n>");
+	printf(" %-30s Order of submission of ready rules.		  (fifo|critical-path, default is fifo)\n", "   --schedule=<mode>");
 	printf(" %-30s Time to retry failed batch job submission.  (default is %ds)\n", "-S,--submission-timeout=<#>", makeflow_submit_timeout);
 	printf(" %-30s Work Queue keepalive timeout.			   (default is %ds)\n", "-t,--wq-keepalive-timeout=<#>", WORK_QUEUE_DEFAULT_KEEPALIVE_TIMEOUT);
 	printf(" %-30s Work Queue keepalive interval.			  (default is %ds)\n", "-u,--wq-keepalive-interval=<#>", WORK_QUEUE_DEFAULT_KEEPALIVE_INTERVAL);
@@ -1166,9 +1427,11 @@ static void show_help_run(const char *cmd)
 	printf(" %-30s Use Parrot to restrict access to the given inputs/outputs.\n", "--enforcement");
 	printf(" %-30s Path to parrot_run (defaults to current directory).\n", "--parrot-path=<path>");
 	printf(" %-30s Indicate preferred master connection. Choose one of by_ip or by_hostname. (default is by_ip)\n", "--work-queue-preferred-connection");
+	printf(" %-30s Load the parsed makeflow from this cache, updated when the makeflow changes.\n", "--dag-cache[=<file>]");
 	printf(" %-30s Use JSON format rather than Make-style format for the input file.\n", "--json");
 	printf(" %-30s Evaluate JX input. Implies --json\n", "--jx");
 	printf(" %-30s Evaluate the JX input in the given context.\n", "--jx-context");
+	printf(" %-30s Evaluate the JX rules with this many threads. (default is the number of cores)\n", "--jx-threads=<n>");
         printf(" %-30s Wrap execution of all rules in a singularity container.\n","--singularity=<image>");
 	printf(" %-30s Assume the given directory is a shared filesystem accessible to all workers.\n", "--shared-fs");
 	printf(" %-30s Archive results of makeflow in specified directory			   (default directory is %s)\n", "--archive=<dir>", MAKEFLOW_ARCHIVE_DEFAULT_DIRECTORY);
@@ -1229,7 +1492,10 @@ int main(int argc, char *argv[])
 	char *mesos_preload = NULL;
 	int json_input = 0;
 	int jx_input = 0;
+	int jx_threads = 0;
 	char *jx_context = NULL;
+	int use_dag_cache = 0;
+	char *dag_cache_name = NULL;
 
 	random_init();
 	debug_config(argv[0]);
@@ -1288,6 +1554,7 @@ int main(int argc, char *argv[])
 		LONG_OPT_JSON,
 		LONG_OPT_JX,
 		LONG_OPT_JX_CONTEXT,
+		LONG_OPT_JX_THREADS,
 		LONG_OPT_SKIP_FILE_CHECK,
 		LONG_OPT_UMBRELLA_BINARY,
 		LONG_OPT_UMBRELLA_LOG_PREFIX,
@@ -1303,7 +1570,9 @@ int main(int argc, char *argv[])
 		LONG_OPT_ARCHIVE_WRITE_ONLY,
 		LONG_OPT_MESOS_MASTER,
 		LONG_OPT_MESOS_PATH,
-		LONG_OPT_MESOS_PRELOAD
+		LONG_OPT_MESOS_PRELOAD,
+		LONG_OPT_SCHEDULE,
+		LONG_OPT_DAG_CACHE
 	};
 
 	static const struct option long_options_run[] = {
@@ -1344,6 +1613,7 @@ int main(int argc, char *argv[])
 		{"project-name", required_argument, 0, 'N'},
 		{"retry", no_argument, 0, 'R'},
 		{"retry-count", required_argument, 0, 'r'},
+		{"schedule", required_argument, 0, LONG_OPT_SCHEDULE},
 		{"shared-fs", required_argument, 0, LONG_OPT_SHARED_FS},
 		{"show-output", no_argument, 0, 'O'},
 		{"submission-timeout", required_argument, 0, 'S'},
@@ -1373,9 +1643,11 @@ int main(int argc, char *argv[])
 		{"docker-tar", required_argument, 0, LONG_OPT_DOCKER_TAR},
 		{"amazon-credentials", required_argument, 0, LONG_OPT_AMAZON_CREDENTIALS},
 		{"amazon-ami", required_argument, 0, LONG_OPT_AMAZON_AMI},
+		{"dag-cache", optional_argument, 0, LONG_OPT_DAG_CACHE},
 		{"json", no_argument, 0, LONG_OPT_JSON},
 		{"jx", no_argument, 0, LONG_OPT_JX},
 		{"jx-context", required_argument, 0, LONG_OPT_JX_CONTEXT},
+		{"jx-threads", required_argument, 0, LONG_OPT_JX_THREADS},
 		{"enforcement", no_argument, 0, LONG_OPT_ENFORCEMENT},
 		{"parrot-path", required_argument, 0, LONG_OPT_PARROT_PATH},
         {"singularity", required_argument, 0, LONG_OPT_SINGULARITY},
@@ -1660,6 +1932,9 @@ int main(int argc, char *argv[])
 			case LONG_OPT_JX_CONTEXT:
 				jx_context = xxstrdup(optarg);
 				break;
+			case LONG_OPT_JX_THREADS:
+				jx_threads = atoi(optarg);
+				break;
 			case LONG_OPT_UMBRELLA_BINARY:
 				if(!umbrella) umbrella = makeflow_wrapper_umbrella_create();
 				makeflow_wrapper_umbrella_set_binary(umbrella, (const char *)xxstrdup(optarg));
@@ -1684,6 +1959,20 @@ int main(int argc, char *argv[])
 			case LONG_OPT_MESOS_PRELOAD:
 				mesos_preload = xxstrdup(optarg);
 				break;
+			case LONG_OPT_DAG_CACHE:
+				use_dag_cache = 1;
+				if(optarg)
+					dag_cache_name = xxstrdup(optarg);
+				break;
+			case LONG_OPT_SCHEDULE:
+				if(!strcmp(optarg, "fifo")) {
+					makeflow_critical_path_flag = 0;
+				} else if(!strcmp(optarg, "critical-path")) {
+					makeflow_critical_path_flag = 1;
+				} else {
+					fatal("unknown schedule '%s': choose one of fifo or critical-path", optarg);
+				}
+				break;
 			case LONG_OPT_ARCHIVE:
 				should_read_archive = 1;
 				should_write_to_archive = 1;
@@ -1781,7 +2070,7 @@ int main(int argc, char *argv[])
 		}
 		if (jx_input) {
 			struct jx *t = dag;
-			dag = jx_eval(t, ctx);
+			dag = dag_jx_eval(t, ctx, jx_threads);
 			jx_delete(t);
 			jx_delete(ctx);
 		}
@@ -1789,6 +2078,10 @@ int main(int argc, char *argv[])
 		jx_delete(dag);
 		// JX doesn't really use errno, so give something generic
 		errno = EINVAL;
+	} else if(use_dag_cache) {
+		if(!dag_cache_name)
+			dag_cache_name = dag_cache_default_name(dagfile);
+		d = dag_from_file_cached(dagfile, dag_cache_name);
 	} else {
 		d = dag_from_file(dagfile);
 	}
@@ -2030,6 +2323,11 @@ int main(int argc, char *argv[])
 
 		if(clean_mode == MAKEFLOW_CLEAN_ALL) {
 			unlink(logfilename);
+			char *checkpoint = string_format("%s%s", logfilename, MAKEFLOW_LOG_CHECKPOINT_SUFFIX);
+			unlink(checkpoint);
+			free(checkpoint);
+			if(dag_cache_name)
+				unlink(dag_cache_name);
 		}
 
 		exit(0);
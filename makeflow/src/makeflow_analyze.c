@@ -16,6 +16,7 @@ See the file COPYING for details.
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <limits.h>
 
 #include "cctools.h"
 #include "catalog_query.h"
@@ -42,6 +43,7 @@ See the file COPYING for details.
 #include "path.h"
 
 #include "dag.h"
+#include "dag_cache.h"
 #include "dag_visitors.h"
 #include "parser.h"
 
@@ -52,6 +54,10 @@ enum { SHOW_INPUT_FILES = 2,
 	   SHOW_DAG_FILE
 };
 
+/* Unique integers for long options. */
+
+enum { LONG_OPT_DAG_CACHE = UCHAR_MAX+1 };
+
 #define MAKEFLOW_AUTO_WIDTH 1
 #define MAKEFLOW_AUTO_GROUP 2
 
@@ -194,6 +200,7 @@ static void show_help_analyze(const char *cmd)
 {
 	fprintf(stdout, "Use: %s [options] <dagfile>\n", cmd);
 	fprintf(stdout, " %-30s Create portable bundle of workflow in <directory>\n", "-b,--bundle-dir=<directory>");
+	fprintf(stdout, " %-30s Load the parsed makeflow from this cache, updated when the makeflow changes.\n", "--dag-cache[=<file>]");
 	fprintf(stdout, " %-30s Show this help screen.\n", "-h,--help");
 	fprintf(stdout, " %-30s Show the pre-execution analysis of the Makeflow script - <dagfile>.\n", "-i,--analyze-exec");
 	fprintf(stdout, " %-30s Show input files.\n", "-I,--show-input");
@@ -211,12 +218,15 @@ int main(int argc, char *argv[])
 
 	cctools_version_debug(D_MAKEFLOW_RUN, argv[0]);
 	const char *dagfile;
+	int use_dag_cache = 0;
+	char *dag_cache_name = NULL;
 
 	char *bundle_directory = NULL;
 	int syntax_check = 0;
 
 	static const struct option long_options_analyze[] = {
 		{"bundle-dir", required_argument, 0, 'b'},
+		{"dag-cache", optional_argument, 0, LONG_OPT_DAG_CACHE},
 		{"help", no_argument, 0, 'h'},
 		{"analyze-exec", no_argument, 0, 'i'},
 		{"show-input", no_argument, 0, 'I'},
@@ -250,6 +260,11 @@ int main(int argc, char *argv[])
 			case 'd':
 				debug_flags_set(optarg);
 				break;
+			case LONG_OPT_DAG_CACHE:
+				use_dag_cache = 1;
+				if(optarg)
+					dag_cache_name = xxstrdup(optarg);
+				break;
 			case 'v':
 				cctools_version_print(stdout, argv[0]);
 				return 0;
@@ -272,7 +287,14 @@ int main(int argc, char *argv[])
 		dagfile = argv[optind];
 	}
 
-	struct dag *d = dag_from_file(dagfile);
+	struct dag *d;
+	if(use_dag_cache) {
+		if(!dag_cache_name)
+			dag_cache_name = dag_cache_default_name(dagfile);
+		d = dag_from_file_cached(dagfile, dag_cache_name);
+	} else {
+		d = dag_from_file(dagfile);
+	}
 	if(!d) {
 		fatal("makeflow_analyze: couldn't load %s: %s\n", dagfile, strerror(errno));
 	}
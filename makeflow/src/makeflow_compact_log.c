@@ -0,0 +1,237 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+/*
+makeflow_compact_log rewrites a makeflow log without the events that no
+longer matter to recovery, so that a long lived workflow does not play back
+its whole history on every restart:
+
+- Of the state changes of a node, only the last one is kept.
+- Of the state changes of a file, only the last one is kept, together with
+  its last change to EXISTS, from which makeflow recovers the time the file
+  was created.
+- Garbage collection events are dropped.
+
+Every other line is kept as is, and the lines kept stay in their order.
+The counts of files created and deleted that makeflow shows when recovering
+are taken from the events kept, and so may be lower after compacting.
+*/
+
+#include "makeflow_log.h"
+#include "dag_file.h"
+
+#include "cctools.h"
+#include "debug.h"
+#include "get_line.h"
+#include "getopt_aux.h"
+#include "hash_table.h"
+#include "itable.h"
+#include "stringtools.h"
+#include "xxmalloc.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* the lines of the log that are last for their file. */
+struct file_lines {
+	int64_t last;
+	int64_t exists;
+};
+
+static void show_help(const char *cmd)
+{
+	fprintf(stdout, "Use: %s [options] <logfile>\n", cmd);
+	fprintf(stdout, "where options are:\n");
+	fprintf(stdout, " %-30s Write the compacted log to this file. (default is to replace <logfile>)\n", "-o,--output=<file>");
+	fprintf(stdout, " %-30s Enable debugging for this subsystem.\n", "-d,--debug=<subsystem>");
+	fprintf(stdout, " %-30s Show this help screen.\n", "-h,--help");
+	fprintf(stdout, " %-30s Show version string.\n", "-v,--version");
+}
+
+/* Marks in keep the lines of the log to be written by the second pass. */
+static int64_t mark_lines(FILE *log, char **keep)
+{
+	struct itable *nodes = itable_create(0);
+	struct hash_table *files = hash_table_create(0, 0);
+	struct file_lines *lines;
+	int64_t count = 0, capacity = 1024;
+	char *line, *name;
+	uint64_t key;
+	void *value;
+
+	*keep = xxmalloc(capacity);
+
+	while((line = get_line(log))) {
+		char *file = xxmalloc(strlen(line) + 1);
+		uint64_t time, size;
+		int nodeid, state;
+		int64_t jobid;
+
+		if(count == capacity) {
+			capacity *= 2;
+			*keep = xxrealloc(*keep, capacity);
+		}
+
+		(*keep)[count] = 1;
+
+		if(sscanf(line, "# FILE %" SCNu64 " %s %d %" SCNu64, &time, file, &state, &size) == 4) {
+			lines = hash_table_lookup(files, file);
+			if(!lines) {
+				lines = xxmalloc(sizeof(*lines));
+				lines->exists = -1;
+				hash_table_insert(files, file, lines);
+			}
+			lines->last = count;
+			if(state == DAG_FILE_STATE_EXISTS)
+				lines->exists = count;
+			(*keep)[count] = 0;
+		} else if(!strncmp(line, "# GC", 4)) {
+			(*keep)[count] = 0;
+		} else if(line[0] != '#' && sscanf(line, "%" SCNu64 " %d %d %" SCNd64, &time, &nodeid, &state, &jobid) == 4) {
+			itable_insert(nodes, nodeid, (void *) (uintptr_t) (count + 1));
+			(*keep)[count] = 0;
+		}
+
+		free(file);
+		free(line);
+		count++;
+	}
+
+	itable_firstkey(nodes);
+	while(itable_nextkey(nodes, &key, &value))
+		(*keep)[(uintptr_t) value - 1] = 1;
+
+	hash_table_firstkey(files);
+	while(hash_table_nextkey(files, &name, (void **) &lines)) {
+		(*keep)[lines->last] = 1;
+		if(lines->exists >= 0)
+			(*keep)[lines->exists] = 1;
+		free(lines);
+	}
+
+	hash_table_delete(files);
+	itable_delete(nodes);
+
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *logfile;
+	char *output = NULL;
+	int c;
+
+	debug_config(argv[0]);
+
+	static const struct option long_options[] = {
+		{"debug", required_argument, 0, 'd'},
+		{"help", no_argument, 0, 'h'},
+		{"output", required_argument, 0, 'o'},
+		{"version", no_argument, 0, 'v'},
+		{0, 0, 0, 0}
+	};
+
+	while((c = getopt_long(argc, argv, "d:ho:v", long_options, NULL)) >= 0) {
+		switch (c) {
+			case 'd':
+				debug_flags_set(optarg);
+				break;
+			case 'h':
+				show_help(argv[0]);
+				return 0;
+			case 'o':
+				free(output);
+				output = xxstrdup(optarg);
+				break;
+			case 'v':
+				cctools_version_print(stdout, argv[0]);
+				return 0;
+			default:
+				show_help(argv[0]);
+				return 1;
+		}
+	}
+
+	cctools_version_debug(D_MAKEFLOW_RUN, argv[0]);
+
+	if((argc - optind) != 1) {
+		show_help(argv[0]);
+		return 1;
+	}
+
+	logfile = argv[optind];
+	if(!output)
+		output = xxstrdup(logfile);
+
+	FILE *log = fopen(logfile, "r");
+	if(!log)
+		fatal("couldn't open %s: %s\n", logfile, strerror(errno));
+
+	struct stat info;
+	if(fstat(fileno(log), &info) < 0)
+		fatal("couldn't stat %s: %s\n", logfile, strerror(errno));
+
+	char *keep;
+	int64_t count = mark_lines(log, &keep);
+	int64_t kept = 0, i;
+
+	char *tmpname = string_format("%s.XXXXXX", output);
+	int fd = mkstemp(tmpname);
+	if(fd < 0)
+		fatal("couldn't create %s: %s\n", tmpname, strerror(errno));
+
+	/* mkstemp creates the file readable only by its owner. */
+	fchmod(fd, info.st_mode & 0777);
+
+	FILE *file = fdopen(fd, "w");
+	if(!file)
+		fatal("couldn't open %s: %s\n", tmpname, strerror(errno));
+
+	rewind(log);
+	for(i = 0; i < count; i++) {
+		char *line = get_line(log);
+		if(!line) {
+			unlink(tmpname);
+			fatal("%s changed while being compacted\n", logfile);
+		}
+		if(keep[i]) {
+			fputs(line, file);
+			kept++;
+		}
+		free(line);
+	}
+	fclose(log);
+
+	int failed = fflush(file) || ferror(file) || fsync(fd);
+	failed = fclose(file) || failed;
+
+	if(failed || rename(tmpname, output) < 0) {
+		unlink(tmpname);
+		fatal("couldn't write %s: %s\n", output, strerror(errno));
+	}
+
+	/* the checkpoint of a log that was replaced no longer matches it. */
+	if(!strcmp(output, logfile)) {
+		char *checkpoint = string_format("%s%s", logfile, MAKEFLOW_LOG_CHECKPOINT_SUFFIX);
+		unlink(checkpoint);
+		free(checkpoint);
+	}
+
+	printf("compacted %s from %" PRId64 " to %" PRId64 " lines.\n", logfile, count, kept);
+
+	free(tmpname);
+	free(output);
+	free(keep);
+
+	return 0;
+}
+
+/* vim: set noexpandtab tabstop=4: */
@@ -13,8 +13,14 @@ See the file COPYING for details.
 #include "timestamp.h"
 #include "list.h"
 #include "debug.h"
+#include "hash_table.h"
+#include "sha1.h"
+#include "stringtools.h"
 #include "xxmalloc.h"
 
+#include <sys/stat.h>
+
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -24,6 +30,15 @@ See the file COPYING for details.
 
 #define MAX_BUFFER_SIZE 4096
 
+#define MAKEFLOW_LOG_CHECKPOINT_VERSION 1
+
+/* The fewest events logged between checkpoints. */
+#define MAKEFLOW_LOG_CHECKPOINT_MIN_EVENTS 1000
+
+/* The checkpoint is matched to its log by the checksum of up to this many
+bytes of the log before the checkpoint. */
+#define MAKEFLOW_LOG_FINGERPRINT_SIZE 4096
+
 /*
 The makeflow log file records every essential event in the execution of a workflow,
 so that after a failure, the workflow can either be continued or aborted cleanly,
@@ -102,10 +117,52 @@ filename - the filename specified within the dag_file whose state has changed.
 timestamp - the unix time (in microseconds) when this line is written to the log file.
 
 These event types indicate that the workflow as a whole has started or completed in the indicated manner.
+
+----
+
+Replaying the whole log on recovery takes time in proportion to the length of
+the log, which for a long running workflow grows without bound. So every so
+often, after a node changes state, and when the workflow ends, makeflow writes
+a checkpoint next to the log (X.makeflowlog.checkpoint) with the state that
+replaying the log up to that point would recover, and the length of the log
+at that point. Recovery then loads the checkpoint, and replays only the events
+after it. The checkpoint is written to a temporary file and renamed over the
+previous one, after the log is synced, so that it always matches some prefix
+of the log. A checkpoint that does not match its log, for example because the
+log was compacted with makeflow_compact_log since, is ignored, and the whole
+log is replayed.
+
+Checkpoint format:
+
+MAKEFLOW_CHECKPOINT version
+OFFSET length fingerprint - the length of the log covered, and the sha1 of its last (up to 4096) bytes.
+COUNTS completed_files deleted_files - the number of EXISTS and DELETE file events in the log.
+CACHE cache_dir - the first cache dir in the log, if any.
+MOUNT target source cache_name type - the first mount of each target in the log.
+NODE node_id state job_id previous_completion - the last state of each node in the log, previous_completion in seconds.
+FILE filename state creation_logged - the last state of each file in the log, but for unknown ones.
+END
 */
 
 void makeflow_node_decide_rerun(struct itable *rerun_table, struct dag *d, struct dag_node *n, int silent );
 
+static char *log_filename = NULL;
+static char *checkpoint_filename = NULL;
+static int checkpoint_events = 0;
+
+/*
+Most of the state in a checkpoint is read from the dag, which matches the log
+at the times checkpoints are written. The rest is changed by makeflow apart
+from the log, so what the log says about it is kept here.
+*/
+
+static int logged_completed_files = 0;
+static int logged_deleted_files = 0;
+static char *logged_cache_dir = NULL;
+static struct hash_table *logged_mounts = NULL;
+
+static void makeflow_log_checkpoint( struct dag *d );
+
 /*
 To balance between performance and consistency, we sync the log every 60 seconds
 on ordinary events, but sync immediately on important events like a makeflow restart.
@@ -131,28 +188,43 @@ void makeflow_log_aborted_event( struct dag *d )
 {
 	fprintf(d->logfile, "# ABORTED %" PRIu64 "\n", timestamp_get());
 	makeflow_log_sync(d,1);
+	makeflow_log_checkpoint(d);
 }
 
 void makeflow_log_failed_event( struct dag *d )
 {
 	fprintf(d->logfile, "# FAILED %" PRIu64 "\n", timestamp_get());
 	makeflow_log_sync(d,1);
+	makeflow_log_checkpoint(d);
 }
 
 void makeflow_log_completed_event( struct dag *d )
 {
 	fprintf(d->logfile, "# COMPLETED %" PRIu64 "\n", timestamp_get());
 	makeflow_log_sync(d,1);
+	makeflow_log_checkpoint(d);
+}
+
+static void makeflow_log_record_mount( const char *target, const char *source, const char *cache_name, int type )
+{
+	if(!logged_mounts)
+		logged_mounts = hash_table_create(0, 0);
+
+	if(!hash_table_lookup(logged_mounts, target))
+		hash_table_insert(logged_mounts, target, string_format("%s %s %d", source, cache_name, type));
 }
 
 void makeflow_log_mount_event( struct dag *d, const char *target, const char *source, const char *cache_name, dag_file_source_t type ) {
 	fprintf(d->logfile, "# MOUNT %" PRIu64 " %s %s %s %d\n", timestamp_get(), target, source, cache_name, type);
 	makeflow_log_sync(d,1);
+	makeflow_log_record_mount(target, source, cache_name, type);
 }
 
 void makeflow_log_cache_event( struct dag *d, const char *cache_dir ) {
 	fprintf(d->logfile, "# CACHE %" PRIu64 " %s\n", timestamp_get(), cache_dir);
 	makeflow_log_sync(d,1);
+	if(!logged_cache_dir)
+		logged_cache_dir = xxstrdup(cache_dir);
 }
 
 void makeflow_log_state_change( struct dag *d, struct dag_node *n, int newstate )
@@ -165,9 +237,21 @@ void makeflow_log_state_change( struct dag *d, struct dag_node *n, int newstate
 	n->state = newstate;
 	d->node_states[n->state]++;
 
-	fprintf(d->logfile, "%" PRIu64 " %d %d %" PRIbjid " %d %d %d %d %d %d\n", timestamp_get(), n->nodeid, newstate, n->jobid, d->node_states[0], d->node_states[1], d->node_states[2], d->node_states[3], d->node_states[4], d->nodeid_counter);
+	timestamp_t time = timestamp_get();
+	fprintf(d->logfile, "%" PRIu64 " %d %d %" PRIbjid " %d %d %d %d %d %d\n", time, n->nodeid, newstate, n->jobid, d->node_states[0], d->node_states[1], d->node_states[2], d->node_states[3], d->node_states[4], d->nodeid_counter);
+
+	/* as recovered from the log, so that checkpoints keep it. */
+	n->previous_completion = (time_t) (time / 1000000);
 
 	makeflow_log_sync(d,0);
+
+	/* Checkpoints once the events logged since the last checkpoint outnumber
+	 * the nodes and files it would write, so that checkpoints cost no more
+	 * than playing back the log they replace. This is only done on changes
+	 * of nodes, as makeflow may update a node before logging its files. */
+	checkpoint_events++;
+	if(checkpoint_events >= MAKEFLOW_LOG_CHECKPOINT_MIN_EVENTS && checkpoint_events >= d->nodeid_counter + hash_table_size(d->files))
+		makeflow_log_checkpoint(d);
 }
 
 void makeflow_log_file_state_change( struct dag *d, struct dag_file *f, int newstate )
@@ -180,11 +264,15 @@ void makeflow_log_file_state_change( struct dag *d, struct dag_file *f, int news
 	fprintf(d->logfile, "# FILE %" PRIu64 " %s %d %" PRIu64 "\n", time, f->filename, f->state, dag_file_size(f));
 	if(f->state == DAG_FILE_STATE_EXISTS){
 		d->completed_files += 1;
+		logged_completed_files += 1;
 		f->creation_logged = (time_t) (time / 1000000);
 	} else if(f->state == DAG_FILE_STATE_DELETE) {
 		d->deleted_files += 1;
+		logged_deleted_files += 1;
 	}
 	makeflow_log_sync(d,0);
+
+	checkpoint_events++;
 }
 
 void makeflow_log_file_list_state_change( struct dag *d, struct list *file_list, int newstate )
@@ -205,6 +293,244 @@ void makeflow_log_gc_event( struct dag *d, int collected, timestamp_t elapsed, i
 	makeflow_log_sync(d,0);
 }
 
+/* Fills fingerprint with the sha1 of the bytes of the log before offset. */
+static int makeflow_log_fingerprint(const char *filename, uint64_t offset, char *fingerprint)
+{
+	char buffer[MAKEFLOW_LOG_FINGERPRINT_SIZE];
+	unsigned char digest[SHA1_DIGEST_LENGTH];
+	size_t length = offset < sizeof(buffer) ? offset : sizeof(buffer);
+
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return 0;
+
+	ssize_t n = pread(fd, buffer, length, offset - length);
+	close(fd);
+
+	if(n < 0 || (size_t) n != length)
+		return 0;
+
+	sha1_buffer(buffer, length, digest);
+	strcpy(fingerprint, sha1_string(digest));
+
+	return 1;
+}
+
+/* Writes the state recovered from the log so far to the checkpoint. */
+static void makeflow_log_checkpoint( struct dag *d )
+{
+	struct dag_node *n;
+	struct dag_file *f;
+	struct stat info;
+	char fingerprint[SHA1_DIGEST_ASCII_LENGTH];
+	char *name, *value;
+
+	checkpoint_events = 0;
+	if(!checkpoint_filename || !d->logfile)
+		return;
+
+	/* the checkpoint must never be ahead of the log on disk. */
+	fflush(d->logfile);
+	makeflow_log_sync(d,1);
+
+	if(fstat(fileno(d->logfile), &info) < 0 || !makeflow_log_fingerprint(log_filename, info.st_size, fingerprint)) {
+		debug(D_MAKEFLOW_RUN, "couldn't checkpoint log %s: %s\n", log_filename, strerror(errno));
+		return;
+	}
+
+	char *tmpname = string_format("%s.XXXXXX", checkpoint_filename);
+	int fd = mkstemp(tmpname);
+	FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+	if(!file) {
+		debug(D_MAKEFLOW_RUN, "couldn't write checkpoint %s: %s\n", tmpname, strerror(errno));
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmpname);
+		}
+		free(tmpname);
+		return;
+	}
+
+	fprintf(file, "MAKEFLOW_CHECKPOINT %d\n", MAKEFLOW_LOG_CHECKPOINT_VERSION);
+	fprintf(file, "OFFSET %" PRIu64 " %s\n", (uint64_t) info.st_size, fingerprint);
+	fprintf(file, "COUNTS %d %d\n", logged_completed_files, logged_deleted_files);
+
+	if(logged_cache_dir)
+		fprintf(file, "CACHE %s\n", logged_cache_dir);
+
+	if(logged_mounts) {
+		hash_table_firstkey(logged_mounts);
+		while(hash_table_nextkey(logged_mounts, &name, (void **) &value))
+			fprintf(file, "MOUNT %s %s\n", name, value);
+	}
+
+	for(n = d->nodes; n; n = n->next) {
+		if(n->state == DAG_NODE_STATE_WAITING && !n->jobid && !n->previous_completion)
+			continue;
+		fprintf(file, "NODE %d %d %" PRIbjid " %" PRIu64 "\n", n->nodeid, n->state, n->jobid, (uint64_t) n->previous_completion);
+	}
+
+	hash_table_firstkey(d->files);
+	while(hash_table_nextkey(d->files, &name, (void **) &f)) {
+		if(f->state == DAG_FILE_STATE_UNKNOWN)
+			continue;
+		fprintf(file, "FILE %s %d %" PRIu64 "\n", name, f->state, (uint64_t) f->creation_logged);
+	}
+
+	fprintf(file, "END\n");
+
+	int failed = fflush(file) || ferror(file) || fsync(fd);
+	failed = fclose(file) || failed;
+
+	if(failed || rename(tmpname, checkpoint_filename) < 0) {
+		debug(D_MAKEFLOW_RUN, "couldn't write checkpoint %s: %s\n", checkpoint_filename, strerror(errno));
+		unlink(tmpname);
+	} else {
+		debug(D_MAKEFLOW_RUN, "checkpointed log %s at %" PRIu64 " bytes\n", log_filename, (uint64_t) info.st_size);
+	}
+
+	free(tmpname);
+}
+
+static int makeflow_log_recover_cache(struct dag *d, const char *cache_dir)
+{
+	/* if the user specifies a cache dir using --cache dir, ignore the info from the log file */
+	if(!d->cache_dir) {
+		d->cache_dir = xxstrdup(cache_dir);
+	} else {
+		/* There are two possible reasons for the inconsistency:
+		 * 1) the cache dir specified via the --cache opt and in the log file mismatch;
+		 * 2) the log file includes multiple different CACHE entries.
+		 */
+		if(strcmp(cache_dir, d->cache_dir)) {
+			fprintf(stderr, "The --cache option (%s) does not match the cache dir (%s) in the log file!\n", d->cache_dir, cache_dir);
+			return -1;
+		}
+	}
+
+	if(!logged_cache_dir)
+		logged_cache_dir = xxstrdup(cache_dir);
+
+	return 0;
+}
+
+static int makeflow_log_recover_mount(struct dag *d, const char *file, const char *source, const char *cache_name, int type)
+{
+	struct dag_file *f = dag_file_lookup_or_create(d, file);
+
+	if(!f->source) {
+		f->source = xxstrdup(source);
+		f->cache_name = xxstrdup(cache_name);
+		f->type = type;
+	} else {
+		/* If a mount entry is specified in the mountfile and logged in a log file at the same time, they must not conflict with each other. */
+		/* If a mount entry is logged in a log file multiple times deliberately or not, they must not conflict with each other. */
+		if(makeflow_mount_check_consistency(file, f->source, source, d->cache_dir, cache_name)) {
+			return -1;
+		}
+	}
+
+	makeflow_log_record_mount(file, source, cache_name, type);
+
+	return 0;
+}
+
+/* Reads the checkpoint twice, first to check that it matches the log and
+ * the dag, and then to recover from it. Returns one and the length of the
+ * log it covers if recovered, zero if it does not match, or -1 if it
+ * conflicts with the cache or mounts given to makeflow. */
+static int makeflow_log_recover_checkpoint(struct dag *d, FILE *log, uint64_t *offset)
+{
+	FILE *file = fopen(checkpoint_filename, "r");
+	if(!file)
+		return 0;
+
+	char fingerprint[SHA1_DIGEST_ASCII_LENGTH];
+	char *line;
+	int pass, matches = 1, result = 1;
+	int has_offset = 0, has_end = 0;
+
+	for(pass = 0; pass < 2 && matches; pass++) {
+		int linenum = 0;
+		has_end = 0;
+		rewind(file);
+
+		while(matches && result > 0 && (line = get_line(file))) {
+			size_t length = strlen(line) + 1;
+			char *a = malloc(length), *b = malloc(length), *c = malloc(length);
+			int version, state, type, nodeid;
+			int64_t jobid;
+			uint64_t bytes, when;
+			struct stat info;
+			struct dag_node *n;
+			struct dag_file *f;
+
+			linenum++;
+
+			if(linenum == 1) {
+				matches = sscanf(line, "MAKEFLOW_CHECKPOINT %d", &version) == 1 && version == MAKEFLOW_LOG_CHECKPOINT_VERSION;
+			} else if(sscanf(line, "OFFSET %" SCNu64 " %s", &bytes, a) == 2) {
+				if(pass == 0) {
+					matches = fstat(fileno(log), &info) == 0 && bytes <= (uint64_t) info.st_size
+						&& makeflow_log_fingerprint(log_filename, bytes, fingerprint) && !strcmp(a, fingerprint);
+				}
+				*offset = bytes;
+				has_offset = 1;
+			} else if(sscanf(line, "COUNTS %d %d", &state, &type) == 2) {
+				if(pass == 1) {
+					d->completed_files += state;
+					d->deleted_files += type;
+					logged_completed_files = state;
+					logged_deleted_files = type;
+				}
+			} else if(sscanf(line, "CACHE %s", a) == 1) {
+				if(pass == 1 && makeflow_log_recover_cache(d, a))
+					result = -1;
+			} else if(sscanf(line, "MOUNT %s %s %s %d", a, b, c, &type) == 4) {
+				if(pass == 1 && makeflow_log_recover_mount(d, a, b, c, type))
+					result = -1;
+			} else if(sscanf(line, "NODE %d %d %" SCNd64 " %" SCNu64, &nodeid, &state, &jobid, &when) == 4) {
+				n = itable_lookup(d->node_table, nodeid);
+				if(!n) {
+					matches = 0;
+				} else if(pass == 1) {
+					n->state = state;
+					n->jobid = jobid;
+					n->previous_completion = (time_t) when;
+				}
+			} else if(sscanf(line, "FILE %s %d %" SCNu64, a, &state, &when) == 3) {
+				if(pass == 1) {
+					f = dag_file_lookup_or_create(d, a);
+					f->state = state;
+					f->creation_logged = (time_t) when;
+				}
+			} else if(!strcmp(line, "END\n")) {
+				has_end = 1;
+			} else {
+				matches = 0;
+			}
+
+			free(a);
+			free(b);
+			free(c);
+			free(line);
+		}
+
+		if(pass == 0 && (!has_offset || !has_end))
+			matches = 0;
+
+		if(pass == 0 && !matches)
+			debug(D_MAKEFLOW_RUN, "checkpoint %s does not match log %s, ignoring it\n", checkpoint_filename, log_filename);
+	}
+
+	fclose(file);
+
+	if(result < 0)
+		return -1;
+
+	return matches && has_end;
+}
+
 /** The clean_mode variable was added so that we could better print out error messages
  * apply in the situation. Currently only used to silence node rerun checking.
  */
@@ -219,12 +545,30 @@ int makeflow_log_recover(struct dag *d, const char *filename, int verbose_mode,
 	timestamp_t previous_completion_time;
 	uint64_t size;
 
+	free(log_filename);
+	free(checkpoint_filename);
+	log_filename = xxstrdup(filename);
+	checkpoint_filename = string_format("%s%s", filename, MAKEFLOW_LOG_CHECKPOINT_SUFFIX);
+
 	d->logfile = fopen(filename, "r");
 	if(d->logfile) {
 		int linenum = 0;
+		uint64_t offset = 0;
 		first_run = 0;
 
-		printf("recovering from log file %s...\n",filename);
+		int recovered = makeflow_log_recover_checkpoint(d, d->logfile, &offset);
+		if(recovered < 0)
+			return -1;
+
+		if(recovered) {
+			printf("recovering from checkpoint %s and log file %s...\n", checkpoint_filename, filename);
+			if(fseeko(d->logfile, offset, SEEK_SET) < 0) {
+				fprintf(stderr, "makeflow: couldn't seek in %s: %s\n", filename, strerror(errno));
+				exit(1);
+			}
+		} else {
+			printf("recovering from log file %s...\n",filename);
+		}
 
 		while((line = get_line(d->logfile))) {
 			char source[PATH_MAX], cache_dir[NAME_MAX], cache_name[NAME_MAX];
@@ -237,45 +581,27 @@ int makeflow_log_recover(struct dag *d, const char *filename, int verbose_mode,
 				f->state = file_state;
 				if(file_state == DAG_FILE_STATE_EXISTS){
 					d->completed_files += 1;
+					logged_completed_files += 1;
 					f->creation_logged = (time_t) (previous_completion_time / 1000000);
 				} else if(file_state == DAG_FILE_STATE_DELETE){
 					d->deleted_files += 1;
+					logged_deleted_files += 1;
 				}
 				free(line);
 				continue;
 			}
 			if(sscanf(line, "# CACHE %" SCNu64 " %s", &previous_completion_time, cache_dir) == 2) {
-				/* if the user specifies a cache dir using --cache dir, ignore the info from the log file */
-				if(!d->cache_dir) {
-					d->cache_dir = xxstrdup(cache_dir);
-				} else {
-					/* There are two possible reasons for the inconsistency:
-					 * 1) the cache dir specified via the --cache opt and in the log file mismatch;
-					 * 2) the log file includes multiple different CACHE entries.
-					 */
-					if(strcmp(cache_dir, d->cache_dir)) {
-						fprintf(stderr, "The --cache option (%s) does not match the cache dir (%s) in the log file!\n", d->cache_dir, cache_dir);
-						free(line);
-						return -1;
-					}
+				if(makeflow_log_recover_cache(d, cache_dir)) {
+					free(line);
+					return -1;
 				}
 				free(line);
 				continue;
 			}
 			if(sscanf(line, "# MOUNT %" SCNu64 " %s %s %s %d", &previous_completion_time, file, source, cache_name, &type) == 5) {
-				f = dag_file_lookup_or_create(d, file);
-
-				if(!f->source) {
-					f->source = xxstrdup(source);
-					f->cache_name = xxstrdup(cache_name);
-					f->type = type;
-				} else {
-					/* If a mount entry is specified in the mountfile and logged in a log file at the same time, they must not conflict with each other. */
-					/* If a mount entry is logged in a log file multiple times deliberately or not, they must not conflict with each other. */
-					if(makeflow_mount_check_consistency(file, f->source, source, d->cache_dir, cache_name)) {
-						free(line);
-						return -1;
-					}
+				if(makeflow_log_recover_mount(d, file, source, cache_name, type)) {
+					free(line);
+					return -1;
 				}
 				free(line);
 				continue;
@@ -296,7 +622,10 @@ int makeflow_log_recover(struct dag *d, const char *filename, int verbose_mode,
 				}
 			}
 
-			fprintf(stderr, "makeflow: %s appears to be corrupted on line %d\n", filename, linenum);
+			if(recovered)
+				fprintf(stderr, "makeflow: %s appears to be corrupted on line %d after its checkpoint\n", filename, linenum);
+			else
+				fprintf(stderr, "makeflow: %s appears to be corrupted on line %d\n", filename, linenum);
 			free(line);
 			exit(1);
 		}
@@ -17,8 +17,14 @@ Each dag is associated with a log file that records each operation that
 moves the workload forward.  As a node changes state, an event is written
 to the log.  Upon recovery from a crash, makeflow_log_recover plays back
 the state to recover the dag.
+
+Every so often, and when the workflow ends, the state recovered so far is
+also written to a checkpoint next to the log, so that recovery only plays
+back the events logged after it.
 */
 
+#define MAKEFLOW_LOG_CHECKPOINT_SUFFIX ".checkpoint"
+
 void makeflow_log_started_event( struct dag *d );
 void makeflow_log_aborted_event( struct dag *d );
 void makeflow_log_failed_event( struct dag *d );
@@ -42,6 +42,7 @@ See the file COPYING for details.
 #include "jx_pretty_print.h"
 
 #include "dag.h"
+#include "dag_cache.h"
 #include "dag_visitors.h"
 #include "parser.h"
 
@@ -71,13 +72,15 @@ enum { LONG_OPT_PPM_ROW,
 	   LONG_OPT_DOT_NODE,
 	   LONG_OPT_DOT_EDGE,
 	   LONG_OPT_DOT_TASK,
-	   LONG_OPT_DOT_FILE
+	   LONG_OPT_DOT_FILE,
+	   LONG_OPT_DAG_CACHE
 };
 
 static void show_help_viz(const char *cmd)
 {
 	fprintf(stdout, "Use: %s [options] <dagfile>\n", cmd);
 	fprintf(stdout, " %-30s Show this help screen.\n", "-h,--help");
+	fprintf(stdout, " %-30s Load the parsed makeflow from this cache, updated when the makeflow changes.\n", "--dag-cache[=<file>]");
 	fprintf(stdout, " %-30s Translate the makeflow to the desired visualization format:\n", "-D,--display=<format>");
 	fprintf(stdout, " %-30s Where <format> is:\n", "");
 	fprintf(stdout, " %-35s dot      DOT file format for precise graph drawing.\n", "");
@@ -113,6 +116,8 @@ int main(int argc, char *argv[])
 
 	cctools_version_debug(D_MAKEFLOW_RUN, argv[0]);
 	const char *dagfile;
+	int use_dag_cache = 0;
+	char *dag_cache_name = NULL;
 
 	int condense_display = 0;
 	int change_size = 0;
@@ -128,6 +133,7 @@ int main(int argc, char *argv[])
 	char *ppm_option = NULL;
 
 	static const struct option long_options_viz[] = {
+		{"dag-cache", optional_argument, 0, LONG_OPT_DAG_CACHE},
 		{"display-mode", required_argument, 0, 'D'},
 		{"help", no_argument, 0, 'h'},
 		{"dot-merge-similar", no_argument, 0,  LONG_OPT_DOT_CONDENSE},
@@ -229,6 +235,11 @@ int main(int argc, char *argv[])
 			case 'h':
 				show_help_viz(argv[0]);
 				return 0;
+			case LONG_OPT_DAG_CACHE:
+				use_dag_cache = 1;
+				if(optarg)
+					dag_cache_name = xxstrdup(optarg);
+				break;
 			case 'v':
 				cctools_version_print(stdout, argv[0]);
 				return 0;
@@ -251,7 +262,14 @@ int main(int argc, char *argv[])
 		dagfile = argv[optind];
 	}
 
-	struct dag *d = dag_from_file(dagfile);
+	struct dag *d;
+	if(use_dag_cache) {
+		if(!dag_cache_name)
+			dag_cache_name = dag_cache_default_name(dagfile);
+		d = dag_from_file_cached(dagfile, dag_cache_name);
+	} else {
+		d = dag_from_file(dagfile);
+	}
 	if(!d) {
 		fatal("makeflow_viz: couldn't load %s: %s\n", dagfile, strerror(errno));
 	}
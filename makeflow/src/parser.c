@@ -145,7 +145,7 @@ void dag_close_over_environment(struct dag *d)
 		v = dag_variable_get_value(name, d->default_category->mf_variables, d->nodeid_counter);
 		if(!v)
 		{
-			char *value_env = getenv(name);
+			char *value_env = dag_variable_getenv(name);
 			if(value_env)
 			{
 				dag_variable_add_value(name, d->default_category->mf_variables, 0, value_env);
@@ -160,7 +160,7 @@ void dag_close_over_environment(struct dag *d)
 		v = dag_variable_get_value(name, d->default_category->mf_variables, d->nodeid_counter);
 		if(!v)
 		{
-			char *value_env = getenv(name);
+			char *value_env = dag_variable_getenv(name);
 			if(value_env)
 			{
 				dag_variable_add_value(name, d->default_category->mf_variables, 0, value_env);
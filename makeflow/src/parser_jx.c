@@ -21,6 +21,18 @@ See the file COPYING for details.
 #include "jx_match.h"
 #include "jx_print.h"
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Rules are handed to the evaluating threads in batches of this size. */
+#define RULE_BATCH_SIZE 64
+
+/* Fewer rules than this are evaluated by the calling thread alone. */
+#define RULE_PARALLEL_MIN 256
+
+#define RULE_THREADS_MAX 16
+
 static int environment_from_jx(struct dag *d, struct dag_node *n, struct hash_table *h, struct jx *env) {
 	int nodeid;
 
@@ -386,3 +398,275 @@ struct dag *dag_from_jx(struct jx *j) {
 	return d;
 }
 
+/*
+The rules of a JX workflow are usually written as a few templates, expanded
+with foreach over long arrays, and evaluating them takes most of the time to
+load the workflow. The rules expression is unrolled into a list of templates,
+each with the context in which it is evaluated: the items of an array, the
+body of a foreach once for each item of its array, and both operands of a +.
+Any other expression is evaluated at once, and its items are taken as rules
+already evaluated. The templates are then evaluated by several threads, and
+the results put back in order, so that the rules are the same as those of
+jx_eval. The one difference is that an error in any rule is returned for the
+whole workflow, where jx_eval leaves the errors of a foreach in its array.
+*/
+
+struct rule_template {
+	struct jx *expression;      /* Part of the workflow, or NULL if already evaluated. */
+	struct jx *context;
+	const char *symbol;         /* Bound to item in the context, for the body of a foreach. */
+	struct jx *item;
+	struct jx *result;
+};
+
+struct rule_templates {
+	struct rule_template *rules;
+	int count;
+	int size;
+	int next;                   /* Next rule to hand to a thread. */
+	pthread_mutex_t mutex;
+};
+
+static void rule_templates_add(struct rule_templates *t, struct jx *expression, struct jx *context, const char *symbol, struct jx *item, struct jx *result)
+{
+	if(t->count == t->size) {
+		t->size = t->size ? 2 * t->size : 1024;
+		t->rules = xxrealloc(t->rules, t->size * sizeof(*t->rules));
+	}
+
+	struct rule_template *r = &t->rules[t->count++];
+	r->expression = expression;
+	r->context = context;
+	r->symbol = symbol;
+	r->item = item;
+	r->result = result;
+}
+
+static void rule_templates_clear(struct rule_templates *t)
+{
+	int i;
+	for(i = 0; i < t->count; i++) {
+		jx_delete(t->rules[i].item);
+		jx_delete(t->rules[i].result);
+	}
+	free(t->rules);
+	t->rules = NULL;
+	t->count = t->size = 0;
+}
+
+static int rule_templates_unroll_foreach(struct rule_templates *t, struct jx *e, struct jx *context)
+{
+	struct jx *symbol = jx_array_index(e->u.func.arguments, 0);
+	struct jx *body = jx_array_index(e->u.func.arguments, 2);
+
+	struct jx *array = jx_eval(jx_array_index(e->u.func.arguments, 1), context);
+	if(!jx_istype(array, JX_ARRAY)) {
+		jx_delete(array);
+		return 0;
+	}
+
+	/* the local context of each item is made only when its rule is
+	 * evaluated, so that they are not all held at once. */
+	struct jx_item *item;
+	for(item = array->u.items; item; item = item->next) {
+		rule_templates_add(t, body, context, symbol->u.symbol_name, item->value, NULL);
+		item->value = NULL;
+	}
+
+	jx_delete(array);
+	return 1;
+}
+
+/* Returns false if e does not evaluate to an array, in which case the rules
+ * must be evaluated as a whole to get the same error as jx_eval. */
+static int rule_templates_unroll(struct rule_templates *t, struct jx *e, struct jx *context)
+{
+	struct jx_item *item;
+
+	switch(e->type) {
+		case JX_ARRAY:
+			for(item = e->u.items; item; item = item->next)
+				rule_templates_add(t, item->value, context, NULL, NULL, NULL);
+			return 1;
+		case JX_OPERATOR:
+			if(e->u.oper.type == JX_OP_ADD && e->u.oper.left && e->u.oper.right)
+				return rule_templates_unroll(t, e->u.oper.left, context)
+					&& rule_templates_unroll(t, e->u.oper.right, context);
+			break;
+		case JX_FUNCTION:
+			if(e->u.func.function == JX_FUNCTION_FOREACH
+					&& jx_array_length(e->u.func.arguments) == 3
+					&& jx_istype(jx_array_index(e->u.func.arguments, 0), JX_SYMBOL))
+				return rule_templates_unroll_foreach(t, e, context);
+			break;
+		default:
+			break;
+	}
+
+	struct jx *rules = jx_eval(e, context);
+	if(!jx_istype(rules, JX_ARRAY)) {
+		jx_delete(rules);
+		return 0;
+	}
+
+	for(item = rules->u.items; item; item = item->next) {
+		rule_templates_add(t, NULL, NULL, NULL, NULL, item->value);
+		item->value = NULL;
+	}
+
+	jx_delete(rules);
+	return 1;
+}
+
+static void *rule_templates_eval(void *arg)
+{
+	struct rule_templates *t = arg;
+
+	while(1) {
+		pthread_mutex_lock(&t->mutex);
+		int first = t->next;
+		t->next += RULE_BATCH_SIZE;
+		pthread_mutex_unlock(&t->mutex);
+
+		if(first >= t->count)
+			break;
+
+		int last = first + RULE_BATCH_SIZE;
+		if(last > t->count)
+			last = t->count;
+
+		int i;
+		for(i = first; i < last; i++) {
+			struct rule_template *r = &t->rules[i];
+			if(!r->expression)
+				continue;
+
+			if(!r->symbol) {
+				r->result = jx_eval(r->expression, r->context);
+				continue;
+			}
+
+			struct jx *local_context = r->context ? jx_copy(r->context) : jx_object(NULL);
+			jx_insert(local_context, jx_string(r->symbol), r->item);
+			r->item = NULL;
+			r->result = jx_eval(r->expression, local_context);
+			jx_delete(local_context);
+		}
+	}
+
+	return NULL;
+}
+
+static int rule_templates_threads(int count, int nthreads)
+{
+	if(count < RULE_PARALLEL_MIN)
+		return 1;
+
+	if(nthreads < 1)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads < 1)
+		return 1;
+
+	return nthreads > RULE_THREADS_MAX ? RULE_THREADS_MAX : nthreads;
+}
+
+/* Evaluates the unrolled rules, and returns them as an array, or the first
+ * error found among them. */
+static struct jx *rule_templates_collect(struct rule_templates *t, int nthreads)
+{
+	nthreads = rule_templates_threads(t->count, nthreads);
+	pthread_t threads[RULE_THREADS_MAX];
+	int started = 0;
+	int i;
+
+	debug(D_MAKEFLOW_PARSER, "Evaluating %d rules with %d thread(s)", t->count, nthreads);
+
+	t->next = 0;
+	pthread_mutex_init(&t->mutex, NULL);
+
+	/* the calling thread is one of the threads evaluating rules, and any
+	 * thread that cannot be started leaves more of the work to it. */
+	for(i = 1; i < nthreads; i++) {
+		if(pthread_create(&threads[started], NULL, rule_templates_eval, t) == 0)
+			started++;
+	}
+	rule_templates_eval(t);
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&t->mutex);
+
+	struct jx *rules = jx_array(NULL);
+	struct jx_item **tail = &rules->u.items;
+	struct jx *error = NULL;
+
+	for(i = 0; i < t->count; i++) {
+		struct rule_template *r = &t->rules[i];
+		if(!error && jx_istype(r->result, JX_ERROR))
+			error = jx_copy(r->result);
+
+		*tail = jx_item(r->result, NULL);
+		tail = &(*tail)->next;
+		r->result = NULL;
+	}
+
+	if(error) {
+		jx_delete(rules);
+		return error;
+	}
+
+	return rules;
+}
+
+struct jx *dag_jx_eval(struct jx *j, struct jx *context, int nthreads)
+{
+	if(!jx_istype(j, JX_OBJECT) || (context && !jx_istype(context, JX_OBJECT)))
+		return jx_eval(j, context);
+
+	/* the workflow without its rules, which are evaluated apart. */
+	struct jx *rest = jx_object(NULL);
+	struct jx_pair **tail = &rest->u.pairs;
+	struct jx *rules = NULL;
+	struct jx_pair *p;
+
+	for(p = j->u.pairs; p; p = p->next) {
+		if(!rules && jx_istype(p->key, JX_STRING) && !strcmp(p->key->u.string_value, "rules")) {
+			rules = p->value;
+			continue;
+		}
+		*tail = jx_pair(jx_copy(p->key), jx_copy(p->value), NULL);
+		tail = &(*tail)->next;
+	}
+
+	if(!rules) {
+		jx_delete(rest);
+		return jx_eval(j, context);
+	}
+
+	struct jx *result = jx_eval(rest, context);
+	jx_delete(rest);
+
+	if(!jx_istype(result, JX_OBJECT))
+		return result;
+
+	struct rule_templates t;
+	memset(&t, 0, sizeof(t));
+
+	struct jx *evaluated;
+	if(rule_templates_unroll(&t, rules, context)) {
+		evaluated = rule_templates_collect(&t, nthreads);
+	} else {
+		evaluated = jx_eval(rules, context);
+	}
+	rule_templates_clear(&t);
+
+	if(jx_istype(evaluated, JX_ERROR)) {
+		jx_delete(result);
+		return evaluated;
+	}
+
+	jx_insert(result, jx_string("rules"), evaluated);
+	return result;
+}
+
+/* vim: set noexpandtab tabstop=4: */
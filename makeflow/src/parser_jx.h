@@ -11,5 +11,9 @@ See the file COPYING for details.
 
 struct dag *dag_from_jx(struct jx *);
 
+/* Evaluates the JX workflow j in context, as jx_eval does, but with the
+ * rules evaluated by nthreads threads, or by one per core if zero. */
+struct jx *dag_jx_eval(struct jx *j, struct jx *context, int nthreads);
+
 #endif
 
@@ -0,0 +1,67 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+test_dir=`basename $0 .sh`.dir
+
+# A chain of three rules, defined before three independent ones, run one job
+# at a time, so that the order of submission is the order of the schedule.
+prepare()
+{
+	mkdir $test_dir
+	cd $test_dir
+	ln -sf ../../src/makeflow .
+
+	cat > chain.makeflow << EOF
+a1:
+	echo a1 > a1
+
+a2: a1
+	cat a1 > a2
+
+a3: a2
+	cat a2 > a3
+
+x:
+	echo x > x
+
+y:
+	echo y > y
+
+z:
+	echo z > z
+EOF
+
+	exit 0
+}
+
+run()
+{
+	cd $test_dir
+	./makeflow -J 1 --schedule=critical-path -d batch -o chain.debug chain.makeflow || exit 1
+
+	[ "`cat a3`" = a1 ] || exit 1
+
+	echo "checking that the head of the chain ran first"
+	order=`grep -v "^#" chain.makeflow.makeflowlog | awk '$3 == 1 { printf "%s ", $2 }'`
+	echo "order: $order"
+	case "$order" in
+		"0 1 "*) ;;
+		*) exit 1 ;;
+	esac
+
+	echo "checking that the critical path was given as the priority"
+	grep -q "set option \`task-priority' to \`3.000'" chain.debug || exit 1
+
+	exit 0
+}
+
+clean()
+{
+	rm -fr $test_dir
+	exit 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
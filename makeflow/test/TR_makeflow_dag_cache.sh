@@ -0,0 +1,92 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+test_dir=`basename $0 .sh`.dir
+
+# Rules with categories, node variables, remote names, and a value from the
+# environment, shown from the makeflow and from its cache.
+prepare()
+{
+	mkdir $test_dir
+	cd $test_dir
+	ln -sf ../../src/makeflow .
+	ln -sf ../../src/makeflow_viz .
+	ln -sf ../../src/makeflow_analyze .
+
+	echo input > input
+
+	cat > cache.makeflow << EOF
+CATEGORY=first
+CORES=1
+
+a: input
+	cat input > a; echo \$(GREETING) >> a
+
+CATEGORY=second
+MEMORY=100
+
+b->b.remote: a->a.remote
+@SUFFIX=second
+	cat a.remote > b.remote; echo \$(SUFFIX) >> b.remote
+
+c: a b
+	LOCAL cat a b > c
+EOF
+
+	exit 0
+}
+
+show()
+{
+	./makeflow_viz -D json cache.makeflow > plain.json || exit 1
+	./makeflow_viz -D json --dag-cache cache.makeflow > cached.json || exit 1
+	cmp plain.json cached.json || exit 1
+}
+
+run()
+{
+	cd $test_dir
+	export GREETING=hello
+
+	echo "writing the cache"
+	show
+	[ -f cache.makeflow.dagcache ] || exit 1
+
+	echo "loading the cache"
+	show
+	./makeflow_analyze --dag-cache -d makeflow_parser -k cache.makeflow 2>&1 | grep -q "loaded cache.makeflow from the dag cache" || exit 1
+	grep -q "echo hello" cached.json || exit 1
+
+	echo "checking that a change of the environment is seen"
+	GREETING=bye
+	show
+	grep -q "echo bye" cached.json || exit 1
+
+	echo "checking that a change of the makeflow is seen"
+	echo "d: c" >> cache.makeflow
+	echo "	cat c > d" >> cache.makeflow
+	show
+	grep -q "cat c > d" cached.json || exit 1
+
+	echo "running from the cache"
+	sed -e 's/->[a-z.]*//g' -e 's/\.remote//g' cache.makeflow > run.makeflow
+	./makeflow --dag-cache=run.dagcache run.makeflow || exit 1
+	[ -f run.dagcache ] || exit 1
+	[ "`cat d`" = "`printf 'input\nbye\ninput\nbye\nsecond\n'`" ] || exit 1
+
+	./makeflow --dag-cache=run.dagcache -c run.makeflow || exit 1
+	[ ! -f run.dagcache ] || exit 1
+
+	exit 0
+}
+
+clean()
+{
+	rm -fr $test_dir
+	exit 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,65 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+test_dir=`basename $0 .sh`.dir
+
+# Enough rules from a foreach, joined to a literal one, to be evaluated by
+# several threads, which should give the same workflow as a single thread.
+prepare()
+{
+	mkdir $test_dir
+	cd $test_dir
+	ln -sf ../../src/makeflow .
+
+	cat > rules.jx << EOF
+{
+	"categories": { "small": { "resources": { "cores": 1 } } },
+	"rules": [
+		{ "command": "echo start > start", "outputs": [ { "path": "start" } ] }
+	] + foreach(i, range(n), {
+		"command": "cat start > out." + str(i) + "; echo " + str(i * 2) + " >> out." + str(i),
+		"inputs": [ { "path": "start" } ],
+		"outputs": [ { "path": "out." + str(i) } ],
+		"category": "small"
+	})
+}
+EOF
+
+	echo '{ "n": 300 }' > context.jx
+
+	exit 0
+}
+
+run()
+{
+	cd $test_dir
+
+	for threads in 1 4
+	do
+		echo "evaluating with $threads thread(s)"
+		./makeflow --jx --jx-context context.jx --jx-threads $threads -T dryrun -d makeflow_parser -o threads.$threads.debug rules.jx || exit 1
+		grep -q "Evaluating 301 rules with $threads thread(s)" threads.$threads.debug || exit 1
+		mv rules.jx.sh threads.$threads.sh || exit 1
+		./makeflow --jx --jx-context context.jx -c rules.jx > /dev/null
+	done
+
+	# the order of the checks for files follows their addresses, so only
+	# the lines of the scripts are compared.
+	grep -q "echo 598 >> out.299" threads.4.sh || exit 1
+	sort threads.1.sh > threads.1.sorted
+	sort threads.4.sh > threads.4.sorted
+	cmp threads.1.sorted threads.4.sorted || exit 1
+
+	exit 0
+}
+
+clean()
+{
+	rm -fr $test_dir
+	exit 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
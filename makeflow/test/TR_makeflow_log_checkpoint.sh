@@ -0,0 +1,81 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+test_dir=`basename $0 .sh`.dir
+
+# A workflow that fails once, recovered from the checkpoint of its log, then
+# from its compacted log, and from a log whose checkpoint does not match.
+prepare()
+{
+	mkdir $test_dir
+	cd $test_dir
+	ln -sf ../../src/makeflow .
+	ln -sf ../../src/makeflow_compact_log .
+
+	cat > checkpoint.makeflow << EOF
+a:
+	echo a > a
+
+b: a
+	test -f go && cat a > b
+
+c: a b
+	cat a b > c
+EOF
+
+	exit 0
+}
+
+rerun_nothing()
+{
+	./makeflow checkpoint.makeflow > output || exit 1
+	grep -q "nothing left to do" output || exit 1
+}
+
+run()
+{
+	cd $test_dir
+
+	echo "failing the first run"
+	./makeflow checkpoint.makeflow && exit 1
+	grep -q "^END$" checkpoint.makeflow.makeflowlog.checkpoint || exit 1
+
+	echo "recovering from the checkpoint"
+	touch go
+	./makeflow checkpoint.makeflow > output || exit 1
+	grep -q "recovering from checkpoint" output || exit 1
+	[ "`cat c`" = "`printf 'a\na\n'`" ] || exit 1
+	rerun_nothing
+
+	echo "compacting the log"
+	before=`wc -l < checkpoint.makeflow.makeflowlog`
+	./makeflow_compact_log checkpoint.makeflow.makeflowlog || exit 1
+	after=`wc -l < checkpoint.makeflow.makeflowlog`
+	[ $after -lt $before ] || exit 1
+	[ ! -f checkpoint.makeflow.makeflowlog.checkpoint ] || exit 1
+	rerun_nothing
+	grep -q "recovering from log file" output || exit 1
+
+	echo "ignoring a checkpoint that does not match"
+	rerun_nothing
+	sed -e 's/^OFFSET \([0-9]*\) .*/OFFSET \1 0000/' checkpoint.makeflow.makeflowlog.checkpoint > bad.checkpoint
+	mv bad.checkpoint checkpoint.makeflow.makeflowlog.checkpoint
+	rerun_nothing
+	grep -q "recovering from log file" output || exit 1
+
+	./makeflow -c checkpoint.makeflow || exit 1
+	[ ! -f checkpoint.makeflow.makeflowlog.checkpoint ] || exit 1
+
+	exit 0
+}
+
+clean()
+{
+	rm -fr $test_dir
+	exit 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,73 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+test_dir=`basename $0 .sh`.dir
+
+# A diamond, a fan out, and a rule that fails once, run two jobs at a time,
+# so that rules become ready as others complete, and wait for room to run.
+prepare()
+{
+	mkdir $test_dir
+	cd $test_dir
+	ln -sf ../../src/makeflow .
+
+	cat > ready.makeflow << EOF
+a:
+	echo a > a
+
+b: a
+	cat a > b; echo b >> b
+
+c: a
+	cat a > c; echo c >> c
+
+d: b c
+	cat b c > d
+
+e1: d
+	cat d > e1
+
+e2: d
+	cat d > e2
+
+e3: d
+	cat d > e3
+
+e4: d
+	cat d > e4
+
+retry: d
+	if [ -f retry.once ]; then cat d > retry; else touch retry.once; exit 1; fi
+
+all: e1 e2 e3 e4 retry
+	cat e1 e2 e3 e4 retry > all
+EOF
+
+	exit 0
+}
+
+run()
+{
+	cd $test_dir
+	./makeflow -J 2 -r 1 ready.makeflow || exit 1
+
+	[ "`cat d`" = "`printf 'a\nb\na\nc\n'`" ] || exit 1
+	[ `wc -l < all` = 20 ] || exit 1
+
+	echo "checking that each rule completed once"
+	completed=`grep -v "^#" ready.makeflow.makeflowlog | awk '$3 == 2' | wc -l`
+	[ $completed = 10 ] || exit 1
+
+	exit 0
+}
+
+clean()
+{
+	rm -fr $test_dir
+	exit 0
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
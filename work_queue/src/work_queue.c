@@ -13,7 +13,9 @@ The following major problems must be fixed:
 #include "work_queue.h"
 #include "work_queue_protocol.h"
 #include "work_queue_internal.h"
+#include "work_queue_compress.h"
 #include "work_queue_resources.h"
+#include "work_queue_transactions.h"
 
 #include "cctools.h"
 #include "int_sizes.h"
@@ -28,7 +30,9 @@ The following major problems must be fixed:
 #include "interfaces_address.h"
 #include "itable.h"
 #include "list.h"
+#include "priority_queue.h"
 #include "macros.h"
+#include "set.h"
 #include "username.h"
 #include "create_dir.h"
 #include "xxmalloc.h"
@@ -52,12 +56,14 @@ The following major problems must be fixed:
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -90,8 +96,22 @@ extern int setenv(const char *name, const char *value, int overwrite);
 
 #define MAX_TASK_STDOUT_STORAGE (1*GIGABYTE)
 
+// Maximum size of the compressed copies of input files kept to be sent again.
+#define MAX_COMPRESSED_COPIES_STORAGE (1*GIGABYTE)
+
+// Maximum number of input files compressed at the same time, each by a thread of its own.
+#define MAX_COMPRESSING 4
+
 #define MAX_NEW_WORKERS 10
 
+// Number of buckets in the index of workers by free cores. Bucket 0 holds
+// workers without free cores, and bucket b > 0 holds workers with free cores
+// in [2^(b-1), 2^b).
+#define WORKER_INDEX_BUCKETS 32
+
+// Maximum number of (task, worker) pairs considered by one call to prefetch_inputs.
+#define PREFETCH_MAX_CHECKS 1000
+
 // Result codes for signaling the completion of operations in WQ
 typedef enum {
 	SUCCESS = 0,
@@ -112,6 +132,10 @@ typedef enum {
 	MON_FULL     = 2    /* generate summary, series and monitoring debug output. */
 } work_queue_monitoring_mode;
 
+// Logs are written when this many bytes or this many microseconds have accumulated.
+#define LOG_BUFFER_MAX (64*1024)
+#define LOG_FLUSH_INTERVAL 1000000
+
 // Threshold for available disk space (MB) beyond which files are not received from worker.
 static uint64_t disk_avail_threshold = 100;
 
@@ -131,20 +155,56 @@ struct work_queue {
 	char workingdir[PATH_MAX];
 
 	struct link      *master_link;   // incoming tcp connection for workers.
-	struct link_info *poll_table;
+	struct link_poller *poller;         // master link, foreman uplink, and worker links.
+	struct link *poller_uplink;         // foreman uplink registered with the poller.
+	int master_link_active;             // master link was ready on the last poll.
+	struct link_info *poll_table;       // links ready, as returned by link_poller_wait.
 	int poll_table_size;
 
 	struct itable *tasks;           // taskid -> task
 	struct itable *task_state_map;  // taskid -> state
-	struct list   *ready_list;      // ready to be sent to a worker
+	struct priority_queue *ready_list; // ready to be sent to a worker, by priority
+
+	struct work_queue_submission *submissions; // tasks submitted from other threads, most recent first.
+	int submissions_pending;                   // number of the above, updated atomically.
+	int submit_pipe[2];                        // written by submitting threads to wake up the master.
+	struct link *submit_link;                  // read end of submit_pipe, registered with the poller.
+	int submit_link_active;                    // submit link was ready on the last poll.
+
+	int completion_queue_enabled;              // completed tasks go to completed_tasks instead of work_queue_wait.
+	struct list *completed_tasks;
+	pthread_mutex_t completed_mutex;
+	pthread_cond_t completed_cond;
 
 	struct hash_table *worker_table;
 	struct hash_table *worker_blacklist;
+	struct work_queue_worker *worker_index[WORKER_INDEX_BUCKETS]; // lists of workers bucketed by free cores.
 	struct itable  *worker_task_map;
+	struct hash_table *file_worker_table;    // cached_name -> set of workers that have the file cached.
 
 	struct hash_table *categories;
 
 	struct hash_table *workers_with_available_results;
+	struct hash_table *workers_with_outbound;       // workers with transfers queued in w->outbound.
+	struct hash_table *workers_with_task_batch;     // workers with tasks waiting in w->task_batch.
+	int task_batch_max;                            // tasks sent to a worker in one tasks message; 1 disables.
+	int64_t async_transfer_min_size;               // files at least this large are sent from the main loop; negative disables.
+	int peer_transfer_fanout;                      // max transfers a worker serves to its peers at once; 0 disables.
+	int64_t peer_transfer_min_size;                // smaller files are always sent by the master.
+	struct hash_table *local_digests;              // local path -> work_queue_local_digest of its contents.
+	struct hash_table *compressed_copies;          // local path, offset, and length -> work_queue_compressed_copy.
+	int64_t compressed_copies_size;                // bytes of the compressed copies kept.
+	struct list *compressing;                      // work_queue_compressed_copy's whose threads have not been joined.
+	int64_t content_digest_min_size;               // smaller files are always put; negative disables digests.
+	int prefetch_depth;                            // ready tasks whose inputs a busy worker may receive in advance; 0 disables.
+	struct itable *prefetch_tasks;                 // taskid -> work_queue_prefetch of the worker that received its inputs.
+	int io_threads;                                // I/O threads the worker links are split among; 0 serves them from the main loop.
+	struct work_queue_io_shard *io_shards;         // one per I/O thread.
+	int io_next_shard;                             // shard of the next worker to connect.
+	int io_pipe[2];                                // written by the I/O threads when they hand workers to the master.
+	struct link *io_link;                          // read end of io_pipe, registered with the poller.
+	struct hash_table *io_claimed;                 // workers the master took from their I/O threads, to give back.
+	struct list *io_pending;                       // workers taken with data left in their link buffers.
 
 	struct work_queue_stats *stats;
 	struct work_queue_stats *stats_measure;
@@ -178,6 +238,11 @@ struct work_queue {
 
 	FILE *logfile;
 	FILE *transactions_logfile;
+	int transactions_binary;                // transactions log in the format of work_queue_transactions.h.
+	buffer_t log_buffer;                    // lines of the logs not yet written, see flush_logs.
+	buffer_t transactions_buffer;
+	timestamp_t time_last_log_flush;
+	timestamp_t time_last_transaction;      // binary records store the time since the previous one.
 	int keepalive_interval;
 	int keepalive_timeout;
 	timestamp_t link_poll_end;	//tracks when we poll link; used to timeout unacknowledged keepalive checks
@@ -199,6 +264,31 @@ struct work_queue {
 	double bandwidth;
 };
 
+/* A task submitted with work_queue_submit_threadsafe, not yet seen by the master. */
+struct work_queue_submission {
+	struct work_queue_task *task;
+	struct work_queue_submission *next;
+};
+
+/* Who may use the link of a worker when there are I/O threads. */
+typedef enum {
+	WORKER_IO_SHARD = 0,      // the I/O thread waits on the link, and sends w->outbound.
+	WORKER_IO_READY,          // the link has data for the master, and the worker waits in shard->ready.
+	WORKER_IO_DISPATCHER      // the master uses the link and w->outbound until it gives the worker back.
+} worker_io_state_t;
+
+/* An I/O thread, and the workers whose links it waits on. */
+struct work_queue_io_shard {
+	struct work_queue *q;
+	pthread_t thread;
+	pthread_mutex_t mutex;         // protects all below, and the io fields of the workers of the shard.
+	struct link_poller *poller;    // links of the workers in WORKER_IO_SHARD.
+	struct itable *workers;        // link fd -> worker, for all the workers of the shard.
+	struct list *ready;            // workers handed to the master, in WORKER_IO_READY.
+	int wake[2];                   // written to interrupt the wait of the thread.
+	int stop;
+};
+
 struct work_queue_worker {
 	char *hostname;
 	char *os;
@@ -207,6 +297,7 @@ struct work_queue_worker {
 	char addrport[WORKER_ADDRPORT_MAX];
 	char hashkey[WORKER_HASHKEY_MAX];
 	int  foreman;                             // 0 if regular worker, 1 if foreman
+	int  protocol;                            // protocol version reported by the worker.
 	struct work_queue_stats     *stats;
 	struct work_queue_resources *resources;
 
@@ -216,6 +307,28 @@ struct work_queue_worker {
 	struct link *link;
 	struct itable *current_tasks;
 	struct itable *current_tasks_boxes;
+	struct list *outbound;                    // queued work_queue_transfer's, in protocol order.
+	struct list *outbound_sent;               // transactions of the transfers sent, for the dispatcher to write.
+	buffer_t *task_batch;                     // descriptions of tasks not yet sent, for a tasks message.
+	int task_batch_count;
+	char peer_addr[LINK_ADDRESS_MAX];         // address where the worker serves cached files to its peers.
+	int peer_port;                            // 0 if the worker does not serve cached files.
+	int peer_serving;                         // peer transfers this worker is currently the source of.
+	struct hash_table *peer_pending;          // cached_name -> work_queue_peer_transfer fetching it.
+	int content_cache;                        // 1 if the worker keeps input files by the digest of their contents.
+	struct hash_table *content_digests;       // digests of the files in the content cache of the worker.
+	int numa_nodes;                           // NUMA nodes of the cores where the worker pins tasks, 0 if it does not.
+	int *numa_node_cores;                     // cores of each of those nodes.
+	struct itable *numa_task_nodes;           // taskid -> 1 + NUMA node suggested for the task.
+	int prefetch_count;                       // ready tasks whose inputs were prefetched to this worker.
+	int64_t cached_bytes;                     // bytes of the files in current_files.
+	struct work_queue_io_shard *io_shard;     // I/O thread of the worker, NULL without I/O threads.
+	worker_io_state_t io_state;
+	int io_failed;                            // errno of the I/O thread when it could not send w->outbound, or wait on the link, 0 if none.
+	timestamp_t io_transfer_time;             // time the I/O thread spent sending files, not yet in total_transfer_time.
+	int index_bucket;                         // bucket in q->worker_index, -1 if not indexed.
+	struct work_queue_worker *index_prev;
+	struct work_queue_worker *index_next;
 	int finished_tasks;
 	int64_t total_tasks_complete;
 	int64_t total_bytes_transferred;
@@ -252,6 +365,16 @@ static void reap_task_from_worker(struct work_queue *q, struct work_queue_worker
 static int cancel_task_on_worker(struct work_queue *q, struct work_queue_task *t, work_queue_task_state_t new_state);
 static void count_worker_resources(struct work_queue *q, struct work_queue_worker *w);
 
+static void worker_index_update(struct work_queue *q, struct work_queue_worker *w);
+static void worker_index_remove(struct work_queue *q, struct work_queue_worker *w);
+static void worker_index_rebuild(struct work_queue *q);
+
+static void worker_peer_transfer_done(struct work_queue *q, struct work_queue_worker *w, const char *cached_name);
+static work_queue_msg_code_t resend_worker_file(struct work_queue *q, struct work_queue_worker *w, const char *cached_name);
+
+static void prefetch_release(struct work_queue *q, uint64_t taskid);
+static void prefetch_forget_worker(struct work_queue *q, struct work_queue_worker *w);
+
 static void find_max_worker(struct work_queue *q);
 static void update_max_worker(struct work_queue *q, struct work_queue_worker *w);
 
@@ -296,6 +419,8 @@ static void write_transaction_task(struct work_queue *q, struct work_queue_task
 static void write_transaction_category(struct work_queue *q, struct category *c);
 static void write_transaction_worker(struct work_queue *q, struct work_queue_worker *w, int leaving);
 static void write_transaction_worker_resources(struct work_queue *q, struct work_queue_worker *w);
+static char *transfer_transaction(struct work_queue_worker *w, struct work_queue_task *t, const char *direction, const char *name, int64_t length, int64_t wire_length);
+static void write_transaction_transfer(struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *direction, const char *name, int64_t length, int64_t wire_length);
 
 /** Clone a @ref work_queue_file
 This performs a deep copy of the file struct.
@@ -385,6 +510,42 @@ static int workers_with_tasks(struct work_queue *q) {
 	return workers_with_tasks;
 }
 
+static void write_log_buffer(FILE *file, buffer_t *B)
+{
+	size_t length;
+	const char *data = buffer_tolstring(B, &length);
+
+	if(file && length > 0) {
+		if(fwrite(data, length, 1, file) != 1) {
+			debug(D_WQ, "could not write log: %s", strerror(errno));
+		}
+	}
+
+	buffer_rewind(B, 0);
+}
+
+/*
+Lines of the logs are accumulated and written at most once per
+LOG_FLUSH_INTERVAL, or when LOG_BUFFER_MAX bytes are waiting, so that logging
+many transactions costs a few large writes, and readers never see incomplete
+lines. Unless forced, the logs are only written when any of these hold.
+*/
+static void flush_logs(struct work_queue *q, int force)
+{
+	timestamp_t now = timestamp_get();
+
+	if(!force
+		&& buffer_pos(&q->log_buffer) + buffer_pos(&q->transactions_buffer) < LOG_BUFFER_MAX
+		&& now - q->time_last_log_flush < LOG_FLUSH_INTERVAL) {
+		return;
+	}
+
+	write_log_buffer(q->logfile, &q->log_buffer);
+	write_log_buffer(q->transactions_logfile, &q->transactions_buffer);
+
+	q->time_last_log_flush = now;
+}
+
 static void log_queue_stats(struct work_queue *q)
 {
 	struct work_queue_stats s;
@@ -477,7 +638,8 @@ static void log_queue_stats(struct work_queue *q)
 	buffer_printf(&B, " %" PRId64, s.min_memory);
 	buffer_printf(&B, " %" PRId64, s.min_disk);
 
-	fprintf(q->logfile, "%s\n", buffer_tostring(&B));
+	buffer_printf(&q->log_buffer, "%s\n", buffer_tostring(&B));
+	flush_logs(q, 0);
 
 	buffer_free(&B);
 }
@@ -487,6 +649,686 @@ static void link_to_hash_key(struct link *link, char *key)
 	sprintf(key, "0x%p", link);
 }
 
+/* Wait on link with p. Only for the dispatcher, as it logs the failures. */
+static void poller_add(struct link_poller *p, struct link *link, int events)
+{
+	if(!link_poller_add(p, link, events))
+		debug(D_WQ, "could not wait on link %d: %s", link_fd(link), strerror(errno));
+}
+
+/*
+Outbound transfer engine. Large input files are not streamed to a worker
+while the master waits. Instead, the put header and the file are queued in
+w->outbound, and sent with non-blocking writes from poll_active_workers as
+the link becomes writable, so that the master keeps serving other workers.
+Once anything is queued for a worker, everything else sent to it is queued
+behind, so that the worker sees the protocol in order.
+*/
+
+struct work_queue_transfer {
+	char *data;          // message or literal data, or NULL when sending from fd.
+	int fd;              // file sent, or -1.
+	off_t position;      // where fd is read from, or -1 to read it from its current offset.
+	int64_t length;      // bytes left to send.
+	int64_t offset;      // bytes of data already sent.
+	int timeout;         // seconds allowed once the transfer starts.
+	time_t stoptime;     // set when the transfer starts, 0 before.
+	timestamp_t start;
+	char *transaction;   // written to the transactions log once the file is sent, or NULL.
+};
+
+static int worker_outbound_pending(struct work_queue_worker *w)
+{
+	struct work_queue_io_shard *s = w->io_shard;
+
+	// While the I/O thread of the worker has it, w->outbound is changing.
+	if(s && __atomic_load_n(&w->io_state, __ATOMIC_ACQUIRE) != WORKER_IO_DISPATCHER) {
+		pthread_mutex_lock(&s->mutex);
+		int pending = w->outbound && list_size(w->outbound) > 0;
+		pthread_mutex_unlock(&s->mutex);
+		return pending;
+	}
+
+	return w->outbound && list_size(w->outbound) > 0;
+}
+
+static void queue_worker_transfer(struct work_queue *q, struct work_queue_worker *w, struct work_queue_transfer *tr)
+{
+	if(!w->outbound)
+		w->outbound = list_create();
+
+	// With I/O threads, the thread of the worker sends it once the master gives the worker back.
+	if(!worker_outbound_pending(w) && !w->io_shard) {
+		hash_table_insert(q->workers_with_outbound, w->hashkey, w);
+		poller_add(q->poller, w->link, LINK_READ|LINK_WRITE);
+	}
+
+	list_push_tail(w->outbound, tr);
+}
+
+static void queue_worker_data(struct work_queue *q, struct work_queue_worker *w, const char *data, int64_t length, int timeout)
+{
+	struct work_queue_transfer *tr = calloc(1, sizeof(*tr));
+
+	tr->data = xxmalloc(length);
+	memcpy(tr->data, data, length);
+	tr->fd = -1;
+	tr->length = length;
+	tr->timeout = timeout;
+
+	queue_worker_transfer(q, w, tr);
+}
+
+/* Queue length bytes of fd, from position, or from its current offset if
+ * position is -1. The transaction, if any, is written once they are sent. */
+static void queue_worker_file(struct work_queue *q, struct work_queue_worker *w, int fd, off_t position, int64_t length, int timeout, char *transaction)
+{
+	struct work_queue_transfer *tr = calloc(1, sizeof(*tr));
+
+	tr->fd = fd;
+	tr->position = position;
+	tr->length = length;
+	tr->timeout = timeout;
+	tr->transaction = transaction;
+
+	if(transaction && !w->outbound_sent)
+		w->outbound_sent = list_create();
+
+	queue_worker_transfer(q, w, tr);
+}
+
+static void delete_worker_transfer(struct work_queue_transfer *tr)
+{
+	if(tr->fd >= 0)
+		close(tr->fd);
+	free(tr->data);
+	free(tr->transaction);
+	free(tr);
+}
+
+/* Write the transactions of the files sent to w. Only for the dispatcher. */
+static void write_sent_transactions(struct work_queue *q, struct work_queue_worker *w)
+{
+	char *transaction;
+
+	if(!w->outbound_sent)
+		return;
+
+	while((transaction = list_pop_head(w->outbound_sent))) {
+		write_transaction(q, transaction);
+		free(transaction);
+	}
+}
+
+static void clear_worker_outbound(struct work_queue *q, struct work_queue_worker *w)
+{
+	struct work_queue_transfer *tr;
+
+	if(!w->outbound)
+		return;
+
+	while((tr = list_pop_head(w->outbound))) {
+		delete_worker_transfer(tr);
+	}
+
+	hash_table_remove(q->workers_with_outbound, w->hashkey);
+}
+
+/* Send as much of w->outbound as the link takes without blocking, adding the
+ * time spent sending files to *transfer_time. Returns 0 if the worker failed,
+ * or a transfer did not finish in its time, with errno set to ETIMEDOUT. As the
+ * I/O threads call it, it does not log, and neither does outbound_timed_out. */
+static int send_outbound_avail(struct work_queue_worker *w, timestamp_t *transfer_time)
+{
+	struct work_queue_transfer *tr;
+
+	while((tr = list_peek_head(w->outbound))) {
+		if(!tr->stoptime) {
+			tr->stoptime = time(0) + tr->timeout;
+			tr->start = timestamp_get();
+		}
+
+		int64_t actual;
+		if(tr->data) {
+			actual = link_write_avail(w->link, tr->data + tr->offset, tr->length);
+		} else {
+			actual = link_stream_from_fd_avail(w->link, tr->fd, tr->position >= 0 ? &tr->position : NULL, tr->length);
+		}
+
+		if(actual < 0) {
+			if(!errno)
+				errno = EIO;
+			return 0;
+		}
+
+		tr->offset += actual;
+		tr->length -= actual;
+
+		if(tr->length > 0) {
+			if(time(0) > tr->stoptime) {
+				errno = ETIMEDOUT;
+				return 0;
+			}
+			return 1;
+		}
+
+		if(!tr->data) {
+			*transfer_time += timestamp_get() - tr->start;
+		}
+
+		if(tr->transaction) {
+			list_push_tail(w->outbound_sent, tr->transaction);
+			tr->transaction = NULL;
+		}
+
+		list_pop_head(w->outbound);
+		delete_worker_transfer(tr);
+	}
+
+	return 1;
+}
+
+/* True if the transfer being sent to w did not finish in its time. */
+static int outbound_timed_out(struct work_queue_worker *w)
+{
+	struct work_queue_transfer *tr = w->outbound ? list_peek_head(w->outbound) : 0;
+
+	return tr && tr->stoptime && time(0) > tr->stoptime;
+}
+
+/* Log why w->outbound could not be sent, as error from send_outbound_avail. Only for the dispatcher. */
+static void debug_outbound_failure(struct work_queue_worker *w, int error)
+{
+	if(error == ETIMEDOUT) {
+		debug(D_WQ, "Timed out sending queued data to %s (%s)", w->hostname, w->addrport);
+	} else {
+		debug(D_WQ, "Failed to send queued data to %s (%s): %s", w->hostname, w->addrport, strerror(error));
+	}
+}
+
+static int send_worker_outbound(struct work_queue *q, struct work_queue_worker *w)
+{
+	int ok = send_outbound_avail(w, &w->total_transfer_time);
+	int error = errno;
+
+	write_sent_transactions(q, w);
+
+	if(!ok) {
+		debug_outbound_failure(w, error);
+		return 0;
+	}
+
+	if(!worker_outbound_pending(w)) {
+		hash_table_remove(q->workers_with_outbound, w->hashkey);
+		if(!w->io_shard)
+			poller_add(q->poller, w->link, LINK_READ);
+	}
+
+	return 1;
+}
+
+/* Send all of w->outbound, waiting as needed. Used before waiting for an answer from the worker. */
+static int flush_worker_outbound(struct work_queue *q, struct work_queue_worker *w)
+{
+	while(worker_outbound_pending(w)) {
+		if(!send_worker_outbound(q, w))
+			return 0;
+
+		struct work_queue_transfer *tr = list_peek_head(w->outbound);
+		if(tr && !link_sleep(w->link, tr->stoptime, 0, 1)) {
+			debug(D_WQ, "Timed out sending queued data to %s (%s)", w->hostname, w->addrport);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+I/O threads. With the io-threads tune, the links of the workers are split
+among that many threads, each waiting on a poller of its own. A thread reads
+what its workers send into the buffers of their links, and sends the files
+queued for them in w->outbound. The master thread remains the dispatcher: it
+parses the messages and makes all the scheduling decisions, so that the
+state of the queue is only ever changed by it. A worker belongs to its thread
+until the thread hands it to the dispatcher because it has something to
+read, or until the dispatcher claims it to talk to it. Either way, the link
+leaves the poller of the thread, and the dispatcher uses the link and
+w->outbound as it would without threads. The dispatcher gives the workers it
+took back to their threads before it waits for events, and before
+work_queue_wait returns, so that the threads carry on with the transfers
+while the dispatcher serves other workers, and while the application runs.
+*/
+
+/* Take a worker whose I/O thread let go of it. Called with the lock of the shard. */
+static void worker_io_take(struct work_queue *q, struct work_queue_worker *w)
+{
+	__atomic_store_n(&w->io_state, WORKER_IO_DISPATCHER, __ATOMIC_RELEASE);
+	w->total_transfer_time += w->io_transfer_time;
+	w->io_transfer_time = 0;
+	write_sent_transactions(q, w);
+	hash_table_insert(q->io_claimed, w->hashkey, w);
+}
+
+/* Take the worker from its I/O thread, so that the dispatcher may use its link. */
+static void worker_io_claim(struct work_queue *q, struct work_queue_worker *w)
+{
+	struct work_queue_io_shard *s = w->io_shard;
+
+	if(!s || __atomic_load_n(&w->io_state, __ATOMIC_ACQUIRE) == WORKER_IO_DISPATCHER)
+		return;
+
+	pthread_mutex_lock(&s->mutex);
+	if(w->io_state == WORKER_IO_READY) {
+		list_remove(s->ready, w);
+	} else {
+		link_poller_remove(s->poller, w->link);
+	}
+	worker_io_take(q, w);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static void worker_io_release(struct work_queue_worker *w)
+{
+	struct work_queue_io_shard *s = w->io_shard;
+
+	pthread_mutex_lock(&s->mutex);
+	poller_add(s->poller, w->link, worker_outbound_pending(w) ? LINK_READ|LINK_WRITE : LINK_READ);
+	__atomic_store_n(&w->io_state, WORKER_IO_SHARD, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/* Give the workers taken by the dispatcher back to their I/O threads, except
+ * those with data left in their buffers, which the dispatcher handles on its
+ * next poll, as the threads would not notice it. */
+static void release_claimed_workers(struct work_queue *q)
+{
+	char *key;
+	struct work_queue_worker *w;
+
+	if(hash_table_size(q->io_claimed) < 1)
+		return;
+
+	hash_table_firstkey(q->io_claimed);
+	while(hash_table_nextkey(q->io_claimed, &key, (void **) &w)) {
+		if(link_buffer_empty(w->link)) {
+			worker_io_release(w);
+		} else {
+			list_push_tail(q->io_pending, w);
+		}
+	}
+
+	hash_table_clear(q->io_claimed);
+}
+
+static void worker_io_add(struct work_queue *q, struct work_queue_worker *w)
+{
+	struct work_queue_io_shard *s = &q->io_shards[q->io_next_shard];
+	q->io_next_shard = (q->io_next_shard + 1) % q->io_threads;
+
+	w->io_shard = s;
+
+	pthread_mutex_lock(&s->mutex);
+	itable_insert(s->workers, link_fd(w->link), w);
+	poller_add(s->poller, w->link, LINK_READ);
+	w->io_state = WORKER_IO_SHARD;
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static void worker_io_remove(struct work_queue *q, struct work_queue_worker *w)
+{
+	struct work_queue_io_shard *s = w->io_shard;
+
+	if(!s)
+		return;
+
+	worker_io_claim(q, w);
+
+	pthread_mutex_lock(&s->mutex);
+	itable_remove(s->workers, link_fd(w->link));
+	pthread_mutex_unlock(&s->mutex);
+
+	hash_table_remove(q->io_claimed, w->hashkey);
+	list_remove(q->io_pending, w);
+	w->io_shard = 0;
+}
+
+/* Called with the lock of the shard. */
+static void io_hand_over(struct work_queue_io_shard *s, struct work_queue_worker *w)
+{
+	link_poller_remove(s->poller, w->link);
+	__atomic_store_n(&w->io_state, WORKER_IO_READY, __ATOMIC_RELEASE);
+	list_push_tail(s->ready, w);
+}
+
+static void *io_thread(void *arg)
+{
+	struct work_queue_io_shard *s = arg;
+	struct work_queue *q = s->q;
+
+	int table_size = 64;
+	struct link_info *table = xxmalloc(sizeof(*table) * table_size);
+	time_t last_timeout_check = 0;
+
+	struct pollfd fds[2];
+	fds[0].fd = s->wake[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = link_poller_fd(s->poller);
+	fds[1].events = POLLIN;
+	int nfds = fds[1].fd >= 0 ? 2 : 1;
+
+	while(1) {
+		// Wait without the lock, so that the dispatcher can claim workers
+		// meanwhile. Without a descriptor for the poller, look at it often.
+		poll(fds, nfds, nfds > 1 ? 1000 : 10);
+
+		char buf[256];
+		while(read(s->wake[0], buf, sizeof(buf)) > 0) { }
+
+		pthread_mutex_lock(&s->mutex);
+
+		if(s->stop) {
+			pthread_mutex_unlock(&s->mutex);
+			break;
+		}
+
+		int i, handed = 0;
+		int n = link_poller_wait(s->poller, table, table_size, 0);
+
+		for(i = 0; i < n; i++) {
+			struct link *l = table[i].link;
+			struct work_queue_worker *w = itable_lookup(s->workers, link_fd(l));
+			if(!w)
+				continue;
+
+			if((table[i].revents & LINK_WRITE) && w->outbound && list_size(w->outbound) > 0) {
+				if(!send_outbound_avail(w, &w->io_transfer_time)) {
+					w->io_failed = errno;
+					io_hand_over(s, w);
+					handed++;
+					continue;
+				}
+				// the dispatcher logs why the link could not be waited on.
+				if(list_size(w->outbound) < 1 && !link_poller_add(s->poller, l, LINK_READ)) {
+					w->io_failed = errno;
+					io_hand_over(s, w);
+					handed++;
+					continue;
+				}
+			}
+
+			if(table[i].revents & LINK_READ) {
+				// a spurious wake up, wait for the data.
+				if(link_buffer_fill(l) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+					continue;
+				io_hand_over(s, w);
+				handed++;
+			}
+		}
+
+		// Transfers to workers that stopped reading are not noticed by the
+		// wait, so their time is checked once a second.
+		if(time(0) > last_timeout_check) {
+			uint64_t fd;
+			struct work_queue_worker *w;
+
+			itable_firstkey(s->workers);
+			while(itable_nextkey(s->workers, &fd, (void **) &w)) {
+				if(w->io_state == WORKER_IO_SHARD && outbound_timed_out(w)) {
+					w->io_failed = ETIMEDOUT;
+					io_hand_over(s, w);
+					handed++;
+				}
+			}
+
+			last_timeout_check = time(0);
+		}
+
+		// The links that did not fit are ready on the next wait.
+		if(n >= table_size) {
+			table_size *= 2;
+			table = xxrealloc(table, sizeof(*table) * table_size);
+		}
+
+		pthread_mutex_unlock(&s->mutex);
+
+		if(handed > 0) {
+			char c = 0;
+			ssize_t r = write(q->io_pipe[1], &c, 1);
+			(void) r;
+		}
+	}
+
+	free(table);
+
+	return 0;
+}
+
+static void io_threads_stop(struct work_queue *q)
+{
+	int i;
+
+	if(!q->io_shards)
+		return;
+
+	for(i = 0; i < q->io_threads; i++) {
+		struct work_queue_io_shard *s = &q->io_shards[i];
+
+		pthread_mutex_lock(&s->mutex);
+		s->stop = 1;
+		pthread_mutex_unlock(&s->mutex);
+
+		char c = 0;
+		ssize_t r = write(s->wake[1], &c, 1);
+		(void) r;
+
+		pthread_join(s->thread, NULL);
+
+		link_poller_delete(s->poller);
+		itable_delete(s->workers);
+		list_delete(s->ready);
+		close(s->wake[0]);
+		close(s->wake[1]);
+		pthread_mutex_destroy(&s->mutex);
+	}
+
+	free(q->io_shards);
+	q->io_shards = 0;
+	q->io_threads = 0;
+
+	link_poller_remove(q->poller, q->io_link);
+	link_close(q->io_link);
+	close(q->io_pipe[1]);
+	q->io_link = 0;
+}
+
+static int nonblocking_pipe(int fds[2])
+{
+	if(pipe(fds) < 0)
+		return 0;
+
+	int i;
+	for(i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	return 1;
+}
+
+/* Start n I/O threads. Only possible while no worker is connected. */
+static int io_threads_start(struct work_queue *q, int n)
+{
+	int i;
+
+	if(n < 1)
+		return 1;
+
+	if(!nonblocking_pipe(q->io_pipe)) {
+		debug(D_NOTICE, "Could not create work_queue I/O pipe: %s", strerror(errno));
+		return 0;
+	}
+
+	q->io_link = link_attach_to_fd(q->io_pipe[0]);
+	poller_add(q->poller, q->io_link, LINK_READ);
+
+	q->io_shards = xxcalloc(n, sizeof(*q->io_shards));
+	q->io_next_shard = 0;
+
+	for(i = 0; i < n; i++) {
+		struct work_queue_io_shard *s = &q->io_shards[i];
+
+		s->q = q;
+		s->poller = link_poller_create();
+		s->workers = itable_create(0);
+		s->ready = list_create();
+		pthread_mutex_init(&s->mutex, NULL);
+
+		int started = 0;
+		if(nonblocking_pipe(s->wake)) {
+			started = pthread_create(&s->thread, NULL, io_thread, s) == 0;
+			if(!started) {
+				close(s->wake[0]);
+				close(s->wake[1]);
+			}
+		}
+
+		if(!started) {
+			debug(D_NOTICE, "Could not start work_queue I/O thread: %s", strerror(errno));
+			link_poller_delete(s->poller);
+			itable_delete(s->workers);
+			list_delete(s->ready);
+			pthread_mutex_destroy(&s->mutex);
+			io_threads_stop(q);
+			return 0;
+		}
+
+		q->io_threads++;
+	}
+
+	debug(D_WQ, "started %d I/O threads", n);
+
+	return 1;
+}
+
+/* Write data to the worker, behind anything queued for it. */
+static int write_worker_data(struct work_queue *q, struct work_queue_worker *w, const char *data, int64_t length, int timeout)
+{
+	worker_io_claim(q, w);
+
+	if(worker_outbound_pending(w)) {
+		queue_worker_data(q, w, data, length, timeout);
+		return length;
+	}
+
+	return link_putlstring(w->link, data, length, time(0) + timeout);
+}
+
+/*
+Task batches. start_one_task writes the whole description of a task into a
+single buffer. Workers that understand the tasks message get the descriptions
+of the tasks dispatched to them in consecutive rounds of the main loop in one
+message, sent when q->task_batch_max tasks are waiting, when the master has no
+more tasks to dispatch, or before anything else is sent to the worker.
+*/
+
+static int worker_timeout(struct work_queue *q, struct work_queue_worker *w)
+{
+	//If foreman, then we wait until foreman gives the master some attention.
+	return w->foreman ? q->long_timeout : q->short_timeout;
+}
+
+static int flush_worker_task_batch(struct work_queue *q, struct work_queue_worker *w)
+{
+	if(w->task_batch_count < 1)
+		return 1;
+
+	buffer_t B[1];
+	buffer_init(B);
+	buffer_abortonfailure(B, 1);
+
+	size_t length;
+	const char *tasks = buffer_tolstring(w->task_batch, &length);
+
+	// a single task does not need the tasks header.
+	if(w->task_batch_count > 1) {
+		buffer_putfstring(B, "tasks %d\n", w->task_batch_count);
+		debug(D_WQ, "tx to %s (%s): %s", w->hostname, w->addrport, buffer_tostring(B));
+	}
+	buffer_putlstring(B, tasks, length);
+
+	w->task_batch_count = 0;
+	buffer_rewind(w->task_batch, 0);
+	hash_table_remove(q->workers_with_task_batch, w->hashkey);
+
+	int result = write_worker_data(q, w, buffer_tostring(B), buffer_pos(B), worker_timeout(q, w));
+	buffer_free(B);
+
+	return result >= 0;
+}
+
+static void flush_task_batches(struct work_queue *q)
+{
+	struct work_queue_worker *w;
+	char *hashkey;
+
+	while(hash_table_size(q->workers_with_task_batch) > 0) {
+		hash_table_firstkey(q->workers_with_task_batch);
+		hash_table_nextkey(q->workers_with_task_batch, &hashkey, (void **) &w);
+		if(!flush_worker_task_batch(q, w)) {
+			handle_worker_failure(q, w);
+		}
+	}
+}
+
+static void clear_worker_task_batch(struct work_queue *q, struct work_queue_worker *w)
+{
+	if(!w->task_batch)
+		return;
+
+	hash_table_remove(q->workers_with_task_batch, w->hashkey);
+	buffer_free(w->task_batch);
+	free(w->task_batch);
+	w->task_batch = 0;
+	w->task_batch_count = 0;
+}
+
+/* Send data to the worker, after any tasks waiting to be sent to it. */
+static int send_worker_data(struct work_queue *q, struct work_queue_worker *w, const char *data, int64_t length, int timeout)
+{
+	if(!flush_worker_task_batch(q, w))
+		return -1;
+
+	return write_worker_data(q, w, data, length, timeout);
+}
+
+/* Send the description of a task, either right away or as part of a batch. */
+static int send_worker_task(struct work_queue *q, struct work_queue_worker *w, buffer_t *task)
+{
+	size_t length;
+	const char *data = buffer_tolstring(task, &length);
+
+	if(q->task_batch_max < 2 || w->protocol < WORK_QUEUE_PROTOCOL_VERSION_TASKS) {
+		return send_worker_data(q, w, data, length, worker_timeout(q, w));
+	}
+
+	if(!w->task_batch) {
+		w->task_batch = malloc(sizeof(*w->task_batch));
+		buffer_init(w->task_batch);
+		buffer_abortonfailure(w->task_batch, 1);
+	}
+
+	buffer_putlstring(w->task_batch, data, length);
+	w->task_batch_count++;
+	hash_table_insert(q->workers_with_task_batch, w->hashkey, w);
+
+	if(w->task_batch_count >= q->task_batch_max) {
+		return flush_worker_task_batch(q, w) ? (int) length : -1;
+	}
+
+	return length;
+}
+
 /**
  * This function sends a message to the worker and records the time the message is
  * successfully sent. This timestamp is used to determine when to send keepalive checks.
@@ -495,7 +1337,6 @@ __attribute__ (( format(printf,3,4) ))
 static int send_worker_msg( struct work_queue *q, struct work_queue_worker *w, const char *fmt, ... )
 {
 	va_list va;
-	time_t stoptime;
 	buffer_t B[1];
 	buffer_init(B);
 	buffer_abortonfailure(B, 1);
@@ -507,13 +1348,7 @@ static int send_worker_msg( struct work_queue *q, struct work_queue_worker *w, c
 
 	debug(D_WQ, "tx to %s (%s): %s", w->hostname, w->addrport, buffer_tostring(B));
 
-	//If foreman, then we wait until foreman gives the master some attention.
-	if(w->foreman)
-		stoptime = time(0) + q->long_timeout;
-	else
-		stoptime = time(0) + q->short_timeout;
-
-	int result = link_putlstring(w->link, buffer_tostring(B), buffer_pos(B), stoptime);
+	int result = send_worker_data(q, w, buffer_tostring(B), buffer_pos(B), worker_timeout(q, w));
 
 	buffer_free(B);
 
@@ -543,6 +1378,26 @@ work_queue_msg_code_t process_name(struct work_queue *q, struct work_queue_worke
 	return MSG_PROCESSED;
 }
 
+/* Set the NUMA nodes of w from the cores of each of them, as in "8,8,4". */
+static void set_worker_numa_nodes(struct work_queue_worker *w, const char *value)
+{
+	free(w->numa_node_cores);
+	w->numa_node_cores = NULL;
+	w->numa_nodes = 0;
+
+	while(*value) {
+		char *end;
+		long cores = strtol(value, &end, 10);
+		if(end == value)
+			break;
+
+		w->numa_node_cores = xxrealloc(w->numa_node_cores, (w->numa_nodes + 1) * sizeof(int));
+		w->numa_node_cores[w->numa_nodes++] = cores;
+
+		value = *end == ',' ? end + 1 : end;
+	}
+}
+
 work_queue_msg_code_t process_info(struct work_queue *q, struct work_queue_worker *w, char *line)
 {
 	char field[WORK_QUEUE_LINE_MAX];
@@ -581,9 +1436,29 @@ work_queue_msg_code_t process_info(struct work_queue *q, struct work_queue_worke
 		free(w->workerid);
 		w->workerid = xxstrdup(value);
 		write_transaction_worker(q, w, 0);
-	}
-
-	//Note we always mark info messages as processed, as they are optional.
+	} else if(string_prefix_is(field, "peer-port")) {
+		int port;
+		if(link_address_remote(w->link, w->peer_addr, &port)) {
+			w->peer_port = atoi(value);
+		}
+	} else if(string_prefix_is(field, "peer-received")) {
+		worker_peer_transfer_done(q, w, value);
+	} else if(string_prefix_is(field, "peer-failed")) {
+		debug(D_WQ, "%s (%s) could not fetch %s from its peer", w->hostname, w->addrport, value);
+		worker_peer_transfer_done(q, w, value);
+		return resend_worker_file(q, w, value);
+	} else if(string_prefix_is(field, "digest-missed")) {
+		debug(D_WQ, "%s (%s) could not find %s in its content cache", w->hostname, w->addrport, value);
+		return resend_worker_file(q, w, value);
+	} else if(string_prefix_is(field, "content-cache")) {
+		w->content_cache = 1;
+	} else if(string_prefix_is(field, "content-digest")) {
+		hash_table_insert(w->content_digests, value, (void *) 1);
+	} else if(string_prefix_is(field, "numa-node-cores")) {
+		set_worker_numa_nodes(w, value);
+	}
+
+	//Note we mark info messages as processed, as they are optional, unless answering them fails.
 	return MSG_PROCESSED;
 }
 
@@ -602,6 +1477,8 @@ static work_queue_msg_code_t recv_worker_msg(struct work_queue *q, struct work_q
 	else
 		stoptime = time(0) + q->short_timeout;
 
+	worker_io_claim(q, w);
+
 	int result = link_readline(w->link, line, length, stoptime);
 
 	if (result <= 0) {
@@ -786,6 +1663,69 @@ static void clean_task_state(struct work_queue_task *t) {
 		t->result = WORK_QUEUE_RESULT_UNKNOWN;
 }
 
+/* Record that w has cached_name in its cache. Besides w->current_files, the
+ * master keeps q->file_worker_table, from cached names to the workers that
+ * have them, so that the files scheduler only looks at those workers. */
+static void worker_file_insert(struct work_queue *q, struct work_queue_worker *w, const char *cached_name, struct stat *remote_info)
+{
+	struct stat *old_info = hash_table_remove(w->current_files, cached_name);
+	if(old_info) {
+		w->cached_bytes -= old_info->st_size;
+		free(old_info);
+	}
+
+	hash_table_insert(w->current_files, cached_name, remote_info);
+	w->cached_bytes += remote_info->st_size;
+
+	struct set *holders = hash_table_lookup(q->file_worker_table, cached_name);
+	if(!holders) {
+		holders = set_create(0);
+		hash_table_insert(q->file_worker_table, cached_name, holders);
+	}
+
+	set_insert(holders, w);
+}
+
+static void worker_file_remove(struct work_queue *q, struct work_queue_worker *w, const char *cached_name)
+{
+	struct set *holders = hash_table_lookup(q->file_worker_table, cached_name);
+	if(holders) {
+		set_remove(holders, w);
+		if(set_size(holders) < 1) {
+			hash_table_remove(q->file_worker_table, cached_name);
+			set_delete(holders);
+		}
+	}
+
+	/* cached_name may be the key of w->current_files, so this goes last. */
+	struct stat *remote_info = hash_table_remove(w->current_files, cached_name);
+	if(remote_info) {
+		w->cached_bytes -= remote_info->st_size;
+		free(remote_info);
+	}
+}
+
+/* A cached file that a worker is fetching from one of its peers. */
+struct work_queue_peer_transfer {
+	char source[WORKER_HASHKEY_MAX];    // hashkey of the worker serving the file.
+	int depth;                          // peer transfers between the master and this one.
+};
+
+/* The fetch of cached_name by w from one of its peers is over, either because
+ * w reported it, or because w is gone. The source may serve another peer. */
+static void worker_peer_transfer_done(struct work_queue *q, struct work_queue_worker *w, const char *cached_name)
+{
+	struct work_queue_peer_transfer *p = hash_table_remove(w->peer_pending, cached_name);
+	if(!p)
+		return;
+
+	struct work_queue_worker *source = hash_table_lookup(q->worker_table, p->source);
+	if(source && source->peer_serving > 0)
+		source->peer_serving--;
+
+	free(p);
+}
+
 static void cleanup_worker(struct work_queue *q, struct work_queue_worker *w)
 {
 	char *key, *value;
@@ -795,10 +1735,15 @@ static void cleanup_worker(struct work_queue *q, struct work_queue_worker *w)
 
 	if(!q || !w) return;
 
+	hash_table_firstkey(w->peer_pending);
+	while(hash_table_nextkey(w->peer_pending, &key, (void **) &value)) {
+		worker_peer_transfer_done(q, w, key);
+		hash_table_firstkey(w->peer_pending);
+	}
+
 	hash_table_firstkey(w->current_files);
 	while(hash_table_nextkey(w->current_files, &key, (void **) &value)) {
-		hash_table_remove(w->current_files, key);
-		free(value);
+		worker_file_remove(q, w, key);
 		hash_table_firstkey(w->current_files);
 	}
 
@@ -828,6 +1773,7 @@ static void cleanup_worker(struct work_queue *q, struct work_queue_worker *w)
 
 	itable_clear(w->current_tasks);
 	itable_clear(w->current_tasks_boxes);
+	itable_clear(w->numa_task_nodes);
 	w->finished_tasks = 0;
 }
 
@@ -871,17 +1817,34 @@ static void remove_worker(struct work_queue *q, struct work_queue_worker *w)
 
 	hash_table_remove(q->worker_table, w->hashkey);
 	hash_table_remove(q->workers_with_available_results, w->hashkey);
+	worker_index_remove(q, w);
+	clear_worker_task_batch(q, w);
+	worker_io_remove(q, w);
+	write_sent_transactions(q, w);
+	clear_worker_outbound(q, w);
+	prefetch_forget_worker(q, w);
 
 	record_removed_worker_stats(q, w);
 
-	if(w->link)
+	if(w->link) {
+		link_poller_remove(q->poller, w->link);
 		link_close(w->link);
+	}
 
 	itable_delete(w->current_tasks);
 	itable_delete(w->current_tasks_boxes);
+	itable_delete(w->numa_task_nodes);
+	free(w->numa_node_cores);
 	hash_table_delete(w->current_files);
+	hash_table_delete(w->peer_pending);
+	hash_table_delete(w->content_digests);
 	work_queue_resources_delete(w->resources);
 
+	if(w->outbound)
+		list_delete(w->outbound);
+	if(w->outbound_sent)
+		list_delete(w->outbound_sent);
+
 	free(w->workerid);
 	free(w->stats);
 	free(w->hostname);
@@ -951,8 +1914,12 @@ static void add_worker(struct work_queue *q)
 	w->foreman = 0;
 	w->link = link;
 	w->current_files = hash_table_create(0, 0);
+	w->peer_pending = hash_table_create(0, 0);
+	w->content_digests = hash_table_create(0, 0);
 	w->current_tasks = itable_create(0);
 	w->current_tasks_boxes = itable_create(0);
+	w->numa_task_nodes = itable_create(0);
+	w->index_bucket = -1;
 	w->finished_tasks = 0;
 	w->start_time = timestamp_get();
 
@@ -966,6 +1933,11 @@ static void add_worker(struct work_queue *q)
 	link_to_hash_key(link, w->hashkey);
 	sprintf(w->addrport, "%s:%d", addr, port);
 	hash_table_insert(q->worker_table, w->hashkey, w);
+	if(q->io_threads > 0) {
+		worker_io_add(q, w);
+	} else {
+		poller_add(q->poller, link, LINK_READ);
+	}
 	q->stats->workers_joined++;
 
 	debug(D_WQ, "%d workers are connected in total now", hash_table_size(q->worker_table));
@@ -974,18 +1946,19 @@ static void add_worker(struct work_queue *q)
 }
 
 /*
-Get a single file from a remote worker.
+Get a single file from a remote worker. If compressed, the file is sent
+compressed, in wire_length bytes.
 */
-static work_queue_result_code_t get_file( struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *local_name, int64_t length, int64_t * total_bytes)
+static work_queue_result_code_t get_file( struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *local_name, int64_t length, int64_t wire_length, int compressed, int64_t * total_bytes)
 {
 	// If a bandwidth limit is in effect, choose the effective stoptime.
 	timestamp_t effective_stoptime = 0;
 	if(q->bandwidth) {
-		effective_stoptime = (length/q->bandwidth)*1000000 + timestamp_get();
+		effective_stoptime = (wire_length/q->bandwidth)*1000000 + timestamp_get();
 	}
 
 	// Choose the actual stoptime.
-	time_t stoptime = time(0) + get_transfer_wait_time(q, w, t, length);
+	time_t stoptime = time(0) + get_transfer_wait_time(q, w, t, wire_length);
 
 	// If necessary, create parent directories of the file.
 	char dirname[WORK_QUEUE_LINE_MAX];
@@ -993,7 +1966,7 @@ static work_queue_result_code_t get_file( struct work_queue *q, struct work_queu
 	if(strchr(local_name,'/')) {
 		if(!create_dir(dirname, 0777)) {
 			debug(D_WQ, "Could not create directory - %s (%s)", dirname, strerror(errno));
-			link_soak(w->link, length, stoptime);
+			link_soak(w->link, wire_length, stoptime);
 			return APP_FAILURE;
 		}
 	}
@@ -1009,12 +1982,17 @@ static work_queue_result_code_t get_file( struct work_queue *q, struct work_queu
 	int fd = open(local_name, O_WRONLY | O_TRUNC | O_CREAT, 0777);
 	if(fd < 0) {
 		debug(D_NOTICE, "Cannot open file %s for writing: %s", local_name, strerror(errno));
-		link_soak(w->link, length, stoptime);
+		link_soak(w->link, wire_length, stoptime);
 		return APP_FAILURE;
 	}
 
 	// Write the data on the link to file.
-	int64_t actual = link_stream_to_fd(w->link, fd, length, stoptime);
+	int64_t actual;
+	if(compressed) {
+		actual = work_queue_uncompress_link_to_fd(w->link, fd, wire_length, stoptime);
+	} else {
+		actual = link_stream_to_fd(w->link, fd, length, stoptime);
+	}
 
 	close(fd);
 
@@ -1024,7 +2002,7 @@ static work_queue_result_code_t get_file( struct work_queue *q, struct work_queu
 		return WORKER_FAILURE;
 	}
 
-	*total_bytes += length;
+	*total_bytes += wire_length;
 
 	// If the transfer was too fast, slow things down.
 	timestamp_t current_time = timestamp_get();
@@ -1041,16 +2019,24 @@ The master sents a single get message, then the worker
 responds with a continuous stream of dir and file message
 that indicate the entire contents of the directory.
 This makes it efficient to move deep directory hierarchies with
-high throughput and low latency.
+high throughput and low latency. With WORK_QUEUE_COMPRESS, the worker sends
+the files that compress well in zfile messages instead.
 */
-static work_queue_result_code_t get_file_or_directory( struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *remote_name, const char *local_name, int64_t * total_bytes)
+static work_queue_result_code_t get_file_or_directory( struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *remote_name, const char *local_name, int flags, int64_t * total_bytes)
 {
 	// Remember the length of the specified remote path so it can be chopped from the result.
 	int remote_name_len = strlen(remote_name);
 
 	// Send the name of the file/dir name to fetch
 	debug(D_WQ, "%s (%s) sending back %s to %s", w->hostname, w->addrport, remote_name, local_name);
-	send_worker_msg(q,w, "get %s 1\n",remote_name);
+	if((flags & WORK_QUEUE_COMPRESS) && w->protocol >= WORK_QUEUE_PROTOCOL_VERSION_COMPRESS) {
+		send_worker_msg(q,w, "get %s 1 1\n",remote_name);
+	} else {
+		send_worker_msg(q,w, "get %s 1\n",remote_name);
+	}
+
+	if(!flush_worker_outbound(q, w))
+		return WORKER_FAILURE;
 
 	work_queue_result_code_t result = SUCCESS; //return success unless something fails below
 
@@ -1059,6 +2045,7 @@ static work_queue_result_code_t get_file_or_directory( struct work_queue *q, str
 		char line[WORK_QUEUE_LINE_MAX];
 		char tmp_remote_path[WORK_QUEUE_LINE_MAX];
 		int64_t length;
+		int64_t wire_length;
 		int errnum;
 
 		if(recv_worker_msg_retry(q, w, line, sizeof(line)) == MSG_FAILURE) {
@@ -1078,10 +2065,21 @@ static work_queue_result_code_t get_file_or_directory( struct work_queue *q, str
 			free(tmp_local_name);
 		} else if(sscanf(line,"file %s %"SCNd64, tmp_remote_path, &length)==2) {
 			char *tmp_local_name = string_format("%s%s",local_name,&tmp_remote_path[remote_name_len]);
-			result = get_file(q,w,t,tmp_local_name,length,total_bytes);
+			result = get_file(q,w,t,tmp_local_name,length,length,0,total_bytes);
+			if(result == SUCCESS && flags & WORK_QUEUE_COMPRESS) {
+				write_transaction_transfer(q, w, t, "OUTPUT", tmp_remote_path, length, length);
+			}
 			free(tmp_local_name);
 			//Return if worker failure. Else wait for end message from worker.
 			if(result == WORKER_FAILURE) break;
+		} else if(sscanf(line,"zfile %s %"SCNd64" %"SCNd64, tmp_remote_path, &wire_length, &length)==3) {
+			char *tmp_local_name = string_format("%s%s",local_name,&tmp_remote_path[remote_name_len]);
+			result = get_file(q,w,t,tmp_local_name,length,wire_length,1,total_bytes);
+			if(result == SUCCESS) {
+				write_transaction_transfer(q, w, t, "OUTPUT", tmp_remote_path, length, wire_length);
+			}
+			free(tmp_local_name);
+			if(result == WORKER_FAILURE) break;
 		} else if(sscanf(line,"missing %s %d",tmp_remote_path,&errnum)==2) {
 			// If the output file is missing, we make a note of that in the task result,
 			// but we continue and consider the transfer a 'success' so that other
@@ -1190,6 +2188,9 @@ static int do_thirdput( struct work_queue *q, struct work_queue_worker *w,  cons
 
 	send_worker_msg(q,w,"thirdput %d %s %s\n",command,cached_name,payload);
 
+	if(!flush_worker_outbound(q, w))
+		return WORKER_FAILURE;
+
 	if(recv_worker_msg_retry(q, w, line, WORK_QUEUE_LINE_MAX) == MSG_FAILURE)
 		return WORKER_FAILURE;
 
@@ -1221,7 +2222,7 @@ static work_queue_result_code_t get_output_file( struct work_queue *q, struct wo
 	} else if(f->type == WORK_QUEUE_REMOTECMD) {
 		result = do_thirdput(q,w,f->cached_name,f->payload,WORK_QUEUE_FS_CMD);
 	} else {
-		result = get_file_or_directory(q, w, t, f->cached_name, f->payload, &total_bytes);
+		result = get_file_or_directory(q, w, t, f->cached_name, f->payload, f->flags, &total_bytes);
 	}
 
 	timestamp_t close_time = timestamp_get();
@@ -1249,7 +2250,7 @@ static work_queue_result_code_t get_output_file( struct work_queue *q, struct wo
 				return APP_FAILURE;
 			}
 			memcpy(remote_info, &local_info, sizeof(local_info));
-			hash_table_insert(w->current_files, f->cached_name, remote_info);
+			worker_file_insert(q, w, f->cached_name, remote_info);
 		} else {
 			debug(D_NOTICE, "Cannot stat file %s: %s", f->payload, strerror(errno));
 		}
@@ -1307,7 +2308,7 @@ static work_queue_result_code_t get_monitor_output_file( struct work_queue *q, s
 static void delete_worker_file( struct work_queue *q, struct work_queue_worker *w, const char *filename, int flags, int except_flags ) {
 	if(!(flags & except_flags)) {
 		send_worker_msg(q,w, "unlink %s\n", filename);
-		hash_table_remove(w->current_files, filename);
+		worker_file_remove(q, w, filename);
 	}
 }
 
@@ -1551,26 +2552,16 @@ static int expire_waiting_tasks(struct work_queue *q)
 {
 	struct work_queue_task *t;
 	int expired = 0;
-	int count;
 
 	timestamp_t current_time = timestamp_get();
-	count = task_state_count(q, NULL, WORK_QUEUE_TASK_READY);
-
-	while(count > 0)
+	priority_queue_first_item(q->ready_list);
+	while((t = priority_queue_next_item(q->ready_list)))
 	{
-		count--;
-
-		t = list_pop_head(q->ready_list);
-
 		if(t->resources_requested->end > 0 && (uint64_t) t->resources_requested->end <= current_time)
 		{
 			expire_waiting_task(q, t);
 			expired++;
 		}
-		else
-		{
-			list_push_tail(q->ready_list, t);
-		}
 	}
 
 	return expired;
@@ -1627,11 +2618,13 @@ static work_queue_msg_code_t process_workqueue(struct work_queue *q, struct work
 	if(n != 5)
 		return MSG_FAILURE;
 
-	if(worker_protocol!=WORK_QUEUE_PROTOCOL_VERSION) {
+	if(worker_protocol<WORK_QUEUE_PROTOCOL_VERSION_MIN || worker_protocol>WORK_QUEUE_PROTOCOL_VERSION) {
 		debug(D_WQ|D_NOTICE,"worker (%s) is using work queue protocol %d, but I am using protocol %d",w->addrport,worker_protocol,WORK_QUEUE_PROTOCOL_VERSION);
 		return MSG_FAILURE;
 	}
 
+	w->protocol = worker_protocol;
+
 	if(w->hostname) free(w->hostname);
 	if(w->os)       free(w->os);
 	if(w->arch)     free(w->arch);
@@ -1868,6 +2861,9 @@ static work_queue_result_code_t get_available_results(struct work_queue *q, stru
 
 	//max_count == -1, tells the worker to send all available results.
 	send_worker_msg(q, w, "send_results %d\n", -1);
+
+	if(!flush_worker_outbound(q, w))
+		return WORKER_FAILURE;
 	debug(D_WQ, "Reading result(s) from %s (%s)", w->hostname, w->addrport);
 
 	char line[WORK_QUEUE_LINE_MAX];
@@ -1956,8 +2952,8 @@ static struct rmsummary *largest_waiting_declared_resources(struct work_queue *q
 	struct rmsummary *max_resources_waiting = rmsummary_create(-1);
 	struct work_queue_task *t;
 
-	list_first_item(q->ready_list);
-	while((t = list_next_item(q->ready_list))) {
+	priority_queue_first_item(q->ready_list);
+	while((t = priority_queue_next_item(q->ready_list))) {
 
 		if(!category || (t->category && !strcmp(t->category, category))) {
 			rmsummary_merge_max(max_resources_waiting, t->resources_requested);
@@ -1979,8 +2975,8 @@ static struct rmsummary  *total_resources_needed(struct work_queue *q) {
 	struct rmsummary *total = rmsummary_create(0);
 
 	/* for waiting tasks, we use what they would request if dispatched right now. */
-	list_first_item(q->ready_list);
-	while((t = list_next_item(q->ready_list))) {
+	priority_queue_first_item(q->ready_list);
+	while((t = priority_queue_next_item(q->ready_list))) {
 		const struct rmsummary *s = task_min_resources(q, t);
 		rmsummary_add(total, s);
 	}
@@ -2008,8 +3004,8 @@ static struct rmsummary *largest_waiting_measured_resources(struct work_queue *q
 	struct rmsummary *max_resources_waiting = rmsummary_create(-1);
 	struct work_queue_task *t;
 
-	list_first_item(q->ready_list);
-	while((t = list_next_item(q->ready_list))) {
+	priority_queue_first_item(q->ready_list);
+	while((t = priority_queue_next_item(q->ready_list))) {
 
 		if(!category || (t->category && !strcmp(t->category, category))) {
 			const struct rmsummary *r = task_min_resources(q, t);
@@ -2328,6 +3324,14 @@ struct jx * worker_to_jx( struct work_queue *q, struct work_queue_worker *w )
 	jx_insert_integer(j,"start_time",w->start_time);
 	jx_insert_integer(j,"current_time",timestamp_get());
 
+	if(w->numa_nodes > 0) {
+		struct jx *cores = jx_array(NULL);
+		int node;
+		for(node = 0; node < w->numa_nodes; node++)
+			jx_array_append(cores, jx_integer(w->numa_node_cores[node]));
+		jx_insert_integer(j,"numa_nodes",w->numa_nodes);
+		jx_insert(j,jx_string("numa_node_cores"),cores);
+	}
 
 	work_queue_resources_add_to_jx(w->resources,j);
 
@@ -2529,58 +3533,174 @@ static work_queue_result_code_t handle_worker(struct work_queue *q, struct link
 	return SUCCESS;
 }
 
-static int build_poll_table(struct work_queue *q, struct link *master)
+/* Where files are compressed before they are sent. */
+static const char *compress_tmpdir()
+{
+	const char *dir = getenv("TMPDIR");
+	return dir ? dir : "/tmp";
+}
+
+/*
+Compressed copies. A file is compressed once for each of its versions, and
+the copy is sent to every worker that needs it, until the file changes. The
+files are compressed by threads of their own, so that the dispatcher does
+not wait for them, and are sent as is until their copies are ready. Data that
+does not compress well is remembered as such. The copies are unlinked files,
+read from their start by each transfer, and take at most
+MAX_COMPRESSED_COPIES_STORAGE, beyond which the older ones are dropped.
+*/
+
+struct work_queue_compressed_copy {
+	char *localname;
+	off_t offset;
+	int64_t length;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	int fd;                  // the copy, or -1 if the data is sent as is.
+	int64_t wire_length;
+	pthread_t thread;
+	int compressing;         // the thread has not been joined.
+	int done;                // set by the thread when it finishes.
+};
+
+static void compressed_copy_delete(struct work_queue *q, struct work_queue_compressed_copy *c)
+{
+	if(c->fd >= 0) {
+		close(c->fd);
+		q->compressed_copies_size -= c->wire_length;
+	}
+	free(c->localname);
+	free(c);
+}
+
+/* Drop the copies that are not being compressed. */
+static void compressed_copies_clear(struct work_queue *q)
 {
-	int n = 0;
 	char *key;
-	struct work_queue_worker *w;
+	struct work_queue_compressed_copy *c;
+	struct list *keys = list_create();
 
-	// Allocate a small table, if it hasn't been done yet.
-	if(!q->poll_table) {
-		q->poll_table = malloc(sizeof(*q->poll_table) * q->poll_table_size);
-		if(!q->poll_table) {
-			//if we can't allocate a poll table, we can't do anything else.
-			fatal("allocating memory for poll table failed.");
-		}
+	hash_table_firstkey(q->compressed_copies);
+	while(hash_table_nextkey(q->compressed_copies, &key, (void **) &c)) {
+		if(!c->compressing)
+			list_push_tail(keys, xxstrdup(key));
 	}
 
-	// The first item in the poll table is the master link, which accepts new connections.
-	q->poll_table[0].link = q->master_link;
-	q->poll_table[0].events = LINK_READ;
-	q->poll_table[0].revents = 0;
-	n = 1;
+	while((key = list_pop_head(keys))) {
+		compressed_copy_delete(q, hash_table_remove(q->compressed_copies, key));
+		free(key);
+	}
 
-	if(master) {
-		/* foreman uplink */
-		q->poll_table[1].link = master;
-		q->poll_table[1].events = LINK_READ;
-		q->poll_table[1].revents = 0;
-		n++;
+	list_delete(keys);
+}
+
+static void *compressed_copy_thread(void *arg)
+{
+	struct work_queue_compressed_copy *c = arg;
+	struct stat info;
+
+	// a version of the file other than the one wanted is not compressed.
+	int fd = open(c->localname, O_RDONLY);
+	if(fd >= 0) {
+		if(fstat(fd, &info) == 0 && info.st_dev == c->dev && info.st_ino == c->ino && info.st_mtime == c->mtime && info.st_size == c->size && lseek(fd, c->offset, SEEK_SET) == c->offset) {
+			c->fd = work_queue_compress_fd(fd, c->length, compress_tmpdir(), &c->wire_length);
+		}
+		close(fd);
 	}
 
-	// For every worker in the hash table, add an item to the poll table
-	hash_table_firstkey(q->worker_table);
-	while(hash_table_nextkey(q->worker_table, &key, (void **) &w)) {
-		// If poll table is not large enough, reallocate it
-		if(n >= q->poll_table_size) {
-			q->poll_table_size *= 2;
-			q->poll_table = realloc(q->poll_table, sizeof(*q->poll_table) * q->poll_table_size);
-			if(q->poll_table == NULL) {
-				//if we can't allocate a poll table, we can't do anything else.
-				fatal("reallocating memory for poll table failed.");
-			}
+	__atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* Join the threads that finished compressing, keeping their copies. */
+static void compressed_copies_reap(struct work_queue *q)
+{
+	int n = list_size(q->compressing);
+	struct work_queue_compressed_copy *c;
+
+	while(n-- > 0) {
+		c = list_pop_head(q->compressing);
+		if(!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE)) {
+			list_push_tail(q->compressing, c);
+			continue;
 		}
 
-		q->poll_table[n].link = w->link;
-		q->poll_table[n].events = LINK_READ;
-		q->poll_table[n].revents = 0;
-		n++;
+		pthread_join(c->thread, NULL);
+
+		if(c->fd >= 0) {
+			debug(D_WQ, "compressed %s (%lld:%lld) to %lld bytes", c->localname, (long long) c->offset, (long long) c->length, (long long) c->wire_length);
+			if(q->compressed_copies_size + c->wire_length > MAX_COMPRESSED_COPIES_STORAGE)
+				compressed_copies_clear(q);
+			q->compressed_copies_size += c->wire_length;
+		} else {
+			debug(D_WQ, "sending %s (%lld:%lld) uncompressed", c->localname, (long long) c->offset, (long long) c->length);
+		}
+
+		c->compressing = 0;
+	}
+}
+
+/*
+Open the compressed copy of length bytes of localname from offset, starting
+to compress them if there is no copy of this version of the file. Returns a
+descriptor of the copy, to be read from its start, and sets *wire_length, or
+-1 if the data is to be sent as is.
+*/
+static int compressed_copy_open(struct work_queue *q, const char *localname, struct stat *info, off_t offset, int64_t length, int64_t *wire_length)
+{
+	char *key = string_format("%s:%lld:%lld", localname, (long long) offset, (long long) length);
+	struct work_queue_compressed_copy *c = hash_table_lookup(q->compressed_copies, key);
+
+	if(c && !c->compressing && (c->dev != info->st_dev || c->ino != info->st_ino || c->mtime != info->st_mtime || c->size != info->st_size)) {
+		compressed_copy_delete(q, hash_table_remove(q->compressed_copies, key));
+		c = NULL;
+	}
+
+	if(!c && (length < WORK_QUEUE_COMPRESS_MIN_SIZE || list_size(q->compressing) < MAX_COMPRESSING)) {
+		c = xxcalloc(1, sizeof(*c));
+		c->localname = xxstrdup(localname);
+		c->offset = offset;
+		c->length = length;
+		c->dev = info->st_dev;
+		c->ino = info->st_ino;
+		c->mtime = info->st_mtime;
+		c->size = info->st_size;
+		c->fd = -1;
+
+		int error = 0;
+		if(length >= WORK_QUEUE_COMPRESS_MIN_SIZE) {
+			c->compressing = 1;
+			error = pthread_create(&c->thread, NULL, compressed_copy_thread, c);
+		}
+
+		if(error) {
+			debug(D_WQ, "could not start compressing %s: %s", localname, strerror(error));
+			free(c->localname);
+			free(c);
+			c = NULL;
+		} else {
+			if(c->compressing)
+				list_push_tail(q->compressing, c);
+			hash_table_insert(q->compressed_copies, key, c);
+		}
 	}
 
-	return n;
+	free(key);
+
+	if(!c || c->compressing || c->fd < 0)
+		return -1;
+
+	int fd = dup(c->fd);
+	if(fd >= 0)
+		*wire_length = c->wire_length;
+
+	return fd;
 }
 
-static int send_file( struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *localname, const char *remotename, off_t offset, int64_t length, int64_t *total_bytes, int flags)
+static int send_file( struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *localname, const char *remotename, off_t offset, int64_t length, int64_t *total_bytes, int flags, const char *digest)
 {
 	struct stat local_info;
 	time_t stoptime;
@@ -2620,18 +3740,69 @@ static int send_file( struct work_queue *q, struct work_queue_worker *w, struct
 		return APP_FAILURE;
 	}
 
+	// Compressed files are sent from a compressed copy, once it is ready, unless they do not compress.
+	int compress = (flags & WORK_QUEUE_COMPRESS) && w->protocol >= WORK_QUEUE_PROTOCOL_VERSION_COMPRESS;
+	int64_t wire_length = length;
+	if(compress) {
+		int compressed_fd = compressed_copy_open(q, localname, &local_info, offset, length, &wire_length);
+		if(compressed_fd >= 0) {
+			close(fd);
+			fd = compressed_fd;
+		} else {
+			compress = 0;
+		}
+	}
+
 	if(q->bandwidth) {
-		effective_stoptime = (length/q->bandwidth)*1000000 + timestamp_get();
+		effective_stoptime = (wire_length/q->bandwidth)*1000000 + timestamp_get();
+	}
+
+	int timeout = get_transfer_wait_time(q, w, t, wire_length);
+	if(compress) {
+		send_worker_msg(q,w, "zput %s %"PRId64" %"PRId64" 0%o %d%s%s\n",remotename, wire_length, length, local_info.st_mode, flags, digest ? " " : "", digest ? digest : "");
+	} else if(digest) {
+		send_worker_msg(q,w, "put %s %"PRId64" 0%o %d %s\n",remotename, length, local_info.st_mode, flags, digest);
+	} else {
+		send_worker_msg(q,w, "put %s %"PRId64" 0%o %d\n",remotename, length, local_info.st_mode, flags);
+	}
+
+	if(digest) {
+		// The worker also adds the file to its content cache.
+		hash_table_insert(w->content_digests, digest, (void *) 1);
 	}
 
-	stoptime = time(0) + get_transfer_wait_time(q, w, t, length);
-	send_worker_msg(q,w, "put %s %"PRId64" 0%o %d\n",remotename, length, local_info.st_mode, flags);
-	actual = link_stream_from_fd(w->link, fd, length, stoptime);
+	// The transfer is logged once the file is sent.
+	char *transaction = NULL;
+	if((flags & WORK_QUEUE_COMPRESS) && q->transactions_logfile) {
+		transaction = transfer_transaction(w, t, "INPUT", remotename, length, wire_length);
+	}
+
+	// Without a bandwidth limit, large files (and any file behind them) are
+	// sent from the main loop, and the master moves on to other workers.
+	// Compressed copies are shared by the transfers, which read them from their start.
+	if(!q->bandwidth && q->async_transfer_min_size >= 0 && (wire_length >= q->async_transfer_min_size || worker_outbound_pending(w))) {
+		debug(D_WQ, "%s (%s) queued %s for sending", w->hostname, w->addrport, localname);
+		queue_worker_file(q, w, fd, compress ? 0 : -1, wire_length, timeout, transaction);
+		*total_bytes += wire_length;
+		return SUCCESS;
+	}
+
+	stoptime = time(0) + timeout;
+	if(compress && lseek(fd, 0, SEEK_SET) == -1) {
+		actual = -1;
+	} else {
+		actual = link_stream_from_fd(w->link, fd, wire_length, stoptime);
+	}
 	close(fd);
 
+	if(actual == wire_length && transaction) {
+		write_transaction(q, transaction);
+	}
+	free(transaction);
+
 	*total_bytes += actual;
 
-	if(actual != length)
+	if(actual != wire_length)
 		return WORKER_FAILURE;
 
 	timestamp_t current_time = timestamp_get();
@@ -2669,7 +3840,7 @@ static work_queue_result_code_t send_directory( struct work_queue *q, struct wor
 			if(S_ISDIR(local_info.st_mode))  {
 				result = send_directory( q, w, t, localpath, remotepath, total_bytes, flags );
 			} else {
-				result = send_file( q, w, t, localpath, remotepath, 0, 0, total_bytes, flags );
+				result = send_file( q, w, t, localpath, remotepath, 0, 0, total_bytes, flags, NULL );
 			}
 		} else {
 			debug(D_NOTICE, "Cannot stat file %s: %s", localpath, strerror(errno));
@@ -2686,6 +3857,134 @@ static work_queue_result_code_t send_directory( struct work_queue *q, struct wor
 	return result;
 }
 
+/*
+Choose a worker from which w can fetch the cached file cached_name, instead of
+the master sending it. The source must have the same version of the file, and
+must be serving fewer than q->peer_transfer_fanout peers. It may still be
+receiving the file itself, in which case its peers wait for it. As every
+worker that gets a file can serve it in turn, the copies of a file spread as a
+tree with that fan-out, and the master sends only the first one.
+Returns 0 if the master should send the file.
+*/
+static int peer_transfer_depth(struct work_queue_worker *w, const char *cached_name)
+{
+	struct work_queue_peer_transfer *p = hash_table_lookup(w->peer_pending, cached_name);
+	return p ? p->depth : 0;
+}
+
+static struct work_queue_worker *find_peer_source(struct work_queue *q, struct work_queue_worker *w, const char *cached_name, struct stat *local_info)
+{
+	if(q->peer_transfer_fanout < 1 || w->foreman || w->peer_port < 1)
+		return 0;
+
+	struct set *holders = hash_table_lookup(q->file_worker_table, cached_name);
+	if(!holders)
+		return 0;
+
+	struct work_queue_worker *s;
+	struct work_queue_worker *best = 0;
+	int best_depth = 0;
+
+	set_first_element(holders);
+	while((s = set_next_element(holders))) {
+		if(s == w || s->foreman || s->peer_port < 1)
+			continue;
+
+		if(s->peer_serving >= q->peer_transfer_fanout)
+			continue;
+
+		struct stat *remote_info = hash_table_lookup(s->current_files, cached_name);
+		if(!remote_info || remote_info->st_size != local_info->st_size || remote_info->st_mtime != local_info->st_mtime)
+			continue;
+
+		/* Prefer sources closer to the master, to keep the tree shallow. */
+		int depth = peer_transfer_depth(s, cached_name);
+		if(!best || depth < best_depth || (depth == best_depth && s->peer_serving < best->peer_serving)) {
+			best = s;
+			best_depth = depth;
+		}
+	}
+
+	return best;
+}
+
+/*
+Ask w to fetch a cached file from source. The worker reports when the file is
+in its cache with "info peer-received", or with "info peer-failed" that it
+could not get it, in which case the master sends the file instead.
+*/
+static work_queue_result_code_t send_peer_file(struct work_queue *q, struct work_queue_worker *w, struct work_queue_worker *source, struct work_queue_file *tf, struct stat *local_info)
+{
+	int mode = (local_info->st_mode | 0600) & 0777;
+
+	debug(D_WQ, "%s (%s) fetches %s from %s (%s)", w->hostname, w->addrport, tf->cached_name, source->hostname, source->addrport);
+
+	if(send_worker_msg(q, w, "peerget %s %s %d %"PRId64" 0%o %d\n", tf->cached_name, source->peer_addr, source->peer_port, (int64_t) local_info->st_size, mode, tf->flags) < 0)
+		return WORKER_FAILURE;
+
+	struct work_queue_peer_transfer *p = hash_table_remove(w->peer_pending, tf->cached_name);
+	if(!p)
+		p = malloc(sizeof(*p));
+
+	strcpy(p->source, source->hashkey);
+	p->depth = peer_transfer_depth(source, tf->cached_name) + 1;
+	hash_table_insert(w->peer_pending, tf->cached_name, p);
+
+	source->peer_serving++;
+
+	return SUCCESS;
+}
+
+/*
+Content digests. Workers with a content cache (see work_queue_content_cache.h)
+announce the digests of the files they have, and keep the files put with a
+digest. The master sends a digest message instead of a file that the worker
+already has under another name, or from another master. The digest of each
+version of a local file is computed once.
+*/
+
+struct work_queue_local_digest {
+	time_t mtime;
+	off_t size;
+	char digest[MD5_DIGEST_LENGTH_HEX + 1];
+};
+
+static const char *local_file_digest(struct work_queue *q, const char *path, struct stat *info)
+{
+	struct work_queue_local_digest *d = hash_table_lookup(q->local_digests, path);
+	if(d && d->mtime == info->st_mtime && d->size == info->st_size)
+		return d->digest;
+
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	if(!md5_file(path, digest)) {
+		debug(D_NOTICE, "Cannot compute the digest of %s: %s", path, strerror(errno));
+		return 0;
+	}
+
+	if(!d) {
+		d = malloc(sizeof(*d));
+		hash_table_insert(q->local_digests, path, d);
+	}
+
+	d->mtime = info->st_mtime;
+	d->size = info->st_size;
+	strcpy(d->digest, md5_string(digest));
+
+	return d->digest;
+}
+
+static work_queue_result_code_t send_content_digest(struct work_queue *q, struct work_queue_worker *w, struct work_queue_file *tf, const char *digest, struct stat *local_info)
+{
+	int mode = (local_info->st_mode | 0600) & 0777;
+
+	debug(D_WQ, "%s (%s) has the contents of %s in its content cache", w->hostname, w->addrport, tf->cached_name);
+
+	if(send_worker_msg(q, w, "digest %s %s %"PRId64" 0%o %d\n", tf->cached_name, digest, (int64_t) local_info->st_size, mode, tf->flags) < 0)
+		return WORKER_FAILURE;
+
+	return SUCCESS;
+}
+
 /*
 Send a file or directory to a remote worker, if it is not already cached.
 The local file name should already have been expanded by the caller.
@@ -2712,18 +4011,35 @@ static work_queue_result_code_t send_file_or_directory( struct work_queue *q, st
 		debug(D_NOTICE|D_WQ, "File %s changed locally. Task %d will be executed with an older version.", expanded_local_name, t->taskid);
 	}
 	else if(!remote_info) {
-		/* If not on the worker, send it. */
-		if(S_ISDIR(local_info.st_mode)) {
+		/* If not on the worker, take it from its content cache, have it
+		 * fetched from a peer, or send it. */
+		const char *digest = 0;
+		if(w->content_cache && tf->type == WORK_QUEUE_FILE && S_ISREG(local_info.st_mode) && q->content_digest_min_size >= 0 && local_info.st_size >= q->content_digest_min_size) {
+			digest = local_file_digest(q, expanded_local_name, &local_info);
+		}
+
+		int digest_cached = digest && hash_table_lookup(w->content_digests, digest);
+
+		struct work_queue_worker *source = 0;
+		if(!digest_cached && tf->type == WORK_QUEUE_FILE && (tf->flags & WORK_QUEUE_CACHE) && S_ISREG(local_info.st_mode) && local_info.st_size >= q->peer_transfer_min_size) {
+			source = find_peer_source(q, w, tf->cached_name, &local_info);
+		}
+
+		if(digest_cached) {
+			result = send_content_digest(q, w, tf, digest, &local_info);
+		} else if(source) {
+			result = send_peer_file(q, w, source, tf, &local_info);
+		} else if(S_ISDIR(local_info.st_mode)) {
 			result = send_directory(q, w, t, expanded_local_name, tf->cached_name, total_bytes, tf->flags);
 		} else {
-			result = send_file(q, w, t, expanded_local_name, tf->cached_name, tf->offset, tf->piece_length, total_bytes, tf->flags);
+			result = send_file(q, w, t, expanded_local_name, tf->cached_name, tf->offset, tf->piece_length, total_bytes, tf->flags, digest);
 		}
 
 		if(result == SUCCESS && tf->flags & WORK_QUEUE_CACHE) {
 			remote_info = malloc(sizeof(*remote_info));
 			if(remote_info) {
 				memcpy(remote_info, &local_info, sizeof(local_info));
-				hash_table_insert(w->current_files, tf->cached_name, remote_info);
+				worker_file_insert(q, w, tf->cached_name, remote_info);
 			} else {
 				debug(D_NOTICE, "Cannot allocate memory for cache entry for input file %s at %s (%s)", expanded_local_name, w->hostname, w->addrport);
 			}
@@ -2807,6 +4123,65 @@ static char *expand_envnames(struct work_queue_worker *w, const char *payload)
 	return expanded_name;
 }
 
+/*
+Send again a cached file that w could not get from one of its peers, or
+from its content cache, which then no longer has the file under its digest.
+The worker holds the tasks that need the file until it arrives. If none of the
+tasks of w needs the file anymore, or it cannot be sent, the worker is told
+to drop it instead, and the tasks waiting for it come back as forsaken.
+*/
+static work_queue_msg_code_t resend_worker_file(struct work_queue *q, struct work_queue_worker *w, const char *cached_name)
+{
+	struct work_queue_task *t;
+	struct work_queue_file *tf = 0;
+	uint64_t taskid;
+
+	itable_firstkey(w->current_tasks);
+	while(!tf && itable_nextkey(w->current_tasks, &taskid, (void **) &t)) {
+		if(!t->input_files)
+			continue;
+
+		list_first_item(t->input_files);
+		while((tf = list_next_item(t->input_files))) {
+			if(tf->type == WORK_QUEUE_FILE && !strcmp(tf->cached_name, cached_name))
+				break;
+		}
+	}
+
+	work_queue_result_code_t result = APP_FAILURE;
+	int64_t total_bytes = 0;
+
+	if(tf) {
+		char *expanded_payload = expand_envnames(w, tf->payload);
+		struct stat local_info;
+		if(expanded_payload && stat(expanded_payload, &local_info) == 0) {
+			const char *digest = 0;
+			if(w->content_cache && S_ISREG(local_info.st_mode) && q->content_digest_min_size >= 0 && local_info.st_size >= q->content_digest_min_size) {
+				digest = local_file_digest(q, expanded_payload, &local_info);
+			}
+			if(digest) {
+				hash_table_remove(w->content_digests, digest);
+			}
+			result = send_file(q, w, t, expanded_payload, tf->cached_name, tf->offset, tf->piece_length, &total_bytes, tf->flags, digest);
+		}
+		free(expanded_payload);
+	}
+
+	if(result == WORKER_FAILURE)
+		return MSG_FAILURE;
+
+	if(result == SUCCESS) {
+		t->bytes_sent        += total_bytes;
+		t->bytes_transferred += total_bytes;
+		w->total_bytes_transferred += total_bytes;
+		q->stats->bytes_sent += total_bytes;
+	} else {
+		delete_worker_file(q, w, cached_name, 0, 0);
+	}
+
+	return MSG_PROCESSED;
+}
+
 static work_queue_result_code_t send_input_file(struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, struct work_queue_file *f)
 {
 
@@ -2822,7 +4197,7 @@ static work_queue_result_code_t send_input_file(struct work_queue *q, struct wor
 		debug(D_WQ, "%s (%s) needs literal as %s", w->hostname, w->addrport, f->remote_name);
 		time_t stoptime = time(0) + get_transfer_wait_time(q, w, t, f->length);
 		send_worker_msg(q,w, "put %s %d %o %d\n",f->cached_name, f->length, 0777, f->flags);
-		actual = link_putlstring(w->link, f->payload, f->length, stoptime);
+		actual = send_worker_data(q, w, f->payload, f->length, stoptime - time(0));
 		if(actual!=f->length) {
 			result = WORKER_FAILURE;
 		}
@@ -2837,7 +4212,7 @@ static work_queue_result_code_t send_input_file(struct work_queue *q, struct wor
 	case WORK_QUEUE_URL:
 		debug(D_WQ, "%s (%s) needs %s from the url, %s %d", w->hostname, w->addrport, f->cached_name, f->payload, f->length);
 		send_worker_msg(q,w, "url %s %d 0%o %d\n",f->cached_name, f->length, 0777, f->flags);
-		link_putlstring(w->link, f->payload, f->length, time(0) + q->short_timeout);
+		send_worker_data(q, w, f->payload, f->length, q->short_timeout);
 		break;
 
 	case WORK_QUEUE_DIRECTORY:
@@ -2950,11 +4325,73 @@ static work_queue_result_code_t send_input_files( struct work_queue *q, struct w
 	return SUCCESS;
 }
 
-/* if max defined, use minimum of max or largest worker
- * else if min is less than largest, chose largest, otherwise 'infinity' */
-#define task_worker_box_size_resource(w, min, max, field)\
-	( max->field  >  -1 ? max->field :\
-	  min->field <= w->resources->field.largest ? w->resources->field.largest : w->resources->field.largest + 1 )
+/* if max defined, use minimum of max or largest worker
+ * else if min is less than largest, chose largest, otherwise 'infinity' */
+#define task_worker_box_size_resource(w, min, max, field)\
+	( max->field  >  -1 ? max->field :\
+	  min->field <= w->resources->field.largest ? w->resources->field.largest : w->resources->field.largest + 1 )
+
+/*
+NUMA nodes. A worker that pins tasks to cores (work_queue_worker --pin-cores)
+reports its NUMA nodes. The master suggests to it a node for each task, the
+one with the fewest free cores that fit the task, counting the cores of the
+tasks it suggested the node for, and prefers the workers that have such a
+node, so that tasks are packed within sockets. The worker follows the
+suggestion when the node has enough free cores.
+*/
+
+/* Cores of the largest NUMA node of w. */
+static int worker_numa_largest_node(struct work_queue_worker *w)
+{
+	int node, largest = 0;
+
+	for(node = 0; node < w->numa_nodes; node++)
+		largest = MAX(largest, w->numa_node_cores[node]);
+
+	return largest;
+}
+
+/* NUMA node of w that fits cores most tightly, or -1 if none does, or w does not report its nodes. */
+static int worker_numa_node_for(struct work_queue_worker *w, int64_t cores)
+{
+	if(w->numa_nodes < 2 || cores < 1 || cores > worker_numa_largest_node(w))
+		return -1;
+
+	int64_t *free_cores = malloc(w->numa_nodes * sizeof(int64_t));
+	int node;
+
+	for(node = 0; node < w->numa_nodes; node++)
+		free_cores[node] = w->numa_node_cores[node];
+
+	uint64_t taskid;
+	void *value;
+	itable_firstkey(w->numa_task_nodes);
+	while(itable_nextkey(w->numa_task_nodes, &taskid, &value)) {
+		node = (int) (uintptr_t) value - 1;
+		struct rmsummary *box = itable_lookup(w->current_tasks_boxes, taskid);
+		if(box && node < w->numa_nodes)
+			free_cores[node] -= box->cores;
+	}
+
+	int best = -1;
+	for(node = 0; node < w->numa_nodes; node++) {
+		if(free_cores[node] >= cores && (best < 0 || free_cores[node] < free_cores[best]))
+			best = node;
+	}
+
+	free(free_cores);
+
+	return best;
+}
+
+/* False if the task would have to span the NUMA nodes of w, while it could fit in one of them. */
+static int worker_numa_fits(struct work_queue_worker *w, int64_t cores)
+{
+	if(w->numa_nodes < 2 || cores < 1 || cores > worker_numa_largest_node(w))
+		return 1;
+
+	return worker_numa_node_for(w, cores) > -1;
+}
 
 static struct rmsummary *task_worker_box_size(struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t) {
 
@@ -2993,25 +4430,35 @@ static work_queue_result_code_t start_one_task(struct work_queue *q, struct work
 		return result;
 	}
 
-	send_worker_msg(q,w, "task %lld\n",  (long long) t->taskid);
+	buffer_t B[1];
+	buffer_init(B);
+	buffer_abortonfailure(B, 1);
+
+	buffer_putfstring(B, "task %lld\n",  (long long) t->taskid);
 
 	long long cmd_len = strlen(command_line);
-	send_worker_msg(q,w, "cmd %lld\n", (long long) cmd_len);
-	link_putlstring(w->link, command_line, cmd_len, /* stoptime */ time(0) + (w->foreman ? q->long_timeout : q->short_timeout));
+	buffer_putfstring(B, "cmd %lld\n", (long long) cmd_len);
+	buffer_putlstring(B, command_line, cmd_len);
 	debug(D_WQ, "%s\n", command_line);
 	free(command_line);
 
-	send_worker_msg(q,w, "category %s\n", t->category);
+	buffer_putfstring(B, "category %s\n", t->category);
 
-	send_worker_msg(q,w, "cores %"PRId64"\n",  limits->cores);
-	send_worker_msg(q,w, "memory %"PRId64"\n", limits->memory);
-	send_worker_msg(q,w, "disk %"PRId64"\n",   limits->disk);
-	send_worker_msg(q,w, "gpus %"PRId64"\n",   limits->gpus);
+	buffer_putfstring(B, "cores %"PRId64"\n",  limits->cores);
+	buffer_putfstring(B, "memory %"PRId64"\n", limits->memory);
+	buffer_putfstring(B, "disk %"PRId64"\n",   limits->disk);
+	buffer_putfstring(B, "gpus %"PRId64"\n",   limits->gpus);
 
 	/* Do not specify end, wall_time if running the resource monitor. We let the monitor police these resources. */
 	if(q->monitor_mode == MON_DISABLED) {
-		send_worker_msg(q,w, "end_time %"PRIu64"\n",  limits->end);
-		send_worker_msg(q,w, "wall_time %"PRIu64"\n", limits->wall_time);
+		buffer_putfstring(B, "end_time %"PRIu64"\n",  limits->end);
+		buffer_putfstring(B, "wall_time %"PRIu64"\n", limits->wall_time);
+	}
+
+	int numa_node = worker_numa_node_for(w, limits->cores);
+	if(numa_node > -1) {
+		buffer_putfstring(B, "numa_node %d\n", numa_node);
+		itable_insert(w->numa_task_nodes, t->taskid, (void *) (uintptr_t) (numa_node + 1));
 	}
 
 	itable_insert(w->current_tasks_boxes, t->taskid, limits);
@@ -3023,7 +4470,7 @@ static work_queue_result_code_t start_one_task(struct work_queue *q, struct work
 	char *var;
 	list_first_item(t->env_list);
 	while((var=list_next_item(t->env_list))) {
-		send_worker_msg(q, w,"env %zu\n%s\n", strlen(var), var);
+		buffer_putfstring(B, "env %zu\n%s\n", strlen(var), var);
 	}
 
 	if(t->input_files) {
@@ -3031,11 +4478,11 @@ static work_queue_result_code_t start_one_task(struct work_queue *q, struct work
 		list_first_item(t->input_files);
 		while((tf = list_next_item(t->input_files))) {
 			if(tf->type == WORK_QUEUE_DIRECTORY) {
-				send_worker_msg(q,w, "dir %s\n", tf->remote_name);
+				buffer_putfstring(B, "dir %s\n", tf->remote_name);
 			} else {
 				char remote_name_encoded[PATH_MAX];
 				url_encode(tf->remote_name, remote_name_encoded, PATH_MAX);
-				send_worker_msg(q,w, "infile %s %s %d\n", tf->cached_name, remote_name_encoded, tf->flags);
+				buffer_putfstring(B, "infile %s %s %d\n", tf->cached_name, remote_name_encoded, tf->flags);
 			}
 		}
 	}
@@ -3046,14 +4493,18 @@ static work_queue_result_code_t start_one_task(struct work_queue *q, struct work
 		while((tf = list_next_item(t->output_files))) {
 			char remote_name_encoded[PATH_MAX];
 			url_encode(tf->remote_name, remote_name_encoded, PATH_MAX);
-			send_worker_msg(q,w, "outfile %s %s %d\n", tf->cached_name, remote_name_encoded, tf->flags);
+			buffer_putfstring(B, "outfile %s %s %d\n", tf->cached_name, remote_name_encoded, tf->flags);
 		}
 	}
 
-	// send_worker_msg returns the number of bytes sent, or a number less than
-	// zero to indicate errors. We are lazy here, we only check the last
-	// message we sent to the worker (other messages may have failed above).
-	int result_msg = send_worker_msg(q,w, "end\n");
+	buffer_putliteral(B, "end\n");
+
+	debug(D_WQ, "tx to %s (%s): task %lld (%zu bytes)", w->hostname, w->addrport, (long long) t->taskid, buffer_pos(B));
+
+	// The whole description of the task is sent with a single write, or
+	// added to the batch of tasks for the worker.
+	int result_msg = send_worker_task(q, w, B);
+	buffer_free(B);
 
 	if(result_msg > -1)
 	{
@@ -3154,7 +4605,96 @@ static void compute_capacity(const struct work_queue *q, struct work_queue_stats
 	s->capacity_disk   = DIV_INT_ROUND_UP(capacity.resources->disk   * ratio, count);
 }
 
-static int check_hand_against_task(struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t) {
+/* Workers that may run tasks are kept in q->worker_index, in lists bucketed by
+ * their free cores (counting overcommit), so that the schedulers below only
+ * look at workers that could possibly fit a task, instead of at the whole
+ * worker_table. */
+
+static int worker_index_bucket(int64_t free_cores)
+{
+	int b = 0;
+
+	while(free_cores > 0 && b < WORKER_INDEX_BUCKETS - 1) {
+		free_cores >>= 1;
+		b++;
+	}
+
+	return b;
+}
+
+static void worker_index_remove(struct work_queue *q, struct work_queue_worker *w)
+{
+	if(w->index_bucket < 0)
+		return;
+
+	if(w->index_prev) {
+		w->index_prev->index_next = w->index_next;
+	} else {
+		q->worker_index[w->index_bucket] = w->index_next;
+	}
+
+	if(w->index_next) {
+		w->index_next->index_prev = w->index_prev;
+	}
+
+	w->index_prev = NULL;
+	w->index_next = NULL;
+	w->index_bucket = -1;
+}
+
+static void worker_index_update(struct work_queue *q, struct work_queue_worker *w)
+{
+	/* worker has not reported any resources yet, or cannot run tasks. */
+	if(w->resources->tag < 0 || w->resources->workers.total < 1) {
+		worker_index_remove(q, w);
+		return;
+	}
+
+	int64_t free_cores = overcommitted_resource_total(q, w->resources->cores.total, 1) - w->resources->cores.inuse;
+	int b = worker_index_bucket(free_cores);
+
+	if(b == w->index_bucket)
+		return;
+
+	worker_index_remove(q, w);
+
+	w->index_next = q->worker_index[b];
+	if(w->index_next) {
+		w->index_next->index_prev = w;
+	}
+	q->worker_index[b] = w;
+	w->index_bucket = b;
+}
+
+static void worker_index_rebuild(struct work_queue *q)
+{
+	char *key;
+	struct work_queue_worker *w;
+
+	hash_table_firstkey(q->worker_table);
+	while(hash_table_nextkey(q->worker_table, &key, (void **) &w)) {
+		worker_index_update(q, w);
+	}
+}
+
+/* Lowest bucket of q->worker_index that may hold a worker that fits a task
+ * with the given min and max resources. When the task does not specify its
+ * cores, it takes at least one core. */
+static int worker_index_first_bucket(const struct rmsummary *min, const struct rmsummary *max)
+{
+	int64_t cores;
+	if(max->cores > -1) {
+		cores = max->cores;
+	} else {
+		cores = MAX(min->cores, 1);
+	}
+
+	return worker_index_bucket(cores);
+}
+
+/* min and max are the resources of the task, as given by task_min_resources
+ * and task_max_resources, computed once by the caller for all the workers. */
+static int check_hand_against_task(struct work_queue *q, struct work_queue_worker *w, const struct rmsummary *min, const struct rmsummary *max) {
 
 	/* worker has no reported any resources yet */
 	if(w->resources->tag < 0)
@@ -3171,88 +4711,129 @@ static int check_hand_against_task(struct work_queue *q, struct work_queue_worke
 		}
 	}
 
-	struct rmsummary *limits = task_worker_box_size(q, w, t);
-
-	int ok = 1;
-
-	if(w->resources->cores.inuse + limits->cores > overcommitted_resource_total(q, w->resources->cores.total, 1)) {
-		ok = 0;
+	/* same as task_worker_box_size, without allocating the box. */
+	if(w->resources->cores.inuse + task_worker_box_size_resource(w, min, max, cores) > overcommitted_resource_total(q, w->resources->cores.total, 1)) {
+		return 0;
 	}
 
-	if(w->resources->memory.inuse + limits->memory > overcommitted_resource_total(q, w->resources->memory.total, 0)) {
-		ok = 0;
+	if(w->resources->memory.inuse + task_worker_box_size_resource(w, min, max, memory) > overcommitted_resource_total(q, w->resources->memory.total, 0)) {
+		return 0;
 	}
 
-	if(w->resources->disk.inuse + limits->disk > w->resources->disk.total) { /* No overcommit disk */
-		ok = 0;
+	if(w->resources->disk.inuse + task_worker_box_size_resource(w, min, max, disk) > w->resources->disk.total) { /* No overcommit disk */
+		return 0;
 	}
 
-	if(w->resources->gpus.inuse + limits->gpus > overcommitted_resource_total(q, w->resources->gpus.total, 0)) {
-		ok = 0;
+	if(w->resources->gpus.inuse + task_worker_box_size_resource(w, min, max, gpus) > overcommitted_resource_total(q, w->resources->gpus.total, 0)) {
+		return 0;
 	}
 
-	rmsummary_delete(limits);
+	return 1;
+}
+
+static struct work_queue_worker *find_worker_by_fcfs(struct work_queue *q, struct work_queue_task *t)
+{
+	const struct rmsummary *min = task_min_resources(q, t);
+	const struct rmsummary *max = task_max_resources(q, t);
 
-	return ok;
+	struct work_queue_worker *w;
+	struct work_queue_worker *first = NULL;
+	int b;
+
+	/* the first worker that fits the task, unless a later one fits it within a NUMA node. */
+	for(b = worker_index_first_bucket(min, max); b < WORKER_INDEX_BUCKETS; b++) {
+		for(w = q->worker_index[b]; w; w = w->index_next) {
+			if( check_hand_against_task(q, w, min, max) ) {
+				if(worker_numa_fits(w, task_worker_box_size_resource(w, min, max, cores))) {
+					return w;
+				} else if(!first) {
+					first = w;
+				}
+			}
+		}
+	}
+	return first;
 }
 
+/* Only the workers that have some of the task's cached input files are
+ * scored, by looking them up in q->file_worker_table. If none of those fit
+ * the task, fall back to the first worker that does. */
 static struct work_queue_worker *find_worker_by_files(struct work_queue *q, struct work_queue_task *t)
 {
-	char *key;
+	const struct rmsummary *min = task_min_resources(q, t);
+	const struct rmsummary *max = task_max_resources(q, t);
+
 	struct work_queue_worker *w;
 	struct work_queue_worker *best_worker = 0;
 	int64_t most_task_cached_bytes = 0;
-	int64_t task_cached_bytes;
+	int64_t *task_cached_bytes;
 	struct stat *remote_info;
 	struct work_queue_file *tf;
+	struct set *holders;
+	uint64_t key;
 
-	hash_table_firstkey(q->worker_table);
-	while(hash_table_nextkey(q->worker_table, &key, (void **) &w)) {
-		if( check_hand_against_task(q, w, t) ) {
-			task_cached_bytes = 0;
-			list_first_item(t->input_files);
-			while((tf = list_next_item(t->input_files))) {
-				if((tf->type == WORK_QUEUE_FILE || tf->type == WORK_QUEUE_FILE_PIECE) && (tf->flags & WORK_QUEUE_CACHE)) {
-					remote_info = hash_table_lookup(w->current_files, tf->cached_name);
-					if(remote_info)
-						task_cached_bytes += remote_info->st_size;
+	struct itable *cached_bytes = itable_create(0);
+
+	list_first_item(t->input_files);
+	while((tf = list_next_item(t->input_files))) {
+		if((tf->type == WORK_QUEUE_FILE || tf->type == WORK_QUEUE_FILE_PIECE) && (tf->flags & WORK_QUEUE_CACHE)) {
+			holders = hash_table_lookup(q->file_worker_table, tf->cached_name);
+			if(!holders)
+				continue;
+
+			set_first_element(holders);
+			while((w = set_next_element(holders))) {
+				remote_info = hash_table_lookup(w->current_files, tf->cached_name);
+				if(!remote_info)
+					continue;
+
+				task_cached_bytes = itable_lookup(cached_bytes, (uintptr_t) w);
+				if(!task_cached_bytes) {
+					task_cached_bytes = calloc(1, sizeof(*task_cached_bytes));
+					itable_insert(cached_bytes, (uintptr_t) w, task_cached_bytes);
 				}
+
+				*task_cached_bytes += remote_info->st_size;
 			}
+		}
+	}
 
-			if(!best_worker || task_cached_bytes > most_task_cached_bytes) {
+	itable_firstkey(cached_bytes);
+	while(itable_nextkey(cached_bytes, &key, (void **) &task_cached_bytes)) {
+		w = (struct work_queue_worker *) (uintptr_t) key;
+		if( check_hand_against_task(q, w, min, max) ) {
+			if(!best_worker || *task_cached_bytes > most_task_cached_bytes) {
 				best_worker = w;
-				most_task_cached_bytes = task_cached_bytes;
+				most_task_cached_bytes = *task_cached_bytes;
 			}
 		}
+		free(task_cached_bytes);
 	}
 
-	return best_worker;
-}
+	itable_delete(cached_bytes);
 
-static struct work_queue_worker *find_worker_by_fcfs(struct work_queue *q, struct work_queue_task *t)
-{
-	char *key;
-	struct work_queue_worker *w;
-	hash_table_firstkey(q->worker_table);
-	while(hash_table_nextkey(q->worker_table, &key, (void**)&w)) {
-		if( check_hand_against_task(q, w, t) ) {
-			return w;
-		}
+	if(best_worker) {
+		return best_worker;
+	} else {
+		return find_worker_by_fcfs(q, t);
 	}
-	return NULL;
 }
 
 static struct work_queue_worker *find_worker_by_random(struct work_queue *q, struct work_queue_task *t)
 {
-	char *key;
+	const struct rmsummary *min = task_min_resources(q, t);
+	const struct rmsummary *max = task_max_resources(q, t);
+
 	struct work_queue_worker *w = NULL;
 	int random_worker;
 	struct list *valid_workers = list_create();
+	int b;
 
-	hash_table_firstkey(q->worker_table);
-	while(hash_table_nextkey(q->worker_table, &key, (void**)&w)) {
-		if(check_hand_against_task(q, w, t)) {
-			list_push_tail(valid_workers, w);
+	for(b = worker_index_first_bucket(min, max); b < WORKER_INDEX_BUCKETS; b++) {
+		for(w = q->worker_index[b]; w; w = w->index_next) {
+			if(check_hand_against_task(q, w, min, max)) {
+				list_push_tail(valid_workers, w);
+			}
 		}
 	}
 
@@ -3307,7 +4888,9 @@ static int compare_worst_fit(struct work_queue_resources *a, struct work_queue_r
 
 static struct work_queue_worker *find_worker_by_worst_fit(struct work_queue *q, struct work_queue_task *t)
 {
-	char *key;
+	const struct rmsummary *min = task_min_resources(q, t);
+	const struct rmsummary *max = task_max_resources(q, t);
+
 	struct work_queue_worker *w;
 	struct work_queue_worker *best_worker = NULL;
 
@@ -3317,22 +4900,33 @@ static struct work_queue_worker *find_worker_by_worst_fit(struct work_queue *q,
 	memset(&bres, 0, sizeof(struct work_queue_resources));
 	memset(&wres, 0, sizeof(struct work_queue_resources));
 
-	hash_table_firstkey(q->worker_table);
-	while(hash_table_nextkey(q->worker_table, &key, (void **) &w)) {
-		if( check_hand_against_task(q, w, t) ) {
+	/* Without overcommit, buckets are ordered by free cores, thus the worst
+	 * fit is in the highest bucket with any worker that fits the task. */
+	int overcommit = q->asynchrony_multiplier > 1 || q->asynchrony_modifier > 0;
 
-			//Use total field on bres, wres to indicate free resources.
-			wres.cores.total   = w->resources->cores.total   - w->resources->cores.inuse;
-			wres.memory.total  = w->resources->memory.total  - w->resources->memory.inuse;
-			wres.disk.total    = w->resources->disk.total    - w->resources->disk.inuse;
-			wres.gpus.total    = w->resources->gpus.total    - w->resources->gpus.inuse;
+	int first = worker_index_first_bucket(min, max);
+	int b;
 
-			if(!best_worker || compare_worst_fit(&bres, &wres))
-			{
-				best_worker = w;
-				memcpy(&bres, &wres, sizeof(struct work_queue_resources));
+	for(b = WORKER_INDEX_BUCKETS - 1; b >= first; b--) {
+		for(w = q->worker_index[b]; w; w = w->index_next) {
+			if( check_hand_against_task(q, w, min, max) ) {
+
+				//Use total field on bres, wres to indicate free resources.
+				wres.cores.total   = w->resources->cores.total   - w->resources->cores.inuse;
+				wres.memory.total  = w->resources->memory.total  - w->resources->memory.inuse;
+				wres.disk.total    = w->resources->disk.total    - w->resources->disk.inuse;
+				wres.gpus.total    = w->resources->gpus.total    - w->resources->gpus.inuse;
+
+				if(!best_worker || compare_worst_fit(&bres, &wres))
+				{
+					best_worker = w;
+					memcpy(&bres, &wres, sizeof(struct work_queue_resources));
+				}
 			}
 		}
+
+		if(best_worker && !overcommit)
+			break;
 	}
 
 	return best_worker;
@@ -3340,19 +4934,23 @@ static struct work_queue_worker *find_worker_by_worst_fit(struct work_queue *q,
 
 static struct work_queue_worker *find_worker_by_time(struct work_queue *q, struct work_queue_task *t)
 {
-	char *key;
+	const struct rmsummary *min = task_min_resources(q, t);
+	const struct rmsummary *max = task_max_resources(q, t);
+
 	struct work_queue_worker *w;
 	struct work_queue_worker *best_worker = 0;
 	double best_time = HUGE_VAL;
-
-	hash_table_firstkey(q->worker_table);
-	while(hash_table_nextkey(q->worker_table, &key, (void **) &w)) {
-		if(check_hand_against_task(q, w, t)) {
-			if(w->total_tasks_complete > 0) {
-				double t = (w->total_task_time + w->total_transfer_time) / w->total_tasks_complete;
-				if(!best_worker || t < best_time) {
-					best_worker = w;
-					best_time = t;
+	int b;
+
+	for(b = worker_index_first_bucket(min, max); b < WORKER_INDEX_BUCKETS; b++) {
+		for(w = q->worker_index[b]; w; w = w->index_next) {
+			if(check_hand_against_task(q, w, min, max)) {
+				if(w->total_tasks_complete > 0) {
+					double t = (w->total_task_time + w->total_transfer_time) / w->total_tasks_complete;
+					if(!best_worker || t < best_time) {
+						best_worker = w;
+						best_time = t;
+					}
 				}
 			}
 		}
@@ -3403,6 +5001,7 @@ static void count_worker_resources(struct work_queue *q, struct work_queue_worke
 
 	if(w->resources->workers.total < 1)
 	{
+		worker_index_update(q, w);
 		return;
 	}
 
@@ -3413,6 +5012,8 @@ static void count_worker_resources(struct work_queue *q, struct work_queue_worke
 		w->resources->disk.inuse      += box->disk;
 		w->resources->gpus.inuse      += box->gpus;
 	}
+
+	worker_index_update(q, w);
 }
 
 static void update_max_worker(struct work_queue *q, struct work_queue_worker *w) {
@@ -3501,6 +5102,7 @@ static void reap_task_from_worker(struct work_queue *q, struct work_queue_worker
 		rmsummary_delete(task_box);
 
 	itable_remove(w->current_tasks_boxes, t->taskid);
+	itable_remove(w->numa_task_nodes, t->taskid);
 	itable_remove(w->current_tasks, t->taskid);
 	itable_remove(q->worker_task_map, t->taskid);
 	change_task_state(q, t, new_state);
@@ -3508,17 +5110,244 @@ static void reap_task_from_worker(struct work_queue *q, struct work_queue_worker
 	count_worker_resources(q, w);
 }
 
+/*
+Speculative prefetch. When no task can be dispatched, the master sends the
+cached input files of the tasks waiting in the ready list to busy workers that
+could run them once their current tasks finish, so that the transfers overlap
+with the execution of those tasks. A worker receives the inputs of at most
+q->prefetch_depth waiting tasks, while the files cached in it take no more
+than half of the disk not allocated to its running tasks. Prefetched files
+stay in the cache, and so count against that disk until they are removed.
+When a task leaves the ready list, its worker gets back the slot, and
+send_one_task prefers that worker for the task, if it fits it then. Only the
+files the master would send itself are prefetched: cached regular files, and
+not pieces, buffers, urls, thirdget files, or files named after the platform
+of the worker. Prefetching is disabled by default.
+*/
+
+struct work_queue_prefetch {
+	struct work_queue_worker *worker;
+};
+
+static int prefetch_file_wanted(struct work_queue_file *f)
+{
+	return f->type == WORK_QUEUE_FILE && (f->flags & WORK_QUEUE_CACHE) && !(f->flags & WORK_QUEUE_THIRDGET) && !strchr(f->payload, '$');
+}
+
+/* As check_hand_against_task, as if the worker were not running any task. */
+static int worker_could_run(struct work_queue *q, struct work_queue_worker *w, const struct rmsummary *min, const struct rmsummary *max)
+{
+	if(w->resources->tag < 0 || w->resources->workers.total < 1)
+		return 0;
+
+	struct blacklist_host_info *info = hash_table_lookup(q->worker_blacklist, w->hostname);
+	if(info && info->blacklisted)
+		return 0;
+
+	return task_worker_box_size_resource(w, min, max, cores) <= overcommitted_resource_total(q, w->resources->cores.total, 1)
+		&& task_worker_box_size_resource(w, min, max, memory) <= overcommitted_resource_total(q, w->resources->memory.total, 0)
+		&& task_worker_box_size_resource(w, min, max, disk) <= w->resources->disk.total
+		&& task_worker_box_size_resource(w, min, max, gpus) <= overcommitted_resource_total(q, w->resources->gpus.total, 0);
+}
+
+/* Fill sizes with the size of each input of t that would be prefetched, or -1. Returns false if there are none. */
+static int prefetch_input_sizes(struct work_queue_task *t, int64_t *sizes)
+{
+	struct work_queue_file *f;
+	struct stat info;
+	int wanted = 0;
+	int i = 0;
+
+	list_first_item(t->input_files);
+	while((f = list_next_item(t->input_files))) {
+		sizes[i] = -1;
+		if(prefetch_file_wanted(f) && stat(f->payload, &info) == 0 && S_ISREG(info.st_mode)) {
+			sizes[i] = info.st_size;
+			wanted = 1;
+		}
+		i++;
+	}
+
+	return wanted;
+}
+
+/* Bytes of the inputs of t that would be prefetched to w, or -1 if w already has all of them. */
+static int64_t prefetch_missing_bytes(struct work_queue_worker *w, struct work_queue_task *t, const int64_t *sizes)
+{
+	struct work_queue_file *f;
+	int64_t bytes = 0;
+	int missing = 0;
+	int i = 0;
+
+	list_first_item(t->input_files);
+	while((f = list_next_item(t->input_files))) {
+		if(sizes[i] >= 0 && !hash_table_lookup(w->current_files, f->cached_name)) {
+			bytes += sizes[i];
+			missing++;
+		}
+		i++;
+	}
+
+	return missing ? bytes : -1;
+}
+
+static void prefetch_task_inputs(struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, int64_t bytes)
+{
+	struct work_queue_file *f;
+	struct stat info;
+	int64_t total_bytes = 0;
+	work_queue_result_code_t result = SUCCESS;
+
+	debug(D_WQ, "prefetching %.2lf MB of inputs of task %d to %s (%s)", bytes / 1000000.0, t->taskid, w->hostname, w->addrport);
+
+	list_first_item(t->input_files);
+	while(result == SUCCESS && (f = list_next_item(t->input_files))) {
+		if(prefetch_file_wanted(f) && stat(f->payload, &info) == 0 && S_ISREG(info.st_mode)) {
+			result = send_file_or_directory(q, w, t, f, f->payload, &total_bytes);
+		}
+	}
+
+	w->total_bytes_transferred += total_bytes;
+	q->stats->bytes_sent += total_bytes;
+
+	if(result == WORKER_FAILURE) {
+		handle_worker_failure(q, w);
+		return;
+	}
+
+	/* recorded even if a file could not be sent, so that the task is not tried again. */
+	struct work_queue_prefetch *p = xxmalloc(sizeof(*p));
+	p->worker = w;
+	itable_insert(q->prefetch_tasks, t->taskid, p);
+
+	w->prefetch_count++;
+}
+
+/*
+Prefetch the inputs of one ready task. Returns 1 if some were sent. The inputs
+of each task are looked at once, and at most PREFETCH_MAX_CHECKS pairs of task
+and worker are considered, from the tasks of highest priority.
+*/
+static int prefetch_inputs(struct work_queue *q)
+{
+	struct work_queue_task *t;
+	struct work_queue_worker *w;
+	char *key;
+
+	if(q->prefetch_depth < 1)
+		return 0;
+
+	/* no more tasks than the workers could take are considered. */
+	int candidates = q->prefetch_depth * hash_table_size(q->worker_table);
+	int checks = PREFETCH_MAX_CHECKS;
+
+	priority_queue_first_item(q->ready_list);
+	while(candidates > 0 && checks > 0 && (t = priority_queue_next_item(q->ready_list))) {
+		if(itable_lookup(q->prefetch_tasks, t->taskid))
+			continue;
+		candidates--;
+
+		int64_t *sizes = xxmalloc((list_size(t->input_files) + 1) * sizeof(*sizes));
+		if(!prefetch_input_sizes(t, sizes)) {
+			free(sizes);
+			continue;
+		}
+
+		const struct rmsummary *min = task_min_resources(q, t);
+		const struct rmsummary *max = task_max_resources(q, t);
+
+		struct work_queue_worker *best = 0;
+		int64_t best_bytes = 0;
+
+		/* the busy worker that is missing the fewest bytes. Foremen report
+		 * the disk of all their workers, so they are left out. */
+		hash_table_firstkey(q->worker_table);
+		while(checks > 0 && hash_table_nextkey(q->worker_table, &key, (void **) &w)) {
+			if(w->foreman || itable_size(w->current_tasks) < 1 || w->prefetch_count >= q->prefetch_depth)
+				continue;
+
+			checks--;
+
+			if(!worker_could_run(q, w, min, max))
+				continue;
+
+			int64_t bytes = prefetch_missing_bytes(w, t, sizes);
+			if(bytes < 0)
+				continue;
+
+			/* tasks without a disk request take the whole disk of the worker,
+			 * which then has no room for prefetched files. */
+			int64_t budget = (w->resources->disk.total - w->resources->disk.inuse) * MEGABYTE / 2 - w->cached_bytes;
+			if(bytes > budget)
+				continue;
+
+			if(!best || bytes < best_bytes || (bytes == best_bytes && w->prefetch_count < best->prefetch_count)) {
+				best = w;
+				best_bytes = bytes;
+			}
+		}
+
+		free(sizes);
+
+		if(best) {
+			prefetch_task_inputs(q, best, t, best_bytes);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void prefetch_release(struct work_queue *q, uint64_t taskid)
+{
+	struct work_queue_prefetch *p = itable_remove(q->prefetch_tasks, taskid);
+	if(!p)
+		return;
+
+	p->worker->prefetch_count--;
+	free(p);
+}
+
+static void prefetch_forget_worker(struct work_queue *q, struct work_queue_worker *w)
+{
+	struct work_queue_prefetch *p;
+	uint64_t taskid;
+
+	itable_firstkey(q->prefetch_tasks);
+	while(w->prefetch_count > 0 && itable_nextkey(q->prefetch_tasks, &taskid, (void **) &p)) {
+		if(p->worker == w) {
+			prefetch_release(q, taskid);
+			itable_firstkey(q->prefetch_tasks);
+		}
+	}
+}
+
+/* The worker that received the inputs of t in advance, if it can run t now. */
+static struct work_queue_worker *prefetch_worker(struct work_queue *q, struct work_queue_task *t)
+{
+	struct work_queue_prefetch *p = itable_lookup(q->prefetch_tasks, t->taskid);
+	if(!p)
+		return 0;
+
+	if(!check_hand_against_task(q, p->worker, task_min_resources(q, t), task_max_resources(q, t)))
+		return 0;
+
+	return p->worker;
+}
+
 static int send_one_task( struct work_queue *q )
 {
 	struct work_queue_task *t;
 	struct work_queue_worker *w;
 
 	// Consider each task in the order of priority:
-	list_first_item(q->ready_list);
-	while( (t = list_next_item(q->ready_list))) {
+	priority_queue_first_item(q->ready_list);
+	while( (t = priority_queue_next_item(q->ready_list))) {
 
-		// Find the best worker for the task at the head of the list
-		w = find_best_worker(q,t);
+		// Find the best worker for the task at the head of the list,
+		// preferring the one that already received its inputs.
+		w = prefetch_worker(q,t);
+		if(!w) w = find_best_worker(q,t);
 
 		// If there is no suitable worker, consider the next task.
 		if(!w) continue;
@@ -3572,6 +5401,12 @@ static void ask_for_workers_updates(struct work_queue *q) {
 			}
 
 
+			// the worker is busy reading the transfers queued for it, which
+			// have their own timeouts.
+			if(worker_outbound_pending(w)) {
+				continue;
+			}
+
 			// send new keepalive check only (1) if we received a response since last keepalive check AND
 			// (2) we are past keepalive interval
 			if(w->last_msg_recv_time > w->last_update_msg_time) {
@@ -4432,13 +6267,20 @@ void work_queue_invalidate_cached_file(struct work_queue *q, const char *local_n
 }
 
 void work_queue_invalidate_cached_file_internal(struct work_queue *q, const char *filename) {
-	char *key;
+	struct set *holders = hash_table_lookup(q->file_worker_table, filename);
+	if(!holders)
+		return;
+
+	/* delete_worker_file below removes the workers from holders. */
+	struct list *workers = list_create();
 	struct work_queue_worker *w;
-	hash_table_firstkey(q->worker_table);
-	while(hash_table_nextkey(q->worker_table, &key, (void**)&w)) {
-		if(!hash_table_lookup(w->current_files, filename))
-			continue;
 
+	set_first_element(holders);
+	while((w = set_next_element(holders))) {
+		list_push_tail(workers, w);
+	}
+
+	while((w = list_pop_head(workers))) {
 		if(w->foreman) {
 			send_worker_msg(q, w, "invalidate-file %s\n", filename);
 		}
@@ -4468,6 +6310,8 @@ void work_queue_invalidate_cached_file_internal(struct work_queue *q, const char
 
 		delete_worker_file(q, w, filename, 0, 0);
 	}
+
+	list_delete(workers);
 }
 
 
@@ -4589,11 +6433,35 @@ struct work_queue *work_queue_create(int port)
 		link_address_local(q->master_link, address, &q->port);
 	}
 
+	q->poller = link_poller_create();
+	poller_add(q->poller, q->master_link, LINK_READ);
+
+	if(pipe(q->submit_pipe) < 0) {
+		debug(D_NOTICE, "Could not create work_queue submission pipe: %s", strerror(errno));
+		link_poller_delete(q->poller);
+		link_close(q->master_link);
+		free(q);
+		return 0;
+	}
+	fcntl(q->submit_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(q->submit_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(q->submit_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(q->submit_pipe[1], F_SETFD, FD_CLOEXEC);
+	q->submit_link = link_attach_to_fd(q->submit_pipe[0]);
+	poller_add(q->poller, q->submit_link, LINK_READ);
+
+	q->completed_tasks = list_create();
+
+	buffer_init(&q->log_buffer);
+	buffer_init(&q->transactions_buffer);
+	pthread_mutex_init(&q->completed_mutex, NULL);
+	pthread_cond_init(&q->completed_cond, NULL);
+
 	getcwd(q->workingdir,PATH_MAX);
 
 	q->next_taskid = 1;
 
-	q->ready_list = list_create();
+	q->ready_list = priority_queue_create();
 
 	q->tasks          = itable_create(0);
 
@@ -4602,6 +6470,7 @@ struct work_queue *work_queue_create(int port)
 	q->worker_table = hash_table_create(0, 0);
 	q->worker_blacklist = hash_table_create(0, 0);
 	q->worker_task_map = itable_create(0);
+	q->file_worker_table = hash_table_create(0, 0);
 
 	q->measured_local_resources   = rmsummary_create(-1);
 	q->current_max_worker         = rmsummary_create(-1);
@@ -4611,9 +6480,24 @@ struct work_queue *work_queue_create(int port)
 	q->stats_measure              = calloc(1, sizeof(struct work_queue_stats));
 
 	q->workers_with_available_results = hash_table_create(0, 0);
+	q->workers_with_outbound = hash_table_create(0, 0);
+	q->workers_with_task_batch = hash_table_create(0, 0);
+	q->async_transfer_min_size = 1*MEGABYTE;
+	q->task_batch_max = 64;
+	q->peer_transfer_fanout = 0;
+	q->peer_transfer_min_size = 1*MEGABYTE;
+	q->local_digests = hash_table_create(0, 0);
+	q->compressed_copies = hash_table_create(0, 0);
+	q->compressing = list_create();
+	q->content_digest_min_size = 0;
+	q->prefetch_depth = 0;
+	q->prefetch_tasks = itable_create(0);
+	q->io_threads = 0;
+	q->io_claimed = hash_table_create(0, 0);
+	q->io_pending = list_create();
 
 	// The poll table is initially null, and will be created
-	// (and resized) as needed by build_poll_table.
+	// (and resized) as needed by poll_active_workers.
 	q->poll_table_size = 8;
 
 	q->worker_selection_algorithm = wq_option_scheduler;
@@ -4880,8 +6764,33 @@ void work_queue_delete(struct work_queue *q)
 
 		hash_table_delete(q->worker_table);
 		hash_table_delete(q->worker_blacklist);
+
+		char *cached_name;
+		struct set *holders;
+		hash_table_firstkey(q->file_worker_table);
+		while(hash_table_nextkey(q->file_worker_table, &cached_name, (void **) &holders)) {
+			set_delete(holders);
+		}
+		hash_table_delete(q->file_worker_table);
 		itable_delete(q->worker_task_map);
 
+		char *path;
+		struct work_queue_local_digest *d;
+		hash_table_firstkey(q->local_digests);
+		while(hash_table_nextkey(q->local_digests, &path, (void **) &d)) {
+			free(d);
+		}
+		hash_table_delete(q->local_digests);
+
+		struct work_queue_compressed_copy *copy;
+		while((copy = list_pop_head(q->compressing))) {
+			pthread_join(copy->thread, NULL);
+			copy->compressing = 0;
+		}
+		list_delete(q->compressing);
+		compressed_copies_clear(q);
+		hash_table_delete(q->compressed_copies);
+
 		struct category *c;
 		hash_table_firstkey(q->categories);
 		while(hash_table_nextkey(q->categories, &key, (void **) &c)) {
@@ -4889,13 +6798,21 @@ void work_queue_delete(struct work_queue *q)
 		}
 		hash_table_delete(q->categories);
 
-		list_delete(q->ready_list);
+		priority_queue_delete(q->ready_list);
 
 		itable_delete(q->tasks);
 
 		itable_delete(q->task_state_map);
 
 		hash_table_delete(q->workers_with_available_results);
+		hash_table_delete(q->workers_with_outbound);
+		hash_table_delete(q->workers_with_task_batch);
+
+		/* emptied as the workers were released. */
+		itable_delete(q->prefetch_tasks);
+		io_threads_stop(q);
+		hash_table_delete(q->io_claimed);
+		list_delete(q->io_pending);
 
 		list_free(q->task_reports);
 		list_delete(q->task_reports);
@@ -4910,14 +6827,35 @@ void work_queue_delete(struct work_queue *q)
 		if(q->master_preferred_connection)
 			free(q->master_preferred_connection);
 
+		struct work_queue_submission *s = q->submissions;
+		while(s) {
+			struct work_queue_submission *next = s->next;
+			free(s);
+			s = next;
+		}
+
+		list_delete(q->completed_tasks);
+		pthread_mutex_destroy(&q->completed_mutex);
+		pthread_cond_destroy(&q->completed_cond);
+
 		free(q->poll_table);
+		link_poller_delete(q->poller);
+		link_close(q->submit_link);
+		close(q->submit_pipe[1]);
 		link_close(q->master_link);
+		if(q->transactions_logfile) {
+			write_transaction(q, "MASTER END");
+		}
+
+		flush_logs(q, 1);
+		buffer_free(&q->log_buffer);
+		buffer_free(&q->transactions_buffer);
+
 		if(q->logfile) {
 			fclose(q->logfile);
 		}
 
 		if(q->transactions_logfile) {
-			write_transaction(q, "MASTER END");
 			fclose(q->transactions_logfile);
 		}
 
@@ -5068,9 +7006,9 @@ void push_task_to_ready_list( struct work_queue *q, struct work_queue_task *t )
 	}
 
 	if(by_priority) {
-		list_push_priority(q->ready_list,t,t->priority);
+		priority_queue_push(q->ready_list,t,t->priority);
 	} else {
-		list_push_head(q->ready_list,t);
+		priority_queue_push_head(q->ready_list,t);
 	}
 
 	/* If the task has been used before, clear out accumulated state. */
@@ -5121,7 +7059,8 @@ static work_queue_task_state_t change_task_state( struct work_queue *q, struct w
 
 	if( old_state == WORK_QUEUE_TASK_READY ) {
 		// Treat WORK_QUEUE_TASK_READY specially, as it has the order of the tasks
-		list_remove(q->ready_list, t);
+		priority_queue_remove(q->ready_list, t);
+		prefetch_release(q, t->taskid);
 	}
 
 	// insert to corresponding table
@@ -5246,6 +7185,10 @@ static int task_state_count(struct work_queue *q, const char *category, work_que
 
 	int count = 0;
 
+	if(!category && state == WORK_QUEUE_TASK_READY) {
+		return priority_queue_size(q->ready_list);
+	}
+
 	itable_firstkey(q->tasks);
 	while( itable_nextkey(q->tasks, &taskid, (void **) &t) ) {
 		if( task_state_is(q, taskid, state) ) {
@@ -5296,14 +7239,119 @@ int work_queue_submit_internal(struct work_queue *q, struct work_queue_task *t)
 
 int work_queue_submit(struct work_queue *q, struct work_queue_task *t)
 {
-	t->taskid = q->next_taskid;
-
 	//Increment taskid. So we get a unique taskid for every submit.
-	q->next_taskid++;
+	//Atomically, as other threads may use work_queue_submit_threadsafe.
+	t->taskid = __atomic_fetch_add(&q->next_taskid, 1, __ATOMIC_RELAXED);
 
 	return work_queue_submit_internal(q, t);
 }
 
+int work_queue_submit_threadsafe(struct work_queue *q, struct work_queue_task *t)
+{
+	struct work_queue_submission *s = malloc(sizeof(*s));
+	if(!s) {
+		return 0;
+	}
+
+	t->taskid = __atomic_fetch_add(&q->next_taskid, 1, __ATOMIC_RELAXED);
+	s->task = t;
+
+	__atomic_add_fetch(&q->submissions_pending, 1, __ATOMIC_RELAXED);
+
+	// Push on the list of submissions without locking. The master takes
+	// the whole list at once, so the usual problems of popping from a
+	// lock-free stack do not arise.
+	struct work_queue_submission *head = __atomic_load_n(&q->submissions, __ATOMIC_RELAXED);
+	do {
+		s->next = head;
+	} while(!__atomic_compare_exchange_n(&q->submissions, &head, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// Only the first submission after the master took the list needs to
+	// wake it up. If the pipe is full, the master is awake already.
+	if(!head) {
+		char c = 0;
+		ssize_t n = write(q->submit_pipe[1], &c, 1);
+		(void) n;
+	}
+
+	return t->taskid;
+}
+
+/* Add the tasks submitted from other threads to the queue, in submission order. Returns the number of tasks added. */
+static int receive_submissions(struct work_queue *q)
+{
+	if(q->submit_link_active) {
+		char buf[256];
+		while(read(q->submit_pipe[0], buf, sizeof(buf)) > 0) { }
+		q->submit_link_active = 0;
+	}
+
+	if(!__atomic_load_n(&q->submissions, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	struct work_queue_submission *s = __atomic_exchange_n(&q->submissions, NULL, __ATOMIC_ACQUIRE);
+
+	struct work_queue_submission *ordered = NULL;
+	while(s) {
+		struct work_queue_submission *next = s->next;
+		s->next = ordered;
+		ordered = s;
+		s = next;
+	}
+
+	int count = 0;
+	while(ordered) {
+		struct work_queue_submission *next = ordered->next;
+		work_queue_submit_internal(q, ordered->task);
+		free(ordered);
+		ordered = next;
+		count++;
+	}
+
+	__atomic_sub_fetch(&q->submissions_pending, count, __ATOMIC_RELAXED);
+
+	debug(D_WQ, "received %d tasks submitted from other threads", count);
+
+	return count;
+}
+
+void work_queue_specify_completion_queue(struct work_queue *q, int enabled)
+{
+	q->completion_queue_enabled = enabled;
+}
+
+/* Hand a completed task to the threads waiting in work_queue_wait_completed. */
+static void push_completed_task(struct work_queue *q, struct work_queue_task *t)
+{
+	pthread_mutex_lock(&q->completed_mutex);
+	list_push_tail(q->completed_tasks, t);
+	pthread_cond_signal(&q->completed_cond);
+	pthread_mutex_unlock(&q->completed_mutex);
+}
+
+struct work_queue_task *work_queue_wait_completed(struct work_queue *q, int timeout)
+{
+	struct work_queue_task *t;
+	struct timespec stoptime;
+
+	clock_gettime(CLOCK_REALTIME, &stoptime);
+	stoptime.tv_sec += timeout;
+
+	pthread_mutex_lock(&q->completed_mutex);
+	while(!(t = list_pop_head(q->completed_tasks))) {
+		if(timeout == WORK_QUEUE_WAITFORTASK) {
+			pthread_cond_wait(&q->completed_cond, &q->completed_mutex);
+		} else if(pthread_cond_timedwait(&q->completed_cond, &q->completed_mutex, &stoptime) == ETIMEDOUT) {
+			t = list_pop_head(q->completed_tasks);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&q->completed_mutex);
+
+	return t;
+}
+
 void work_queue_blacklist_add_with_timeout(struct work_queue *q, const char *hostname, time_t timeout)
 {
 	struct blacklist_host_info *info = hash_table_lookup(q->worker_blacklist, hostname);
@@ -5407,12 +7455,90 @@ struct work_queue_task *work_queue_wait(struct work_queue *q, int timeout)
 	return work_queue_wait_internal(q, timeout, NULL, NULL);
 }
 
+/* Handle a message from each of the workers handed over by the I/O threads, or
+ * with more in their buffers. Returns the number of workers removed. */
+static int handle_io_ready_workers(struct work_queue *q)
+{
+	char buf[256];
+	while(read(q->io_pipe[0], buf, sizeof(buf)) > 0) { }
+
+	struct list *ready = list_create();
+	struct work_queue_worker *w;
+	struct link *l;
+	int i;
+
+	// the links, as workers may be removed while handling the previous ones.
+	while((w = list_pop_head(q->io_pending))) {
+		hash_table_insert(q->io_claimed, w->hashkey, w);
+		list_push_tail(ready, w->link);
+	}
+
+	for(i = 0; i < q->io_threads; i++) {
+		struct work_queue_io_shard *s = &q->io_shards[i];
+		pthread_mutex_lock(&s->mutex);
+		while((w = list_pop_head(s->ready))) {
+			worker_io_take(q, w);
+			list_push_tail(ready, w->link);
+		}
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	int workers_removed = 0;
+	char key[WORKER_HASHKEY_MAX];
+
+	while((l = list_pop_head(ready))) {
+		link_to_hash_key(l, key);
+		w = hash_table_lookup(q->worker_table, key);
+		if(!w) {
+			continue;
+		}
+
+		if(w->io_failed) {
+			debug_outbound_failure(w, w->io_failed);
+			handle_worker_failure(q, w);
+			workers_removed++;
+		} else if(handle_worker(q, l) == WORKER_FAILURE) {
+			workers_removed++;
+		}
+	}
+
+	list_delete(ready);
+
+	return workers_removed;
+}
+
 /* return number of workers lost */
 static int poll_active_workers(struct work_queue *q, int stoptime, struct link *foreman_uplink, int *foreman_uplink_active)
 {
 	BEGIN_ACCUM_TIME(q, time_polling);
 
-	int n = build_poll_table(q, foreman_uplink);
+	q->master_link_active = 0;
+	if(foreman_uplink) {
+		*foreman_uplink_active = 0;
+	}
+
+	// Allocate a small table, if it hasn't been done yet.
+	if(!q->poll_table) {
+		q->poll_table = malloc(sizeof(*q->poll_table) * q->poll_table_size);
+		if(!q->poll_table) {
+			//if we can't allocate a poll table, we can't do anything else.
+			fatal("allocating memory for poll table failed.");
+		}
+	}
+
+	// The foreman uplink is registered with the poller while it is passed in.
+	if(foreman_uplink != q->poller_uplink) {
+		if(q->poller_uplink) {
+			link_poller_remove(q->poller, q->poller_uplink);
+		}
+		if(foreman_uplink) {
+			poller_add(q->poller, foreman_uplink, LINK_READ);
+		}
+		q->poller_uplink = foreman_uplink;
+	}
+
+	// The I/O threads wait on the workers given back to them.
+	release_claimed_workers(q);
 
 	// We poll in at most small time segments (of a second). This lets
 	// promptly dispatch tasks, while avoiding busy waiting.
@@ -5420,6 +7546,9 @@ static int poll_active_workers(struct work_queue *q, int stoptime, struct link *
 	if(stoptime) {
 		msec = MIN(msec, (stoptime - time(0)) * 1000);
 	}
+	if(list_size(q->io_pending) > 0) {
+		msec = 0;
+	}
 
 	END_ACCUM_TIME(q, time_polling);
 
@@ -5429,19 +7558,24 @@ static int poll_active_workers(struct work_queue *q, int stoptime, struct link *
 
 	BEGIN_ACCUM_TIME(q, time_polling);
 
-	// Poll all links for activity.
-	link_poll(q->poll_table, n, msec);
+	// Wait for activity. Only the links ready are returned, in poll_table.
+	int n = link_poller_wait(q->poller, q->poll_table, q->poll_table_size, msec);
 	q->link_poll_end = timestamp_get();
 
-	int i, j = 1;
-	// Consider the foreman_uplink passed into the function and disregard if inactive.
-	if(foreman_uplink) {
-		if(q->poll_table[1].revents) {
+	int i;
+	int worker_links = 0;
+	for(i = 0; i < n; i++) {
+		if(q->poll_table[i].link == q->master_link) {
+			q->master_link_active = 1;
+		} else if(q->poll_table[i].link == q->submit_link) {
+			q->submit_link_active = 1;
+		} else if(q->poll_table[i].link == q->io_link) {
+			continue;
+		} else if(foreman_uplink && q->poll_table[i].link == foreman_uplink) {
 			*foreman_uplink_active = 1; //signal that the master link saw activity
 		} else {
-			*foreman_uplink_active = 0;
+			worker_links++;
 		}
-		j++;
 	}
 
 	END_ACCUM_TIME(q, time_polling);
@@ -5450,24 +7584,90 @@ static int poll_active_workers(struct work_queue *q, int stoptime, struct link *
 	BEGIN_ACCUM_TIME(q, time_status_msgs);
 
 	int workers_removed = 0;
-	// Then consider all existing active workers
-	for(i = j; i < n; i++) {
-		if(q->poll_table[i].revents) {
-			if(handle_worker(q, q->poll_table[i].link) == WORKER_FAILURE) {
+	char key[WORKER_HASHKEY_MAX];
+	// Then consider the workers that are active
+	for(i = 0; i < n && worker_links > 0; i++) {
+		struct link *l = q->poll_table[i].link;
+		if(l == q->master_link || l == q->submit_link || l == q->io_link || l == foreman_uplink) {
+			continue;
+		}
+
+		worker_links--;
+
+		if(!(q->poll_table[i].revents & LINK_READ)) {
+			continue;
+		}
+
+		// skip the workers removed while handling the previous ones.
+		link_to_hash_key(l, key);
+		if(!hash_table_lookup(q->worker_table, key)) {
+			continue;
+		}
+
+		if(handle_worker(q, l) == WORKER_FAILURE) {
+			workers_removed++;
+		}
+	}
+
+	if(q->io_threads > 0) {
+		workers_removed += handle_io_ready_workers(q);
+	}
+
+	// Move the transfers queued for workers forward.
+	if(hash_table_size(q->workers_with_outbound) > 0) {
+		struct list *outbound = list_create();
+		char *hashkey;
+		struct work_queue_worker *w;
+
+		hash_table_firstkey(q->workers_with_outbound);
+		while(hash_table_nextkey(q->workers_with_outbound, &hashkey, (void **) &w)) {
+			list_push_tail(outbound, w);
+		}
+
+		while((w = list_pop_head(outbound))) {
+			if(!send_worker_outbound(q, w)) {
+				handle_worker_failure(q, w);
 				workers_removed++;
 			}
 		}
+
+		list_delete(outbound);
+	}
+
+	// If the table was filled, the links left over are ready on the next
+	// poll. Make room for more of them.
+	if(n >= q->poll_table_size) {
+		q->poll_table_size *= 2;
+		q->poll_table = realloc(q->poll_table, sizeof(*q->poll_table) * q->poll_table_size);
+		if(q->poll_table == NULL) {
+			//if we can't allocate a poll table, we can't do anything else.
+			fatal("reallocating memory for poll table failed.");
+		}
 	}
 
 	if(hash_table_size(q->workers_with_available_results) > 0) {
 		char *key;
 		struct work_queue_worker *w;
+		struct list *deferred = list_create();
+
 		hash_table_firstkey(q->workers_with_available_results);
 		while(hash_table_nextkey(q->workers_with_available_results,&key,(void**)&w)) {
-			get_available_results(q, w);
 			hash_table_remove(q->workers_with_available_results, key);
+			// Retrieving results waits on the worker, so wait until
+			// the transfers queued for it are done.
+			if(worker_outbound_pending(w)) {
+				list_push_tail(deferred, w);
+			} else {
+				get_available_results(q, w);
+			}
 			hash_table_firstkey(q->workers_with_available_results);
 		}
+
+		while((w = list_pop_head(deferred))) {
+			hash_table_insert(q->workers_with_available_results, w->hashkey, w);
+		}
+
+		list_delete(deferred);
 	}
 
 	END_ACCUM_TIME(q, time_status_msgs);
@@ -5483,7 +7683,7 @@ static int connect_new_workers(struct work_queue *q, int stoptime, int max_new_w
 	// If the master link was awake, then accept at most max_new_workers.
 	// Note we are using the information gathered in poll_active_workers, which
 	// is a little ugly.
-	if(q->poll_table[0].revents) {
+	if(q->master_link_active) {
 		do {
 			add_worker(q);
 			new_workers++;
@@ -5528,6 +7728,11 @@ struct work_queue_task *work_queue_wait_internal(struct work_queue *q, int timeo
 
 		BEGIN_ACCUM_TIME(q, time_internal);
 
+		// tasks submitted from other threads?
+		if(receive_submissions(q)) {
+			events++;
+		}
+
 		// task completed?
 		t = task_state_any(q, WORK_QUEUE_TASK_RETRIEVED);
 		if(t) {
@@ -5540,10 +7745,20 @@ struct work_queue_task *work_queue_wait_internal(struct work_queue *q, int timeo
 				q->stats->tasks_failed++;
 			}
 
+			events++;
+
+			// with a completion queue, other threads take the task, and we
+			// keep working until the timeout.
+			if(q->completion_queue_enabled) {
+				push_completed_task(q, t);
+				t = NULL;
+				END_ACCUM_TIME(q, time_internal);
+				continue;
+			}
+
 			// return completed task (t) to the user. We do not return right
 			// away, and instead break out of the loop to correctly update the
 			// queue time statistics.
-			events++;
 			END_ACCUM_TIME(q, time_internal);
 			break;
 		}
@@ -5557,6 +7772,9 @@ struct work_queue_task *work_queue_wait_internal(struct work_queue *q, int timeo
 		if(q->monitor_mode)
 			update_resource_report(q);
 
+		// compressed copies of input files that became ready.
+		compressed_copies_reap(q);
+
 		END_ACCUM_TIME(q, time_internal);
 
 		// retrieve worker status messages
@@ -5593,6 +7811,12 @@ struct work_queue_task *work_queue_wait_internal(struct work_queue *q, int timeo
 		// tasks waiting to be dispatched?
 		BEGIN_ACCUM_TIME(q, time_send);
 		result = send_one_task(q);
+		if(!result) {
+			// no more tasks can be dispatched for now, so send the batches,
+			// and the inputs of the tasks waiting for busy workers.
+			flush_task_batches(q);
+			result = prefetch_inputs(q);
+		}
 		END_ACCUM_TIME(q, time_send);
 		if(result) {
 			// sent at least one task
@@ -5643,19 +7867,26 @@ struct work_queue_task *work_queue_wait_internal(struct work_queue *q, int timeo
 		int done = !task_state_any(q, WORK_QUEUE_TASK_RUNNING) && !task_state_any(q, WORK_QUEUE_TASK_READY) && !task_state_any(q, WORK_QUEUE_TASK_WAITING_RETRIEVAL) && !(foreman_uplink);
 		END_ACCUM_TIME(q, time_internal);
 
-		if(done)
+		// with a completion queue, tasks may still arrive from other threads.
+		if(done && !q->completion_queue_enabled)
 			break;
 
 		/* if we got here, no events were triggered. we set the busy_waiting
 		 * flag so that link_poll waits for some time the next time around. */
 		q->busy_waiting_flag = 1;
 
+		// write the logs while idle, if enough time has passed.
+		flush_logs(q, 0);
+
 		// If the foreman_uplink is active then break so the caller can handle it.
 		if(foreman_uplink) {
 			break;
 		}
 	}
 
+	flush_task_batches(q);
+	release_claimed_workers(q);
+
 	if(events > 0) {
 		log_queue_stats(q);
 	}
@@ -5810,6 +8041,8 @@ int work_queue_empty(struct work_queue *q)
 	struct work_queue_task *t;
 	uint64_t taskid;
 
+	if(__atomic_load_n(&q->submissions_pending, __ATOMIC_RELAXED) > 0) return 0;
+
 	itable_firstkey(q->tasks);
 	while( itable_nextkey(q->tasks, &taskid, (void **) &t) ) {
 		int state = work_queue_task_state(q, taskid);
@@ -5844,9 +8077,11 @@ int work_queue_tune(struct work_queue *q, const char *name, double value)
 
 	if(!strcmp(name, "asynchrony-multiplier")) {
 		q->asynchrony_multiplier = MAX(value, 1.0);
+		worker_index_rebuild(q);
 
 	} else if(!strcmp(name, "asynchrony-modifier")) {
 		q->asynchrony_modifier = MAX(value, 0);
+		worker_index_rebuild(q);
 
 	} else if(!strcmp(name, "min-transfer-timeout")) {
 		q->minimum_transfer_timeout = (int)value;
@@ -5872,6 +8107,34 @@ int work_queue_tune(struct work_queue *q, const char *name, double value)
 	} else if(!strcmp(name, "short-timeout")) {
 		q->short_timeout = MAX(1, (int)value);
 
+	} else if(!strcmp(name, "async-transfer-min-size")) {
+		q->async_transfer_min_size = value;
+
+	} else if(!strcmp(name, "task-batch-max")) {
+		q->task_batch_max = MAX(1, (int)value);
+
+	} else if(!strcmp(name, "peer-transfer-fanout")) {
+		q->peer_transfer_fanout = MAX(0, (int)value);
+
+	} else if(!strcmp(name, "peer-transfer-min-size")) {
+		q->peer_transfer_min_size = MAX(0, (int64_t)value);
+
+	} else if(!strcmp(name, "content-digest-min-size")) {
+		q->content_digest_min_size = value;
+
+	} else if(!strcmp(name, "prefetch-depth")) {
+		q->prefetch_depth = MAX(0, (int)value);
+
+	} else if(!strcmp(name, "io-threads")) {
+		if(hash_table_size(q->worker_table) > 0) {
+			debug(D_NOTICE|D_WQ, "Warning: io-threads cannot be changed while workers are connected\n");
+			return -1;
+		}
+		io_threads_stop(q);
+		if(!io_threads_start(q, MAX(0, (int)value))) {
+			return -1;
+		}
+
 	} else if(!strcmp(name, "category-steady-n-tasks")) {
 		category_tune_bucket_size("category-steady-n-tasks", (int) value);
 
@@ -6146,7 +8409,7 @@ int work_queue_specify_log(struct work_queue *q, const char *logfile)
 {
 	q->logfile = fopen(logfile, "a");
 	if(q->logfile) {
-		setvbuf(q->logfile, NULL, _IOLBF, 2048); // line buffered, we don't want incomplete lines
+		setvbuf(q->logfile, NULL, _IONBF, 0); // lines are buffered in q->log_buffer, see flush_logs.
 		fprintf(q->logfile,
 				// start with a comment
 				"#"
@@ -6186,25 +8449,85 @@ int work_queue_specify_log(struct work_queue *q, const char *logfile)
 	}
 }
 
+static void write_binary_transaction(struct work_queue *q, work_queue_transaction_t type, buffer_t *fields) {
+	timestamp_t now = timestamp_get();
+
+	if(type == WORK_QUEUE_TRANSACTION_START) {
+		work_queue_transactions_put_record(&q->transactions_buffer, type, now, fields);
+	} else {
+		work_queue_transactions_put_record(&q->transactions_buffer, type, (int64_t) (now - q->time_last_transaction), fields);
+	}
+
+	q->time_last_transaction = now;
+	flush_logs(q, 0);
+}
+
 static void write_transaction(struct work_queue *q, const char *str) {
 	if(!q->transactions_logfile)
 		return;
 
-	fprintf(q->transactions_logfile, "%" PRIu64, timestamp_get());
-	fprintf(q->transactions_logfile, " %d", getpid());
-	fprintf(q->transactions_logfile, " %s", str);
-	fprintf(q->transactions_logfile, "\n");
+	if(q->transactions_binary) {
+		struct buffer B;
+		buffer_init(&B);
+		work_queue_transactions_put_string(&B, str);
+		write_binary_transaction(q, WORK_QUEUE_TRANSACTION_TEXT, &B);
+		buffer_free(&B);
+		return;
+	}
+
+	buffer_printf(&q->transactions_buffer, "%" PRIu64 " %d %s\n", timestamp_get(), getpid(), str);
+	flush_logs(q, 0);
+}
+
+/* The same information as write_transaction_task, in the format of work_queue_transactions.h. */
+static void write_binary_transaction_task(struct work_queue *q, struct work_queue_task *t, work_queue_task_state_t state) {
+	struct buffer B;
+	buffer_init(&B);
+
+	work_queue_transactions_put_int(&B, t->taskid);
+	work_queue_transactions_put_int(&B, state);
+
+	if(state == WORK_QUEUE_TASK_READY) {
+		work_queue_transactions_put_string(&B, t->category);
+		work_queue_transactions_put_int(&B, t->resource_request != CATEGORY_ALLOCATION_FIRST);
+		work_queue_transactions_put_resources(&B, task_min_resources(q, t));
+	} else if(state == WORK_QUEUE_TASK_DONE) {
+		work_queue_transactions_put_int(&B, t->result);
+		work_queue_transactions_put_resources(&B, t->resources_measured);
+	} else if(state == WORK_QUEUE_TASK_RETRIEVED) {
+		work_queue_transactions_put_int(&B, t->result);
+		if(t->result == WORK_QUEUE_RESULT_RESOURCE_EXHAUSTION && t->resources_measured) {
+			work_queue_transactions_put_resources(&B, t->resources_measured->limits_exceeded);
+		} else {
+			work_queue_transactions_put_resources(&B, NULL);
+		}
+	} else if(state == WORK_QUEUE_TASK_RUNNING || state == WORK_QUEUE_TASK_WAITING_RETRIEVAL) {
+		struct work_queue_worker *w = itable_lookup(q->worker_task_map, t->taskid);
+		work_queue_transactions_put_string(&B, w ? w->addrport : NULL);
+		if(w && state == WORK_QUEUE_TASK_RUNNING) {
+			work_queue_transactions_put_int(&B, t->resource_request != CATEGORY_ALLOCATION_FIRST);
+			work_queue_transactions_put_resources(&B, itable_lookup(w->current_tasks_boxes, t->taskid));
+		}
+	}
+
+	write_binary_transaction(q, WORK_QUEUE_TRANSACTION_TASK, &B);
+	buffer_free(&B);
 }
 
 static void write_transaction_task(struct work_queue *q, struct work_queue_task *t) {
 	if(!q->transactions_logfile)
 		return;
 
+	work_queue_task_state_t state = (uintptr_t) itable_lookup(q->task_state_map, t->taskid);
+
+	if(q->transactions_binary) {
+		write_binary_transaction_task(q, t, state);
+		return;
+	}
+
 	struct buffer B;
 	buffer_init(&B);
 
-	work_queue_task_state_t state = (uintptr_t) itable_lookup(q->task_state_map, t->taskid);
-
 	buffer_printf(&B, "TASK %d %s", t->taskid, task_state_str(state));
 
 	if(state == WORK_QUEUE_TASK_UNKNOWN) {
@@ -6295,6 +8618,9 @@ static void write_transaction_category(struct work_queue *q, struct category *c)
 }
 
 static void write_transaction_worker(struct work_queue *q, struct work_queue_worker *w, int leaving) {
+	if(!q->transactions_logfile)
+		return;
+
 	struct buffer B;
 	buffer_init(&B);
 
@@ -6311,8 +8637,24 @@ static void write_transaction_worker(struct work_queue *q, struct work_queue_wor
 	buffer_free(&B);
 }
 
+static char *transfer_transaction(struct work_queue_worker *w, struct work_queue_task *t, const char *direction, const char *name, int64_t length, int64_t wire_length) {
+	return string_format("TRANSFER %d %s %s %s %" PRId64 " %" PRId64, t ? t->taskid : 0, direction, w->addrport, name, length, wire_length);
+}
+
+static void write_transaction_transfer(struct work_queue *q, struct work_queue_worker *w, struct work_queue_task *t, const char *direction, const char *name, int64_t length, int64_t wire_length) {
+	if(!q->transactions_logfile)
+		return;
+
+	char *transaction = transfer_transaction(w, t, direction, name, length, wire_length);
+	write_transaction(q, transaction);
+	free(transaction);
+}
+
 static void write_transaction_worker_resources(struct work_queue *q, struct work_queue_worker *w) {
 
+	if(!q->transactions_logfile)
+		return;
+
 	struct rmsummary *s = rmsummary_create(-1);
 
 	s->cores  = w->resources->cores.total;
@@ -6334,26 +8676,30 @@ static void write_transaction_worker_resources(struct work_queue *q, struct work
 }
 
 
-int work_queue_specify_transactions_log(struct work_queue *q, const char *logfile) {
+static int open_transactions_log(struct work_queue *q, const char *logfile, int binary) {
 	q->transactions_logfile =fopen(logfile, "a");
 	if(q->transactions_logfile) {
-		setvbuf(q->transactions_logfile, NULL, _IOLBF, 1024); // line buffered, we don't want incomplete lines
+		setvbuf(q->transactions_logfile, NULL, _IONBF, 0); // lines are buffered in q->transactions_buffer, see flush_logs.
 		debug(D_WQ, "transactions log enabled and is being written to %s\n", logfile);
 
-		fprintf(q->transactions_logfile, "# date time master-pid MASTER START|END\n");
-		fprintf(q->transactions_logfile, "# date time master-pid WORKER worker-id host:port CONNECTION|DISCONNECTION\n");
-		fprintf(q->transactions_logfile, "# date time master-pid WORKER worker-id RESOURCES resources\n");
-		fprintf(q->transactions_logfile, "# date time master-pid CATEGORY name MAX resources-max-per-task\n");
-		fprintf(q->transactions_logfile, "# date time master-pid CATEGORY name MIN resources-min-per-task-per-worker\n");
-		fprintf(q->transactions_logfile, "# date time master-pid CATEGORY name FIRST FIXED|MAX|MIN_WASTE|MAX_THROUGHPUT resources-requested\n");
-		fprintf(q->transactions_logfile, "# date time master-pid TASK taskid WAITING category-name FIRST_RESOURCES|MAX_RESOURCES resources-requested\n");
-		fprintf(q->transactions_logfile, "# date time master-pid TASK taskid RUNNING worker-address FIRST_RESOURCES|MAX_RESOURCES resources-given\n");
-		fprintf(q->transactions_logfile, "# date time master-pid TASK taskid WAITING_RETRIEVAL worker-address\n");
-		fprintf(q->transactions_logfile, "# date time master-pid TASK taskid RETRIEVED|DONE task-result ...\n");
-		fprintf(q->transactions_logfile, "# date time master-pid TASK taskid RETRIEVED SUCCESS|SIGNAL|END_TIME|FORSAKEN|MAX_RETRIES|MAX_WALLTIME|UNKNOWN|RESOURCE_EXHAUSTION [limits-exceeded]\n");
-		fprintf(q->transactions_logfile, "# date time master-pid TASK taskid DONE SUCCESS|INPUT_MISS|OUTPUT_MISS|STDOUT_MISS|SIGNAL|END_TIME|MAX_RETRIES|MAX_WALLTIME|UNKNOWN|RESOURCE_EXHAUSTION [limits-exceeded]\n\n");
-
-		write_transaction(q, "MASTER START");
+		q->transactions_binary = binary;
+
+		if(binary) {
+			fseek(q->transactions_logfile, 0, SEEK_END);
+			if(ftell(q->transactions_logfile) == 0) {
+				buffer_putliteral(&q->transactions_buffer, WORK_QUEUE_TRANSACTIONS_MAGIC);
+			}
+
+			struct buffer B;
+			buffer_init(&B);
+			work_queue_transactions_put_int(&B, getpid());
+			write_binary_transaction(q, WORK_QUEUE_TRANSACTION_START, &B);
+			buffer_free(&B);
+		} else {
+			work_queue_transactions_text_header(&q->transactions_buffer);
+			write_transaction(q, "MASTER START");
+		}
+
 		return 1;
 	}
 	else
@@ -6363,6 +8709,14 @@ int work_queue_specify_transactions_log(struct work_queue *q, const char *logfil
 	}
 }
 
+int work_queue_specify_transactions_log(struct work_queue *q, const char *logfile) {
+	return open_transactions_log(q, logfile, 0);
+}
+
+int work_queue_specify_transactions_log_binary(struct work_queue *q, const char *logfile) {
+	return open_transactions_log(q, logfile, 1);
+}
+
 void work_queue_accumulate_task(struct work_queue *q, struct work_queue_task *t) {
 	const char *name   = t->category ? t->category : "default";
 	struct category *c = work_queue_category_lookup_or_create(q, name);
@@ -6542,4 +8896,94 @@ int work_queue_specify_min_taskid(struct work_queue *q, int minid) {
 	return q->next_taskid;
 }
 
+int work_queue_benchmark_dispatch(struct work_queue *q, int nworkers, int ntasks, timestamp_t *elapsed)
+{
+	struct work_queue_worker **workers = malloc(nworkers * sizeof(*workers));
+	int i;
+
+	/* simulated workers, without a link, of 4 cores, 4GB of memory and disk. */
+	for(i = 0; i < nworkers; i++) {
+		struct work_queue_worker *w = calloc(1, sizeof(*w));
+
+		w->hostname = string_format("sim-%d", i);
+		w->os = strdup("simulated");
+		w->arch = strdup("simulated");
+		w->version = strdup("simulated");
+		w->workerid = string_format("sim-%d", i);
+		snprintf(w->hashkey, sizeof(w->hashkey), "sim-%d", i);
+		snprintf(w->addrport, sizeof(w->addrport), "sim-%d:0", i);
+		w->current_files = hash_table_create(0, 0);
+		w->current_tasks = itable_create(0);
+		w->current_tasks_boxes = itable_create(0);
+		w->index_bucket = -1;
+		w->stats = calloc(1, sizeof(struct work_queue_stats));
+		w->resources = work_queue_resources_create();
+
+		struct work_queue_resources *r = w->resources;
+		r->tag = 0;
+		r->workers.total = r->workers.smallest = r->workers.largest = 1;
+		r->cores.total   = r->cores.smallest   = r->cores.largest   = 4;
+		r->memory.total  = r->memory.smallest  = r->memory.largest  = 4096;
+		r->disk.total    = r->disk.smallest    = r->disk.largest    = 4096;
+
+		hash_table_insert(q->worker_table, w->hashkey, w);
+		count_worker_resources(q, w);
+		workers[i] = w;
+	}
+
+	struct work_queue_task *t = work_queue_task_create("simulated");
+	work_queue_task_specify_cores(t, 1);
+	work_queue_task_specify_memory(t, 100);
+	work_queue_task_specify_disk(t, 100);
+
+	int dispatched = 0;
+	timestamp_t start = timestamp_get();
+
+	for(i = 0; i < ntasks; i++) {
+		struct work_queue_worker *w = find_best_worker(q, t);
+		if(!w)
+			break;
+
+		itable_insert(w->current_tasks_boxes, i + 1, task_worker_box_size(q, w, t));
+		count_worker_resources(q, w);
+		dispatched++;
+	}
+
+	*elapsed = timestamp_get() - start;
+
+	/* remove the simulated workers directly, as they never had a link or tasks. */
+	for(i = 0; i < nworkers; i++) {
+		struct work_queue_worker *w = workers[i];
+		uint64_t taskid;
+		struct rmsummary *box;
+
+		itable_firstkey(w->current_tasks_boxes);
+		while(itable_nextkey(w->current_tasks_boxes, &taskid, (void **) &box)) {
+			rmsummary_delete(box);
+		}
+
+		hash_table_remove(q->worker_table, w->hashkey);
+		worker_index_remove(q, w);
+
+		itable_delete(w->current_tasks);
+		itable_delete(w->current_tasks_boxes);
+		hash_table_delete(w->current_files);
+		work_queue_resources_delete(w->resources);
+
+		free(w->workerid);
+		free(w->stats);
+		free(w->hostname);
+		free(w->os);
+		free(w->arch);
+		free(w->version);
+		free(w);
+	}
+
+	find_max_worker(q);
+	work_queue_task_delete(t);
+	free(workers);
+
+	return dispatched;
+}
+
 /* vim: set noexpandtab tabstop=4: */
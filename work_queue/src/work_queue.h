@@ -42,7 +42,8 @@ typedef enum {
 	WORK_QUEUE_PREEXIST = 4, /**< If the filename already exists on the host, use it in place. */
 	WORK_QUEUE_THIRDGET = 8, /**< Access the file on the client from a shared filesystem */
 	WORK_QUEUE_THIRDPUT = 8, /**< Access the file on the client from a shared filesystem (same as WORK_QUEUE_THIRDGET, included for readability) */
-	WORK_QUEUE_WATCH    = 16 /**< Watch the output file and send back changes as the task runs. */
+	WORK_QUEUE_WATCH    = 16, /**< Watch the output file and send back changes as the task runs. */
+	WORK_QUEUE_COMPRESS = 32  /**< Compress the file while it is transferred between the master and the worker. */
 } work_queue_file_flags_t;
 
 typedef enum {
@@ -345,6 +346,8 @@ void work_queue_task_specify_command( struct work_queue_task *t, const char *cmd
 and incrementally return the file to the master as the task runs.  (The frequency of these updates
 is entirely dependent upon the system load.  If the master is busy interacting with many workers,
 output updates will be infrequent.)
+- @ref WORK_QUEUE_COMPRESS indicates that the file is compressed with zlib while it is transferred,
+for files such as text that compress well. Files that do not compress are sent as they are.
 @return 1 if the task file is successfully specified, 0 if either of @a t,  @a local_name, or @a remote_name is null or @a remote_name is an absolute path.
 */
 int work_queue_task_specify_file(struct work_queue_task *t, const char *local_name, const char *remote_name, work_queue_file_type_t type, work_queue_file_flags_t flags);
@@ -568,6 +571,39 @@ Once returned, it is safe to re-submit the same take object via @ref work_queue_
 */
 int work_queue_submit(struct work_queue *q, struct work_queue_task *t);
 
+/** Submit a task to a queue from any thread.
+Unlike the other functions of this API, this one may be called from any
+number of threads at once, while another thread calls @ref work_queue_wait.
+The task is added to the queue on the next pass of @ref work_queue_wait, which
+is woken up if it is waiting. Until then, the taskid returned is not yet known
+to functions such as @ref work_queue_cancel_by_taskid.
+@param q A work queue object.
+@param t A task object returned from @ref work_queue_task_create.
+@return An integer taskid assigned to the submitted task, or zero on failure.
+*/
+int work_queue_submit_threadsafe(struct work_queue *q, struct work_queue_task *t);
+
+/** Deliver completed tasks to a completion queue instead of @ref work_queue_wait.
+When enabled, @ref work_queue_wait no longer returns completed tasks. Instead,
+it keeps managing the queue until its timeout expires, even if the queue is
+empty, and places completed tasks where any thread can retrieve them with
+@ref work_queue_wait_completed. Thus, one thread may drive the queue by calling
+@ref work_queue_wait with a finite timeout in a loop, while other threads submit
+tasks with @ref work_queue_submit_threadsafe and process their results.
+@param q A work queue object.
+@param enabled If true, enable the completion queue. If false, return completed tasks from @ref work_queue_wait.
+*/
+void work_queue_specify_completion_queue(struct work_queue *q, int enabled);
+
+/** Wait for a task in the completion queue.
+This function may be called from any thread.
+See @ref work_queue_specify_completion_queue.
+@param q A work queue object.
+@param timeout The number of seconds to wait for a completed task, or @ref WORK_QUEUE_WAITFORTASK to block until a task has completed.
+@returns A completed task, which the caller should dispose of with @ref work_queue_task_delete, or null if the timeout was reached.
+*/
+struct work_queue_task *work_queue_wait_completed(struct work_queue *q, int timeout);
+
 
 /** Set the minimum taskid of future submitted tasks.
 Further submitted tasks are guaranteed to have a taskid larger or equal to
@@ -852,6 +888,15 @@ int work_queue_specify_log(struct work_queue *q, const char *logfile);
 */
 int work_queue_specify_transactions_log(struct work_queue *q, const char *logfile);
 
+/** Add a log file that records the states of the connected workers and tasks, in a compact binary format.
+The log is smaller and faster to write than the one of @ref work_queue_specify_transactions_log,
+and can be converted to it with <tt>work_queue_status --convert-transactions</tt>.
+@param q A work queue object.
+@param logfile The filename.
+@return 1 if logfile was opened, 0 otherwise.
+*/
+int work_queue_specify_transactions_log_binary(struct work_queue *q, const char *logfile);
+
 /** Add a mandatory password that each worker must present.
 @param q A work queue object.
 @param password The password to require.
@@ -898,6 +943,12 @@ void work_queue_master_preferred_connection(struct work_queue *q, const char *pr
  - "fast-abort-multiplier" Set the multiplier of the average task time at which point to abort; if negative or zero fast_abort is deactivated. (default=0)
  - "keepalive-interval" Set the minimum number of seconds to wait before sending new keepalive checks to workers. (default=300)
  - "keepalive-timeout" Set the minimum number of seconds to wait for a keepalive response from worker before marking it as dead. (default=30)
+ - "task-batch-max" Send up to this many tasks to a worker in one message; 1 sends each task on its own. (default=64)
+ - "peer-transfer-fanout" Let workers fetch cached input files from other workers, each serving at most this many workers at once; 0 disables. (default=0)
+ - "peer-transfer-min-size" Cached input files smaller than this many bytes are always sent by the master. (default=1MB)
+ - "content-digest-min-size" Input files at least this many bytes large are not sent to workers that have their contents in their content cache (work_queue_worker --content-cache); -1 disables. (default=0)
+ - "prefetch-depth" Send the cached input files of up to this many waiting tasks to each busy worker that could run them, while the files cached in it take less than half of the disk not allocated to its running tasks; 0 disables. (default=0)
+ - "io-threads" Split the connections to the workers among this many threads, which read from them and send the queued input files, while the messages are handled and the tasks scheduled in @ref work_queue_wait. Can only be changed while no workers are connected; 0 handles the connections in @ref work_queue_wait. (default=0)
 @param value The value to set the parameter to.
 @return 0 on succes, -1 on failure.
 */
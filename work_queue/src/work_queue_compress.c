@@ -0,0 +1,221 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "work_queue_compress.h"
+
+#include "full_io.h"
+#include "macros.h"
+#include "stringtools.h"
+#include "xxmalloc.h"
+
+#include <zlib.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Speed over ratio, as the time to compress is added to the transfer. */
+#define COMPRESS_LEVEL Z_BEST_SPEED
+#define COMPRESS_CHUNK (1<<16)
+
+/* Data that does not compress well in its first bytes is sent as is. */
+#define COMPRESS_SAMPLE (1<<20)
+
+static int compresses_well( int64_t in, int64_t out )
+{
+	return out * 10 <= in * 9;
+}
+
+/* Compress length bytes of fd, from offset, into out. Returns false if the data does not compress well. */
+static int compress_into( int fd, off_t offset, int64_t length, int out, int64_t *compressed_length )
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if(deflateInit(&z, COMPRESS_LEVEL) != Z_OK) {
+		return 0;
+	}
+
+	unsigned char *in_buffer = xxmalloc(COMPRESS_CHUNK);
+	unsigned char *out_buffer = xxmalloc(COMPRESS_CHUNK);
+	int64_t consumed = 0;
+	int64_t produced = 0;
+	int flush = Z_NO_FLUSH;
+	int ok = 1;
+
+	while(ok) {
+		if(z.avail_in == 0 && flush != Z_FINISH) {
+			size_t wanted = MIN(COMPRESS_CHUNK, length - consumed);
+			if(full_read(fd, in_buffer, wanted) != (ssize_t) wanted) {
+				ok = 0;
+				break;
+			}
+			consumed += wanted;
+			z.next_in = in_buffer;
+			z.avail_in = wanted;
+			if(consumed == length)
+				flush = Z_FINISH;
+		}
+
+		z.next_out = out_buffer;
+		z.avail_out = COMPRESS_CHUNK;
+
+		int result = deflate(&z, flush);
+		if(result == Z_STREAM_ERROR) {
+			ok = 0;
+			break;
+		}
+
+		size_t have = COMPRESS_CHUNK - z.avail_out;
+		if(have > 0 && full_write(out, out_buffer, have) != (ssize_t) have) {
+			ok = 0;
+			break;
+		}
+		produced += have;
+
+		if(result == Z_STREAM_END)
+			break;
+
+		if(z.total_in >= COMPRESS_SAMPLE && !compresses_well(z.total_in, produced))
+			ok = 0;
+	}
+
+	deflateEnd(&z);
+	free(in_buffer);
+	free(out_buffer);
+
+	if(ok && compresses_well(length, produced) && lseek(out, 0, SEEK_SET) == 0) {
+		*compressed_length = produced;
+		return 1;
+	}
+
+	lseek(fd, offset, SEEK_SET);
+
+	return 0;
+}
+
+int work_queue_compress_fd( int fd, int64_t length, const char *dir, int64_t *compressed_length )
+{
+	if(length < WORK_QUEUE_COMPRESS_MIN_SIZE)
+		return -1;
+
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if(offset < 0)
+		return -1;
+
+	char *path = string_format("%s/wq-compress-XXXXXX", dir);
+	int out = mkstemp(path);
+	if(out >= 0)
+		unlink(path);
+	free(path);
+
+	if(out < 0)
+		return -1;
+
+	if(compress_into(fd, offset, length, out, compressed_length))
+		return out;
+
+	close(out);
+
+	return -1;
+}
+
+struct work_queue_inflater {
+	z_stream z;
+	int fd;
+	int64_t written;
+	int done;
+	int error;
+};
+
+struct work_queue_inflater *work_queue_inflater_create( int fd )
+{
+	struct work_queue_inflater *z = xxcalloc(1, sizeof(*z));
+	z->fd = fd;
+
+	if(inflateInit(&z->z) != Z_OK) {
+		free(z);
+		return NULL;
+	}
+
+	return z;
+}
+
+int work_queue_inflater_write( struct work_queue_inflater *z, const void *data, size_t length )
+{
+	unsigned char buffer[COMPRESS_CHUNK];
+
+	if(z->error)
+		return 0;
+
+	z->z.next_in = (unsigned char *) data;
+	z->z.avail_in = length;
+
+	do {
+		/* anything after the end of the stream is an error. */
+		if(z->done) {
+			z->error = 1;
+			break;
+		}
+
+		z->z.next_out = buffer;
+		z->z.avail_out = sizeof(buffer);
+
+		int result = inflate(&z->z, Z_NO_FLUSH);
+		if(result == Z_STREAM_END) {
+			z->done = 1;
+		} else if(result != Z_OK && result != Z_BUF_ERROR) {
+			z->error = 1;
+			break;
+		}
+
+		size_t have = sizeof(buffer) - z->z.avail_out;
+		if(have > 0 && full_write(z->fd, buffer, have) != (ssize_t) have) {
+			z->error = 1;
+			break;
+		}
+		z->written += have;
+	} while(z->z.avail_in > 0 || (z->z.avail_out == 0 && !z->done));
+
+	return !z->error;
+}
+
+int64_t work_queue_inflater_finish( struct work_queue_inflater *z )
+{
+	int64_t written = (z->done && !z->error) ? z->written : -1;
+
+	inflateEnd(&z->z);
+	free(z);
+
+	return written;
+}
+
+int64_t work_queue_uncompress_link_to_fd( struct link *l, int fd, int64_t compressed_length, time_t stoptime )
+{
+	char buffer[COMPRESS_CHUNK];
+	int64_t received = 0;
+
+	struct work_queue_inflater *z = work_queue_inflater_create(fd);
+	if(!z)
+		return -1;
+
+	while(received < compressed_length) {
+		size_t chunk = MIN(sizeof(buffer), (size_t) (compressed_length - received));
+		ssize_t actual = link_read(l, buffer, chunk, stoptime);
+		if(actual <= 0)
+			break;
+
+		received += actual;
+
+		if(!work_queue_inflater_write(z, buffer, actual))
+			break;
+	}
+
+	int64_t written = work_queue_inflater_finish(z);
+
+	return received == compressed_length ? written : -1;
+}
+
+/* vim: set noexpandtab tabstop=4: */
@@ -0,0 +1,53 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef WORK_QUEUE_COMPRESS_H
+#define WORK_QUEUE_COMPRESS_H
+
+/*
+Compressed transfers. Files with the WORK_QUEUE_COMPRESS flag are sent
+between the master and the workers as zlib streams, in the zput and zfile
+messages, which carry both the compressed length and the length of the
+file. The sender compresses the file into a temporary file first, so that
+the compressed length is known, and sends it as is if it does not compress
+well, which is usually found after compressing a small sample of it. The
+master compresses its input files in threads of their own, and keeps the
+compressed copies, to send them to other workers.
+*/
+
+#include "link.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Files smaller than this are not worth compressing. */
+#define WORK_QUEUE_COMPRESS_MIN_SIZE 4096
+
+/*
+Compress length bytes of fd, from its current offset, into an unlinked
+temporary file in dir. Returns the descriptor of the temporary file at
+offset zero and sets *compressed_length, or -1 if the data is too small or
+does not compress to 90% of its size or less, in which case fd is back at
+its original offset. It does not log, so that any thread may call it.
+*/
+int work_queue_compress_fd( int fd, int64_t length, const char *dir, int64_t *compressed_length );
+
+/* Receives a zlib stream in pieces, and writes the data to fd. */
+struct work_queue_inflater *work_queue_inflater_create( int fd );
+
+/* Inflate length bytes of compressed data. Returns false on a corrupt stream or a failed write. */
+int work_queue_inflater_write( struct work_queue_inflater *z, const void *data, size_t length );
+
+/* Free z. Returns the number of bytes written, or -1 if the stream was not complete. */
+int64_t work_queue_inflater_finish( struct work_queue_inflater *z );
+
+/* Read compressed_length bytes from the link, and write them inflated to fd. Returns the number of bytes written, or -1. */
+int64_t work_queue_uncompress_link_to_fd( struct link *l, int fd, int64_t compressed_length, time_t stoptime );
+
+#endif
+
+/* vim: set noexpandtab tabstop=4: */
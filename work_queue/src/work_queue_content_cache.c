@@ -0,0 +1,276 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "work_queue_content_cache.h"
+
+#include "copy_stream.h"
+#include "create_dir.h"
+#include "debug.h"
+#include "list.h"
+#include "md5.h"
+#include "stringtools.h"
+#include "xxmalloc.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct work_queue_content_cache {
+	char *path;
+	int64_t max_size;
+	int64_t size;      // as of the last scan, plus the files inserted since.
+};
+
+struct content_entry {
+	char digest[MD5_DIGEST_LENGTH_HEX + 1];
+	time_t mtime;
+	int64_t size;
+	int nlink;
+};
+
+int work_queue_content_cache_valid_digest( const char *digest )
+{
+	int i;
+
+	for(i = 0; i < MD5_DIGEST_LENGTH_HEX; i++) {
+		if(!isxdigit((unsigned char) digest[i]))
+			return 0;
+	}
+
+	return digest[i] == 0;
+}
+
+/* Fill entries with the files of the cache, and return their total size. */
+static int64_t content_cache_scan( struct work_queue_content_cache *c, struct content_entry **entries, int *count )
+{
+	int64_t total = 0;
+	int capacity = 0;
+
+	*entries = NULL;
+	*count = 0;
+
+	DIR *dir = opendir(c->path);
+	if(!dir) {
+		debug(D_WQ, "could not open content cache %s: %s", c->path, strerror(errno));
+		return 0;
+	}
+
+	struct dirent *d;
+	while((d = readdir(dir))) {
+		if(!work_queue_content_cache_valid_digest(d->d_name))
+			continue;
+
+		char *path = string_format("%s/%s", c->path, d->d_name);
+		struct stat info;
+		int result = stat(path, &info);
+		free(path);
+
+		if(result < 0)
+			continue;
+
+		if(*count >= capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			*entries = xxrealloc(*entries, capacity * sizeof(**entries));
+		}
+
+		struct content_entry *e = &(*entries)[(*count)++];
+		strcpy(e->digest, d->d_name);
+		e->mtime = info.st_mtime;
+		e->size = info.st_size;
+		e->nlink = info.st_nlink;
+
+		total += info.st_size;
+	}
+
+	closedir(dir);
+
+	return total;
+}
+
+static int entry_older( const void *a, const void *b )
+{
+	const struct content_entry *x = a;
+	const struct content_entry *y = b;
+
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+static int entry_newer( const void *a, const void *b )
+{
+	return entry_older(b, a);
+}
+
+/* Remove the least recently used files that are not linked from elsewhere, until the cache fits. */
+static void content_cache_evict( struct work_queue_content_cache *c )
+{
+	struct content_entry *entries;
+	int count, i;
+
+	c->size = content_cache_scan(c, &entries, &count);
+	qsort(entries, count, sizeof(*entries), entry_older);
+
+	for(i = 0; i < count && c->size > c->max_size; i++) {
+		if(entries[i].nlink > 1)
+			continue;
+
+		char *path = string_format("%s/%s", c->path, entries[i].digest);
+		if(unlink(path) == 0) {
+			debug(D_WQ, "evicted %s (%" PRId64 " bytes) from content cache", entries[i].digest, entries[i].size);
+			c->size -= entries[i].size;
+		}
+		free(path);
+	}
+
+	free(entries);
+}
+
+struct work_queue_content_cache *work_queue_content_cache_create( const char *path, int64_t max_size )
+{
+	if(!create_dir(path, 0755)) {
+		debug(D_NOTICE, "could not create content cache %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct work_queue_content_cache *c = xxmalloc(sizeof(*c));
+	c->path = xxstrdup(path);
+	c->max_size = max_size;
+	c->size = 0;
+
+	content_cache_evict(c);
+
+	debug(D_WQ, "content cache %s holds %" PRId64 " bytes", c->path, c->size);
+
+	return c;
+}
+
+void work_queue_content_cache_delete( struct work_queue_content_cache *c )
+{
+	if(!c)
+		return;
+
+	free(c->path);
+	free(c);
+}
+
+/* Place a copy of source at target, sharing its contents if possible. */
+static int content_cache_link( const char *source, const char *target, int mode )
+{
+	unlink(target);
+
+	if(link(source, target) == 0)
+		return 1;
+
+	if(errno != EXDEV && errno != EPERM && errno != EMLINK)
+		return 0;
+
+	if(copy_file_to_file(source, target) < 0 || chmod(target, mode) < 0) {
+		unlink(target);
+		return 0;
+	}
+
+	return 1;
+}
+
+int work_queue_content_cache_insert( struct work_queue_content_cache *c, const char *digest, const char *path )
+{
+	struct stat info;
+
+	if(!work_queue_content_cache_valid_digest(digest) || stat(path, &info) < 0)
+		return 0;
+
+	char *entry = string_format("%s/%s", c->path, digest);
+
+	/* already there, possibly from another worker. */
+	if(access(entry, F_OK) == 0) {
+		utime(entry, NULL);
+		free(entry);
+		return 1;
+	}
+
+	/* entries are read-only, and so is the file at path when it is linked. */
+	char *partial = string_format("%s/.%s.%d", c->path, digest, (int) getpid());
+	int result = content_cache_link(path, partial, info.st_mode & 0777) && chmod(partial, info.st_mode & 0555) == 0 && rename(partial, entry) == 0;
+
+	if(result) {
+		utime(entry, NULL);
+		c->size += info.st_size;
+		debug(D_WQ, "added %s as %s to content cache", path, digest);
+	} else {
+		debug(D_WQ, "could not add %s to content cache: %s", path, strerror(errno));
+		unlink(partial);
+	}
+
+	free(partial);
+	free(entry);
+
+	if(c->size > c->max_size)
+		content_cache_evict(c);
+
+	return result;
+}
+
+int work_queue_content_cache_fetch( struct work_queue_content_cache *c, const char *digest, const char *path, int64_t length, int mode )
+{
+	struct stat info;
+
+	if(!work_queue_content_cache_valid_digest(digest))
+		return 0;
+
+	char *entry = string_format("%s/%s", c->path, digest);
+	int result = 0;
+
+	if(stat(entry, &info) < 0) {
+		/* not in the cache, or evicted. */
+	} else if(info.st_size != length || (info.st_mode & 0222)) {
+		/* made writable, and possibly changed, through one of its links. */
+		debug(D_WQ, "dropped %s from content cache, as it was changed", digest);
+		unlink(entry);
+		errno = ENOENT;
+	} else if((info.st_mode & 0777) == (mode & 0555)) {
+		/* the mode is shared by all the links, so files with other modes are copied. */
+		result = content_cache_link(entry, path, mode);
+	} else {
+		unlink(path);
+		result = copy_file_to_file(entry, path) >= 0 && chmod(path, mode) == 0;
+	}
+
+	if(result) {
+		utime(entry, NULL);
+	} else {
+		debug(D_WQ, "could not fetch %s from content cache: %s", digest, strerror(errno));
+	}
+
+	free(entry);
+
+	return result;
+}
+
+struct list *work_queue_content_cache_digests( struct work_queue_content_cache *c, int max )
+{
+	struct content_entry *entries;
+	int count, i;
+
+	content_cache_scan(c, &entries, &count);
+	qsort(entries, count, sizeof(*entries), entry_newer);
+
+	struct list *digests = list_create();
+	for(i = 0; i < count && i < max; i++) {
+		list_push_tail(digests, xxstrdup(entries[i].digest));
+	}
+
+	free(entries);
+
+	return digests;
+}
+
+/* vim: set noexpandtab tabstop=4: */
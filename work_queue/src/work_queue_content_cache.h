@@ -0,0 +1,46 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef WORK_QUEUE_CONTENT_CACHE_H
+#define WORK_QUEUE_CONTENT_CACHE_H
+
+/*
+The content cache keeps input files by the md5 digest of their contents,
+in a directory outside of the workspace of the worker. It survives the
+worker, and it may be shared by all the workers of a node, whatever their
+master, so that a file is transferred to the node only once. Files are
+hard linked between the content cache and the cache of the workers, and
+copied when they are in different filesystems. Files are made read-only
+when added, so that tasks cannot change the contents shared with other
+workers, and files found changed anyway are dropped when fetched.
+
+The most recently used files are kept, up to the maximum size of the
+content cache. Files that are linked from somewhere else, such as the
+cache of a worker, are never evicted.
+*/
+
+#include "list.h"
+
+#include <stdint.h>
+
+struct work_queue_content_cache *work_queue_content_cache_create( const char *path, int64_t max_size );
+void work_queue_content_cache_delete( struct work_queue_content_cache *c );
+
+/* True if digest is a valid name for an entry, as sent by the master. */
+int work_queue_content_cache_valid_digest( const char *digest );
+
+/* Add the file at path under digest, evicting older files as needed. */
+int work_queue_content_cache_insert( struct work_queue_content_cache *c, const char *digest, const char *path );
+
+/* Place the file with digest and length at path, with the given mode. Returns false if it is not in the cache, or was changed. */
+int work_queue_content_cache_fetch( struct work_queue_content_cache *c, const char *digest, const char *path, int64_t length, int mode );
+
+/* A list of at most max digests in the cache, the most recently used first. The caller frees the list and its strings. */
+struct list *work_queue_content_cache_digests( struct work_queue_content_cache *c, int max );
+
+#endif
+
+/* vim: set noexpandtab tabstop=4: */
@@ -8,6 +8,7 @@ See the file COPYING for details.
 #include "work_queue_resources.h"
 
 #include "list.h"
+#include "timestamp.h"
 
 struct work_queue_file {
 	work_queue_file_t type;
@@ -48,6 +49,20 @@ void update_catalog(struct work_queue *q, struct link *foreman_uplink, int force
 /** Send msg to all the workers in the queue. **/
 void work_queue_broadcast_message(struct work_queue *q, const char *msg);
 
+/** Measure the worker selection of the scheduler, by placing up to ntasks tasks of one core on nworkers simulated workers of four cores each.
+The simulated workers are removed from the queue before returning.
+@param q A work queue object.
+@param nworkers Number of simulated workers.
+@param ntasks Number of tasks to place.
+@param elapsed Set to the microseconds spent placing the tasks.
+@return The number of tasks placed.
+*/
+int work_queue_benchmark_dispatch(struct work_queue *q, int nworkers, int ntasks, timestamp_t *elapsed);
+
+/* names of task states and results, as in the transactions log. */
+const char *task_state_str(work_queue_task_state_t state);
+const char *task_result_str(work_queue_result_t result);
+
 /* shortcut to set cores, memory, disk, etc. from a single function. */
 void work_queue_task_specify_resources(struct work_queue_task *t, const struct rmsummary *rm);
 
@@ -0,0 +1,403 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "work_queue_launcher.h"
+
+#include "buffer.h"
+#include "debug.h"
+#include "stringtools.h"
+#include "xxmalloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#if defined(CCTOOLS_OPSYS_LINUX) && !defined(__s390__)
+#define HAS_LAUNCHER_HELPER
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* Characters that make the shell do more than split a command into words. */
+static const char shell_metacharacters[] = "|&;<>()$`\\\"'*?[]#~{}!\n";
+
+/* Words that the shell does not execute as a program. */
+static const char *shell_builtins[] = {
+	".", ":", "alias", "bg", "break", "case", "cd", "command", "continue", "do", "done",
+	"elif", "else", "esac", "eval", "exec", "exit", "export", "fc", "fg", "fi", "for",
+	"function", "getopts", "hash", "if", "jobs", "local", "read", "readonly", "return",
+	"set", "shift", "source", "then", "times", "trap", "type", "ulimit", "umask",
+	"unalias", "unset", "until", "wait", "while", NULL
+};
+
+void work_queue_launcher_free_words( char **words )
+{
+	char **w;
+
+	if(!words)
+		return;
+
+	for(w = words; *w; w++)
+		free(*w);
+	free(words);
+}
+
+char **work_queue_launcher_split( const char *command )
+{
+	if(strpbrk(command, shell_metacharacters))
+		return NULL;
+
+	int count = 0;
+	char **words = xxmalloc((strlen(command) / 2 + 2) * sizeof(char *));
+
+	const char *c = command;
+	while(1) {
+		c += strspn(c, " \t");
+		if(!*c)
+			break;
+
+		size_t length = strcspn(c, " \t");
+		words[count++] = strndup(c, length);
+		c += length;
+	}
+	words[count] = NULL;
+
+	/* no command, assignments, or builtins. */
+	int i;
+	int plain = count > 0 && !strchr(words[0], '=');
+	for(i = 0; plain && shell_builtins[i]; i++) {
+		if(!strcmp(words[0], shell_builtins[i]))
+			plain = 0;
+	}
+
+	if(!plain) {
+		work_queue_launcher_free_words(words);
+		return NULL;
+	}
+
+	return words;
+}
+
+char *work_queue_launcher_resolve( const char *name, const char *path, const char *sandbox )
+{
+	if(strchr(name, '/'))
+		return xxstrdup(name);
+
+	if(!path)
+		path = "/usr/local/bin:/usr/bin:/bin";
+
+	const char *dir = path;
+	while(1) {
+		size_t length = strcspn(dir, ":");
+		char *candidate;
+
+		if(length == 0) {
+			candidate = string_format("%s/%s", sandbox, name);
+		} else if(dir[0] == '/') {
+			candidate = string_format("%.*s/%s", (int) length, dir, name);
+		} else {
+			candidate = string_format("%s/%.*s/%s", sandbox, (int) length, dir, name);
+		}
+
+		struct stat info;
+		if(stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0)
+			return candidate;
+
+		free(candidate);
+
+		if(!dir[length])
+			break;
+		dir += length + 1;
+	}
+
+	return NULL;
+}
+
+/* Runs in the new process, which may share the memory of its parent. Only system calls here. */
+static void exec_task( const char *executable, char **argv, char **envp, const char *sandbox, int null_fd, int out_fd, struct work_queue_cpuset *cpuset )
+{
+	setpgid(0, 0);
+
+	if(chdir(sandbox) < 0)
+		_exit(127);
+
+	if(dup2(null_fd, STDIN_FILENO) < 0 || dup2(out_fd, STDOUT_FILENO) < 0 || dup2(out_fd, STDERR_FILENO) < 0)
+		_exit(127);
+
+	if(out_fd > STDERR_FILENO)
+		close(out_fd);
+
+	if(cpuset)
+		work_queue_cpuset_bind(cpuset);
+
+	execve(executable, argv, envp);
+
+	/* as execvp, run files without a known format, such as scripts without #!, with the shell. */
+	if(errno == ENOEXEC) {
+		int argc = 0;
+		while(argv[argc])
+			argc++;
+
+		const char *shell_argv[argc + 2];
+		int i;
+		shell_argv[0] = "sh";
+		shell_argv[1] = executable;
+		for(i = 1; i <= argc; i++)
+			shell_argv[i + 1] = argv[i];
+
+		execve("/bin/sh", (char **) shell_argv, envp);
+	}
+
+	_exit(127);
+}
+
+pid_t work_queue_launcher_spawn( const char *executable, char **argv, char **envp, const char *sandbox, int out_fd, struct work_queue_cpuset *cpuset )
+{
+	int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if(null_fd < 0)
+		return -1;
+
+	pid_t pid = vfork();
+	if(pid == 0)
+		exec_task(executable, argv, envp, sandbox, null_fd, out_fd, cpuset);
+
+	close(null_fd);
+
+	/* as in work_queue_process_execute, in case the child has not run yet. */
+	if(pid > 0)
+		setpgid(pid, 0);
+
+	return pid;
+}
+
+/*
+The helper. Requests are sent over a SOCK_SEQPACKET socket, one message each,
+with the output file descriptor attached. A request is the number of words of
+argv and of envp, followed by the executable, the sandbox, the words of argv,
+and those of envp, each terminated by a null byte. The helper answers with the
+pid of the new process, or -1.
+*/
+
+#define HELPER_MAX_REQUEST (128 * 1024)
+
+static int helper_socket = -1;
+static pid_t helper_pid = 0;
+
+#ifdef HAS_LAUNCHER_HELPER
+
+/* Point words to count strings from *data, advancing it. */
+static int unpack_words( char **data, char *end, char **words, uint32_t count )
+{
+	uint32_t i;
+
+	for(i = 0; i < count; i++) {
+		char *zero = memchr(*data, 0, end - *data);
+		if(!zero)
+			return 0;
+
+		words[i] = *data;
+		*data = zero + 1;
+	}
+	words[count] = NULL;
+
+	return 1;
+}
+
+static void helper_serve( int sock )
+{
+	char *request = xxmalloc(HELPER_MAX_REQUEST);
+	char control[CMSG_SPACE(sizeof(int))];
+
+	int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	while(1) {
+		struct iovec iov = { request, HELPER_MAX_REQUEST };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t length = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if(length <= 0)
+			break;
+
+		int out_fd = -1;
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&out_fd, CMSG_DATA(cmsg), sizeof(int));
+
+		int32_t pid = -1;
+		uint32_t counts[2];
+
+		if(out_fd >= 0 && length > (ssize_t) sizeof(counts)) {
+			memcpy(counts, request, sizeof(counts));
+
+			char *data = request + sizeof(counts);
+			char *end = request + length;
+			char **argv = malloc((counts[0] + 1) * sizeof(char *));
+			char **envp = malloc((counts[1] + 1) * sizeof(char *));
+			char *strings[2];
+
+			if(argv && envp && unpack_words(&data, end, strings, 2) && unpack_words(&data, end, argv, counts[0]) && unpack_words(&data, end, envp, counts[1])) {
+				/* the new process is a child of the worker, not of the helper. */
+				pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+				if(pid == 0)
+					exec_task(strings[0], argv, envp, strings[1], null_fd, out_fd, NULL);
+			}
+
+			free(argv);
+			free(envp);
+		}
+
+		if(out_fd >= 0)
+			close(out_fd);
+
+		if(send(sock, &pid, sizeof(pid), 0) < 0)
+			break;
+	}
+
+	free(request);
+}
+
+int work_queue_launcher_helper_start()
+{
+	int fds[2];
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		debug(D_WQ, "could not create socket for the launcher helper: %s", strerror(errno));
+		return 0;
+	}
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		close(fds[0]);
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+		/* the handlers of the worker, which a fork of the worker would reset on exec. */
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGUSR1, SIG_DFL);
+		signal(SIGUSR2, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+
+		helper_serve(fds[1]);
+		_exit(0);
+	}
+
+	close(fds[1]);
+
+	if(pid < 0) {
+		debug(D_WQ, "could not start the launcher helper: %s", strerror(errno));
+		close(fds[0]);
+		return 0;
+	}
+
+	helper_socket = fds[0];
+	helper_pid = pid;
+
+	debug(D_WQ, "started launcher helper %d", (int) pid);
+
+	return 1;
+}
+
+pid_t work_queue_launcher_helper_spawn( const char *executable, char **argv, char **envp, const char *sandbox, int out_fd )
+{
+	if(helper_socket < 0)
+		return -1;
+
+	uint32_t counts[2] = { 0, 0 };
+	while(argv[counts[0]]) counts[0]++;
+	while(envp[counts[1]]) counts[1]++;
+
+	buffer_t B;
+	buffer_init(&B);
+	buffer_putlstring(&B, (const char *) counts, sizeof(counts));
+	buffer_putlstring(&B, executable, strlen(executable) + 1);
+	buffer_putlstring(&B, sandbox, strlen(sandbox) + 1);
+
+	uint32_t i;
+	for(i = 0; i < counts[0]; i++)
+		buffer_putlstring(&B, argv[i], strlen(argv[i]) + 1);
+	for(i = 0; i < counts[1]; i++)
+		buffer_putlstring(&B, envp[i], strlen(envp[i]) + 1);
+
+	size_t length;
+	const char *request = buffer_tolstring(&B, &length);
+
+	int32_t pid = -1;
+
+	if(length <= HELPER_MAX_REQUEST) {
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(control, 0, sizeof(control));
+
+		struct iovec iov = { (void *) request, length };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &out_fd, sizeof(int));
+
+		if(sendmsg(helper_socket, &msg, 0) < 0 || recv(helper_socket, &pid, sizeof(pid), 0) != sizeof(pid)) {
+			debug(D_WQ, "launcher helper is gone: %s", strerror(errno));
+			work_queue_launcher_helper_stop();
+			pid = -1;
+		}
+	}
+
+	buffer_free(&B);
+
+	if(pid > 0)
+		setpgid(pid, 0);
+
+	return pid;
+}
+
+#else
+
+int work_queue_launcher_helper_start()
+{
+	return 0;
+}
+
+pid_t work_queue_launcher_helper_spawn( const char *executable, char **argv, char **envp, const char *sandbox, int out_fd )
+{
+	return -1;
+}
+
+#endif
+
+void work_queue_launcher_helper_stop()
+{
+	if(helper_socket < 0)
+		return;
+
+	close(helper_socket);
+	helper_socket = -1;
+
+	waitpid(helper_pid, NULL, 0);
+	helper_pid = 0;
+}
+
+/* vim: set noexpandtab tabstop=4: */
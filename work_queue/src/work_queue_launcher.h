@@ -0,0 +1,55 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef WORK_QUEUE_LAUNCHER_H
+#define WORK_QUEUE_LAUNCHER_H
+
+/*
+Launchers start the processes of tasks faster than a fork of the whole
+worker followed by sh -c. A command without shell metacharacters is
+executed directly from its words, without a shell. The process is created
+either with vfork, which does not copy the page tables of the worker, or
+by a small helper process forked when the worker starts, which creates the
+process as a child of the worker (Linux only).
+*/
+
+#include "work_queue_topology.h"
+
+#include <sys/types.h>
+
+typedef enum {
+	WORK_QUEUE_LAUNCHER_FORK,      // fork the worker, then sh -c, as always.
+	WORK_QUEUE_LAUNCHER_SPAWN,     // vfork the worker.
+	WORK_QUEUE_LAUNCHER_HELPER     // ask the helper process.
+} work_queue_launcher_t;
+
+/* The words of command, if it can be executed without a shell, else NULL. The caller frees the array and its strings. */
+char **work_queue_launcher_split( const char *command );
+
+/* Free an array of words, such as the one returned by work_queue_launcher_split. */
+void work_queue_launcher_free_words( char **words );
+
+/* The executable for name, searched in path as the shell would, with relative directories taken from sandbox. NULL if not found. */
+char *work_queue_launcher_resolve( const char *name, const char *path, const char *sandbox );
+
+/*
+Execute executable with argv and envp in the directory sandbox, with stdin
+from /dev/null and stdout and stderr to out_fd, as the leader of a new
+process group, and pinned to cpuset if not NULL. The new process is a child
+of the caller. Returns its pid, or -1 on error.
+*/
+pid_t work_queue_launcher_spawn( const char *executable, char **argv, char **envp, const char *sandbox, int out_fd, struct work_queue_cpuset *cpuset );
+
+/* Start and stop the helper process. Start returns false if helpers are not supported. */
+int work_queue_launcher_helper_start();
+void work_queue_launcher_helper_stop();
+
+/* As work_queue_launcher_spawn, without pinning, through the helper process. Returns -1 if the helper is not running. */
+pid_t work_queue_launcher_helper_spawn( const char *executable, char **argv, char **envp, const char *sandbox, int out_fd );
+
+#endif
+
+/* vim: set noexpandtab tabstop=4: */
@@ -29,6 +29,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+extern char **environ;
+
 #define SMALL_BUFFER_SIZE 256
 #define MAX_BUFFER_SIZE 4096
 #define DEFAULT_WORK_DIR "/home/worker"
@@ -69,6 +71,7 @@ struct work_queue_process *work_queue_process_create(struct work_queue_task *wq_
 	memset(p, 0, sizeof(*p));
 	p->task = wq_task;
 	p->task->disk_allocation_exhausted = 0;
+	p->numa_node = -1;
 	//placeholder filesystem until permanent solution
 	char *fs = "ext2";
 
@@ -197,12 +200,9 @@ static void specify_resources_vars(struct work_queue_process *p) {
 
 static const char task_output_template[] = "./worker.stdout.XXXXXX";
 
-pid_t work_queue_process_execute(struct work_queue_process *p, int container_mode, ...)
+/* Create the output file of the process, and complete its command. */
+static int prepare_execution(struct work_queue_process *p)
 {
-	// make warning
-
-	fflush(NULL);		/* why is this necessary? */
-
 	p->output_file_name = strdup(task_output_template);
 	p->output_fd = mkstemp(p->output_file_name);
 	if(p->output_fd == -1) {
@@ -220,6 +220,18 @@ pid_t work_queue_process_execute(struct work_queue_process *p, int container_mod
 
 	p->execution_start = timestamp_get();
 
+	return 1;
+}
+
+pid_t work_queue_process_execute(struct work_queue_process *p, int container_mode, ...)
+{
+	// make warning
+
+	fflush(NULL);		/* why is this necessary? */
+
+	if(!prepare_execution(p))
+		return 0;
+
 	p->pid = fork();
 
 	if(p->pid > 0) {
@@ -261,6 +273,9 @@ pid_t work_queue_process_execute(struct work_queue_process *p, int container_mod
 
 		close(p->output_fd);
 
+		if(p->cpuset)
+			work_queue_cpuset_bind(p->cpuset);
+
 		clear_environment();
 
 		/* overwrite CORES, MEMORY, or DISK variables, if the task used specify_* */
@@ -345,6 +360,138 @@ pid_t work_queue_process_execute(struct work_queue_process *p, int container_mod
 	return 0;
 }
 
+/* Set name to value in env, a list of name=value strings. If value is NULL, remove name. */
+static void environment_set(struct list *env, const char *name, const char *value)
+{
+	size_t length = strlen(name);
+	char *var;
+
+	list_first_item(env);
+	while((var = list_next_item(env))) {
+		if(!strncmp(var, name, length) && var[length] == '=') {
+			list_remove(env, var);
+			free(var);
+		}
+	}
+
+	if(value)
+		list_push_tail(env, string_format("%s=%s", name, value));
+}
+
+static void environment_set_integer(struct list *env, const char *name, int64_t value)
+{
+	char *value_str = string_format("%" PRId64, value);
+	environment_set(env, name, value_str);
+	free(value_str);
+}
+
+/* The environment of the process, as set in the child by work_queue_process_execute. */
+static char **task_environment(struct work_queue_process *p)
+{
+	struct list *env = list_create();
+	char **e;
+
+	for(e = environ; *e; e++)
+		list_push_tail(env, xxstrdup(*e));
+
+	environment_set(env, "DISPLAY", NULL);
+
+	char *name;
+	list_first_item(p->task->env_list);
+	while((name = list_next_item(p->task->env_list))) {
+		char *value = strchr(name, '=');
+		if(value) {
+			*value = 0;
+			environment_set(env, name, value + 1);
+			*value = '=';
+		} else {
+			environment_set(env, name, NULL);
+		}
+	}
+
+	struct rmsummary *r = p->task->resources_requested;
+	if(r->cores > 0)  environment_set_integer(env, "CORES",  r->cores);
+	if(r->memory > 0) environment_set_integer(env, "MEMORY", r->memory);
+	if(r->disk > 0)   environment_set_integer(env, "DISK",   r->disk);
+	if(r->gpus > 0)   environment_set_integer(env, "GPUS",   r->gpus);
+
+	if(p->tmpdir) {
+		environment_set(env, "TMPDIR", p->tmpdir);
+		environment_set(env, "TEMP",   p->tmpdir);
+		environment_set(env, "TMP",    p->tmpdir);
+	}
+
+	char **envp = xxmalloc((list_size(env) + 1) * sizeof(char *));
+	int i = 0;
+	while((envp[i] = list_pop_head(env)))
+		i++;
+
+	list_delete(env);
+
+	return envp;
+}
+
+pid_t work_queue_process_launch(struct work_queue_process *p, work_queue_launcher_t launcher)
+{
+	if(!prepare_execution(p))
+		return 0;
+
+	char **envp = task_environment(p);
+
+	const char *path = NULL;
+	char **e;
+	for(e = envp; *e; e++) {
+		if(!strncmp(*e, "PATH=", 5))
+			path = *e + 5;
+	}
+
+	/* without a shell if possible, as sh -c otherwise. */
+	char *executable = NULL;
+	char **argv = work_queue_launcher_split(p->task->command_line);
+	if(argv) {
+		executable = work_queue_launcher_resolve(argv[0], path, p->sandbox);
+		if(!executable) {
+			work_queue_launcher_free_words(argv);
+			argv = NULL;
+		}
+	}
+
+	if(!argv) {
+		argv = xxmalloc(4 * sizeof(char *));
+		argv[0] = xxstrdup("sh");
+		argv[1] = xxstrdup("-c");
+		argv[2] = xxstrdup(p->task->command_line);
+		argv[3] = NULL;
+
+		executable = work_queue_launcher_resolve("sh", path, p->sandbox);
+		if(!executable)
+			executable = xxstrdup("/bin/sh");
+	}
+
+	p->pid = -1;
+
+	/* the helper does not pin processes. */
+	if(launcher == WORK_QUEUE_LAUNCHER_HELPER && !p->cpuset)
+		p->pid = work_queue_launcher_helper_spawn(executable, argv, envp, p->sandbox, p->output_fd);
+
+	if(p->pid < 0)
+		p->pid = work_queue_launcher_spawn(executable, argv, envp, p->sandbox, p->output_fd, p->cpuset);
+
+	if(p->pid > 0) {
+		debug(D_WQ, "started process %d: %s (%s)", p->pid, p->task->command_line, executable);
+	} else {
+		debug(D_WQ, "couldn't create new process: %s\n", strerror(errno));
+		unlink(p->output_file_name);
+		close(p->output_fd);
+	}
+
+	work_queue_launcher_free_words(argv);
+	work_queue_launcher_free_words(envp);
+	free(executable);
+
+	return p->pid;
+}
+
 void work_queue_process_kill(struct work_queue_process *p)
 {
 	//make sure a few seconds have passed since child process was created to avoid sending a signal
@@ -4,6 +4,8 @@
 #include "work_queue.h"
 #include "timestamp.h"
 #include "path_disk_size_info.h"
+#include "work_queue_launcher.h"
+#include "work_queue_topology.h"
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -50,11 +52,18 @@ struct work_queue_process {
 	struct path_disk_size_info *disk_measurement_state;
 
 	char container_id[MAX_BUFFER_SIZE];
+
+	/* cores the process is pinned to, NULL if not pinned. */
+	struct work_queue_cpuset *cpuset;
+	/* NUMA node suggested by the master, -1 if none. */
+	int numa_node;
 };
 
 struct work_queue_process * work_queue_process_create( struct work_queue_task *task, int disk_allocation );
 pid_t work_queue_process_execute( struct work_queue_process *p, int container_mode, ... );
 // lunching process with container, arg_3 can be either img_name or container_name, depending on container_mode
+pid_t work_queue_process_launch( struct work_queue_process *p, work_queue_launcher_t launcher );
+// launching process without container, see work_queue_launcher.h
 void  work_queue_process_kill( struct work_queue_process *p );
 void  work_queue_process_delete( struct work_queue_process *p );
 void  work_queue_process_compute_disk_needed( struct work_queue_process *p );
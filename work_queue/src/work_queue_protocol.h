@@ -18,8 +18,19 @@ This file should not be installed and should only be included by .c files.
 /* 5: added wall_time, end_time messages, for task maximum running time. */
 /* 6: worker only report total, max, and min resources. */
 /* 7: added category message */
+/* 8: added tasks message, to send several tasks at once. */
+/* 9: added zput and zfile messages, for compressed transfers. */
 
-#define WORK_QUEUE_PROTOCOL_VERSION 7
+#define WORK_QUEUE_PROTOCOL_VERSION 9
+
+/* Oldest protocol of the workers a master still accepts. */
+#define WORK_QUEUE_PROTOCOL_VERSION_MIN 7
+
+/* Oldest protocol of the workers that understand the tasks message. */
+#define WORK_QUEUE_PROTOCOL_VERSION_TASKS 8
+
+/* Oldest protocol of the workers that understand compressed transfers. */
+#define WORK_QUEUE_PROTOCOL_VERSION_COMPRESS 9
 
 #define WORK_QUEUE_LINE_MAX 4096       /**< Maximum length of a work queue message line. */
 #define WORK_QUEUE_POOL_NAME_MAX 128   /**< Maximum length of a work queue pool name. */
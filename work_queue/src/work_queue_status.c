@@ -6,6 +6,7 @@ See the file COPYING for details.
 
 #include "work_queue.h"
 #include "work_queue_catalog.h"
+#include "work_queue_transactions.h"
 
 #include "cctools.h"
 #include "debug.h"
@@ -36,7 +37,8 @@ typedef enum {
 	QUERY_WORKERS,
 	QUERY_ABLE_WORKERS,
 	QUERY_MASTER_RESOURCES,
-	QUERY_CAPACITIES
+	QUERY_CAPACITIES,
+	CONVERT_TRANSACTIONS
 } query_t;
 
 #define CATALOG_SIZE 50 //size of the array of jx pointers
@@ -48,6 +50,7 @@ static char *catalog_host = NULL;
 int catalog_size = CATALOG_SIZE;
 static struct jx **global_catalog = NULL; //pointer to an array of jx pointers
 static const char *where_expr = "true";
+static const char *transactions_file = NULL;
 static int columns = 80;
 
 /* negative columns mean a minimum of abs(value), but the column may expand if
@@ -122,6 +125,7 @@ static void show_help(const char *progname)
 	fprintf(stdout, " %-30s List categories of the given master, size of largest task, and workers that can run it.\n", "-A,--able-workers");
 	fprintf(stdout, " %-30s Shows aggregated resources of all masters.\n", "-R,--resources");
 	fprintf(stdout, " %-30s Shows resource capacities of all masters.\n", "--capacity");
+	fprintf(stdout, " %-30s Print a binary transactions log in the text format, and exit.\n", "--convert-transactions=<file>");
 	fprintf(stdout, " %-30s Long text output.\n", "-l,--verbose");
 	fprintf(stdout, " %-30s Set catalog server to <catalog>. Format: HOSTNAME:PORT\n", "-C,--catalog=<catalog>");
 	fprintf(stdout, " %-30s Enable debugging for this subsystem.\n", "-d,--debug <flag>");
@@ -132,7 +136,8 @@ static void show_help(const char *progname)
 
 enum {
 	LONG_OPT_WHERE=1000,
-	LONG_OPT_CAPACITY
+	LONG_OPT_CAPACITY,
+	LONG_OPT_CONVERT_TRANSACTIONS
 };
 
 static void work_queue_status_parse_command_line_arguments(int argc, char *argv[], const char **master_host, int *master_port, const char **project_name)
@@ -146,6 +151,7 @@ static void work_queue_status_parse_command_line_arguments(int argc, char *argv[
 		{"verbose", no_argument, 0, 'l'},
 		{"resources", no_argument, 0, 'R'},
 		{"capacity", no_argument, 0, LONG_OPT_CAPACITY},
+		{"convert-transactions", required_argument, 0, LONG_OPT_CONVERT_TRANSACTIONS},
 		{"catalog", required_argument, 0, 'C'},
 		{"debug", required_argument, 0, 'd'},
 		{"timeout", required_argument, 0, 't'},
@@ -215,6 +221,12 @@ static void work_queue_status_parse_command_line_arguments(int argc, char *argv[
 				fatal("Options -A, -Q, -T, and -W, are mutually exclusive, and can be specified only once.");
 			query_mode = QUERY_CAPACITIES;
 			break;
+		case LONG_OPT_CONVERT_TRANSACTIONS:
+			if(query_mode != NO_QUERY)
+				fatal("Options -A, -Q, -T, and -W, are mutually exclusive, and can be specified only once.");
+			query_mode = CONVERT_TRANSACTIONS;
+			transactions_file = optarg;
+			break;
 		case 'v':
 			cctools_version_print(stdout, argv[0]);
 			exit(EXIT_SUCCESS);
@@ -488,6 +500,20 @@ int main(int argc, char *argv[])
 
 	cctools_version_debug(D_DEBUG, argv[0]);
 
+	if(query_mode == CONVERT_TRANSACTIONS) {
+		FILE *file = fopen(transactions_file, "r");
+		if(!file)
+			fatal("could not open %s: %s", transactions_file, strerror(errno));
+
+		int64_t count = work_queue_transactions_to_text(file, stdout);
+		fclose(file);
+
+		if(count < 0)
+			fatal("%s is not a binary transactions log.", transactions_file);
+
+		return EXIT_SUCCESS;
+	}
+
 	struct winsize window;
 	char *columns_str = getenv("COLUMNS");
 	if(columns_str) {
@@ -5,6 +5,7 @@ See the file COPYING for details.
 */
 
 #include "work_queue.h"
+#include "work_queue_internal.h"
 
 #include "cctools.h"
 #include "debug.h"
@@ -13,9 +14,11 @@ See the file COPYING for details.
 #include "itable.h"
 #include "list.h"
 #include "get_line.h"
+#include "timestamp.h"
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +27,12 @@ See the file COPYING for details.
 #include <sys/types.h>
 #include <unistd.h>
 
+/* Flags added to the files of the tasks submitted, such as WORK_QUEUE_COMPRESS. */
+static int submit_file_flags = 0;
+
+/* Disk in MB requested by the tasks submitted, 0 for none. */
+static int submit_disk = 0;
+
 int submit_tasks(struct work_queue *q, int input_size, int run_time, int output_size, int count, char *category )
 {
 	static int ntasks=0;
@@ -50,9 +59,11 @@ int submit_tasks(struct work_queue *q, int input_size, int run_time, int output_
 		ntasks++;
 
 		struct work_queue_task *t = work_queue_task_create(command);
-		work_queue_task_specify_file(t, input_file, "infile", WORK_QUEUE_INPUT, WORK_QUEUE_CACHE);
-		work_queue_task_specify_file(t, output_file, "outfile", WORK_QUEUE_OUTPUT, WORK_QUEUE_NOCACHE);
+		work_queue_task_specify_file(t, input_file, "infile", WORK_QUEUE_INPUT, WORK_QUEUE_CACHE | submit_file_flags);
+		work_queue_task_specify_file(t, output_file, "outfile", WORK_QUEUE_OUTPUT, WORK_QUEUE_NOCACHE | submit_file_flags);
 		work_queue_task_specify_cores(t,1);
+		if(submit_disk > 0)
+			work_queue_task_specify_disk(t, submit_disk);
 
 		if(category && strlen(category) > 0)
 			work_queue_task_specify_category(t, category);
@@ -63,6 +74,43 @@ int submit_tasks(struct work_queue *q, int input_size, int run_time, int output_
 	return 1;
 }
 
+/* Rewrite the directory indir with a new generation number, and submit tasks that read it as a cached input. */
+int submit_dir_tasks(struct work_queue *q, int run_time, int count )
+{
+	static int ntasks=0;
+	static int generation=0;
+	char output_file[128];
+	char command[256];
+
+	generation++;
+	mkdir("indir", 0777);
+	FILE *file = fopen("indir/data", "w");
+	if(!file) {
+		fprintf(stderr,"couldn't write indir/data: %s\n",strerror(errno));
+		return 0;
+	}
+	fprintf(file, "%d\n", generation);
+	fclose(file);
+
+	int i;
+	for(i=0;i<count;i++) {
+
+		sprintf(output_file, "output.dir.%d",ntasks);
+		sprintf(command, "cat indir/data > outfile; sleep %d", run_time );
+
+		ntasks++;
+
+		struct work_queue_task *t = work_queue_task_create(command);
+		work_queue_task_specify_file(t, "indir", "indir", WORK_QUEUE_INPUT, WORK_QUEUE_CACHE);
+		work_queue_task_specify_file(t, output_file, "outfile", WORK_QUEUE_OUTPUT, WORK_QUEUE_NOCACHE);
+		work_queue_task_specify_cores(t,1);
+
+		work_queue_submit(q, t);
+	}
+
+	return 1;
+}
+
 void wait_for_all_tasks( struct work_queue *q )
 {
 	struct work_queue_task *t;
@@ -72,12 +120,192 @@ void wait_for_all_tasks( struct work_queue *q )
 	}
 }
 
+static int parse_algorithm( const char *name )
+{
+	if(!strcmp(name, "fcfs")) {
+		return WORK_QUEUE_SCHEDULE_FCFS;
+	} else if(!strcmp(name, "files")) {
+		return WORK_QUEUE_SCHEDULE_FILES;
+	} else if(!strcmp(name, "time")) {
+		return WORK_QUEUE_SCHEDULE_TIME;
+	} else if(!strcmp(name, "rand")) {
+		return WORK_QUEUE_SCHEDULE_RAND;
+	} else if(!strcmp(name, "worst")) {
+		return WORK_QUEUE_SCHEDULE_WORST;
+	} else {
+		return WORK_QUEUE_SCHEDULE_UNSET;
+	}
+}
+
+void benchmark_dispatch( struct work_queue *q, int nworkers, int ntasks, const char *algorithm )
+{
+	int a = parse_algorithm(algorithm);
+	if(a == WORK_QUEUE_SCHEDULE_UNSET) {
+		fprintf(stderr,"unknown algorithm: %s\n",algorithm);
+		return;
+	}
+
+	work_queue_specify_algorithm(q, a);
+
+	timestamp_t elapsed;
+	int placed = work_queue_benchmark_dispatch(q, nworkers, ntasks, &elapsed);
+	double seconds = elapsed / 1000000.0;
+
+	printf("%s: placed %d of %d tasks on %d workers in %.3f s (%.0f tasks/s)\n", algorithm, placed, ntasks, nworkers, seconds, seconds > 0 ? placed / seconds : 0);
+}
+
+void benchmark_submit( struct work_queue *q, int ntasks )
+{
+	int *taskids = malloc(ntasks * sizeof(*taskids));
+	int i;
+
+	timestamp_t start = timestamp_get();
+
+	/* a few distinct priorities, so that many tasks share each one. */
+	for(i = 0; i < ntasks; i++) {
+		struct work_queue_task *t = work_queue_task_create(":");
+		work_queue_task_specify_priority(t, rand() % 100);
+		taskids[i] = work_queue_submit(q, t);
+	}
+
+	double submit = (timestamp_get() - start) / 1000000.0;
+
+	/* cancel in random order, to remove tasks from the middle of the queue. */
+	for(i = ntasks - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		int k = taskids[i];
+		taskids[i] = taskids[j];
+		taskids[j] = k;
+	}
+
+	start = timestamp_get();
+
+	for(i = 0; i < ntasks; i++) {
+		struct work_queue_task *t = work_queue_cancel_by_taskid(q, taskids[i]);
+		if(t) work_queue_task_delete(t);
+	}
+
+	double cancel = (timestamp_get() - start) / 1000000.0;
+
+	printf("submitted %d tasks in %.3f s (%.0f tasks/s), cancelled them in %.3f s (%.0f tasks/s)\n", ntasks, submit, submit > 0 ? ntasks / submit : 0, cancel, cancel > 0 ? ntasks / cancel : 0);
+
+	free(taskids);
+}
+
+void benchmark_tasks( struct work_queue *q, int ntasks, const char *command )
+{
+	int i, completed = 0, failed = 0;
+
+	timestamp_t start = timestamp_get();
+
+	/* small tasks, so that a worker runs as many at once as it has cores. */
+	for(i = 0; i < ntasks; i++) {
+		struct work_queue_task *t = work_queue_task_create(command);
+		work_queue_task_specify_cores(t, 1);
+		work_queue_task_specify_memory(t, 10);
+		work_queue_task_specify_disk(t, 10);
+		work_queue_submit(q, t);
+	}
+
+	while(!work_queue_empty(q)) {
+		struct work_queue_task *t = work_queue_wait(q, 5);
+		if(t) {
+			completed++;
+			if(t->result != WORK_QUEUE_RESULT_SUCCESS || t->return_status != 0)
+				failed++;
+			work_queue_task_delete(t);
+		}
+	}
+
+	double seconds = (timestamp_get() - start) / 1000000.0;
+
+	printf("completed %d tasks (%d failed) of '%s' in %.3f s (%.0f tasks/s)\n", completed, failed, command, seconds, seconds > 0 ? completed / seconds : 0);
+}
+
+struct threads_benchmark {
+	struct work_queue *q;
+	int ntasks;
+	int completed;
+};
+
+static void *threads_benchmark_submit( void *arg )
+{
+	struct threads_benchmark *b = arg;
+	int i;
+
+	for(i = 0; i < b->ntasks; i++) {
+		struct work_queue_task *t = work_queue_task_create(":");
+		work_queue_task_specify_cores(t, 1);
+		work_queue_task_specify_memory(t, 10);
+		work_queue_task_specify_disk(t, 10);
+		work_queue_submit_threadsafe(b->q, t);
+	}
+
+	return 0;
+}
+
+static void *threads_benchmark_complete( void *arg )
+{
+	struct threads_benchmark *b = arg;
+
+	while(__atomic_load_n(&b->completed, __ATOMIC_RELAXED) < b->ntasks) {
+		struct work_queue_task *t = work_queue_wait_completed(b->q, 1);
+		if(t) {
+			work_queue_task_delete(t);
+			__atomic_add_fetch(&b->completed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return 0;
+}
+
+void submit_threads( struct work_queue *q, int nthreads, int ntasks )
+{
+	pthread_t *producers = malloc(nthreads * sizeof(*producers));
+	pthread_t consumer;
+	int i;
+
+	struct threads_benchmark each = { q, ntasks, 0 };
+	struct threads_benchmark all = { q, nthreads * ntasks, 0 };
+
+	work_queue_specify_completion_queue(q, 1);
+
+	timestamp_t start = timestamp_get();
+
+	for(i = 0; i < nthreads; i++) {
+		pthread_create(&producers[i], NULL, threads_benchmark_submit, &each);
+	}
+	pthread_create(&consumer, NULL, threads_benchmark_complete, &all);
+
+	/* this thread only drives the queue. */
+	while(__atomic_load_n(&all.completed, __ATOMIC_RELAXED) < all.ntasks) {
+		work_queue_wait(q, 1);
+	}
+
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(producers[i], NULL);
+	}
+	pthread_join(consumer, NULL);
+
+	double seconds = (timestamp_get() - start) / 1000000.0;
+
+	work_queue_specify_completion_queue(q, 0);
+
+	printf("completed %d tasks submitted from %d threads in %.3f s\n", all.completed, nthreads, seconds);
+
+	free(producers);
+}
+
 void work_queue_mainloop( struct work_queue *q )
 {
 	char line[1024];
 	char category[1024];
+	char algorithm[1024];
+	char command[1024];
+	char name[1024];
+	double value;
 
-	int sleep_time, run_time, input_size, output_size, count;
+	int sleep_time, run_time, input_size, output_size, count, nworkers, enable;
 
 	while(1) {
 		printf("work_queue_test > ");
@@ -90,6 +318,8 @@ void work_queue_mainloop( struct work_queue *q )
 		string_chomp(line);
 
 		strcpy(category, "default");
+		strcpy(algorithm, "fcfs");
+		strcpy(command, "true");
 
 		if(sscanf(line,"sleep %d",&sleep_time)==1) {
 			printf("sleeping %d seconds...\n",sleep_time);
@@ -100,6 +330,29 @@ void work_queue_mainloop( struct work_queue *q )
 		} else if(sscanf(line, "submit %d %d %d %d %s",&input_size, &run_time, &output_size, &count, category) >= 4) {
 			printf("submitting %d tasks...\n",count);
 			submit_tasks(q,input_size,run_time,output_size,count,category);
+		} else if(sscanf(line, "submit-dir %d %d",&run_time, &count) == 2) {
+			printf("submitting %d tasks...\n",count);
+			submit_dir_tasks(q,run_time,count);
+		} else if(sscanf(line, "invalidate %s", name) == 1) {
+			work_queue_invalidate_cached_file(q, name, WORK_QUEUE_FILE);
+		} else if(sscanf(line, "benchmark %d %d %s",&nworkers, &count, algorithm) >= 2) {
+			benchmark_dispatch(q,nworkers,count,algorithm);
+		} else if(!strcmp(line,"benchmark")) {
+			benchmark_dispatch(q,1000,4000,algorithm);
+			benchmark_dispatch(q,10000,40000,algorithm);
+			benchmark_dispatch(q,50000,200000,algorithm);
+		} else if(sscanf(line, "benchmark-submit %d", &count) == 1) {
+			benchmark_submit(q,count);
+		} else if(sscanf(line, "benchmark-tasks %d %[^\n]", &count, command) >= 1) {
+			benchmark_tasks(q,count,command);
+		} else if(sscanf(line, "submit-threads %d %d", &nworkers, &count) == 2) {
+			submit_threads(q,nworkers,count);
+		} else if(sscanf(line, "tune %s %lf", name, &value) == 2) {
+			work_queue_tune(q, name, value);
+		} else if(sscanf(line, "compress %d", &enable) == 1) {
+			submit_file_flags = enable ? WORK_QUEUE_COMPRESS : 0;
+		} else if(sscanf(line, "disk %d", &submit_disk) == 1) {
+			/* used by the tasks submitted next. */
 		} else if(!strcmp(line,"quit") || !strcmp(line,"exit")) {
 			break;
 		} else if(!strcmp(line,"help")) {
@@ -108,6 +361,20 @@ void work_queue_mainloop( struct work_queue *q )
 			printf("wait                    Wait for all submitted tasks to finish.\n");
 			printf("submit <I> <T> <O> <N>  Submit N tasks that read I MB input,\n");
 			printf("                        run for T seconds, and produce O MB of output.\n");
+			printf("submit-dir <T> <N>      Write a new version of the directory indir, and submit\n");
+			printf("                        N tasks that read it and run for T seconds.\n");
+			printf("invalidate <F>          Remove the cached file F from the workers.\n");
+			printf("benchmark <W> <N> [A]   Place N one-core tasks on W simulated four-core workers\n");
+			printf("                        with algorithm A (fcfs, files, time, rand, worst).\n");
+			printf("benchmark               Same as above, with 1k, 10k, and 50k workers using fcfs.\n");
+			printf("benchmark-submit <N>    Submit N tasks of random priority, then cancel them.\n");
+			printf("benchmark-tasks <N> [C] Run N one-core tasks of command C (default true), and\n");
+			printf("                        report the tasks completed per second.\n");
+			printf("submit-threads <P> <N>  Submit N empty tasks from each of P threads, and wait\n");
+			printf("                        for them from another thread.\n");
+			printf("tune <name> <value>     Tune an advanced parameter, as with work_queue_tune.\n");
+			printf("compress <0|1>          Compress the files of the tasks submitted next.\n");
+			printf("disk <D>                The tasks submitted next request D MB of disk.\n");
 			printf("quit, exit              Wait for all tasks to complete, then exit.\n");
 			printf("\n");
 		} else {
@@ -20,6 +20,9 @@ void show_help( const char *cmd )
 	printf("-Z <file>  Write listening port to this file.\n");
 	printf("-p <port>  Listen on this port.\n");
 	printf("-N <name>  Advertise this project name.\n");
+	printf("-P <file>  Password file for authenticating workers.\n");
+	printf("-l <file>  Write the transactions log to this file.\n");
+	printf("-b         Write the transactions log in binary format.\n");
 	printf("-d <flag>  Enable debugging for this subsystem.\n");
 	printf("-o <file>  Send debugging output to this file.\n");
 	printf("-v         Show version information.\n");
@@ -31,10 +34,13 @@ int main(int argc, char *argv[])
 	int port = WORK_QUEUE_DEFAULT_PORT;
 	const char *port_file=0;
 	const char *project_name=0;
+	const char *password_file=0;
+	const char *transactions_log=0;
+	int binary_flag = 0;
 	int monitor_flag = 0;
 	int c;
 
-	while((c = getopt(argc, argv, "d:o:mN:p:Z:vh"))!=-1) {
+	while((c = getopt(argc, argv, "bd:l:o:mN:p:P:Z:vh"))!=-1) {
 		switch (c) {
 		case 'd':
 			debug_flags_set(optarg);
@@ -51,6 +57,15 @@ int main(int argc, char *argv[])
 		case 'N':
 			project_name = optarg;
 			break;
+		case 'P':
+			password_file = optarg;
+			break;
+		case 'l':
+			transactions_log = optarg;
+			break;
+		case 'b':
+			binary_flag = 1;
+			break;
 		case 'Z':
 			port_file = strdup(optarg);
 			port = 0;
@@ -84,6 +99,10 @@ int main(int argc, char *argv[])
 		work_queue_specify_name(q,project_name);
 	}
 
+	if(password_file) {
+		if(!work_queue_specify_password_file(q,password_file)) fatal("couldn't read %s: %s",password_file,strerror(errno));
+	}
+
 	if(monitor_flag) {
 		unlink_recursive("work-queue-test-monitor");
 		work_queue_enable_monitoring(q, "work-queue-test-monitor");
@@ -93,6 +112,14 @@ int main(int argc, char *argv[])
 	}
 
 
+	if(transactions_log) {
+		if(binary_flag) {
+			work_queue_specify_transactions_log_binary(q, transactions_log);
+		} else {
+			work_queue_specify_transactions_log(q, transactions_log);
+		}
+	}
+
 	int result = work_queue_mainloop(q);
 
 	work_queue_delete(q);
@@ -0,0 +1,398 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "work_queue_topology.h"
+
+#include "debug.h"
+#include "macros.h"
+#include "stringtools.h"
+#include "xxmalloc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CCTOOLS_OPSYS_LINUX
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* NUMA node ids passed to set_mempolicy are below this. */
+#define TOPOLOGY_MAX_NODE 1024
+
+struct core {
+	int cpu;
+	int node;                          // index in topology->node_ids.
+	struct work_queue_cpuset *owner;   // NULL if free.
+};
+
+struct work_queue_topology {
+	struct core *cores;
+	int count;
+	int *node_ids;                     // NUMA node id of each node, -1 if unknown.
+	int nodes;
+};
+
+struct work_queue_cpuset {
+	int *cpus;
+	int count;
+	int node;
+	int node_id;
+};
+
+/* Parse a list of cpus such as "0-3,8,10-11", as in /sys/devices/system/node/nodeN/cpulist. */
+static void parse_cpulist( const char *list, cpu_set_t *set )
+{
+	CPU_ZERO(set);
+
+	while(*list) {
+		char *end;
+		long first = strtol(list, &end, 10);
+		if(end == list)
+			break;
+
+		long last = first;
+		if(*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+		}
+
+		for(; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+
+		list = end;
+		while(*list == ',' || *list == '\n')
+			list++;
+	}
+}
+
+static int read_line( const char *path, char *line, int length )
+{
+	FILE *file = fopen(path, "r");
+	if(!file)
+		return 0;
+
+	int result = fgets(line, length, file) != NULL;
+	fclose(file);
+
+	return result;
+}
+
+/* Fill node_of with the NUMA node id of each cpu, or with its socket when /sys has no NUMA nodes. */
+static int read_nodes( int *node_of, int *numa )
+{
+	char line[4096];
+	int cpu, found = 0;
+
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		node_of[cpu] = -1;
+
+	DIR *dir = opendir("/sys/devices/system/node");
+	if(dir) {
+		struct dirent *d;
+		while((d = readdir(dir))) {
+			int node;
+			if(sscanf(d->d_name, "node%d", &node) != 1)
+				continue;
+
+			char *path = string_format("/sys/devices/system/node/%s/cpulist", d->d_name);
+			if(read_line(path, line, sizeof(line))) {
+				cpu_set_t set;
+				parse_cpulist(line, &set);
+				for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+					if(CPU_ISSET(cpu, &set)) {
+						node_of[cpu] = node;
+						found = 1;
+					}
+				}
+			}
+			free(path);
+		}
+		closedir(dir);
+	}
+
+	*numa = found;
+	if(found)
+		return 1;
+
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		char *path = string_format("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		if(read_line(path, line, sizeof(line))) {
+			node_of[cpu] = atoi(line);
+			found = 1;
+		}
+		free(path);
+	}
+
+	return found;
+}
+
+static int core_compare( const void *a, const void *b )
+{
+	const struct core *x = a;
+	const struct core *y = b;
+
+	if(x->node != y->node)
+		return x->node - y->node;
+
+	return x->cpu - y->cpu;
+}
+
+struct work_queue_topology *work_queue_topology_create( int max_cores )
+{
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		debug(D_WQ, "could not read the cpus of the worker: %s", strerror(errno));
+		return NULL;
+	}
+
+	int *node_of = xxmalloc(CPU_SETSIZE * sizeof(int));
+	int numa;
+
+	if(!read_nodes(node_of, &numa)) {
+		debug(D_WQ, "could not read the topology of the cpus");
+		free(node_of);
+		return NULL;
+	}
+
+	struct work_queue_topology *t = xxcalloc(1, sizeof(*t));
+	t->cores = xxcalloc(CPU_COUNT(&allowed), sizeof(*t->cores));
+
+	int cpu;
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(!CPU_ISSET(cpu, &allowed))
+			continue;
+
+		struct core *c = &t->cores[t->count++];
+		c->cpu = cpu;
+		c->node = MAX(node_of[cpu], 0);
+		c->owner = NULL;
+	}
+
+	qsort(t->cores, t->count, sizeof(*t->cores), core_compare);
+
+	if(max_cores > 0 && max_cores < t->count)
+		t->count = max_cores;
+
+	/* number the nodes of the cores kept from 0. */
+	t->node_ids = xxmalloc(t->count * sizeof(int));
+	int i;
+	for(i = 0; i < t->count; i++) {
+		int id = t->cores[i].node;
+		if(t->nodes == 0 || t->node_ids[t->nodes - 1] != id)
+			t->node_ids[t->nodes++] = id;
+		t->cores[i].node = t->nodes - 1;
+	}
+
+	if(!numa) {
+		for(i = 0; i < t->nodes; i++)
+			t->node_ids[i] = -1;
+	}
+
+	free(node_of);
+
+	debug(D_WQ, "mapped %d cores in %d %s", t->count, t->nodes, numa ? "numa nodes" : "sockets");
+
+	return t;
+}
+
+void work_queue_topology_delete( struct work_queue_topology *t )
+{
+	if(!t)
+		return;
+
+	free(t->cores);
+	free(t->node_ids);
+	free(t);
+}
+
+int work_queue_topology_nodes( struct work_queue_topology *t )
+{
+	return t->nodes;
+}
+
+static int node_cores( struct work_queue_topology *t, int node, int only_free )
+{
+	int i, n = 0;
+
+	for(i = 0; i < t->count; i++) {
+		if(t->cores[i].node == node && (!only_free || !t->cores[i].owner))
+			n++;
+	}
+
+	return n;
+}
+
+int work_queue_topology_node_cores( struct work_queue_topology *t, int node )
+{
+	return node_cores(t, node, 0);
+}
+
+/* Give s up to n free cores of node. */
+static void take_cores( struct work_queue_topology *t, struct work_queue_cpuset *s, int node, int n )
+{
+	int i;
+
+	for(i = 0; i < t->count && n > 0; i++) {
+		struct core *c = &t->cores[i];
+		if(c->node == node && !c->owner) {
+			c->owner = s;
+			s->cpus[s->count++] = c->cpu;
+			n--;
+		}
+	}
+}
+
+struct work_queue_cpuset *work_queue_topology_allocate( struct work_queue_topology *t, int cores, int preferred_node )
+{
+	int *free_cores = xxmalloc(t->nodes * sizeof(int));
+	int node, total = 0;
+
+	for(node = 0; node < t->nodes; node++) {
+		free_cores[node] = node_cores(t, node, 1);
+		total += free_cores[node];
+	}
+
+	if(cores < 1 || cores > total) {
+		free(free_cores);
+		return NULL;
+	}
+
+	int chosen = -1;
+	if(preferred_node >= 0 && preferred_node < t->nodes && free_cores[preferred_node] >= cores) {
+		chosen = preferred_node;
+	} else {
+		for(node = 0; node < t->nodes; node++) {
+			if(free_cores[node] >= cores && (chosen < 0 || free_cores[node] < free_cores[chosen]))
+				chosen = node;
+		}
+	}
+
+	struct work_queue_cpuset *s = xxmalloc(sizeof(*s));
+	s->cpus = xxmalloc(cores * sizeof(int));
+	s->count = 0;
+	s->node = chosen;
+	s->node_id = chosen >= 0 ? t->node_ids[chosen] : -1;
+
+	if(chosen >= 0) {
+		take_cores(t, s, chosen, cores);
+	} else {
+		/* no node fits the task, so spread it over the nodes with the most free cores. */
+		while(s->count < cores) {
+			int most = 0;
+			for(node = 1; node < t->nodes; node++) {
+				if(free_cores[node] > free_cores[most])
+					most = node;
+			}
+
+			int n = MIN(free_cores[most], cores - s->count);
+			take_cores(t, s, most, n);
+			free_cores[most] -= n;
+		}
+	}
+
+	free(free_cores);
+
+	return s;
+}
+
+void work_queue_topology_release( struct work_queue_topology *t, struct work_queue_cpuset *s )
+{
+	int i;
+
+	if(!s)
+		return;
+
+	for(i = 0; i < t->count; i++) {
+		if(t->cores[i].owner == s)
+			t->cores[i].owner = NULL;
+	}
+
+	free(s->cpus);
+	free(s);
+}
+
+int work_queue_cpuset_node( struct work_queue_cpuset *s )
+{
+	return s->node;
+}
+
+int work_queue_cpuset_bind( struct work_queue_cpuset *s )
+{
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	for(i = 0; i < s->count; i++)
+		CPU_SET(s->cpus[i], &set);
+
+	if(sched_setaffinity(0, sizeof(set), &set) < 0)
+		return 0;
+
+	/* preferred rather than bound, so that a full node does not fail the task. */
+	if(s->node_id >= 0 && s->node_id < TOPOLOGY_MAX_NODE) {
+		unsigned long mask[TOPOLOGY_MAX_NODE / (8 * sizeof(unsigned long))];
+		memset(mask, 0, sizeof(mask));
+		mask[s->node_id / (8 * sizeof(unsigned long))] |= 1UL << (s->node_id % (8 * sizeof(unsigned long)));
+
+		/* the kernel reads maxnode - 1 bits of the mask. */
+		if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, TOPOLOGY_MAX_NODE + 1) < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+#else
+
+struct work_queue_topology *work_queue_topology_create( int max_cores )
+{
+	return NULL;
+}
+
+void work_queue_topology_delete( struct work_queue_topology *t )
+{
+}
+
+int work_queue_topology_nodes( struct work_queue_topology *t )
+{
+	return 0;
+}
+
+int work_queue_topology_node_cores( struct work_queue_topology *t, int node )
+{
+	return 0;
+}
+
+struct work_queue_cpuset *work_queue_topology_allocate( struct work_queue_topology *t, int cores, int preferred_node )
+{
+	return NULL;
+}
+
+void work_queue_topology_release( struct work_queue_topology *t, struct work_queue_cpuset *s )
+{
+}
+
+int work_queue_cpuset_node( struct work_queue_cpuset *s )
+{
+	return -1;
+}
+
+int work_queue_cpuset_bind( struct work_queue_cpuset *s )
+{
+	return 0;
+}
+
+#endif
+
+/* vim: set noexpandtab tabstop=4: */
@@ -0,0 +1,45 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef WORK_QUEUE_TOPOLOGY_H
+#define WORK_QUEUE_TOPOLOGY_H
+
+/*
+The topology is the map of the cores available to the worker and the NUMA
+node of each, as found in /sys. Each task is given a disjoint set of cores,
+within a single node whenever one has enough free cores, so that the task
+is not migrated between sockets and its memory stays local. Only Linux is
+supported; elsewhere, work_queue_topology_create returns NULL.
+*/
+
+/* A set of cores given to a task. node is -1 if it spans several nodes. */
+struct work_queue_cpuset;
+
+/* Map the first max_cores cores available to this process, filling whole nodes first. */
+struct work_queue_topology *work_queue_topology_create( int max_cores );
+void work_queue_topology_delete( struct work_queue_topology *t );
+
+/* Number of NUMA nodes, and the cores of each node, among the mapped cores. */
+int work_queue_topology_nodes( struct work_queue_topology *t );
+int work_queue_topology_node_cores( struct work_queue_topology *t, int node );
+
+/*
+Take cores free cores, preferably in node preferred_node (-1 for any), else
+in the node that fits them most tightly, else across nodes. Returns NULL if
+there are not enough free cores.
+*/
+struct work_queue_cpuset *work_queue_topology_allocate( struct work_queue_topology *t, int cores, int preferred_node );
+void work_queue_topology_release( struct work_queue_topology *t, struct work_queue_cpuset *s );
+
+/* Node of the set, -1 if it spans several nodes. */
+int work_queue_cpuset_node( struct work_queue_cpuset *s );
+
+/* Restrict the calling process to the cores of the set, and its memory to their node. Called after fork. */
+int work_queue_cpuset_bind( struct work_queue_cpuset *s );
+
+#endif
+
+/* vim: set noexpandtab tabstop=4: */
@@ -0,0 +1,349 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#include "work_queue_transactions.h"
+#include "work_queue_internal.h"
+
+#include "debug.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The resources of a task, as printed in the text log. */
+static const size_t resource_offsets[] = {
+	offsetof(struct rmsummary, start),
+	offsetof(struct rmsummary, end),
+	offsetof(struct rmsummary, wall_time),
+	offsetof(struct rmsummary, total_processes),
+	offsetof(struct rmsummary, max_concurrent_processes),
+	offsetof(struct rmsummary, cpu_time),
+	offsetof(struct rmsummary, virtual_memory),
+	offsetof(struct rmsummary, memory),
+	offsetof(struct rmsummary, swap_memory),
+	offsetof(struct rmsummary, bytes_read),
+	offsetof(struct rmsummary, bytes_written),
+	offsetof(struct rmsummary, bytes_sent),
+	offsetof(struct rmsummary, bytes_received),
+	offsetof(struct rmsummary, bandwidth),
+	offsetof(struct rmsummary, total_files),
+	offsetof(struct rmsummary, disk),
+	offsetof(struct rmsummary, cores),
+	offsetof(struct rmsummary, cores_avg),
+};
+
+#define RESOURCE_FIELDS (sizeof(resource_offsets) / sizeof(resource_offsets[0]))
+
+#define resource_field(s, i) (*(int64_t *) ((char *) (s) + resource_offsets[i]))
+
+void work_queue_transactions_put_int( buffer_t *B, uint64_t n )
+{
+	char bytes[10];
+	int i = 0;
+
+	while(n >= 0x80) {
+		bytes[i++] = (n & 0x7f) | 0x80;
+		n >>= 7;
+	}
+	bytes[i++] = n;
+
+	buffer_putlstring(B, bytes, i);
+}
+
+void work_queue_transactions_put_string( buffer_t *B, const char *s )
+{
+	if(!s) {
+		work_queue_transactions_put_int(B, 0);
+		return;
+	}
+
+	size_t length = strlen(s);
+	work_queue_transactions_put_int(B, length + 1);
+	buffer_putlstring(B, s, length);
+}
+
+void work_queue_transactions_put_resources( buffer_t *B, const struct rmsummary *s )
+{
+	if(!s) {
+		work_queue_transactions_put_int(B, 0);
+		return;
+	}
+
+	uint64_t mask = 0;
+	size_t i;
+
+	for(i = 0; i < RESOURCE_FIELDS; i++) {
+		if(resource_field(s, i) > -1)
+			mask |= UINT64_C(1) << i;
+	}
+
+	/* the lowest bit tells an empty summary from no summary. */
+	work_queue_transactions_put_int(B, (mask << 1) | 1);
+
+	for(i = 0; i < RESOURCE_FIELDS; i++) {
+		if(mask & (UINT64_C(1) << i))
+			work_queue_transactions_put_int(B, resource_field(s, i));
+	}
+}
+
+void work_queue_transactions_put_record( buffer_t *B, work_queue_transaction_t type, int64_t time, buffer_t *fields )
+{
+	buffer_t header;
+	buffer_init(&header);
+
+	char type_byte = type;
+	buffer_putlstring(&header, &type_byte, 1);
+
+	if(type == WORK_QUEUE_TRANSACTION_START) {
+		work_queue_transactions_put_int(&header, time);
+	} else {
+		/* zigzag, as the clock may step back. */
+		work_queue_transactions_put_int(&header, ((uint64_t) time << 1) ^ (uint64_t) (time >> 63));
+	}
+
+	size_t length;
+	const char *f = fields ? buffer_tolstring(fields, &length) : NULL;
+	if(!f)
+		length = 0;
+
+	work_queue_transactions_put_int(B, buffer_pos(&header) + length);
+	buffer_putlstring(B, buffer_tostring(&header), buffer_pos(&header));
+	if(length > 0)
+		buffer_putlstring(B, f, length);
+
+	buffer_free(&header);
+}
+
+void work_queue_transactions_text_header( buffer_t *B )
+{
+	buffer_putliteral(B, "# date time master-pid MASTER START|END\n");
+	buffer_putliteral(B, "# date time master-pid WORKER worker-id host:port CONNECTION|DISCONNECTION\n");
+	buffer_putliteral(B, "# date time master-pid WORKER worker-id RESOURCES resources\n");
+	buffer_putliteral(B, "# date time master-pid CATEGORY name MAX resources-max-per-task\n");
+	buffer_putliteral(B, "# date time master-pid CATEGORY name MIN resources-min-per-task-per-worker\n");
+	buffer_putliteral(B, "# date time master-pid CATEGORY name FIRST FIXED|MAX|MIN_WASTE|MAX_THROUGHPUT resources-requested\n");
+	buffer_putliteral(B, "# date time master-pid TASK taskid WAITING category-name FIRST_RESOURCES|MAX_RESOURCES resources-requested\n");
+	buffer_putliteral(B, "# date time master-pid TASK taskid RUNNING worker-address FIRST_RESOURCES|MAX_RESOURCES resources-given\n");
+	buffer_putliteral(B, "# date time master-pid TASK taskid WAITING_RETRIEVAL worker-address\n");
+	buffer_putliteral(B, "# date time master-pid TASK taskid RETRIEVED|DONE task-result ...\n");
+	buffer_putliteral(B, "# date time master-pid TASK taskid RETRIEVED SUCCESS|SIGNAL|END_TIME|FORSAKEN|MAX_RETRIES|MAX_WALLTIME|UNKNOWN|RESOURCE_EXHAUSTION [limits-exceeded]\n");
+	buffer_putliteral(B, "# date time master-pid TASK taskid DONE SUCCESS|INPUT_MISS|OUTPUT_MISS|STDOUT_MISS|SIGNAL|END_TIME|MAX_RETRIES|MAX_WALLTIME|UNKNOWN|RESOURCE_EXHAUSTION [limits-exceeded]\n");
+	buffer_putliteral(B, "# date time master-pid TRANSFER taskid INPUT|OUTPUT worker-address file-name bytes bytes-on-the-wire\n\n");
+}
+
+/* A record being decoded. error is set when reading past its end. */
+struct cursor {
+	const unsigned char *data;
+	size_t length;
+	size_t pos;
+	int error;
+};
+
+static uint64_t get_int( struct cursor *c )
+{
+	uint64_t n = 0;
+	int shift = 0;
+
+	while(c->pos < c->length && shift < 64) {
+		unsigned char byte = c->data[c->pos++];
+		n |= (uint64_t) (byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return n;
+		shift += 7;
+	}
+
+	c->error = 1;
+	return 0;
+}
+
+static char *get_string( struct cursor *c )
+{
+	uint64_t length = get_int(c);
+	if(length == 0 || c->error)
+		return NULL;
+
+	length--;
+	if(length > c->length - c->pos) {
+		c->error = 1;
+		return NULL;
+	}
+
+	char *s = malloc(length + 1);
+	memcpy(s, c->data + c->pos, length);
+	s[length] = 0;
+	c->pos += length;
+
+	return s;
+}
+
+static struct rmsummary *get_resources( struct cursor *c )
+{
+	uint64_t mask = get_int(c);
+	if(!(mask & 1) || c->error)
+		return NULL;
+
+	mask >>= 1;
+
+	struct rmsummary *s = rmsummary_create(-1);
+	size_t i;
+
+	for(i = 0; i < RESOURCE_FIELDS; i++) {
+		if(mask & (UINT64_C(1) << i))
+			resource_field(s, i) = get_int(c);
+	}
+
+	return s;
+}
+
+static void print_resources( buffer_t *B, struct rmsummary *s )
+{
+	if(s) {
+		rmsummary_print_buffer(B, s, 1);
+		rmsummary_delete(s);
+	}
+}
+
+static const char *allocation_str( uint64_t max )
+{
+	return max ? "MAX_RESOURCES" : "FIRST_RESOURCES";
+}
+
+/* Write the fields of a task record as the text of the transaction, as in write_transaction_task. */
+static void task_to_text( struct cursor *c, buffer_t *B )
+{
+	int taskid = get_int(c);
+	work_queue_task_state_t state = get_int(c);
+	uint64_t value;
+	char *s;
+
+	buffer_printf(B, "TASK %d %s", taskid, task_state_str(state));
+
+	switch(state) {
+		case WORK_QUEUE_TASK_READY:
+			s = get_string(c);
+			value = get_int(c);
+			buffer_printf(B, " %s %s ", s ? s : "(null)", allocation_str(value));
+			print_resources(B, get_resources(c));
+			free(s);
+			break;
+		case WORK_QUEUE_TASK_RETRIEVED:
+		case WORK_QUEUE_TASK_DONE:
+			value = get_int(c);
+			buffer_printf(B, " %s ", task_result_str(value));
+			print_resources(B, get_resources(c));
+			break;
+		case WORK_QUEUE_TASK_RUNNING:
+		case WORK_QUEUE_TASK_WAITING_RETRIEVAL:
+			s = get_string(c);
+			if(s) {
+				buffer_printf(B, " %s ", s);
+				if(state == WORK_QUEUE_TASK_RUNNING) {
+					value = get_int(c);
+					buffer_printf(B, " %s ", allocation_str(value));
+					print_resources(B, get_resources(c));
+				}
+				free(s);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+int64_t work_queue_transactions_to_text( FILE *input, FILE *output )
+{
+	char magic[sizeof(WORK_QUEUE_TRANSACTIONS_MAGIC) - 1];
+
+	if(fread(magic, sizeof(magic), 1, input) != 1 || memcmp(magic, WORK_QUEUE_TRANSACTIONS_MAGIC, sizeof(magic))) {
+		debug(D_NOTICE, "not a binary transactions log");
+		return -1;
+	}
+
+	buffer_t B;
+	buffer_init(&B);
+	work_queue_transactions_text_header(&B);
+	fputs(buffer_tostring(&B), output);
+
+	unsigned char *record = NULL;
+	size_t record_size = 0;
+	uint64_t time = 0;
+	int pid = 0;
+	int64_t count = 0;
+
+	while(1) {
+		/* the length of the record, read a byte at a time. */
+		uint64_t length = 0;
+		int shift = 0;
+		int byte;
+		while((byte = getc(input)) != EOF) {
+			length |= (uint64_t) (byte & 0x7f) << shift;
+			shift += 7;
+			if(!(byte & 0x80) || shift >= 64)
+				break;
+		}
+
+		if(byte == EOF) {
+			if(shift > 0)
+				debug(D_NOTICE, "transactions log ends in the middle of a record");
+			break;
+		}
+
+		if(length > record_size) {
+			record_size = length;
+			record = realloc(record, record_size);
+		}
+
+		if(length > 0 && fread(record, length, 1, input) != 1) {
+			debug(D_NOTICE, "transactions log ends in the middle of a record");
+			break;
+		}
+
+		struct cursor c = { record, length, 0, 0 };
+
+		int type = length > 0 ? record[c.pos++] : 0;
+		uint64_t t = get_int(&c);
+
+		buffer_rewind(&B, 0);
+
+		switch(type) {
+			case WORK_QUEUE_TRANSACTION_START:
+				time = t;
+				pid = get_int(&c);
+				buffer_putliteral(&B, "MASTER START");
+				break;
+			case WORK_QUEUE_TRANSACTION_TEXT: {
+				time += (int64_t) ((t >> 1) ^ -(t & 1));
+				char *s = get_string(&c);
+				buffer_putstring(&B, s ? s : "");
+				free(s);
+				break;
+			}
+			case WORK_QUEUE_TRANSACTION_TASK:
+				time += (int64_t) ((t >> 1) ^ -(t & 1));
+				task_to_text(&c, &B);
+				break;
+			default:
+				/* skip records from newer versions. */
+				continue;
+		}
+
+		if(c.error) {
+			debug(D_NOTICE, "corrupted record in transactions log");
+			break;
+		}
+
+		fprintf(output, "%" PRIu64 " %d %s\n", time, pid, buffer_tostring(&B));
+		count++;
+	}
+
+	free(record);
+	buffer_free(&B);
+
+	return count;
+}
+
+/* vim: set noexpandtab tabstop=4: */
@@ -0,0 +1,64 @@
+/*
+Copyright (C) 2016- The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file COPYING for details.
+*/
+
+#ifndef WORK_QUEUE_TRANSACTIONS_H
+#define WORK_QUEUE_TRANSACTIONS_H
+
+/*
+The binary transactions log holds the same information as the text
+transactions log, in a fraction of the space and of the time needed to
+write it. It starts with WORK_QUEUE_TRANSACTIONS_MAGIC, followed by records
+of the form:
+
+	length type time fields...
+
+where length is the size in bytes of the rest of the record, type is one
+byte, and time is the timestamp of the record for START records, and the
+difference with the timestamp of the previous record otherwise. Integers
+are written as variable length integers, seven bits per byte, least
+significant first. Signed integers are zigzag encoded first. Strings are
+written as their length plus one (zero for null), followed by their bytes.
+Resources are written as a mask of the fields present, followed by their
+values, or as zero for no resources.
+
+START records carry the pid of the master, used for the records after them.
+TASK records carry the task id and state, and the details of the state
+change. TEXT records carry any other transaction, as it appears in the text
+log, since those are rare.
+*/
+
+#include "buffer.h"
+#include "rmsummary.h"
+#include "timestamp.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define WORK_QUEUE_TRANSACTIONS_MAGIC "WQTXLOG1"
+
+typedef enum {
+	WORK_QUEUE_TRANSACTION_START = 1,
+	WORK_QUEUE_TRANSACTION_TEXT,
+	WORK_QUEUE_TRANSACTION_TASK
+} work_queue_transaction_t;
+
+void work_queue_transactions_put_int( buffer_t *B, uint64_t n );
+void work_queue_transactions_put_string( buffer_t *B, const char *s );
+void work_queue_transactions_put_resources( buffer_t *B, const struct rmsummary *s );
+
+/* Append a record of the given type and time, with the fields encoded in fields, to B. */
+void work_queue_transactions_put_record( buffer_t *B, work_queue_transaction_t type, int64_t time, buffer_t *fields );
+
+/* Write the comment lines that start a text transactions log. */
+void work_queue_transactions_text_header( buffer_t *B );
+
+/* Write the binary transactions log read from input as a text transactions log to output.
+Returns the number of records converted, or -1 if input is not a binary transactions log. */
+int64_t work_queue_transactions_to_text( FILE *input, FILE *output );
+
+#endif
+
+/* vim: set noexpandtab tabstop=4: */
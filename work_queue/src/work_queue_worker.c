@@ -7,10 +7,13 @@ See the file COPYING for details.
 #include "work_queue.h"
 #include "work_queue_protocol.h"
 #include "work_queue_internal.h"
+#include "work_queue_compress.h"
 #include "work_queue_resources.h"
 #include "work_queue_process.h"
 #include "work_queue_catalog.h"
 #include "work_queue_watcher.h"
+#include "work_queue_content_cache.h"
+#include "work_queue_topology.h"
 
 #include "cctools.h"
 #include "macros.h"
@@ -22,6 +25,7 @@ See the file COPYING for details.
 #include "host_disk_info.h"
 #include "path_disk_size_info.h"
 #include "hash_cache.h"
+#include "hash_table.h"
 #include "link.h"
 #include "link_auth.h"
 #include "list.h"
@@ -39,6 +43,8 @@ See the file COPYING for details.
 #include "url_encode.h"
 #include "md5.h"
 #include "disk_alloc.h"
+#include "buffer.h"
+#include "full_io.h"
 
 #include <unistd.h>
 #include <dirent.h>
@@ -63,6 +69,11 @@ See the file COPYING for details.
 #include <sys/utsname.h>
 #include <sys/wait.h>
 
+#ifdef CCTOOLS_OPSYS_LINUX
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #ifdef CCTOOLS_OPSYS_SUNOS
 extern int setenv(const char *name, const char *value, int overwrite);
 #endif
@@ -96,9 +107,27 @@ static int connect_timeout = 900;
 // Maximum time to attempt sending/receiving any given file or message.
 static const int active_timeout = 3600;
 
+// Results are sent to the master in writes of about this many bytes. Larger task outputs are sent on their own.
+static const int64_t result_batch_max = 64*1024;
+
 // Maximum time for the foreman to spend waiting in its internal loop
 static const int foreman_internal_timeout = 5;
 
+// A foreman tells the master it has results when it has this many, when
+// the oldest has waited foreman_batch_delay seconds, or when no other task is
+// left, so that results go up in a few large messages.
+static int foreman_batch_max = 64;
+static int foreman_batch_delay = 1;
+
+// When the oldest result not yet announced by the foreman completed, 0 if none.
+static time_t foreman_batch_start = 0;
+
+// A foreman sends its resources when they change, at most once in this many seconds.
+static const int foreman_update_interval = 1;
+
+// Statistics last sent by the foreman, which only sends those that change.
+static struct work_queue_stats foreman_stats_last;
+
 // Initial value for backoff interval (in seconds) when worker fails to connect to a master.
 static int init_backoff_interval = 1;
 
@@ -122,12 +151,56 @@ static int sigchld_received_flag = 0;
 static int64_t disk_avail_threshold = 100;
 static int64_t memory_avail_threshold = 100;
 
+// Directory of the content cache, shared by the workers of the node. Disabled if null.
+static char *content_cache_dir = NULL;
+static struct work_queue_content_cache *content_cache = NULL;
+
+// Maximum size (MB) of the content cache.
+static int64_t content_cache_size = 1024;
+
+// Maximum number of files in the content cache announced to a master.
+static const int content_cache_announce_max = 1000;
+
+// How inputs are placed into sandboxes, see setup_sandbox.
+typedef enum {
+	SANDBOX_MODE_LINK,
+	SANDBOX_MODE_CLONE
+} sandbox_mode_t;
+
+static sandbox_mode_t sandbox_mode = SANDBOX_MODE_LINK;
+
+// Cleared when the filesystem of the workspace turns out not to support reflinks.
+static int reflinks_supported = 1;
+
+// Prebuilt trees of links to cached directories, indexed by cached directory.
+static struct hash_table *sandbox_trees = NULL;
+
+// If set, each task is pinned to cores of its own, see work_queue_topology.h.
+static int pin_cores = 0;
+static struct work_queue_topology *topology = NULL;
+
+// How the processes of tasks are created, see work_queue_launcher.h.
+static work_queue_launcher_t launcher = WORK_QUEUE_LAUNCHER_FORK;
+
 // Password shared between master and worker.
 char *password = 0;
 
 // Allow worker to use symlinks when link() fails.  Enabled by default.
 static int symlinks_enabled = 1;
 
+// Serve cached files to other workers, when the master asks them to fetch from us.  Disabled by default, and needs a password.
+static int peer_transfers_enabled = 0;
+
+// Listening link and process serving cached files to other workers.
+static struct link *peer_link = 0;
+static pid_t peer_server_pid = 0;
+
+// Maximum time a peer waits for a cached file to start arriving.
+static const int peer_file_timeout = 60;
+
+// Maximum number of peers served at once. Further peers wait to be accepted.
+static const int peer_server_children_max = 16;
+
 // Worker id. A unique id for this worker instance.
 static char *worker_id;
 
@@ -200,6 +273,13 @@ static struct list   *procs_waiting = NULL;
 // These are additional pointers into procs_table.
 static struct itable *procs_complete = NULL;
 
+// Cached files that could not be fetched from a peer or the content cache, and that the master sends instead.
+static struct hash_table *files_missing = NULL;
+
+// List of all procs waiting for some of those files before their sandboxes are set up.
+// These are additional pointers into procs_table.
+static struct list   *procs_missing_inputs = NULL;
+
 static int results_to_be_sent_msg = 0;
 
 static timestamp_t total_task_execution_time = 0;
@@ -208,6 +288,38 @@ static int total_tasks_executed = 0;
 static const char *project_regex = 0;
 static int released_by_master = 0;
 
+/*
+A file being received from the master. Files are received a slice at a
+time from work_for_master, so that tasks keep being started and reaped
+while large inputs arrive. While a file is being received, the master
+link carries its contents, and no other messages are read.
+*/
+
+struct inbound_file {
+	char cached_filename[WORK_QUEUE_LINE_MAX];
+	char partial_filename[WORK_QUEUE_LINE_MAX];
+	int fd;
+	char digest[MD5_DIGEST_LENGTH_HEX + 1];     // contents digest, to add the file to the content cache.
+	int64_t length;
+	int64_t wire_length;                        // bytes sent by the master.
+	int64_t received;
+	struct work_queue_inflater *inflater;       // if the file is sent compressed.
+	time_t stoptime;
+	timestamp_t start;
+	timestamp_t blocked;
+};
+
+static struct inbound_file *inbound_file = NULL;
+
+// Maximum time (usecs) to spend receiving a file before attending the tasks again.
+static const timestamp_t inbound_file_slice = 50000;
+
+// Time (usecs) spent transferring files, during which tasks could not be started nor reaped.
+static timestamp_t time_transfers_blocked = 0;
+
+// Time (usecs) spent receiving files from the master while tasks were attended.
+static timestamp_t time_transfers_concurrent = 0;
+
 __attribute__ (( format(printf,2,3) ))
 static void send_master_message( struct link *master, const char *fmt, ... )
 {
@@ -226,6 +338,28 @@ static void send_master_message( struct link *master, const char *fmt, ... )
 	va_end(va);
 }
 
+/*
+Like send_master_message, but add the message to B, to be sent later with others.
+*/
+
+__attribute__ (( format(printf,2,3) ))
+static void buffer_master_message( buffer_t *B, const char *fmt, ... )
+{
+	char debug_msg[2*WORK_QUEUE_LINE_MAX];
+	va_list va;
+	va_list debug_va;
+
+	va_start(va,fmt);
+
+	sprintf(debug_msg, "tx to master: %s", fmt);
+	va_copy(debug_va, va);
+
+	vdebug(D_WQ, debug_msg, debug_va);
+	buffer_putvfstring(B, fmt, va);
+
+	va_end(va);
+}
+
 static int recv_master_message( struct link *master, char *line, int length, time_t stoptime )
 {
 	int result = link_readline(master,line,length,stoptime);
@@ -340,6 +474,10 @@ static void send_resource_update(struct link *master)
 	if(worker_mode == WORKER_MODE_FOREMAN) {
 		total_resources->disk.total = local_resources->disk.total - disk_avail_threshold;
 		total_resources->disk.inuse = local_resources->disk.inuse;
+
+		/* the cache of the foreman holds every file for its workers, so no worker has more disk than the foreman. */
+		total_resources->disk.largest  = MIN(total_resources->disk.largest,  total_resources->disk.total);
+		total_resources->disk.smallest = MIN(total_resources->disk.smallest, total_resources->disk.total);
 	} else {
 		total_resources->memory.total    = MAX(0, local_resources->memory.total    - memory_avail_threshold);
 		total_resources->memory.largest  = MAX(0, local_resources->memory.largest  - memory_avail_threshold);
@@ -351,48 +489,73 @@ static void send_resource_update(struct link *master)
 	}
 
 	work_queue_resources_send(master,total_resources,stoptime);
+	memcpy(total_resources_last, total_resources, sizeof(struct work_queue_resources));
+
+	/* so that the master packs tasks within NUMA nodes. */
+	if(topology) {
+		int node, nodes = work_queue_topology_nodes(topology);
+		buffer_t B;
+		buffer_init(&B);
+		for(node = 0; node < nodes; node++)
+			buffer_printf(&B, "%s%d", node ? "," : "", work_queue_topology_node_cores(topology, node));
+		send_master_message(master, "info numa-node-cores %s\n", buffer_tostring(&B));
+		buffer_free(&B);
+	}
+
 	send_master_message(master, "info end_of_resource_update %d\n", 0);
 }
 
 /*
 Send a message to the master with my current statistics information.
+A foreman only sends the statistics that changed since the last time.
 */
 
+#define send_stat_if_changed(master, s, field)\
+	do {\
+		if((s).field != foreman_stats_last.field)\
+			send_master_message(master, "info " #field " %lld\n", (long long) (s).field);\
+	} while(0)
+
 static void send_stats_update(struct link *master)
 {
 	if(worker_mode == WORKER_MODE_FOREMAN) {
 		struct work_queue_stats s;
 		work_queue_get_stats_hierarchy(foreman_q, &s);
 
-		send_master_message(master, "info workers_joined %lld\n", (long long) s.workers_joined);
-		send_master_message(master, "info workers_removed %lld\n", (long long) s.workers_removed);
-		send_master_message(master, "info workers_released %lld\n", (long long) s.workers_released);
-		send_master_message(master, "info workers_idled_out %lld\n", (long long) s.workers_idled_out);
-		send_master_message(master, "info workers_fast_aborted %lld\n", (long long) s.workers_fast_aborted);
-		send_master_message(master, "info workers_blacklisted %lld\n", (long long) s.workers_blacklisted);
-		send_master_message(master, "info workers_lost %lld\n", (long long) s.workers_lost);
-
-		send_master_message(master, "info tasks_waiting %lld\n", (long long) s.tasks_waiting);
-		send_master_message(master, "info tasks_on_workers %lld\n", (long long) s.tasks_on_workers);
-		send_master_message(master, "info tasks_running %lld\n", (long long) s.tasks_running);
+		send_stat_if_changed(master, s, workers_joined);
+		send_stat_if_changed(master, s, workers_removed);
+		send_stat_if_changed(master, s, workers_released);
+		send_stat_if_changed(master, s, workers_idled_out);
+		send_stat_if_changed(master, s, workers_fast_aborted);
+		send_stat_if_changed(master, s, workers_blacklisted);
+		send_stat_if_changed(master, s, workers_lost);
+
+		send_stat_if_changed(master, s, tasks_waiting);
+		send_stat_if_changed(master, s, tasks_on_workers);
+		send_stat_if_changed(master, s, tasks_running);
 		send_master_message(master, "info tasks_waiting %lld\n", (long long) list_size(procs_waiting));
-		send_master_message(master, "info tasks_with_results %lld\n", (long long) s.tasks_with_results);
+		send_stat_if_changed(master, s, tasks_with_results);
+
+		send_stat_if_changed(master, s, time_send);
+		send_stat_if_changed(master, s, time_receive);
+		send_stat_if_changed(master, s, time_send_good);
+		send_stat_if_changed(master, s, time_receive_good);
 
-		send_master_message(master, "info time_send %lld\n", (long long) s.time_send);
-		send_master_message(master, "info time_receive %lld\n", (long long) s.time_receive);
-		send_master_message(master, "info time_send_good %lld\n", (long long) s.time_send_good);
-		send_master_message(master, "info time_receive_good %lld\n", (long long) s.time_receive_good);
+		send_stat_if_changed(master, s, time_workers_execute);
+		send_stat_if_changed(master, s, time_workers_execute_good);
+		send_stat_if_changed(master, s, time_workers_execute_exhaustion);
 
-		send_master_message(master, "info time_workers_execute %lld\n", (long long) s.time_workers_execute);
-		send_master_message(master, "info time_workers_execute_good %lld\n", (long long) s.time_workers_execute_good);
-		send_master_message(master, "info time_workers_execute_exhaustion %lld\n", (long long) s.time_workers_execute_exhaustion);
+		send_stat_if_changed(master, s, bytes_sent);
+		send_stat_if_changed(master, s, bytes_received);
 
-		send_master_message(master, "info bytes_sent %lld\n", (long long) s.bytes_sent);
-		send_master_message(master, "info bytes_received %lld\n", (long long) s.bytes_received);
+		foreman_stats_last = s;
 	}
 	else {
 		send_master_message(master, "info tasks_running %lld\n", (long long) itable_size(procs_running));
 	}
+
+	send_master_message(master, "info time_transfers_blocked %lld\n", (long long) time_transfers_blocked);
+	send_master_message(master, "info time_transfers_concurrent %lld\n", (long long) time_transfers_concurrent);
 }
 
 static int send_keepalive(struct link *master, int force_resources){
@@ -415,12 +578,41 @@ Send the initial "ready" message to the master with the version and so forth.
 The master will not start sending tasks until this message is recevied.
 */
 
+/*
+Tell the master which files the content cache has, so that it sends a
+digest instead of those files.
+*/
+
+static void announce_content_cache( struct link *master )
+{
+	send_master_message(master, "info content-cache %" PRId64 "\n", content_cache_size);
+
+	struct list *digests = work_queue_content_cache_digests(content_cache, content_cache_announce_max);
+	char *digest;
+
+	while((digest = list_pop_head(digests))) {
+		send_master_message(master, "info content-digest %s\n", digest);
+		free(digest);
+	}
+
+	list_delete(digests);
+}
+
 static void report_worker_ready( struct link *master )
 {
 	char hostname[DOMAIN_NAME_MAX];
 	domain_name_cache_guess(hostname);
 	send_master_message(master,"workqueue %d %s %s %s %d.%d.%d\n",WORK_QUEUE_PROTOCOL_VERSION,hostname,os_name,arch_name,CCTOOLS_VERSION_MAJOR,CCTOOLS_VERSION_MINOR,CCTOOLS_VERSION_MICRO);
 	send_master_message(master, "info worker-id %s\n", worker_id);
+	if(peer_link) {
+		char addr[LINK_ADDRESS_MAX];
+		int port;
+		link_address_local(peer_link, addr, &port);
+		send_master_message(master, "info peer-port %d\n", port);
+	}
+	if(content_cache && worker_mode == WORKER_MODE_WORKER) {
+		announce_content_cache(master);
+	}
 	send_keepalive(master, 1);
 }
 
@@ -431,10 +623,58 @@ const char *skip_dotslash( const char *s )
 	return s;
 }
 
+/*
+Make target a copy-on-write clone of the file source, which shares its
+blocks until either is modified. Returns false if the filesystem does not
+support reflinks, and the file should be linked instead.
+*/
+
+static int clone_file( const char *source, const char *target )
+{
+#if defined(CCTOOLS_OPSYS_LINUX) && defined(FICLONE)
+	if(!reflinks_supported)
+		return 0;
+
+	struct stat info;
+	if(stat(source, &info) < 0)
+		return 0;
+
+	int in = open(source, O_RDONLY);
+	if(in < 0)
+		return 0;
+
+	int out = open(target, O_WRONLY | O_CREAT | O_EXCL, info.st_mode & 0777);
+	if(out < 0) {
+		close(in);
+		return 0;
+	}
+
+	int result = ioctl(out, FICLONE, in);
+	int saved_errno = errno;
+
+	close(in);
+	close(out);
+
+	if(result == 0)
+		return 1;
+
+	unlink(target);
+
+	if(saved_errno == EOPNOTSUPP || saved_errno == ENOTTY || saved_errno == EINVAL || saved_errno == EXDEV) {
+		debug(D_WQ, "reflinks are not supported for %s, using links instead", source);
+		reflinks_supported = 0;
+	}
+
+	errno = saved_errno;
+#endif
+	return 0;
+}
+
 /*
 Link a file from one place to another.
 If a hard link doesn't work, use a symbolic link.
 If it is a directory, do it recursively.
+In SANDBOX_MODE_CLONE, files are cloned if the filesystem allows it.
 */
 
 int link_recursive( const char *source, const char *target )
@@ -470,6 +710,8 @@ int link_recursive( const char *source, const char *target )
 
 		return result;
 	} else {
+		if(sandbox_mode == SANDBOX_MODE_CLONE && clone_file(source, target)) return 1;
+
 		if(link(source, target)==0) return 1;
 
 		if( (errno == EXDEV || errno == EPERM) && symlinks_enabled) {
@@ -504,10 +746,21 @@ static int start_process( struct work_queue_process *p )
 
 	pid_t pid;
 
+	struct work_queue_task *t = p->task;
+
+	if(topology) {
+		p->cpuset = work_queue_topology_allocate(topology, t->resources_requested->cores, p->numa_node);
+		if(p->cpuset) {
+			debug(D_WQ, "task %d pinned to %" PRId64 " cores in numa node %d", t->taskid, t->resources_requested->cores, work_queue_cpuset_node(p->cpuset));
+		}
+	}
+
 	if (container_mode == DOCKER)
 		pid = work_queue_process_execute(p, container_mode, img_name);
 	else if (container_mode == DOCKER_PRESERVE)
 		pid = work_queue_process_execute(p, container_mode, container_name);
+	else if (launcher != WORK_QUEUE_LAUNCHER_FORK)
+		pid = work_queue_process_launch(p, launcher);
 	else
 		pid = work_queue_process_execute(p, container_mode);
 
@@ -515,8 +768,6 @@ static int start_process( struct work_queue_process *p )
 
 	itable_insert(procs_running,pid,p);
 
-	struct work_queue_task *t = p->task;
-
 	cores_allocated += t->resources_requested->cores;
 	memory_allocated += t->resources_requested->memory;
 	disk_allocated += t->resources_requested->disk;
@@ -526,12 +777,29 @@ static int start_process( struct work_queue_process *p )
 }
 
 /*
-Transmit the results of the given process to the master.
-If a local worker, stream the output from disk.
+Send the results accumulated in B to the master, and empty B.
+*/
+
+static void flush_results( struct link *master, buffer_t *B )
+{
+	size_t length;
+	const char *data = buffer_tolstring(B, &length);
+
+	if(length > 0) {
+		link_putlstring(master, data, length, time(0)+active_timeout);
+		buffer_rewind(B, 0);
+	}
+}
+
+/*
+Add the results of the given process to the results B for the master.
+If a local worker, read the output from disk.
 If a foreman, send the outputs contained in the task structure.
+Outputs larger than result_batch_max are streamed on their own,
+after sending what was already in B.
 */
 
-static void report_task_complete( struct link *master, struct work_queue_process *p )
+static void report_task_complete( struct link *master, struct work_queue_process *p, buffer_t *B )
 {
 	int64_t output_length;
 	struct stat st;
@@ -540,8 +808,21 @@ static void report_task_complete( struct link *master, struct work_queue_process
 		fstat(p->output_fd, &st);
 		output_length = st.st_size;
 		lseek(p->output_fd, 0, SEEK_SET);
-		send_master_message(master, "result %d %d %lld %llu %d\n", p->task_status, p->exit_status, (long long) output_length, (unsigned long long) p->execution_end-p->execution_start, p->task->taskid);
-		link_stream_from_fd(master, p->output_fd, output_length, time(0)+active_timeout);
+		buffer_master_message(B, "result %d %d %lld %llu %d\n", p->task_status, p->exit_status, (long long) output_length, (unsigned long long) p->execution_end-p->execution_start, p->task->taskid);
+
+		if(output_length <= result_batch_max) {
+			char *output = malloc(output_length + 1);
+			ssize_t actual = full_read(p->output_fd, output, output_length);
+			if(actual < output_length) {
+				// keep the message framed even if the output shrank.
+				memset(output + MAX(actual, 0), 0, output_length - MAX(actual, 0));
+			}
+			buffer_putlstring(B, output, output_length);
+			free(output);
+		} else {
+			flush_results(master, B);
+			link_stream_from_fd(master, p->output_fd, output_length, time(0)+active_timeout);
+		}
 
 		total_task_execution_time += (p->execution_end - p->execution_start);
 		total_tasks_executed++;
@@ -552,8 +833,11 @@ static void report_task_complete( struct link *master, struct work_queue_process
 		} else {
 			output_length = 0;
 		}
-		send_master_message(master, "result %d %d %lld %llu %d\n", t->result, t->return_status, (long long) output_length, (unsigned long long) t->time_workers_execute_last, t->taskid);
-		if(output_length) {
+		buffer_master_message(B, "result %d %d %lld %llu %d\n", t->result, t->return_status, (long long) output_length, (unsigned long long) t->time_workers_execute_last, t->taskid);
+		if(output_length <= result_batch_max) {
+			buffer_putlstring(B, t->output, output_length);
+		} else {
+			flush_results(master, B);
 			link_putlstring(master, t->output, output_length, time(0)+active_timeout);
 		}
 
@@ -561,7 +845,9 @@ static void report_task_complete( struct link *master, struct work_queue_process
 		total_tasks_executed++;
 	}
 
-	send_stats_update(master);
+	if(buffer_pos(B) >= (size_t) result_batch_max) {
+		flush_results(master, B);
+	}
 }
 
 /*
@@ -589,15 +875,23 @@ send the results to the master.
 static void report_tasks_complete( struct link *master )
 {
 	struct work_queue_process *p;
+	buffer_t B[1];
+	buffer_init(B);
+	buffer_abortonfailure(B, 1);
 
 	while((p=itable_pop(procs_complete))) {
-		report_task_complete(master,p);
+		report_task_complete(master,p,B);
 	}
 
+	flush_results(master, B);
+	buffer_free(B);
+
 	work_queue_watcher_send_changes(watcher,master,time(0)+active_timeout);
 
 	send_master_message(master, "end\n");
 
+	send_stats_update(master);
+
 	results_to_be_sent_msg = 0;
 }
 
@@ -666,6 +960,9 @@ static int handle_tasks(struct link *master)
 			disk_allocated   -= p->task->resources_requested->disk;
 			gpus_allocated   -= p->task->resources_requested->gpus;
 
+			work_queue_topology_release(topology, p->cpuset);
+			p->cpuset = NULL;
+
 			itable_remove(procs_running, p->pid);
 			itable_firstkey(procs_running);
 
@@ -704,6 +1001,9 @@ static int handle_tasks(struct link *master)
  * 		for a directory: a new line in the format of "dir $DIR_NAME 0"
  * 		for a file: a new line in the format of "file $FILE_NAME $FILE_LENGTH"
  * 					then file contents.
+ * 		or, if compress is set and the file compresses well:
+ * 					"zfile $FILE_NAME $COMPRESSED_LENGTH $FILE_LENGTH"
+ * 					then the compressed file contents.
  * 		string "end" at the end of the stream (on a new line).
  *
  * Example:
@@ -733,7 +1033,7 @@ static int handle_tasks(struct link *master)
  * end
  *
  */
-static int stream_output_item(struct link *master, const char *filename, int recursive)
+static int stream_output_item(struct link *master, const char *filename, int recursive, int compress)
 {
 	DIR *dir;
 	struct dirent *dent;
@@ -761,7 +1061,7 @@ static int stream_output_item(struct link *master, const char *filename, int rec
 			if(!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
 				continue;
 			sprintf(dentline, "%s/%s", filename, dent->d_name);
-			stream_output_item(master, dentline, recursive);
+			stream_output_item(master, dentline, recursive, compress);
 		}
 
 		closedir(dir);
@@ -770,7 +1070,18 @@ static int stream_output_item(struct link *master, const char *filename, int rec
 		fd = open(cached_filename, O_RDONLY, 0);
 		if(fd >= 0) {
 			length = info.st_size;
-			send_master_message(master, "file %s %"PRId64"\n", filename, length);
+
+			int64_t compressed_length;
+			int compressed_fd = compress ? work_queue_compress_fd(fd, length, ".", &compressed_length) : -1;
+			if(compressed_fd >= 0) {
+				close(fd);
+				fd = compressed_fd;
+				send_master_message(master, "zfile %s %"PRId64" %"PRId64"\n", filename, compressed_length, length);
+				length = compressed_length;
+			} else {
+				send_master_message(master, "file %s %"PRId64"\n", filename, length);
+			}
+
 			actual = link_stream_from_fd(master, fd, length, time(0) + active_timeout);
 			close(fd);
 			if(actual != length) {
@@ -789,6 +1100,172 @@ failure:
 	return 0;
 }
 
+/*
+Prebuilt trees. In SANDBOX_MODE_CLONE, a cached directory is placed into a
+sandbox by renaming a spare tree of links to its files, which takes the
+same time whatever the size of the directory. After each use, a child
+process builds a new spare while the task runs. A directory without a
+spare tree ready is linked file by file, as in SANDBOX_MODE_LINK.
+*/
+
+struct sandbox_tree {
+	char *path;       // the spare tree, when ready.
+	char *partial;    // the spare tree, while built.
+	pid_t builder;    // process building the spare tree, 0 if none.
+	int ready;
+};
+
+static struct sandbox_tree *sandbox_tree_lookup( const char *source )
+{
+	if(!sandbox_trees)
+		sandbox_trees = hash_table_create(0, 0);
+
+	struct sandbox_tree *t = hash_table_lookup(sandbox_trees, source);
+	if(!t) {
+		unsigned char digest[MD5_DIGEST_LENGTH];
+		md5_buffer(source, strlen(source), digest);
+
+		t = xxcalloc(1, sizeof(*t));
+		t->path = string_format("trees/%s", md5_string(digest));
+		t->partial = string_format("%s.part", t->path);
+		hash_table_insert(sandbox_trees, source, t);
+	}
+
+	return t;
+}
+
+/* Reap the builder of t, if done. If wait is set, stop it and wait for it. */
+static void sandbox_tree_reap( struct sandbox_tree *t, int wait )
+{
+	int status;
+
+	if(!t->builder)
+		return;
+
+	if(wait)
+		kill(t->builder, SIGKILL);
+
+	pid_t result = waitpid(t->builder, &status, wait ? 0 : WNOHANG);
+	if(result == 0)
+		return;
+
+	if(result > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		t->ready = 1;
+	} else {
+		delete_dir(t->partial);
+	}
+
+	t->builder = 0;
+}
+
+static void sandbox_tree_build( const char *source, struct sandbox_tree *t )
+{
+	if(t->ready || t->builder)
+		return;
+
+	create_dir("trees", 0777);
+	delete_dir(t->partial);
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		int ok = link_recursive(source, t->partial) && rename(t->partial, t->path) == 0;
+		_exit(ok ? 0 : 1);
+	} else if(pid > 0) {
+		t->builder = pid;
+	} else {
+		debug(D_WQ, "could not start building a tree for %s: %s", source, strerror(errno));
+	}
+}
+
+/* Place the cached directory source at target. */
+static int sandbox_tree_take( const char *source, const char *target )
+{
+	struct sandbox_tree *t = sandbox_tree_lookup(source);
+	int result;
+
+	sandbox_tree_reap(t, 0);
+
+	if(t->ready && rename(t->path, target) == 0) {
+		debug(D_WQ, "moved the tree of %s to %s", source, target);
+		result = 1;
+	} else {
+		result = link_recursive(source, target);
+	}
+
+	t->ready = 0;
+	sandbox_tree_build(source, t);
+
+	return result;
+}
+
+/* Forget the tree of source, as when it is removed from the cache. */
+static void sandbox_tree_discard( const char *source )
+{
+	if(!sandbox_trees)
+		return;
+
+	struct sandbox_tree *t = hash_table_remove(sandbox_trees, source);
+	if(!t)
+		return;
+
+	sandbox_tree_reap(t, 1);
+	delete_dir(t->path);
+	delete_dir(t->partial);
+
+	free(t->path);
+	free(t->partial);
+	free(t);
+}
+
+/* Forget the trees of the cached directories that contain path, or are path, as when path is written. */
+static void sandbox_trees_discard_within( const char *path )
+{
+	char *source;
+	struct sandbox_tree *t;
+
+	if(!sandbox_trees)
+		return;
+
+	hash_table_firstkey(sandbox_trees);
+	while(hash_table_nextkey(sandbox_trees, &source, (void **) &t)) {
+		size_t length = strlen(source);
+		if(!strncmp(path, source, length) && (path[length] == '/' || path[length] == 0)) {
+			sandbox_tree_discard(source);
+			hash_table_firstkey(sandbox_trees);
+		}
+	}
+}
+
+/* Reap the builders that finished, so that they do not linger until their tree is taken. */
+static void sandbox_trees_reap()
+{
+	char *source;
+	struct sandbox_tree *t;
+
+	if(!sandbox_trees)
+		return;
+
+	hash_table_firstkey(sandbox_trees);
+	while(hash_table_nextkey(sandbox_trees, &source, (void **) &t)) {
+		sandbox_tree_reap(t, 0);
+	}
+}
+
+static void sandbox_trees_clear()
+{
+	char *source;
+	struct sandbox_tree *t;
+
+	if(!sandbox_trees)
+		return;
+
+	hash_table_firstkey(sandbox_trees);
+	while(hash_table_nextkey(sandbox_trees, &source, (void **) &t)) {
+		sandbox_tree_discard(source);
+		hash_table_firstkey(sandbox_trees);
+	}
+}
+
 /*
 For each of the files and directories needed by a task, link
 them into the sandbox.  Return true if successful.
@@ -812,8 +1289,13 @@ int setup_sandbox( struct work_queue_process *p )
 			result = create_dir(sandbox_name, 0700);
 			if(!result) debug(D_WQ,"couldn't create directory %s: %s", sandbox_name, strerror(errno));
 		} else {
+			struct stat info;
 			debug(D_WQ,"linking %s to %s",f->payload,sandbox_name);
-			result = link_recursive(skip_dotslash(f->payload),skip_dotslash(sandbox_name));
+			if(sandbox_mode == SANDBOX_MODE_CLONE && stat(f->payload, &info) == 0 && S_ISDIR(info.st_mode)) {
+				result = sandbox_tree_take(skip_dotslash(f->payload),skip_dotslash(sandbox_name));
+			} else {
+				result = link_recursive(skip_dotslash(f->payload),skip_dotslash(sandbox_name));
+			}
 			if(!result) {
 				if(errno==EEXIST) {
 					// XXX silently ignore the case where the target file exists.
@@ -826,191 +1308,700 @@ int setup_sandbox( struct work_queue_process *p )
 			}
 		}
 
-		free(sandbox_name);
-		if(!result) return 0;
+		free(sandbox_name);
+		if(!result) return 0;
+	}
+
+	return 1;
+}
+
+/*
+For a task run locally, if the resources are all set to -1,
+then assume that the task occupies all worker resources.
+Otherwise, just make sure all values are non-zero.
+*/
+
+static void normalize_resources( struct work_queue_process *p )
+{
+	struct work_queue_task *t = p->task;
+
+	if(t->resources_requested->cores < 0 && t->resources_requested->memory < 0 && t->resources_requested->disk < 0 && t->resources_requested->gpus < 0) {
+		t->resources_requested->cores = local_resources->cores.total;
+		t->resources_requested->memory = local_resources->memory.total;
+		t->resources_requested->disk = local_resources->disk.total;
+		t->resources_requested->gpus = local_resources->gpus.total;
+	} else {
+		t->resources_requested->cores = MAX(t->resources_requested->cores, 0);
+		t->resources_requested->memory = MAX(t->resources_requested->memory, 0);
+		t->resources_requested->disk = MAX(t->resources_requested->disk, 0);
+		t->resources_requested->gpus = MAX(t->resources_requested->gpus, 0);
+	}
+}
+
+/*
+A cached file could not be fetched from a peer or the content cache. The master is told with
+the given message, and sends the file instead. Until then, the tasks that
+need the file wait in procs_missing_inputs.
+*/
+
+static void report_file_missing( struct link *master, const char *message, const char *filename, const char *cached_filename )
+{
+	hash_table_insert(files_missing, cached_filename, (void *) 1);
+	send_master_message(master, "info %s %s\n", message, filename);
+}
+
+static void file_no_longer_missing( const char *cached_filename )
+{
+	if(files_missing)
+		hash_table_remove(files_missing, cached_filename);
+}
+
+static int process_inputs_missing( struct work_queue_process *p )
+{
+	struct work_queue_file *f;
+
+	if(hash_table_size(files_missing) == 0)
+		return 0;
+
+	list_first_item(p->task->input_files);
+	while((f = list_next_item(p->task->input_files))) {
+		if(hash_table_lookup(files_missing, f->payload))
+			return 1;
+	}
+
+	return 0;
+}
+
+void forsake_waiting_process(struct link *master, struct work_queue_process *p);
+
+/*
+Queue the tasks that waited for inputs sent again, once those arrived.
+A task whose sandbox cannot be set up, because the master dropped one of
+its inputs instead, is forsaken, and the master runs it again.
+*/
+
+static void release_missing_inputs( struct link *master )
+{
+	int waiting = list_size(procs_missing_inputs);
+	int visited;
+
+	for(visited = 0; visited < waiting; visited++) {
+		struct work_queue_process *p = list_pop_head(procs_missing_inputs);
+		if(process_inputs_missing(p)) {
+			list_push_tail(procs_missing_inputs, p);
+		} else if(setup_sandbox(p)) {
+			normalize_resources(p);
+			list_push_tail(procs_waiting, p);
+		} else {
+			forsake_waiting_process(master, p);
+		}
+	}
+}
+
+/*
+Handle an incoming task message from the master.
+Generate a work_queue_process wrapped around a work_queue_task,
+and deposit it into the waiting list or the foreman_q as appropriate.
+*/
+
+static int do_task( struct link *master, int taskid, time_t stoptime )
+{
+	char line[WORK_QUEUE_LINE_MAX];
+	char filename[WORK_QUEUE_LINE_MAX];
+	char localname[WORK_QUEUE_LINE_MAX];
+	char taskname[WORK_QUEUE_LINE_MAX];
+	char taskname_encoded[WORK_QUEUE_LINE_MAX];
+	char category[WORK_QUEUE_LINE_MAX];
+	int flags, length;
+	int64_t n;
+	int disk_alloc = disk_allocation;
+	int numa_node = -1;
+
+	timestamp_t nt;
+
+	struct work_queue_task *task = work_queue_task_create(0);
+	task->taskid = taskid;
+
+	while(recv_master_message(master,line,sizeof(line),stoptime)) {
+		if(!strcmp(line,"end")) {
+			break;
+		} else if(sscanf(line, "category %s",category)) {
+			work_queue_task_specify_category(task, category);
+		} else if(sscanf(line,"cmd %d",&length)==1) {
+			char *cmd = malloc(length+1);
+			link_read(master,cmd,length,stoptime);
+			cmd[length] = 0;
+			work_queue_task_specify_command(task,cmd);
+			debug(D_WQ,"rx from master: %s",cmd);
+			free(cmd);
+		} else if(sscanf(line,"infile %s %s %d", filename, taskname_encoded, &flags)) {
+			sprintf(localname, "cache/%s", filename);
+			url_decode(taskname_encoded, taskname, WORK_QUEUE_LINE_MAX);
+			work_queue_task_specify_file(task, localname, taskname, WORK_QUEUE_INPUT, flags);
+		} else if(sscanf(line,"outfile %s %s %d", filename, taskname_encoded, &flags)) {
+			sprintf(localname, "cache/%s", filename);
+			url_decode(taskname_encoded, taskname, WORK_QUEUE_LINE_MAX);
+			work_queue_task_specify_file(task, localname, taskname, WORK_QUEUE_OUTPUT, flags);
+		} else if(sscanf(line, "dir %s", filename)) {
+			work_queue_task_specify_directory(task, filename, filename, WORK_QUEUE_INPUT, 0700, 0);
+		} else if(sscanf(line,"cores %" PRId64,&n)) {
+				work_queue_task_specify_cores(task, n);
+		} else if(sscanf(line,"memory %" PRId64,&n)) {
+				work_queue_task_specify_memory(task, n);
+		} else if(sscanf(line,"disk %" PRId64,&n)) {
+				work_queue_task_specify_disk(task, n);
+		} else if(sscanf(line,"gpus %" PRId64,&n)) {
+			work_queue_task_specify_gpus(task, n);
+		} else if(sscanf(line,"numa_node %d",&numa_node) == 1) {
+			/* used when the task is started. */
+		} else if(sscanf(line,"wall_time %" PRIu64,&nt)) {
+			work_queue_task_specify_running_time(task, nt);
+		} else if(sscanf(line,"end_time %" PRIu64,&nt)) {
+			work_queue_task_specify_end_time(task, nt);
+		} else if(sscanf(line,"env %d",&length)==1) {
+			char *env = malloc(length+2); /* +2 for \n and \0 */
+			link_read(master, env, length+1, stoptime);
+			env[length] = 0;              /* replace \n with \0 */
+			char *value = strchr(env,'=');
+			if(value) {
+				*value = 0;
+				value++;
+				work_queue_task_specify_enviroment_variable(task,env,value);
+			}
+			free(env);
+		} else {
+			debug(D_WQ|D_NOTICE,"invalid command from master: %s",line);
+			return 0;
+		}
+	}
+
+	last_task_received = task->taskid;
+
+	struct work_queue_process *p = work_queue_process_create(task, disk_alloc);
+
+	if(!p) {
+		return 0;
+	}
+
+	p->numa_node = numa_node;
+
+	// Every received task goes into procs_table.
+	itable_insert(procs_table,taskid,p);
+
+	if(worker_mode==WORKER_MODE_FOREMAN) {
+		work_queue_submit_internal(foreman_q,task);
+	} else {
+		if(process_inputs_missing(p)) {
+			debug(D_WQ, "task %d waits for its inputs to be sent again", taskid);
+			list_push_tail(procs_missing_inputs,p);
+		} else {
+			// XXX sandbox setup should be done in task execution,
+			// so that it can be returned cleanly as a failure to execute.
+			if(!setup_sandbox(p)) {
+				itable_remove(procs_table,taskid);
+				work_queue_process_delete(p);
+				return 0;
+			}
+			normalize_resources(p);
+			list_push_tail(procs_waiting,p);
+		}
+	}
+
+	work_queue_watcher_add_process(watcher,p);
+
+	return 1;
+}
+
+/*
+Handle an incoming "tasks" message from the master,
+which is followed by count task descriptions.
+*/
+
+static int do_tasks( struct link *master, int count, time_t stoptime )
+{
+	char line[WORK_QUEUE_LINE_MAX];
+	int64_t taskid;
+	int i;
+
+	for(i = 0; i < count; i++) {
+		if(!recv_master_message(master, line, sizeof(line), stoptime) || sscanf(line, "task %" SCNd64, &taskid) != 1) {
+			debug(D_WQ, "Expected task %d of %d from master.\n", i + 1, count);
+			return 0;
+		}
+
+		if(!do_task(master, taskid, stoptime)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+Fill in cached_filename with the path of filename in the cache directory,
+and create its parent directories. The file is about to be written, so the
+trees of the directories that contain it are out of date.
+*/
+
+static int prepare_cached_filename( const char *filename, char *cached_filename, int mode )
+{
+	char *cur_pos;
+
+	while(!strncmp(filename, "./", 2)) {
+		filename += 2;
+	}
+
+	sprintf(cached_filename, "cache/%s", filename);
+	sandbox_trees_discard_within(cached_filename);
+
+	cur_pos = strrchr(cached_filename, '/');
+	if(cur_pos) {
+		*cur_pos = '\0';
+		if(!create_dir(cached_filename, mode | 0700)) {
+			debug(D_WQ, "Could not create directory - %s (%s)\n", cached_filename, strerror(errno));
+			return 0;
+		}
+		*cur_pos = '/';
+	}
+
+	return 1;
+}
+
+/*
+Write length bytes from the link into the cached file cached_filename, or
+inflate them from wire_length bytes if they are compressed.
+The data goes to a temporary file that is renamed once complete, so that
+peers served by peer_serve_file never see a partial file.
+*/
+
+static int stream_to_cached_file( struct link *l, const char *cached_filename, int64_t length, int64_t wire_length, int compressed, int mode )
+{
+	char partial_filename[WORK_QUEUE_LINE_MAX];
+	int n = snprintf(partial_filename, sizeof(partial_filename), "%s.part", cached_filename);
+	if(n < 0 || (size_t) n >= sizeof(partial_filename)) {
+		debug(D_WQ, "Could not write %s, its name is too long.\n", cached_filename);
+		return 0;
+	}
+
+	int fd = open(partial_filename, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if(fd < 0) {
+		debug(D_WQ, "Could not open %s for writing. (%s)\n", partial_filename, strerror(errno));
+		return 0;
+	}
+
+	int64_t actual;
+	if(compressed) {
+		actual = work_queue_uncompress_link_to_fd(l, fd, wire_length, time(0) + active_timeout);
+	} else {
+		actual = link_stream_to_fd(l, fd, length, time(0) + active_timeout);
+	}
+	close(fd);
+	if(actual != length || rename(partial_filename, cached_filename) < 0) {
+		debug(D_WQ, "Failed to write file - %s (%s)\n", cached_filename, strerror(errno));
+		unlink(partial_filename);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+Close the file being received from the master, and move it into the cache
+if it was received completely.
+*/
+
+static int finish_inbound_file( int ok )
+{
+	struct inbound_file *f = inbound_file;
+
+	if(f->inflater && work_queue_inflater_finish(f->inflater) != f->length)
+		ok = 0;
+
+	if(close(f->fd) < 0)
+		ok = 0;
+
+	if(ok && rename(f->partial_filename, f->cached_filename) < 0)
+		ok = 0;
+
+	if(ok) {
+		timestamp_t elapsed = timestamp_get() - f->start;
+		time_transfers_concurrent += elapsed - MIN(elapsed, f->blocked);
+
+		if(content_cache && f->digest[0]) {
+			work_queue_content_cache_insert(content_cache, f->digest, f->cached_filename);
+		}
+
+		file_no_longer_missing(f->cached_filename);
+	} else {
+		debug(D_WQ, "Failed to put file - %s (%s)\n", f->cached_filename, strerror(errno));
+		unlink(f->partial_filename);
+	}
+
+	free(f);
+	inbound_file = NULL;
+
+	return ok;
+}
+
+/*
+Receive the data of the file from the master that is immediately available,
+for at most inbound_file_slice usecs. Return false if the file could not be
+received.
+*/
+
+static int receive_inbound_file( struct link *master )
+{
+	struct inbound_file *f = inbound_file;
+	char buffer[1<<16];
+
+	timestamp_t start = timestamp_get();
+	timestamp_t now = start;
+
+	while(f->received < f->wire_length && now - start < inbound_file_slice) {
+		if(link_buffer_empty(master) && !link_usleep(master, 0, 1, 0))
+			break;
+
+		size_t chunk = MIN(sizeof(buffer), (size_t)(f->wire_length - f->received));
+		ssize_t ractual = link_read_avail(master, buffer, chunk, f->stoptime);
+		int written;
+		if(ractual <= 0) {
+			written = 0;
+		} else if(f->inflater) {
+			written = work_queue_inflater_write(f->inflater, buffer, ractual);
+		} else {
+			written = full_write(f->fd, buffer, ractual) == ractual;
+		}
+
+		if(!written) {
+			time_transfers_blocked += timestamp_get() - start;
+			return finish_inbound_file(0);
+		}
+
+		f->received += ractual;
+		now = timestamp_get();
+	}
+
+	now = timestamp_get();
+	f->blocked += now - start;
+	time_transfers_blocked += now - start;
+
+	if(f->received == f->wire_length)
+		return finish_inbound_file(1);
+
+	if(time(0) > f->stoptime) {
+		debug(D_WQ, "Timed out receiving file %s\n", f->cached_filename);
+		return finish_inbound_file(0);
+	}
+
+	return 1;
+}
+
+/*
+Handle an incoming "put" message from the master,
+which places a file into the cache directory.
+A worker receives the file from work_for_master, interleaved with
+its tasks, while a foreman receives it at once. If the master sent
+the digest of the file, it is added to the content cache. A "zput"
+message sends the file compressed, in wire_length bytes.
+*/
+
+static int do_put( struct link *master, char *filename, int64_t length, int64_t wire_length, int compressed, int mode, const char *digest )
+{
+	char cached_filename[WORK_QUEUE_LINE_MAX];
+
+	debug(D_WQ, "Putting file %s into workspace\n", filename);
+	if(!check_disk_space_for_filesize(".", length, disk_avail_threshold)) {
+		debug(D_WQ, "Could not put file %s, not enough disk space (%"PRId64" bytes needed)\n", filename, length);
+		return 0;
+	}
+
+	mode = mode | 0600;
+
+	if(!prepare_cached_filename(filename, cached_filename, mode)) {
+		return 0;
+	}
+
+	if(worker_mode == WORKER_MODE_FOREMAN) {
+		timestamp_t start = timestamp_get();
+		int result = stream_to_cached_file(master, cached_filename, length, wire_length, compressed, mode);
+		time_transfers_blocked += timestamp_get() - start;
+
+		if(!result) {
+			debug(D_WQ, "Failed to put file - %s (%s)\n", filename, strerror(errno));
+		}
+
+		return result;
+	}
+
+	struct inbound_file *f = xxcalloc(1, sizeof(*f));
+	strcpy(f->cached_filename, cached_filename);
+	int n = snprintf(f->partial_filename, sizeof(f->partial_filename), "%s.part", cached_filename);
+	if(n < 0 || (size_t) n >= sizeof(f->partial_filename)) {
+		debug(D_WQ, "Could not put file %s, its name is too long.\n", filename);
+		free(f);
+		return 0;
+	}
+	if(digest && work_queue_content_cache_valid_digest(digest)) {
+		strcpy(f->digest, digest);
+	}
+	f->length = length;
+	f->wire_length = wire_length;
+	f->stoptime = time(0) + active_timeout;
+	f->start = timestamp_get();
+
+	f->fd = open(f->partial_filename, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if(f->fd < 0) {
+		debug(D_WQ, "Could not open %s for writing. (%s)\n", f->partial_filename, strerror(errno));
+		free(f);
+		return 0;
+	}
+
+	if(compressed) {
+		f->inflater = work_queue_inflater_create(f->fd);
+		if(!f->inflater) {
+			inbound_file = f;
+			return finish_inbound_file(0);
+		}
+	}
+
+	inbound_file = f;
+
+	/* small files are usually received right away. */
+	return receive_inbound_file(master);
+}
+
+/*
+Handle an incoming "digest" message from the master, which places a file
+from the content cache into the cache directory, instead of a put. The
+master sends it only for the files this worker announced, or put with a
+digest. If the file was evicted or changed since, the master is asked to
+send the file instead.
+*/
+
+static int do_digest( struct link *master, const char *filename, const char *digest, int64_t length, int mode )
+{
+	char cached_filename[WORK_QUEUE_LINE_MAX];
+	struct stat info;
+
+	if(!content_cache) {
+		debug(D_WQ, "Received digest of %s, but the content cache is disabled\n", filename);
+		return 0;
+	}
+
+	mode = mode | 0600;
+
+	if(!prepare_cached_filename(filename, cached_filename, mode)) {
+		return 0;
+	}
+
+	if(!work_queue_content_cache_fetch(content_cache, digest, cached_filename, length, mode) || stat(cached_filename, &info) < 0 || info.st_size != length) {
+		debug(D_WQ, "Could not get file %s with digest %s from the content cache\n", filename, digest);
+		unlink(cached_filename);
+		report_file_missing(master, "digest-missed", filename, cached_filename);
+		return 1;
 	}
 
+	debug(D_WQ, "File %s is %s from the content cache\n", filename, digest);
+	file_no_longer_missing(cached_filename);
+
 	return 1;
 }
 
 /*
-For a task run locally, if the resources are all set to -1,
-then assume that the task occupies all worker resources.
-Otherwise, just make sure all values are non-zero.
+Handle an incoming "peerget" message from the master,
+which fetches a file into the cache directory from the worker
+listening at host:port, which has it in its cache. If the peer
+cannot send it, the master is asked to send the file instead.
 */
 
-static void normalize_resources( struct work_queue_process *p )
+static int do_peerget( struct link *master, const char *filename, const char *host, int port, int64_t length, int mode )
 {
-	struct work_queue_task *t = p->task;
+	char cached_filename[WORK_QUEUE_LINE_MAX];
+	char line[WORK_QUEUE_LINE_MAX];
+	int64_t actual_length;
+	int result = 0;
 
-	if(t->resources_requested->cores < 0 && t->resources_requested->memory < 0 && t->resources_requested->disk < 0 && t->resources_requested->gpus < 0) {
-		t->resources_requested->cores = local_resources->cores.total;
-		t->resources_requested->memory = local_resources->memory.total;
-		t->resources_requested->disk = local_resources->disk.total;
-		t->resources_requested->gpus = local_resources->gpus.total;
+	debug(D_WQ, "Fetching file %s from peer %s:%d\n", filename, host, port);
+	if(!check_disk_space_for_filesize(".", length, disk_avail_threshold)) {
+		debug(D_WQ, "Could not fetch file %s, not enough disk space (%"PRId64" bytes needed)\n", filename, length);
+		return 0;
+	}
+
+	mode = mode | 0600;
+
+	if(!prepare_cached_filename(filename, cached_filename, mode)) {
+		return 0;
+	}
+
+	time_t stoptime = time(0) + active_timeout;
+
+	struct link *peer = link_connect(host, port, stoptime);
+	if(!peer) {
+		debug(D_WQ, "Could not connect to peer %s:%d (%s)\n", host, port, strerror(errno));
+	} else if(password && !link_auth_password(peer, password, stoptime)) {
+		debug(D_WQ, "Could not authenticate to peer %s:%d\n", host, port);
+	} else if(link_putfstring(peer, "get %s\n", stoptime, filename) < 0 || !link_readline(peer, line, sizeof(line), stoptime)) {
+		debug(D_WQ, "Lost connection to peer %s:%d (%s)\n", host, port, strerror(errno));
+	} else if(sscanf(line, "file %" SCNd64, &actual_length) != 1 || actual_length != length) {
+		debug(D_WQ, "Peer %s:%d cannot send %s: %s\n", host, port, filename, line);
 	} else {
-		t->resources_requested->cores = MAX(t->resources_requested->cores, 0);
-		t->resources_requested->memory = MAX(t->resources_requested->memory, 0);
-		t->resources_requested->disk = MAX(t->resources_requested->disk, 0);
-		t->resources_requested->gpus = MAX(t->resources_requested->gpus, 0);
+		result = stream_to_cached_file(peer, cached_filename, length, length, 0, mode);
+	}
+
+	if(peer)
+		link_close(peer);
+
+	if(result) {
+		file_no_longer_missing(cached_filename);
+		send_master_message(master, "info peer-received %s\n", filename);
+	} else {
+		report_file_missing(master, "peer-failed", filename, cached_filename);
 	}
+
+	return 1;
 }
 
 /*
-Handle an incoming task message from the master.
-Generate a work_queue_process wrapped around a work_queue_task,
-and deposit it into the waiting list or the foreman_q as appropriate.
+Serve one request from another worker for a file in our cache.
+A file still being received is waited for, as the master may
+direct peers here as soon as it has asked us for the file.
 */
 
-static int do_task( struct link *master, int taskid, time_t stoptime )
+static void peer_serve_file( struct link *l )
 {
 	char line[WORK_QUEUE_LINE_MAX];
 	char filename[WORK_QUEUE_LINE_MAX];
-	char localname[WORK_QUEUE_LINE_MAX];
-	char taskname[WORK_QUEUE_LINE_MAX];
-	char taskname_encoded[WORK_QUEUE_LINE_MAX];
-	char category[WORK_QUEUE_LINE_MAX];
-	int flags, length;
-	int64_t n;
-	int disk_alloc = disk_allocation;
-
-	timestamp_t nt;
-
-	struct work_queue_task *task = work_queue_task_create(0);
-	task->taskid = taskid;
+	char cached_filename[WORK_QUEUE_LINE_MAX];
+	char partial_filename[WORK_QUEUE_LINE_MAX];
+	struct stat info;
 
-	while(recv_master_message(master,line,sizeof(line),stoptime)) {
-		if(!strcmp(line,"end")) {
-			break;
-		} else if(sscanf(line, "category %s",category)) {
-			work_queue_task_specify_category(task, category);
-		} else if(sscanf(line,"cmd %d",&length)==1) {
-			char *cmd = malloc(length+1);
-			link_read(master,cmd,length,stoptime);
-			cmd[length] = 0;
-			work_queue_task_specify_command(task,cmd);
-			debug(D_WQ,"rx from master: %s",cmd);
-			free(cmd);
-		} else if(sscanf(line,"infile %s %s %d", filename, taskname_encoded, &flags)) {
-			sprintf(localname, "cache/%s", filename);
-			url_decode(taskname_encoded, taskname, WORK_QUEUE_LINE_MAX);
-			work_queue_task_specify_file(task, localname, taskname, WORK_QUEUE_INPUT, flags);
-		} else if(sscanf(line,"outfile %s %s %d", filename, taskname_encoded, &flags)) {
-			sprintf(localname, "cache/%s", filename);
-			url_decode(taskname_encoded, taskname, WORK_QUEUE_LINE_MAX);
-			work_queue_task_specify_file(task, localname, taskname, WORK_QUEUE_OUTPUT, flags);
-		} else if(sscanf(line, "dir %s", filename)) {
-			work_queue_task_specify_directory(task, filename, filename, WORK_QUEUE_INPUT, 0700, 0);
-		} else if(sscanf(line,"cores %" PRId64,&n)) {
-				work_queue_task_specify_cores(task, n);
-		} else if(sscanf(line,"memory %" PRId64,&n)) {
-				work_queue_task_specify_memory(task, n);
-		} else if(sscanf(line,"disk %" PRId64,&n)) {
-				work_queue_task_specify_disk(task, n);
-		} else if(sscanf(line,"gpus %" PRId64,&n)) {
-			work_queue_task_specify_gpus(task, n);
-		} else if(sscanf(line,"wall_time %" PRIu64,&nt)) {
-			work_queue_task_specify_running_time(task, nt);
-		} else if(sscanf(line,"end_time %" PRIu64,&nt)) {
-			work_queue_task_specify_end_time(task, nt);
-		} else if(sscanf(line,"env %d",&length)==1) {
-			char *env = malloc(length+2); /* +2 for \n and \0 */
-			link_read(master, env, length+1, stoptime);
-			env[length] = 0;              /* replace \n with \0 */
-			char *value = strchr(env,'=');
-			if(value) {
-				*value = 0;
-				value++;
-				work_queue_task_specify_enviroment_variable(task,env,value);
-			}
-			free(env);
-		} else {
-			debug(D_WQ|D_NOTICE,"invalid command from master: %s",line);
-			return 0;
-		}
-	}
+	time_t stoptime = time(0) + active_timeout;
 
-	last_task_received = task->taskid;
+	if(!password || !link_auth_password(l, password, stoptime))
+		return;
 
-	struct work_queue_process *p = work_queue_process_create(task, disk_alloc);
+	if(!link_readline(l, line, sizeof(line), stoptime) || sscanf(line, "get %s", filename) != 1)
+		return;
 
-	if(!p) {
-		return 0;
+	/* the file is opened under the cache, so no part of its name may leave it. */
+	int n = snprintf(cached_filename, sizeof(cached_filename), "cache/%s", filename);
+	int m = snprintf(partial_filename, sizeof(partial_filename), "cache/%s.part", filename);
+	if(n < 0 || m < 0 || (size_t) m >= sizeof(partial_filename) || path_has_doubledots(filename)) {
+		link_putliteral(l, "missing\n", stoptime);
+		return;
 	}
 
-	// Every received task goes into procs_table.
-	itable_insert(procs_table,taskid,p);
-
-	if(worker_mode==WORKER_MODE_FOREMAN) {
-		work_queue_submit_internal(foreman_q,task);
-	} else {
-		// XXX sandbox setup should be done in task execution,
-		// so that it can be returned cleanly as a failure to execute.
-		if(!setup_sandbox(p)) {
-			itable_remove(procs_table,taskid);
-			work_queue_process_delete(p);
-			return 0;
+	/* wait for the file a little longer each time, up to a fifth of a second. */
+	useconds_t interval = 10000;
+	time_t waittime = time(0) + peer_file_timeout;
+	int fd;
+	while((fd = open(cached_filename, O_RDONLY)) < 0 && errno == ENOENT && time(0) < stoptime) {
+		if(access(partial_filename, F_OK) == 0) {
+			waittime = time(0) + peer_file_timeout;
+		} else if(time(0) > waittime) {
+			errno = ENOENT;
+			break;
 		}
-		normalize_resources(p);
-		list_push_tail(procs_waiting,p);
+		usleep(interval);
+		interval = MIN(2 * interval, 200000);
 	}
 
-	work_queue_watcher_add_process(watcher,p);
+	if(fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+		link_putfstring(l, "missing %d\n", stoptime, errno);
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
 
-	return 1;
+	link_putfstring(l, "file %" PRId64 "\n", stoptime, (int64_t) info.st_size);
+	link_stream_from_fd(l, fd, info.st_size, stoptime);
+	close(fd);
 }
 
 /*
-Handle an incoming "put" message from the master,
-which places a file into the cache directory.
+Accept connections from other workers, serving each one from a child process,
+and at most peer_server_children_max at once. The server exits when the worker
+goes away.
 */
 
-static int do_put( struct link *master, char *filename, int64_t length, int mode )
+static void peer_server_loop( pid_t worker_pid )
 {
-	char cached_filename[WORK_QUEUE_LINE_MAX];
-	char *cur_pos;
+	int children = 0;
 
-	debug(D_WQ, "Putting file %s into workspace\n", filename);
-	if(!check_disk_space_for_filesize(".", length, disk_avail_threshold)) {
-		debug(D_WQ, "Could not put file %s, not enough disk space (%"PRId64" bytes needed)\n", filename, length);
-		return 0;
-	}
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
 
+	while(getppid() == worker_pid) {
+		while(children > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+			children--;
 
-	mode = mode | 0600;
+		if(children >= peer_server_children_max) {
+			usleep(100000);
+			continue;
+		}
 
-	cur_pos = filename;
+		struct link *l = link_accept(peer_link, time(0) + 5);
+		if(!l)
+			continue;
 
-	while(!strncmp(cur_pos, "./", 2)) {
-		cur_pos += 2;
+		pid_t pid = fork();
+		if(pid == 0) {
+			link_close(peer_link);
+			peer_serve_file(l);
+			link_close(l);
+			_exit(0);
+		} else if(pid > 0) {
+			children++;
+		}
+
+		link_close(l);
 	}
 
-	sprintf(cached_filename, "cache/%s", cur_pos);
+	_exit(0);
+}
 
-	cur_pos = strrchr(cached_filename, '/');
-	if(cur_pos) {
-		*cur_pos = '\0';
-		if(!create_dir(cached_filename, mode | 0700)) {
-			debug(D_WQ, "Could not create directory - %s (%s)\n", cached_filename, strerror(errno));
-			return 0;
-		}
-		*cur_pos = '/';
+static void peer_server_start()
+{
+	if(!peer_transfers_enabled || !password || worker_mode == WORKER_MODE_FOREMAN)
+		return;
+
+	peer_link = link_serve(0);
+	if(!peer_link) {
+		debug(D_WQ, "could not listen for peer transfers: %s", strerror(errno));
+		return;
 	}
 
-	int fd = open(cached_filename, O_WRONLY | O_CREAT | O_TRUNC, mode);
-	if(fd < 0) {
-		debug(D_WQ, "Could not open %s for writing. (%s)\n", filename, strerror(errno));
-		return 0;
+	// keep tasks from inheriting the listening socket.
+	fcntl(link_fd(peer_link), F_SETFD, FD_CLOEXEC);
+
+	pid_t worker_pid = getpid();
+
+	peer_server_pid = fork();
+	if(peer_server_pid == 0) {
+		peer_server_loop(worker_pid);
+	} else if(peer_server_pid < 0) {
+		debug(D_WQ, "could not start peer transfer server: %s", strerror(errno));
+		link_close(peer_link);
+		peer_link = 0;
 	}
+}
 
-	int64_t actual = link_stream_to_fd(master, fd, length, time(0) + active_timeout);
-	close(fd);
-	if(actual != length) {
-		debug(D_WQ, "Failed to put file - %s (%s)\n", filename, strerror(errno));
-		return 0;
+static void peer_server_stop()
+{
+	if(peer_server_pid > 0) {
+		kill(peer_server_pid, SIGKILL);
+		waitpid(peer_server_pid, NULL, 0);
+		peer_server_pid = 0;
 	}
 
-	return 1;
+	if(peer_link) {
+		link_close(peer_link);
+		peer_link = 0;
+	}
 }
 
 static int file_from_url(const char *url, const char *filename) {
@@ -1036,6 +2027,7 @@ static int do_url(struct link* master, const char *filename, int length, int mod
 
 		char cache_name[WORK_QUEUE_LINE_MAX];
 		snprintf(cache_name,WORK_QUEUE_LINE_MAX, "cache/%s", filename);
+		sandbox_trees_discard_within(cache_name);
 
 		return file_from_url(url, cache_name);
 }
@@ -1043,6 +2035,8 @@ static int do_url(struct link* master, const char *filename, int length, int mod
 static int do_unlink(const char *path) {
 	char cached_path[WORK_QUEUE_LINE_MAX];
 	sprintf(cached_path, "cache/%s", path);
+	sandbox_trees_discard_within(cached_path);
+	file_no_longer_missing(cached_path);
 	//Use delete_dir() since it calls unlink() if path is a file.
 	if(delete_dir(cached_path) != 0) {
 		struct stat buf;
@@ -1058,8 +2052,8 @@ static int do_unlink(const char *path) {
 	return 1;
 }
 
-static int do_get(struct link *master, const char *filename, int recursive) {
-	stream_output_item(master, filename, recursive);
+static int do_get(struct link *master, const char *filename, int recursive, int compress) {
+	stream_output_item(master, filename, recursive, compress);
 	send_master_message(master, "end\n");
 	return 1;
 }
@@ -1088,6 +2082,7 @@ static int do_thirdget(int mode, char *filename, const char *path) {
 	}
 
 	sprintf(cached_filename, "cache/%s", cur_pos);
+	sandbox_trees_discard_within(cached_filename);
 
 	cur_pos = strrchr(cached_filename, '/');
 	if(cur_pos) {
@@ -1211,11 +2206,15 @@ static int do_kill(int taskid)
 			memory_allocated -= p->task->resources_requested->memory;
 			disk_allocated -= p->task->resources_requested->disk;
 			gpus_allocated -= p->task->resources_requested->gpus;
+
+			work_queue_topology_release(topology, p->cpuset);
+			p->cpuset = NULL;
 		}
 	}
 
 	itable_remove(procs_complete, p->task->taskid);
 	list_remove(procs_waiting,p);
+	list_remove(procs_missing_inputs,p);
 
 	work_queue_watcher_remove_process(watcher,p);
 
@@ -1245,6 +2244,7 @@ static void kill_all_tasks() {
 	assert(itable_size(procs_running)==0);
 	assert(itable_size(procs_complete)==0);
 	assert(list_size(procs_waiting)==0);
+	assert(list_size(procs_missing_inputs)==0);
 	assert(cores_allocated==0);
 	assert(memory_allocated==0);
 	assert(disk_allocated==0);
@@ -1390,17 +2390,48 @@ static int handle_master(struct link *master) {
 	char line[WORK_QUEUE_LINE_MAX];
 	char filename[WORK_QUEUE_LINE_MAX];
 	char path[WORK_QUEUE_LINE_MAX];
-	int64_t length;
+	char digest[WORK_QUEUE_LINE_MAX];
+	int64_t length, wire_length;
 	int64_t taskid = 0;
 	int flags = WORK_QUEUE_NOCACHE;
-	int mode, r, n;
+	int mode, port, r, n;
+	int transfer = 0;
 
 	if(recv_master_message(master, line, sizeof(line), idle_stoptime )) {
+		timestamp_t start = timestamp_get();
+
 		if(sscanf(line,"task %" SCNd64, &taskid)==1) {
 			r = do_task(master, taskid,time(0)+active_timeout);
-		} else if((n = sscanf(line, "put %s %" SCNd64 " %o %d", filename, &length, &mode, &flags)) >= 3) {
+		} else if(sscanf(line,"tasks %d", &n)==1) {
+			r = do_tasks(master, n, time(0)+active_timeout);
+		} else if((n = sscanf(line, "put %s %" SCNd64 " %o %d %s", filename, &length, &mode, &flags, digest)) >= 3) {
+			if(path_within_dir(filename, workspace)) {
+				r = do_put(master, filename, length, length, 0, mode, n == 5 ? digest : NULL);
+				reset_idle_timer();
+			} else {
+				debug(D_WQ, "Path - %s is not within workspace %s.", filename, workspace);
+				r = 0;
+			}
+		} else if((n = sscanf(line, "zput %s %" SCNd64 " %" SCNd64 " %o %d %s", filename, &wire_length, &length, &mode, &flags, digest)) >= 5) {
+			if(path_within_dir(filename, workspace)) {
+				r = do_put(master, filename, length, wire_length, 1, mode, n == 6 ? digest : NULL);
+				reset_idle_timer();
+			} else {
+				debug(D_WQ, "Path - %s is not within workspace %s.", filename, workspace);
+				r = 0;
+			}
+		} else if(sscanf(line, "digest %s %s %" SCNd64 " %o", filename, digest, &length, &mode) == 4) {
+			if(path_within_dir(filename, workspace)) {
+				r = do_digest(master, filename, digest, length, mode);
+				reset_idle_timer();
+			} else {
+				debug(D_WQ, "Path - %s is not within workspace %s.", filename, workspace);
+				r = 0;
+			}
+		} else if(sscanf(line, "peerget %s %s %d %" SCNd64 " %o", filename, path, &port, &length, &mode) == 5) {
 			if(path_within_dir(filename, workspace)) {
-				r = do_put(master, filename, length, mode);
+				r = do_peerget(master, filename, path, port, length, mode);
+				transfer = 1;
 				reset_idle_timer();
 			} else {
 				debug(D_WQ, "Path - %s is not within workspace %s.", filename, workspace);
@@ -1408,6 +2439,7 @@ static int handle_master(struct link *master) {
 			}
 		} else if(sscanf(line, "url %s %" SCNd64 " %o", filename, &length, &mode) == 3) {
 			r = do_url(master, filename, length, mode);
+			transfer = 1;
 			reset_idle_timer();
 		} else if(sscanf(line, "unlink %s", filename) == 1) {
 			if(path_within_dir(filename, workspace)) {
@@ -1416,12 +2448,15 @@ static int handle_master(struct link *master) {
 				debug(D_WQ, "Path - %s is not within workspace %s.", filename, workspace);
 				r= 0;
 			}
-		} else if(sscanf(line, "get %s %d", filename, &mode) == 2) {
-			r = do_get(master, filename, mode);
+		} else if((n = sscanf(line, "get %s %d %d", filename, &mode, &flags)) >= 2) {
+			r = do_get(master, filename, mode, n == 3 && flags);
+			transfer = 1;
 		} else if(sscanf(line, "thirdget %o %s %[^\n]", &mode, filename, path) == 3) {
 			r = do_thirdget(mode, filename, path);
+			transfer = 1;
 		} else if(sscanf(line, "thirdput %o %s %[^\n]", &mode, filename, path) == 3) {
 			r = do_thirdput(master, mode, filename, path);
+			transfer = 1;
 			reset_idle_timer();
 		} else if(sscanf(line, "kill %" SCNd64, &taskid) == 1) {
 			if(taskid >= 0) {
@@ -1450,6 +2485,11 @@ static int handle_master(struct link *master) {
 			debug(D_WQ, "Unrecognized master message: %s.\n", line);
 			r = 0;
 		}
+
+		/* puts account for their own time, as they may not block. */
+		if(transfer) {
+			time_transfers_blocked += timestamp_get() - start;
+		}
 	} else {
 		debug(D_WQ, "Failed to read from master.\n");
 		r = 0;
@@ -1618,14 +2658,28 @@ static void work_for_master(struct link *master) {
 		if(master_activity < 0) break;
 
 		int ok = 1;
-		if(master_activity) {
+		if(master_activity && inbound_file) {
+			// The master is sending the contents of a file. Receive the next
+			// slice, and attend the tasks before going back for more.
+			ok &= receive_inbound_file(master);
+			reset_idle_timer();
+		} else if(master_activity) {
 			ok &= handle_master(master);
+
+			// Handle the rest of the messages that arrived together,
+			// such as the kills that follow a batch of results, unless
+			// they are followed by the contents of a file.
+			while(ok && !inbound_file && !link_buffer_empty(master)) {
+				ok &= handle_master(master);
+			}
 		}
 
 		expire_procs_running();
 
 		ok &= handle_tasks(master);
 
+		sandbox_trees_reap();
+
 		measure_worker_resources();
 
 		if(!enforce_worker_promises(master)) {
@@ -1649,6 +2703,9 @@ static void work_for_master(struct link *master) {
 		if(ok) {
 			struct work_queue_process *p;
 			int visited;
+
+			release_missing_inputs(master);
+
 			int waiting = list_size(procs_waiting);
 
 			for(visited = 0; visited < waiting; visited++) {
@@ -1686,6 +2743,29 @@ static void work_for_master(struct link *master) {
 			reset_idle_timer();
 		}
 	}
+
+	if(inbound_file) {
+		finish_inbound_file(0);
+	}
+
+	debug(D_WQ, "spent %" PRIu64 " usecs blocked on transfers, and %" PRIu64 " usecs receiving files while attending tasks.\n", time_transfers_blocked, time_transfers_concurrent);
+}
+
+/*
+True if the aggregated resources of the workers of the foreman changed since
+they were last sent to the master.
+*/
+
+static int foreman_resources_changed()
+{
+	struct work_queue_resources *r = total_resources;
+	struct work_queue_resources *l = total_resources_last;
+
+	return memcmp(&r->workers, &l->workers, sizeof(r->workers))
+		|| memcmp(&r->disk, &l->disk, sizeof(r->disk))
+		|| memcmp(&r->cores, &l->cores, sizeof(r->cores))
+		|| memcmp(&r->memory, &l->memory, sizeof(r->memory))
+		|| memcmp(&r->gpus, &l->gpus, sizeof(r->gpus));
 }
 
 static void foreman_for_master(struct link *master) {
@@ -1698,7 +2778,8 @@ static void foreman_for_master(struct link *master) {
 
 	reset_idle_timer();
 
-	int prev_num_workers = 0;
+	time_t last_update = 0;
+
 	while(!abort_flag) {
 		int result = 1;
 		struct work_queue_task *task = NULL;
@@ -1711,27 +2792,36 @@ static void foreman_for_master(struct link *master) {
 
 		measure_worker_resources();
 
-		/* if the number of workers changed by more than %10, send an status update */
-		int curr_num_workers = total_resources->workers.total;
-		if(10*abs(curr_num_workers - prev_num_workers) > prev_num_workers) {
+		/* the aggregated resources of the workers, when they change. */
+		if(foreman_resources_changed() && time(0) >= last_update + foreman_update_interval) {
 			send_keepalive(master, 0);
+			last_update = time(0);
 		}
-		prev_num_workers = curr_num_workers;
 
-		task = work_queue_wait_internal(foreman_q, foreman_internal_timeout, master, &master_active);
+		/* wake up in time to announce the results waiting for a batch. */
+		int timeout = foreman_batch_start ? 1 : foreman_internal_timeout;
+
+		task = work_queue_wait_internal(foreman_q, timeout, master, &master_active);
 
 		if(task) {
 			struct work_queue_process *p;
 			p = itable_lookup(procs_table,task->taskid);
 			if(!p) fatal("no entry in procs table for taskid %d",task->taskid);
 			itable_insert(procs_complete, task->taskid, p);
+			if(!foreman_batch_start) {
+				foreman_batch_start = time(0);
+			}
 			result = 1;
 		}
 
-		if(!results_to_be_sent_msg && itable_size(procs_complete) > 0)
-		{
-			send_master_message(master, "available_results\n");
-			results_to_be_sent_msg = 1;
+		int complete = itable_size(procs_complete);
+		if(!results_to_be_sent_msg && complete > 0) {
+			if(complete >= foreman_batch_max || complete >= itable_size(procs_table) || time(0) >= foreman_batch_start + foreman_batch_delay) {
+				debug(D_WQ, "announcing %d results to the master", complete);
+				send_master_message(master, "available_results\n");
+				results_to_be_sent_msg = 1;
+				foreman_batch_start = 0;
+			}
 		}
 
 		if(master_active) {
@@ -1810,6 +2900,8 @@ to remove any state left over from a previous run.
 static void workspace_cleanup()
 {
 	debug(D_WQ,"cleaning workspace %s",workspace);
+	sandbox_trees_clear();
+	hash_table_clear(files_missing);
 	delete_dir_contents(workspace);
 }
 
@@ -1830,8 +2922,11 @@ static void workspace_delete()
 	if(procs_table)        itable_delete(procs_table);
 	if(procs_complete)     itable_delete(procs_complete);
 	if(procs_waiting)      list_delete(procs_waiting);
+	if(procs_missing_inputs) list_delete(procs_missing_inputs);
+	if(files_missing)      hash_table_delete(files_missing);
 
 	if(watcher)            work_queue_watcher_delete(watcher);
+	if(content_cache)      work_queue_content_cache_delete(content_cache);
 
 	printf( "work_queue_worker: deleting workspace %s\n", workspace);
 
@@ -1917,6 +3012,11 @@ static int serve_master_by_hostport( const char *host, int port, const char *ver
 	last_task_received     = 0;
 	results_to_be_sent_msg = 0;
 
+	/* so that the next master gets all the statistics and resources of a foreman. */
+	foreman_batch_start = 0;
+	memset(&foreman_stats_last, 0, sizeof(foreman_stats_last));
+	work_queue_resources_clear(total_resources_last);
+
 	workspace_cleanup();
 	disconnect_master(master);
 	printf("disconnected from master %s:%d\n", host, port );
@@ -2152,6 +3252,12 @@ static void show_help(const char *cmd)
 	printf( " %-30s Select port to listen to at random and write to this file.  Implies --foreman.\n", "-Z,--foreman-port-file=<file>");
 	printf( " %-30s Set the fast abort multiplier for foreman (default=disabled).\n", "-F,--fast-abort=<mult>");
 	printf( " %-30s Send statistics about foreman to this file.\n", "--specify-log=<logfile>");
+	printf( " %-30s Tell the master about results of the foreman once this many are ready.\n", "--foreman-batch=<n>");
+	printf( " %-30s (default=%d)\n", "", foreman_batch_max);
+	printf( " %-30s Maximum number of seconds a result waits for the rest of its batch.\n", "--foreman-batch-delay=<s>");
+	printf( " %-30s (default=%d)\n", "", foreman_batch_delay);
+	printf( " %-30s Let the workers of the foreman fetch cached inputs from each other, each\n", "--foreman-peer-fanout=<n>");
+	printf( " %-30s serving at most n workers at once. (default=disabled)\n", "");
 	printf( " %-30s Password file for authenticating to the master.\n", "-P,--password=<pwfile>");
 	printf( " %-30s Set both --idle-timeout and --connect-timeout.\n", "-t,--timeout=<time>");
 	printf( " %-30s Disconnect after this time if master sends no work. (default=%ds)\n", "   --idle-timeout=<time>", idle_timeout);
@@ -2181,6 +3287,20 @@ static void show_help(const char *cmd)
 	printf( " %-30s Use loop devices for task sandboxes (default=disabled, requires root access).\n", "--disk-allocation");
 	printf( " %-30s Set the maximum number of seconds the worker may be active. (in s).\n", "--wall-time=<s>");
 	printf( " %-30s Forbid the use of symlinks for cache management.\n", "--disable-symlinks");
+	printf( " %-30s How to place inputs into task sandboxes. With link (the default), files\n", "--sandbox-mode=<link|clone>");
+	printf( " %-30s are linked from the cache. With clone, files are reflinked if the\n", "");
+	printf( " %-30s filesystem supports it, and directories are moved from trees of links\n", "");
+	printf( " %-30s built in the background.\n", "");
+	printf( " %-30s Pin each task to cores of its own, within a single NUMA node when\n", "--pin-cores");
+	printf( " %-30s possible, and prefer memory from that node. (Linux only)\n", "");
+	printf( " %-30s How to start tasks. With fork (the default), the worker forks and runs\n", "--launcher=<fork|spawn|helper>");
+	printf( " %-30s sh -c. With spawn and helper, commands without shell metacharacters are\n", "");
+	printf( " %-30s executed directly, and the worker uses vfork, or a helper process started\n", "");
+	printf( " %-30s with the worker (Linux only), instead of fork.\n", "");
+	printf( " %-30s Serve cached files to other workers. Requires a password (-P).\n", "--enable-peer-transfers");
+	printf( " %-30s Keep input files by contents in this directory, which outlives the worker\n", "--content-cache=<dir>");
+	printf( " %-30s and may be shared by the workers of the host. (default=disabled)\n", "");
+	printf( " %-30s Set the maximum size of the content cache (in MB). (default=%" PRId64 "MB)\n", "--content-cache-size=<mb>", content_cache_size);
 	printf(" %-30s Single-shot mode -- quit immediately after disconnection.\n", "--single-shot");
 	printf(" %-30s docker mode -- run each task with a container based on this docker image.\n", "--docker=<image>");
 	printf(" %-30s docker-preserve mode -- tasks execute by a worker share a container based on this docker image.\n", "--docker-preserve=<image>");
@@ -2193,7 +3313,9 @@ enum {LONG_OPT_DEBUG_FILESIZE = 256, LONG_OPT_VOLATILITY, LONG_OPT_BANDWIDTH,
 	  LONG_OPT_DISK, LONG_OPT_GPUS, LONG_OPT_FOREMAN, LONG_OPT_FOREMAN_PORT, LONG_OPT_DISABLE_SYMLINKS,
 	  LONG_OPT_IDLE_TIMEOUT, LONG_OPT_CONNECT_TIMEOUT, LONG_OPT_RUN_DOCKER, LONG_OPT_RUN_DOCKER_PRESERVE,
 	  LONG_OPT_BUILD_FROM_TAR, LONG_OPT_SINGLE_SHOT, LONG_OPT_WALL_TIME, LONG_OPT_DISK_ALLOCATION,
-	  LONG_OPT_MEMORY_THRESHOLD};
+	  LONG_OPT_MEMORY_THRESHOLD, LONG_OPT_ENABLE_PEER_TRANSFERS, LONG_OPT_CONTENT_CACHE,
+	  LONG_OPT_CONTENT_CACHE_SIZE, LONG_OPT_SANDBOX_MODE, LONG_OPT_PIN_CORES, LONG_OPT_LAUNCHER,
+	  LONG_OPT_FOREMAN_BATCH, LONG_OPT_FOREMAN_BATCH_DELAY, LONG_OPT_FOREMAN_PEER_FANOUT};
 
 static const struct option long_options[] = {
 	{"advertise",           no_argument,        0,  'a'},
@@ -2206,6 +3328,9 @@ static const struct option long_options[] = {
 	{"foreman-port",        required_argument,  0,  LONG_OPT_FOREMAN_PORT},
 	{"foreman-port-file",   required_argument,  0,  'Z'},
 	{"foreman-name",        required_argument,  0,  'f'},
+	{"foreman-batch",       required_argument,  0,  LONG_OPT_FOREMAN_BATCH},
+	{"foreman-batch-delay", required_argument,  0,  LONG_OPT_FOREMAN_BATCH_DELAY},
+	{"foreman-peer-fanout", required_argument,  0,  LONG_OPT_FOREMAN_PEER_FANOUT},
 	{"measure-capacity",    no_argument,        0,  'c'},
 	{"fast-abort",          required_argument,  0,  'F'},
 	{"specify-log",         required_argument,  0,  LONG_OPT_SPECIFY_LOG},
@@ -2219,6 +3344,12 @@ static const struct option long_options[] = {
 	{"max-backoff",         required_argument,  0,  'b'},
 	{"single-shot",		    no_argument,        0,  LONG_OPT_SINGLE_SHOT },
 	{"disable-symlinks",    no_argument,        0,  LONG_OPT_DISABLE_SYMLINKS},
+	{"enable-peer-transfers", no_argument,      0,  LONG_OPT_ENABLE_PEER_TRANSFERS},
+	{"content-cache",       required_argument,  0,  LONG_OPT_CONTENT_CACHE},
+	{"content-cache-size",  required_argument,  0,  LONG_OPT_CONTENT_CACHE_SIZE},
+	{"sandbox-mode",        required_argument,  0,  LONG_OPT_SANDBOX_MODE},
+	{"pin-cores",           no_argument,        0,  LONG_OPT_PIN_CORES},
+	{"launcher",            required_argument,  0,  LONG_OPT_LAUNCHER},
 	{"disk-threshold",      required_argument,  0,  'z'},
 	{"memory-threshold",    required_argument,  0,  LONG_OPT_MEMORY_THRESHOLD},
 	{"arch",                required_argument,  0,  'A'},
@@ -2245,6 +3376,7 @@ int main(int argc, char *argv[])
 	int c;
 	int w;
 	int foreman_port = -1;
+	int foreman_peer_fanout = 0;
 	char * foreman_name = NULL;
 	char * port_file = NULL;
 	struct utsname uname_data;
@@ -2426,6 +3558,50 @@ int main(int argc, char *argv[])
 		case LONG_OPT_DISABLE_SYMLINKS:
 			symlinks_enabled = 0;
 			break;
+		case LONG_OPT_ENABLE_PEER_TRANSFERS:
+			peer_transfers_enabled = 1;
+			break;
+		case LONG_OPT_CONTENT_CACHE:
+			free(content_cache_dir);
+			content_cache_dir = xxstrdup(optarg);
+			break;
+		case LONG_OPT_CONTENT_CACHE_SIZE:
+			content_cache_size = strtoll(optarg, 0, 10);
+			break;
+		case LONG_OPT_SANDBOX_MODE:
+			if(!strcmp(optarg, "link")) {
+				sandbox_mode = SANDBOX_MODE_LINK;
+			} else if(!strcmp(optarg, "clone")) {
+				sandbox_mode = SANDBOX_MODE_CLONE;
+			} else {
+				fprintf(stderr, "work_queue_worker: unknown sandbox mode %s (use link or clone)\n", optarg);
+				exit(1);
+			}
+			break;
+		case LONG_OPT_FOREMAN_BATCH:
+			foreman_batch_max = MAX(1, atoi(optarg));
+			break;
+		case LONG_OPT_FOREMAN_BATCH_DELAY:
+			foreman_batch_delay = MAX(0, atoi(optarg));
+			break;
+		case LONG_OPT_FOREMAN_PEER_FANOUT:
+			foreman_peer_fanout = atoi(optarg);
+			break;
+		case LONG_OPT_PIN_CORES:
+			pin_cores = 1;
+			break;
+		case LONG_OPT_LAUNCHER:
+			if(!strcmp(optarg, "fork")) {
+				launcher = WORK_QUEUE_LAUNCHER_FORK;
+			} else if(!strcmp(optarg, "spawn")) {
+				launcher = WORK_QUEUE_LAUNCHER_SPAWN;
+			} else if(!strcmp(optarg, "helper")) {
+				launcher = WORK_QUEUE_LAUNCHER_HELPER;
+			} else {
+				fprintf(stderr, "work_queue_worker: unknown launcher %s (use fork, spawn, or helper)\n", optarg);
+				exit(1);
+			}
+			break;
 		case LONG_OPT_SINGLE_SHOT:
 			single_shot_mode = 1;
 			break;
@@ -2550,6 +3726,15 @@ int main(int argc, char *argv[])
 		free(foreman_stats_filename);
 		foreman_stats_filename = xxstrdup(temp_abs_path);
 	}
+	if(content_cache_dir)
+	{
+		path_absolute(content_cache_dir, temp_abs_path, 0);
+		content_cache = work_queue_content_cache_create(temp_abs_path, content_cache_size * MEGABYTE);
+		if(!content_cache) {
+			fprintf(stderr, "work_queue_worker: failed to setup content cache at %s.\n", temp_abs_path);
+			exit(1);
+		}
+	}
 
 	// change to workspace
 	chdir(workspace);
@@ -2590,6 +3775,11 @@ int main(int argc, char *argv[])
 		if(foreman_stats_filename) {
 			work_queue_specify_log(foreman_q, foreman_stats_filename);
 		}
+
+		/* inputs reach the foreman once, and then its workers once, from the foreman or from each other. */
+		if(foreman_peer_fanout > 0) {
+			work_queue_tune(foreman_q, "peer-transfer-fanout", foreman_peer_fanout);
+		}
 	}
 
 	if(container_mode == DOCKER && load_from_tar == 1) {
@@ -2617,6 +3807,8 @@ int main(int argc, char *argv[])
 	procs_table    = itable_create(0);
 	procs_waiting  = list_create();
 	procs_complete = itable_create(0);
+	procs_missing_inputs = list_create();
+	files_missing  = hash_table_create(0, 0);
 
 	watcher = work_queue_watcher_create();
 
@@ -2633,6 +3825,16 @@ int main(int argc, char *argv[])
 		manual_cores_option = load_average_get_cpus();
 	}
 
+	/* before the worker grows, so that the helper stays small. */
+	if(launcher == WORK_QUEUE_LAUNCHER_HELPER && worker_mode != WORKER_MODE_FOREMAN) {
+		if(!work_queue_launcher_helper_start()) {
+			fprintf(stderr, "work_queue_worker: cannot start the launcher helper, using spawn instead.\n");
+			launcher = WORK_QUEUE_LAUNCHER_SPAWN;
+		}
+	}
+
+	peer_server_start();
+
 	int backoff_interval = init_backoff_interval;
 	connect_stoptime = time(0) + connect_timeout;
 
@@ -2643,6 +3845,13 @@ int main(int argc, char *argv[])
 		total_resources->disk.total,
 		total_resources->gpus.total);
 
+	if(pin_cores && worker_mode != WORKER_MODE_FOREMAN) {
+		topology = work_queue_topology_create(total_resources->cores.total);
+		if(!topology) {
+			fprintf(stderr, "work_queue_worker: cannot pin tasks to cores in this host.\n");
+		}
+	}
+
 	while(1) {
 		int result = 0;
 
@@ -2709,6 +3918,9 @@ int main(int argc, char *argv[])
 
 	}
 
+	peer_server_stop();
+	work_queue_launcher_helper_stop();
+
 	workspace_delete();
 
 	return 0;
@@ -0,0 +1,85 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+# Inputs and outputs of zeros, which compress well, and empty ones, which are too small.
+# The first two tasks share their input, and run at the same time on two workers. The
+# first worker gets the input as is, while it is compressed, and the second one its copy.
+prepare()
+{
+	cat > master.script << EOF
+compress 1
+submit 4 2 4 2
+submit 0 0 0 1
+wait
+quit
+EOF
+}
+
+run()
+{
+	rm -f master.port
+	echo "starting master"
+	work_queue_test -d all -o master.log -Z master.port -l transactions.log < master.script &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting the first worker"
+	work_queue_worker -d all -o worker.1.log localhost `cat master.port` --timeout 10 --single-shot --cores 1 --memory 1000 --disk 1000 &
+
+	echo "waiting for the input to be compressed"
+	i=0
+	until grep -q "compressed .*input.0 " master.log
+	do
+		i=$((i+1))
+		[ $i -lt 30 ] || return 1
+		sleep 1
+	done
+
+	echo "starting the second worker"
+	work_queue_worker -d all -o worker.2.log localhost `cat master.port` --timeout 10 --single-shot --cores 1 --memory 1000 --disk 1000 &
+
+	wait
+
+	for file in output.0 output.1
+	do
+		if [ "`wc -c < $file`" -ne 4194304 ]
+		then
+			echo "$file is missing or has the wrong size!"
+			return 1
+		fi
+	done
+
+	cmp output.0 input.0 || return 1
+
+	echo "checking that the files were sent compressed"
+	grep -q "tx to .*: zput .*input.0 [0-9]* 4194304 " master.log || return 1
+	grep -q "rx from .*: zfile .*output.0 [0-9]* 4194304" master.log || return 1
+
+	echo "checking that the input was compressed once, and sent as is until then"
+	[ `grep -c "tx to .*: put .*input.0 4194304 " master.log` = 1 ] || return 1
+	[ `grep -c "tx to .*: zput .*input.0 [0-9]* 4194304 " master.log` = 1 ] || return 1
+	[ `grep -c "compressed .*input.0 " master.log` = 1 ] || return 1
+
+	echo "checking that the transfers are in the transactions log"
+	grep -q "TRANSFER 1 INPUT .* 4194304 [0-9]*$" transactions.log || return 1
+	grep -q "TRANSFER 1 OUTPUT .* 4194304 [0-9]*$" transactions.log || return 1
+	grep -q "TRANSFER 3 INPUT .* 0 0$" transactions.log || return 1
+	grep "TRANSFER [12] OUTPUT " transactions.log | awk '$9 >= $8 { exit 1 }' || return 1
+	[ `grep "TRANSFER [12] INPUT " transactions.log | awk '$9 == $8' | wc -l` = 1 ] || return 1
+	[ `grep "TRANSFER [12] INPUT " transactions.log | awk '$9 < $8' | wc -l` = 1 ] || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.log master.port worker.*.log transactions.log output.* input.*
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,83 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+prepare()
+{
+	echo "nothing to do"
+}
+
+# Both tasks have inputs of the same contents under different names.
+run_master()
+{
+	cat > master.script << EOF
+submit 1 0 0 1
+submit 1 0 0 1
+wait
+quit
+EOF
+
+	rm -f master.port
+	echo "starting master"
+	work_queue_test -d all -o master.$1.log -Z master.port < master.script &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting worker"
+	work_queue_worker -d all -o worker.$1.log localhost `cat master.port` --timeout 10 --single-shot --content-cache content.cache
+
+	wait
+
+	for file in output.0 output.1
+	do
+		if [ ! -f $file ]
+		then
+			echo "$file is missing!"
+			return 1
+		fi
+	done
+
+	rm -f output.*
+}
+
+run()
+{
+	run_master 1 || return 1
+
+	echo "checking that the second input was not sent"
+	grep -q "tx to .*: put .*input.0 1048576 .* [0-9a-f]*$" master.1.log || return 1
+	grep -q "tx to .*: digest .*input.1 [0-9a-f]* 1048576" master.1.log || return 1
+	[ `ls content.cache | wc -l` = 1 ] || return 1
+	[ -z "`find content.cache -type f -perm /222`" ] || return 1
+
+	run_master 2 || return 1
+
+	echo "checking that the inputs were taken from the content cache of the previous worker"
+	grep -q "tx to .*: put .*input" master.2.log && return 1
+	[ `grep -c "tx to .*: digest .*input" master.2.log` = 2 ] || return 1
+
+	echo "changing the file in the content cache"
+	entry=`ls content.cache/*`
+	chmod u+w $entry
+	echo changed >> $entry
+
+	run_master 3 || return 1
+
+	echo "checking that the changed file was dropped and sent again"
+	grep -q "rx from .*: info digest-missed .*input" master.3.log || return 1
+	grep -q "tx to .*: put .*input" master.3.log || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -rf master.script master.*.log master.port worker.*.log output.* input.* content.cache
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
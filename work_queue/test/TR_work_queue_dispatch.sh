@@ -0,0 +1,42 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+prepare()
+{
+	echo "nothing to do"
+}
+
+run()
+{
+	cat > master.script << EOF2
+benchmark 1000 3000 fcfs
+benchmark 1000 5000 worst
+benchmark 1000 2000 time
+benchmark 1000 2000 files
+benchmark-submit 20000
+quit
+EOF2
+
+	work_queue_test -Z master.port < master.script > master.output || return 1
+	cat master.output
+
+	grep -q "fcfs: placed 3000 of 3000 tasks on 1000 workers" master.output || return 1
+	grep -q "worst: placed 4000 of 5000 tasks on 1000 workers" master.output || return 1
+	grep -q "time: placed 2000 of 2000 tasks on 1000 workers" master.output || return 1
+	grep -q "files: placed 2000 of 2000 tasks on 1000 workers" master.output || return 1
+	grep -q "submitted 20000 tasks" master.output || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.output master.port
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../../batch_job/src:$PATH
+
+prepare()
+{
+	# ten tasks of ten minutes every thirty seconds, for an hour.
+	i=0
+	while [ $i -le 3600 ]
+	do
+		echo "$i 10 600"
+		i=$((i+30))
+	done > factory.trace
+}
+
+simulate()
+{
+	work_queue_factory --simulate=factory.trace --simulate-latency=300 -S factory.scratch -w 0 -W 1000 -t 120 --workers-per-cycle 20 "$@" | tail -1
+}
+
+run()
+{
+	reactive=`simulate`
+	predictive=`simulate --predictive`
+
+	echo "reactive:   $reactive"
+	echo "predictive: $predictive"
+
+	echo "$reactive"   | grep -q "1210 of 1210 tasks done" || return 1
+	echo "$predictive" | grep -q "1210 of 1210 tasks done" || return 1
+
+	echo "checking that workers were submitted to the dryrun batch system"
+	grep -q "work_queue_worker" factory.scratch/work_queue_factory.dryrun || return 1
+
+	echo "checking that tasks waited less with the predictive mode"
+	wait_reactive=`echo "$reactive" | sed 's/.*waited \([0-9]*\).*/\1/'`
+	wait_predictive=`echo "$predictive" | sed 's/.*waited \([0-9]*\).*/\1/'`
+	[ $wait_predictive -lt $wait_reactive ] || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -rf factory.trace factory.scratch
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,53 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+TASKS=20
+
+prepare()
+{
+	cat > master.script << EOF
+benchmark-tasks $TASKS sleep 1
+quit
+EOF
+}
+
+run()
+{
+	rm -f master.port foreman.port
+	echo "starting master"
+	work_queue_test -d all -o master.log -Z master.port < master.script > master.out &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting foreman"
+	work_queue_worker -d all -o foreman.log --foreman -Z foreman.port localhost `cat master.port` --timeout 10 --single-shot --foreman-batch 8 --foreman-batch-delay 2 &
+	wait_for_file_creation foreman.port 5
+
+	echo "starting worker"
+	work_queue_worker -d all -o worker.log localhost `cat foreman.port` --timeout 10 --cores 4 --memory 1000 --disk 1000 --single-shot
+
+	wait
+
+	cat master.out
+	grep -q "completed $TASKS tasks (0 failed)" master.out || return 1
+
+	echo "checking that results were announced in batches"
+	announced=`grep -c "announcing [0-9]* results" foreman.log`
+	echo "foreman announced results $announced times for $TASKS tasks"
+	[ $announced -gt 0 -a $announced -lt $TASKS ] || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.log master.out master.port foreman.log foreman.port worker.log
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
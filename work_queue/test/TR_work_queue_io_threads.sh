@@ -0,0 +1,85 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+TASKS=400
+
+prepare()
+{
+	cat > master.script << EOF
+tune io-threads 2
+submit 4 0 4 2
+submit 0 0 0 1
+wait
+quit
+EOF
+}
+
+start_workers()
+{
+	for i in 1 2
+	do
+		work_queue_worker -d all -o worker.$i.log localhost `cat master.port` --timeout 10 --single-shot --cores 4 --memory 1000 --disk 1000 &
+	done
+}
+
+# Tasks that do nothing, for the dispatch rate with a number of I/O threads.
+benchmark()
+{
+	rm -f master.port
+	printf "tune io-threads $1\nbenchmark-tasks $TASKS true\nquit\n" | work_queue_test -Z master.port > benchmark.out &
+	wait_for_file_creation master.port 5
+	start_workers
+	wait
+	echo "io-threads $1: `grep -o 'completed.*' benchmark.out`"
+	grep -q "completed $TASKS tasks (0 failed)" benchmark.out
+}
+
+run()
+{
+	rm -f master.port
+	echo "starting master"
+	work_queue_test -d all -o master.log -Z master.port < master.script &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting workers"
+	start_workers
+
+	wait
+
+	for file in output.0 output.1
+	do
+		if [ "`wc -c < $file`" -ne 4194304 ]
+		then
+			echo "$file is missing or has the wrong size!"
+			return 1
+		fi
+	done
+
+	[ -f output.2 ] || return 1
+
+	echo "checking that the links were served by the I/O threads"
+	grep -q "started 2 I/O threads" master.log || return 1
+	grep -q "queued .*input.0 for sending" master.log || return 1
+
+	echo "measuring the dispatch rate"
+	for threads in 0 1 2 4
+	do
+		benchmark $threads || return 1
+	done
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.log master.port worker.*.log benchmark.out output.* input.*
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
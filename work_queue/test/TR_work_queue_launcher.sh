@@ -0,0 +1,65 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+prepare()
+{
+	# a script without #!, which is run by the shell.
+	echo 'test "$CORES" = 1' > noshebang
+	chmod 755 noshebang
+
+	cat > master.script << EOF
+benchmark-tasks 20
+benchmark-tasks 20 false
+benchmark-tasks 20 test "\$CORES" = 1 -a -d "\$TMPDIR"
+benchmark-tasks 20 $PWD/noshebang
+quit
+EOF
+}
+
+run_launcher()
+{
+	rm -f master.port
+	echo "starting master"
+	work_queue_test -d all -o master.$1.log -Z master.port < master.script > master.$1.out &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting worker with launcher $1"
+	work_queue_worker -d all -o worker.$1.log localhost `cat master.port` --timeout 10 --single-shot --cores 2 --memory 1000 --disk 1000 --launcher $1
+
+	wait
+
+	cat master.$1.out
+
+	grep -q "completed 20 tasks (0 failed) of 'true'" master.$1.out || return 1
+	grep -q "completed 20 tasks (20 failed) of 'false'" master.$1.out || return 1
+	grep -q "completed 20 tasks (0 failed) of 'test" master.$1.out || return 1
+	grep -q "completed 20 tasks (0 failed) of '.*/noshebang'" master.$1.out || return 1
+}
+
+run()
+{
+	for launcher in fork spawn helper
+	do
+		run_launcher $launcher || return 1
+	done
+
+	echo "checking that commands without metacharacters were executed directly"
+	grep -q "started process [0-9]*: true (.*/true)" worker.spawn.log || return 1
+	grep -q "started process [0-9]*: false (.*/false)" worker.helper.log || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f noshebang master.script master.*.log master.*.out master.port worker.*.log
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
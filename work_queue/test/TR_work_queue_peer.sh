@@ -0,0 +1,69 @@
+#!/bin/sh
+
+WORKERS=3
+TASKS=6
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+prepare()
+{
+	echo "nothing to do"
+}
+
+run()
+{
+	echo peers > password
+
+	cat > master.script << EOF
+tune peer-transfer-fanout 1
+submit 2 1 0 $TASKS
+wait
+quit
+EOF
+
+	echo "starting master"
+	work_queue_test -d all -o master.log -P password -Z master.port < master.script &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	port=`cat master.port`
+
+	echo "starting workers"
+	i=0
+	while [ $i -lt $WORKERS ]
+	do
+		work_queue_worker -d all -o worker.$i.log -P password --enable-peer-transfers localhost $port --timeout 10 --cores 2 --memory-threshold 10 --memory 50 --single-shot &
+		i=$((i+1))
+	done
+	wait
+
+	echo "checking for output"
+	i=0
+	while [ $i -lt $TASKS ]
+	do
+		file=output.$i
+		if [ ! -f $file ]
+		then
+			echo "$file is missing!"
+			return 1
+		fi
+		i=$((i+1))
+	done
+
+	echo "checking for peer transfers"
+	grep -q "info peer-received" master.log || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f password master.script master.log master.port worker.*.log worker.*.log.old output.* input.*
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,49 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+check_needed()
+{
+	[ `uname -s` = Linux ] && [ -d /sys/devices/system/cpu ]
+}
+
+prepare()
+{
+	cat > master.script << EOF
+submit 1 0 0 2
+wait
+quit
+EOF
+}
+
+run()
+{
+	rm -f master.port
+	echo "starting master"
+	work_queue_test -d all -o master.log -Z master.port < master.script &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting worker"
+	work_queue_worker -d all -o worker.log localhost `cat master.port` --timeout 10 --single-shot --cores 1 --pin-cores
+
+	wait
+
+	echo "checking that the tasks were pinned"
+	grep -q "rx from .*: info numa-node-cores [0-9][0-9,]*$" master.log || return 1
+	[ `grep -c "task [0-9]* pinned to 1 cores" worker.log` = 2 ] || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.log master.port worker.log input.* output.*
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
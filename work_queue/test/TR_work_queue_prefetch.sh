@@ -0,0 +1,64 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+# Tasks with inputs of their own, one at a time on a single core worker. The
+# tasks request some disk, so that the worker has room for prefetched files.
+prepare()
+{
+	cat > master.script << EOF
+tune prefetch-depth 1
+disk 100
+submit 4 2 0 1
+submit 4 2 0 1
+submit 4 2 0 1
+wait
+quit
+EOF
+}
+
+run()
+{
+	rm -f master.port
+	echo "starting master"
+	work_queue_test -d all -o master.log -Z master.port < master.script &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting worker"
+	work_queue_worker -d all -o worker.log localhost `cat master.port` --timeout 10 --single-shot --cores 1 --memory 1000 --disk 1000
+
+	wait
+
+	for file in output.0 output.1 output.2
+	do
+		if [ ! -f $file ]
+		then
+			echo "$file is missing!"
+			return 1
+		fi
+	done
+
+	echo "checking that the inputs of waiting tasks were sent while another task ran"
+	grep -q "prefetching .* of inputs of task" master.log || return 1
+
+	echo "checking that each input was sent once"
+	for file in input.0 input.1 input.2
+	do
+		[ `grep -c "tx to .*: put .*$file " master.log` = 1 ] || return 1
+	done
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.log master.port worker.log output.* input.*
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
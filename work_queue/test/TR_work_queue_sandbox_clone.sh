@@ -0,0 +1,64 @@
+#!/bin/sh
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+# Two pairs of one-core tasks read the cached directory indir, one at a time on a
+# single worker. The second task of each pair should get the tree prebuilt for the
+# first one, and the second pair the tree rebuilt after indir is sent again.
+prepare()
+{
+	cat > master.script << EOF
+submit-dir 1 2
+wait
+invalidate indir
+submit-dir 1 2
+wait
+quit
+EOF
+}
+
+run()
+{
+	rm -f master.port
+	echo "starting master"
+	work_queue_test -d all -o master.log -Z master.port < master.script &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	echo "starting worker"
+	work_queue_worker -d all -o worker.log localhost `cat master.port` --timeout 10 --single-shot --cores 1 --memory 1000 --disk 1000 --sandbox-mode=clone &
+
+	wait
+
+	echo "checking that each pair of tasks read its own version of indir"
+	for i in 0 1
+	do
+		[ "`cat output.dir.$i`" = 1 ] || return 1
+	done
+	for i in 2 3
+	do
+		[ "`cat output.dir.$i`" = 2 ] || return 1
+	done
+
+	echo "checking that the second task of each pair got the prebuilt tree"
+	[ `grep -c "moved the tree of cache/.*indir to .*/t\.2/indir$" worker.log` = 1 ] || return 1
+	[ `grep -c "moved the tree of cache/.*indir to .*/t\.4/indir$" worker.log` = 1 ] || return 1
+	[ `grep -c "moved the tree of " worker.log` = 2 ] || return 1
+
+	echo "checking that indir was sent again"
+	[ `grep -c "tx to .*: put .*indir/data " master.log` = 2 ] || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -rf master.script master.log master.port worker.log output.* indir
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
@@ -0,0 +1,49 @@
+#!/bin/sh
+
+THREADS=4
+TASKS=50
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+prepare()
+{
+	echo "nothing to do"
+}
+
+run()
+{
+	cat > master.script << EOF2
+submit-threads $THREADS $TASKS
+quit
+EOF2
+
+	echo "starting master"
+	work_queue_test -d all -o master.log -Z master.port < master.script > master.output &
+
+	echo "waiting for master to get ready"
+	wait_for_file_creation master.port 5
+
+	port=`cat master.port`
+
+	echo "starting worker"
+	work_queue_worker -d all -o worker.log localhost $port --timeout 10 --cores 4 --single-shot
+	wait
+
+	cat master.output
+
+	echo "checking all tasks completed"
+	grep -q "completed $((THREADS*TASKS)) tasks submitted from $THREADS threads" master.output || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.log master.port master.output worker.log
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4:
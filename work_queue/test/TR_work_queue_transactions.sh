@@ -0,0 +1,64 @@
+#!/bin/sh
+
+TASKS=5
+
+. ../../dttools/test/test_runner_common.sh
+
+export PATH=../src:$PATH
+
+prepare()
+{
+	echo "nothing to do"
+}
+
+# run the same tasks with a master writing the transactions log in the given format.
+run_master()
+{
+	rm -f master.port
+
+	work_queue_test -d all -o master.$1.debug -Z master.port $2 -l transactions.$1 < master.script > /dev/null &
+
+	wait_for_file_creation master.port 5
+
+	work_queue_worker -d all -o worker.$1.debug localhost `cat master.port` --timeout 10 --cores 2 --single-shot
+	wait
+}
+
+# keep only the records, without times, pids, and addresses of the workers.
+normalize()
+{
+	grep -v '^#' $1 | cut -d' ' -f3- | sed -e 's/[0-9.]*:[0-9]*/ADDRESS/g' -e 's/worker-[0-9a-f]*/WORKER/g' > $2
+}
+
+run()
+{
+	cat > master.script << EOF2
+submit 1 0 0 $TASKS
+wait
+quit
+EOF2
+
+	run_master text ""
+	run_master binary "-b"
+
+	work_queue_status --convert-transactions=transactions.binary > transactions.converted || return 1
+
+	normalize transactions.text text.normalized
+	normalize transactions.converted converted.normalized
+
+	echo "comparing the text and converted logs"
+	diff text.normalized converted.normalized || return 1
+
+	grep -q "TASK $TASKS DONE SUCCESS" transactions.converted || return 1
+
+	return 0
+}
+
+clean()
+{
+	rm -f master.script master.port master.*.debug worker.*.debug transactions.* *.normalized input.* output.*
+}
+
+dispatch "$@"
+
+# vim: set noexpandtab tabstop=4: